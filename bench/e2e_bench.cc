@@ -0,0 +1,798 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// End-to-end benchmark: serves objects from a local HTTP origin, with given
+// latency, jitter, bandwidth per connection and error rate, mounts ghostfs
+// on them with a manifest, and runs workloads through the mount, each with a
+// mount of its own so that nothing is cached when it starts. Results are
+// printed as JSON: throughput, latency of reads, requests and bytes served by
+// origin, and CPU time ghostfs took per GB read.
+//
+// Content of objects is a function of their offset, so every read is
+// checked, and reads returning wrong content are counted as corrupt.
+//
+// With -S, workloads (cache_hit unless given with -w) are run twice, with
+// replies spliced from cache and then written from memory (no_splice), as
+// <workload>/splice and <workload>/iov.
+//
+// Usage: e2e_bench [-g ghostfs] [-d dir] [-w workload,...] [-l latency ms]
+//                  [-j jitter ms] [-b bandwidth MB/s] [-e error rate]
+//                  [-s scale] [-o ghostfs options] [-f output] [-S]
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "manifest.h"
+#include "metrics.h"
+#include "utils.h"
+
+#define MB (1024 * 1024ul)
+
+// Size of chunks origin sends, and paces when its bandwidth is limited.
+#define ORIGIN_CHUNK (64 * 1024)
+
+// Time, in seconds, given to ghostfs to mount and to unmount.
+#define MOUNT_TIMEOUT 10
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_seconds(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static uint8_t content_byte(uint64_t object, uint64_t offset) {
+    uint64_t x = ((offset >> 3) + object) * 0x9e3779b97f4a7c15ull;
+    return uint8_t(x >> 56) ^ uint8_t(offset);
+}
+
+struct origin_config {
+    double latency_ms = 20;
+    double jitter_ms = 5;
+    // Per connection, in MB/s, unlimited if zero.
+    double bandwidth_mb = 0;
+    // Fraction of requests for content answered with 503.
+    double error_rate = 0;
+};
+
+// HTTP/1.1 origin serving objects named /<index>, with support for a single
+// range per request, on a thread per connection.
+struct bench_origin {
+private:
+    origin_config _config;
+    int _fd = -1;
+    uint16_t _port = 0;
+    std::thread _acceptor;
+    std::mutex _mtx;
+    std::vector<int> _connections;
+    std::vector<std::thread> _threads;
+    std::vector<uint64_t> _objects;
+
+    void serve(int fd, unsigned seed);
+    bool respond(int fd, const std::string& request, std::mt19937& rng);
+    void send_content(int fd, uint64_t object, uint64_t start, uint64_t end);
+public:
+    std::atomic<uint64_t> requests { 0 };
+    std::atomic<uint64_t> bytes { 0 };
+    std::atomic<uint64_t> errors { 0 };
+
+    explicit bench_origin(const origin_config& config)
+        : _config(config) {}
+
+    ~bench_origin() {
+        stop();
+    }
+
+    // Serve objects of the given sizes, until the next call.
+    void set_objects(std::vector<uint64_t> sizes) {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _objects = std::move(sizes);
+    }
+
+    uint16_t port() const {
+        return _port;
+    }
+
+    int start();
+
+    void stop();
+};
+
+int bench_origin::start() {
+    _fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_fd < 0) {
+        return -errno;
+    }
+    int one = 1;
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(_fd, 128) < 0 ||
+            getsockname(_fd, (struct sockaddr*) &addr, &len) < 0) {
+        int err = errno;
+        close(_fd);
+        _fd = -1;
+        return -err;
+    }
+    _port = ntohs(addr.sin_port);
+
+    _acceptor = std::thread([this] {
+        for (unsigned seed = 0; ; seed++) {
+            int fd = accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::lock_guard<std::mutex> lock(_mtx);
+            _connections.push_back(fd);
+            _threads.emplace_back(&bench_origin::serve, this, fd, seed);
+        }
+    });
+    return 0;
+}
+
+void bench_origin::stop() {
+    if (!_acceptor.joinable()) {
+        return;
+    }
+    shutdown(_fd, SHUT_RDWR);
+    _acceptor.join();
+    close(_fd);
+
+    // Connections are only closed once their thread is done with them.
+    for (auto fd : _connections) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    for (auto& t : _threads) {
+        t.join();
+    }
+    for (auto fd : _connections) {
+        close(fd);
+    }
+    _connections.clear();
+    _threads.clear();
+}
+
+void bench_origin::serve(int fd, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::string buf;
+    char data[4096];
+
+    for (;;) {
+        size_t header_end;
+        while ((header_end = buf.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t n = recv(fd, data, sizeof(data), 0);
+            if (n <= 0) {
+                return;
+            }
+            buf.append(data, n);
+        }
+        std::string request = buf.substr(0, header_end + 2);
+        buf.erase(0, header_end + 4);
+        if (!respond(fd, request, rng)) {
+            shutdown(fd, SHUT_RDWR);
+            return;
+        }
+    }
+}
+
+static bool send_all(int fd, const char* data, size_t size) {
+    while (size) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Value of header name in request, or an empty string if there is none.
+static std::string header_value(const std::string& request, const char* name) {
+    size_t name_len = strlen(name);
+    for (size_t pos = request.find("\r\n"); pos != std::string::npos;
+            pos = request.find("\r\n", pos + 2)) {
+        if (strncasecmp(request.c_str() + pos + 2, name, name_len) == 0 &&
+                request[pos + 2 + name_len] == ':') {
+            size_t start = request.find_first_not_of(' ', pos + 3 + name_len);
+            return request.substr(start, request.find("\r\n", start) - start);
+        }
+    }
+    return "";
+}
+
+// Answer request, and return whether connection can be kept alive.
+bool bench_origin::respond(int fd, const std::string& request, std::mt19937& rng) {
+    requests++;
+    char method[16], target[256];
+    if (sscanf(request.c_str(), "%15s %255s", method, target) != 2) {
+        return false;
+    }
+    bool head = strcmp(method, "HEAD") == 0;
+    bool keep_alive = strcasecmp(header_value(request, "Connection").c_str(), "close") != 0;
+
+    std::uniform_real_distribution<double> uniform(0, 1);
+    double delay_ms = _config.latency_ms + _config.jitter_ms * (2 * uniform(rng) - 1);
+    std::this_thread::sleep_for(std::chrono::microseconds(int64_t(std::max(0.0, delay_ms) * 1000)));
+
+    uint64_t object = strtoull(target + 1, nullptr, 10);
+    uint64_t size = 0;
+    bool found;
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        found = target[0] == '/' && object < _objects.size();
+        if (found) {
+            size = _objects[object];
+        }
+    }
+
+    char header[512];
+    if (!found || (!head && uniform(rng) < _config.error_rate)) {
+        if (found) {
+            errors++;
+        }
+        int len = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Length: 0\r\n\r\n",
+                           found ? "503 Service Unavailable" : "404 Not Found");
+        return send_all(fd, header, len) && keep_alive;
+    }
+
+    uint64_t start = 0, end = size ? size - 1 : 0;
+    bool ranged = false;
+    std::string range = header_value(request, "Range");
+    unsigned long long range_start, range_end = size - 1;
+    if (sscanf(range.c_str(), "bytes=%llu-%llu", &range_start, &range_end) >= 1) {
+        if (range_start >= size || range_end < range_start) {
+            int len = snprintf(header, sizeof(header), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                               "Content-Range: bytes */%lu\r\nContent-Length: 0\r\n\r\n", size);
+            return send_all(fd, header, len) && keep_alive;
+        }
+        ranged = true;
+        start = range_start;
+        end = std::min<uint64_t>(range_end, size - 1);
+    }
+    uint64_t length = size ? end - start + 1 : 0;
+
+    int len;
+    if (ranged) {
+        len = snprintf(header, sizeof(header), "HTTP/1.1 206 Partial Content\r\n"
+                       "Content-Range: bytes %lu-%lu/%lu\r\nContent-Length: %lu\r\n"
+                       "Accept-Ranges: bytes\r\nETag: \"%lu-%lu\"\r\n\r\n",
+                       start, end, size, length, object, size);
+    } else {
+        len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n"
+                       "Accept-Ranges: bytes\r\nETag: \"%lu-%lu\"\r\n\r\n", length, object, size);
+    }
+    if (!send_all(fd, header, len)) {
+        return false;
+    }
+    if (!head && length) {
+        send_content(fd, object, start, start + length);
+    }
+    return keep_alive;
+}
+
+// Send content of object from start to end, at the bandwidth of origin.
+void bench_origin::send_content(int fd, uint64_t object, uint64_t start, uint64_t end) {
+    char chunk[ORIGIN_CHUNK];
+    auto began = bench_clock::now();
+    double bandwidth = _config.bandwidth_mb * MB;
+
+    for (uint64_t offset = start; offset < end; ) {
+        size_t size = std::min<uint64_t>(sizeof(chunk), end - offset);
+        for (size_t i = 0; i < size; i++) {
+            chunk[i] = content_byte(object, offset + i);
+        }
+        if (!send_all(fd, chunk, size)) {
+            return;
+        }
+        offset += size;
+        bytes += size;
+        if (bandwidth) {
+            std::this_thread::sleep_until(began + std::chrono::microseconds(
+                int64_t((offset - start) / bandwidth * 1e6)));
+        }
+    }
+}
+
+// What a workload read, as seen by the application.
+struct bench_result {
+    std::atomic<uint64_t> reads { 0 };
+    std::atomic<uint64_t> bytes { 0 };
+    std::atomic<uint64_t> errors { 0 };
+    std::atomic<uint64_t> corrupt { 0 };
+    latency_histogram latency;
+};
+
+struct bench_run {
+    std::string mountpoint;
+    bench_result& result;
+
+    std::string path(size_t object) const {
+        return mountpoint + "/" + std::to_string(object);
+    }
+
+    int open_object(size_t object) {
+        int fd = open(path(object).c_str(), O_RDONLY);
+        if (fd < 0) {
+            result.errors++;
+        }
+        return fd;
+    }
+
+    // Read size bytes of object at offset, and check what was read. Return
+    // number of bytes read, or -1 on error.
+    ssize_t read_at(int fd, size_t object, uint64_t offset, size_t size, char* buf) {
+        auto start = trace_clock();
+        ssize_t n = pread(fd, buf, size, offset);
+        result.latency.record(trace_clock() - start);
+        result.reads++;
+        if (n < 0) {
+            result.errors++;
+            return -1;
+        }
+        result.bytes += n;
+        if (n && (uint8_t(buf[0]) != content_byte(object, offset) ||
+                  uint8_t(buf[n - 1]) != content_byte(object, offset + n - 1))) {
+            result.corrupt++;
+        }
+        return n;
+    }
+
+    // Read object from offset to end, size bytes at a time. If uncached,
+    // what was read is dropped from kernel page cache, so that reading it
+    // again goes to ghostfs.
+    void read_sequentially(int fd, size_t object, uint64_t offset, uint64_t end, size_t size,
+                           bool uncached = false) {
+        std::vector<char> buf(size);
+        while (offset < end) {
+            ssize_t n = read_at(fd, object, offset, std::min<uint64_t>(size, end - offset), buf.data());
+            if (n <= 0) {
+                return;
+            }
+            if (uncached) {
+                posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+            }
+            offset += n;
+        }
+    }
+};
+
+static void run_threads(unsigned threads, const std::function<void(unsigned)>& fn) {
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(fn, i);
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+}
+
+struct bench_workload {
+    const char* name;
+    // Sizes of objects the workload reads.
+    std::vector<uint64_t> objects;
+    std::function<void(bench_run&)> run;
+    // Run once mounted and before the workload, without being measured.
+    std::function<void(bench_run&)> warm;
+};
+
+static std::vector<bench_workload> make_workloads(unsigned scale) {
+    std::vector<bench_workload> workloads;
+
+    // One reader scanning a large object.
+    workloads.push_back({ "sequential", { 256 * MB * scale }, [] (bench_run& run) {
+        int fd = run.open_object(0);
+        if (fd >= 0) {
+            struct stat st;
+            fstat(fd, &st);
+            run.read_sequentially(fd, 0, 0, st.st_size, MB);
+            close(fd);
+        }
+    } });
+
+    // Readers each reading 4K at random offsets of a large object.
+    workloads.push_back({ "random_4k", { 256 * MB * scale }, [scale] (bench_run& run) {
+        run_threads(8, [&] (unsigned thread) {
+            std::mt19937_64 rng(thread);
+            char buf[4096];
+            int fd = run.open_object(0);
+            if (fd < 0) {
+                return;
+            }
+            for (unsigned i = 0; i < 250 * scale; i++) {
+                run.read_at(fd, 0, (rng() % (256 * MB * scale / 4096)) * 4096, sizeof(buf), buf);
+            }
+            close(fd);
+        });
+    } });
+
+    // Readers sharing a small set of objects, which mostly fits in cache.
+    workloads.push_back({ "hot_set", std::vector<uint64_t>(8, 16 * MB), [scale] (bench_run& run) {
+        run_threads(8, [&] (unsigned thread) {
+            std::mt19937_64 rng(thread);
+            std::vector<char> buf(64 * 1024);
+            int fds[8];
+            for (size_t object = 0; object < 8; object++) {
+                fds[object] = run.open_object(object);
+            }
+            for (unsigned i = 0; i < 1000 * scale; i++) {
+                size_t object = rng() % 8;
+                if (fds[object] >= 0) {
+                    run.read_at(fds[object], object, (rng() % (16 * MB / buf.size())) * buf.size(),
+                                buf.size(), buf.data());
+                }
+            }
+            for (auto fd : fds) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        });
+    } });
+
+    // Readers each reading a share of many small objects whole.
+    workloads.push_back({ "fan_out", std::vector<uint64_t>(512 * scale, 256 * 1024),
+                          [scale] (bench_run& run) {
+        run_threads(16, [&] (unsigned thread) {
+            for (size_t object = thread; object < 512 * scale; object += 16) {
+                int fd = run.open_object(object);
+                if (fd >= 0) {
+                    run.read_sequentially(fd, object, 0, 256 * 1024, 64 * 1024);
+                    close(fd);
+                }
+            }
+        });
+    } });
+
+    // Players of a large media object, which read its header and then seek
+    // to random positions, playing a few MB from each.
+    workloads.push_back({ "media_seek", { 512 * MB * scale }, [scale] (bench_run& run) {
+        run_threads(4, [&] (unsigned thread) {
+            std::mt19937_64 rng(thread);
+            uint64_t size = 512 * MB * scale;
+            int fd = run.open_object(0);
+            if (fd < 0) {
+                return;
+            }
+            run.read_sequentially(fd, 0, 0, MB, 256 * 1024);
+            for (unsigned i = 0; i < 16 * scale; i++) {
+                uint64_t offset = (rng() % ((size - 4 * MB) / 4096)) * 4096;
+                run.read_sequentially(fd, 0, offset, offset + 4 * MB, 256 * 1024);
+            }
+            close(fd);
+        });
+    } });
+
+    // Readers each reading their share of an object in ghostfs cache, again
+    // and again, with nothing left in kernel page cache.
+    workloads.push_back({ "cache_hit", { 256 * MB }, [scale] (bench_run& run) {
+        run_threads(4, [&] (unsigned thread) {
+            uint64_t share = 256 * MB / 4;
+            int fd = run.open_object(0);
+            if (fd < 0) {
+                return;
+            }
+            for (unsigned i = 0; i < 8 * scale; i++) {
+                run.read_sequentially(fd, 0, thread * share, (thread + 1) * share, MB, true);
+            }
+            close(fd);
+        });
+    }, [] (bench_run& run) {
+        int fd = run.open_object(0);
+        if (fd >= 0) {
+            run.read_sequentially(fd, 0, 0, 256 * MB, MB, true);
+            close(fd);
+        }
+    } });
+
+    return workloads;
+}
+
+// CPU time, in seconds, process pid took so far.
+static double cpu_seconds(pid_t pid) {
+    std::string path = "/proc/" + std::to_string(pid) + "/stat";
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) {
+        return 0;
+    }
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // Fields following the command, which may hold spaces, start with state.
+    char* p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2) {
+        return 0;
+    }
+    return double(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static pid_t run_command(const std::vector<std::string>& args, const std::string& log_path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        std::vector<char*> argv;
+        for (auto& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+// Wait for pid to exit for up to timeout seconds, and return whether it did.
+static bool wait_exit(pid_t pid, unsigned timeout) {
+    auto start = bench_clock::now();
+    while (elapsed_seconds(start) < timeout) {
+        if (waitpid(pid, nullptr, WNOHANG) == pid) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+struct bench_options {
+    std::string ghostfs;
+    std::string dir = "/tmp";
+    std::string ghostfs_options;
+    unsigned scale = 1;
+};
+
+// Mount ghostfs on a manifest of the objects of workload, run it and unmount,
+// and print its results as name.
+// Return 0 on success, or -1 if ghostfs couldn't be mounted.
+static int run_workload(const bench_options& options, bench_origin& origin,
+                        bench_workload& workload, const std::string& name, FILE* out,
+                        bool first) {
+    std::string base = options.dir + "/e2e_bench." + std::to_string(getpid());
+    std::string mountpoint = base + ".mnt";
+    std::string manifest_path = base + ".manifest";
+    std::string log_path = base + ".log";
+
+    std::vector<manifest_file> files(workload.objects.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        files[i].path = "/" + std::to_string(i);
+        files[i].url = "http://127.0.0.1:" + std::to_string(origin.port()) + "/" + std::to_string(i);
+        files[i].length = workload.objects[i];
+        files[i].has_length = true;
+    }
+    if (write_manifest(manifest_path.c_str(), std::move(files)) < 0) {
+        fprintf(stderr, "Unable to write manifest %s\n", manifest_path.c_str());
+        return -1;
+    }
+    origin.set_objects(workload.objects);
+    mkdir(mountpoint.c_str(), 0755);
+
+    std::string mount_options = "manifest=" + manifest_path;
+    if (!options.ghostfs_options.empty()) {
+        mount_options += "," + options.ghostfs_options;
+    }
+    pid_t pid = run_command({ options.ghostfs, "-f", mountpoint, "-o", mount_options }, log_path);
+
+    // Mount is ready once objects can be looked up through it.
+    struct stat st;
+    auto start = bench_clock::now();
+    while (stat((mountpoint + "/0").c_str(), &st) < 0) {
+        if (elapsed_seconds(start) > MOUNT_TIMEOUT || waitpid(pid, nullptr, WNOHANG) == pid) {
+            fprintf(stderr, "Unable to mount ghostfs, see %s\n", log_path.c_str());
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+            return -1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    if (workload.warm) {
+        bench_result warm_result;
+        bench_run warm = { mountpoint, warm_result };
+        workload.warm(warm);
+    }
+
+    fprintf(stderr, "Running %s\n", name.c_str());
+    bench_result result;
+    bench_run run = { mountpoint, result };
+    uint64_t requests = origin.requests, origin_bytes = origin.bytes, errors = origin.errors;
+    double cpu = cpu_seconds(pid);
+    start = bench_clock::now();
+
+    workload.run(run);
+
+    double seconds = elapsed_seconds(start);
+    cpu = cpu_seconds(pid) - cpu;
+    requests = origin.requests - requests;
+    origin_bytes = origin.bytes - origin_bytes;
+    errors = origin.errors - errors;
+
+    pid_t umount = run_command({ "fusermount", "-u", mountpoint }, log_path);
+    waitpid(umount, nullptr, 0);
+    if (!wait_exit(pid, MOUNT_TIMEOUT)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    rmdir(mountpoint.c_str());
+    unlink(manifest_path.c_str());
+
+    latency_histogram::snapshot s;
+    result.latency.read(s);
+    double gb = double(result.bytes) / (1024 * MB);
+    fprintf(out, "%s    {\"name\": \"%s\", \"reads\": %lu, \"bytes\": %lu, \"seconds\": %.3f, "
+            "\"throughput_mb\": %.1f, \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}, "
+            "\"errors\": %lu, \"corrupt\": %lu, \"origin_requests\": %lu, \"origin_bytes\": %lu, "
+            "\"origin_errors\": %lu, \"cpu_seconds\": %.3f, \"cpu_seconds_per_gb\": %.3f}",
+            first ? "" : ",\n", name.c_str(), result.reads.load(), result.bytes.load(), seconds,
+            result.bytes / seconds / MB, s.quantile(0.5) / 1e3, s.quantile(0.99) / 1e3,
+            s.quantile(0.999) / 1e3, result.errors.load(), result.corrupt.load(), requests,
+            origin_bytes, errors, cpu, gb ? cpu / gb : 0);
+    return 0;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-g ghostfs] [-d dir] [-w workload,...] [-l latency ms]\n"
+            "       [-j jitter ms] [-b bandwidth MB/s] [-e error rate] [-s scale]\n"
+            "       [-o ghostfs options] [-f output] [-S]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    bench_options options;
+    origin_config config;
+    std::vector<std::string> names;
+    const char* output = nullptr;
+    bool compare_splice = false;
+    int opt;
+
+    // ghostfs is looked for next to the benchmark by default, as both are
+    // built in the same directory.
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len > 0) {
+        self[len] = '\0';
+        options.ghostfs = std::string(self, strrchr(self, '/') - self) + "/ghostfs";
+    }
+
+    while ((opt = getopt(argc, argv, "g:d:w:l:j:b:e:s:o:f:S")) != -1) {
+        switch (opt) {
+        case 'g':
+            options.ghostfs = optarg;
+            break;
+        case 'd':
+            options.dir = optarg;
+            break;
+        case 'w':
+            names = split(optarg, ',');
+            break;
+        case 'l':
+            config.latency_ms = atof(optarg);
+            break;
+        case 'j':
+            config.jitter_ms = atof(optarg);
+            break;
+        case 'b':
+            config.bandwidth_mb = atof(optarg);
+            break;
+        case 'e':
+            config.error_rate = atof(optarg);
+            break;
+        case 's':
+            options.scale = std::max(1, atoi(optarg));
+            break;
+        case 'o':
+            options.ghostfs_options = optarg;
+            break;
+        case 'f':
+            output = optarg;
+            break;
+        case 'S':
+            compare_splice = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (compare_splice && names.empty()) {
+        names.push_back("cache_hit");
+    }
+    std::vector<bench_workload> workloads;
+    for (auto& workload : make_workloads(options.scale)) {
+        if (names.empty() || std::find(names.begin(), names.end(), workload.name) != names.end()) {
+            workloads.push_back(std::move(workload));
+        }
+    }
+    if (workloads.empty()) {
+        fprintf(stderr, "No such workload, workloads are sequential, random_4k, hot_set, "
+                "fan_out, media_seek and cache_hit\n");
+        return 1;
+    }
+
+    FILE* out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Unable to open %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+
+    bench_origin origin(config);
+    int res = origin.start();
+    if (res < 0) {
+        fprintf(stderr, "Unable to start origin: %s\n", strerror(-res));
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"origin\": {\"latency_ms\": %g, \"jitter_ms\": %g, \"bandwidth_mb\": %g, "
+            "\"error_rate\": %g},\n  \"scale\": %u,\n  \"workloads\": [\n", config.latency_ms,
+            config.jitter_ms, config.bandwidth_mb, config.error_rate, options.scale);
+    int ret = 0;
+    bool first = true;
+    for (auto& workload : workloads) {
+        if (!compare_splice) {
+            ret = run_workload(options, origin, workload, workload.name, out, first) < 0;
+        } else {
+            bench_options iov = options;
+            iov.ghostfs_options += iov.ghostfs_options.empty() ? "no_splice" : ",no_splice";
+            ret = run_workload(options, origin, workload, workload.name + std::string("/splice"),
+                               out, first) < 0 ||
+                  run_workload(iov, origin, workload, workload.name + std::string("/iov"),
+                               out, false) < 0;
+        }
+        if (ret) {
+            break;
+        }
+        first = false;
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    origin.stop();
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ret;
+}
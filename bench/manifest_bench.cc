@@ -0,0 +1,102 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// Time it takes to get ready to serve a manifest, as a function of its number
+// of entries, and to materialize files as they're looked up and listed.
+//
+// Usage: manifest_bench [directory] [max entries]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+
+#include "ghost_fs.h"
+#include "manifest.h"
+
+#define BENCH_DIRS 1000
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ms(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp";
+    uint64_t max_entries = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000000;
+    std::string path = dir + "/manifest_bench." + std::to_string(getpid());
+
+    // Manifests are all written before being measured, so that freeing what
+    // was used to write them doesn't get in the way.
+    std::vector<std::pair<uint64_t, double>> written;
+    for (uint64_t entries = 1000; entries <= max_entries; entries *= 10) {
+        std::vector<manifest_file> files(entries);
+        for (uint64_t i = 0; i < entries; i++) {
+            files[i].path = "/dir" + std::to_string(i % BENCH_DIRS) + "/file" + std::to_string(i);
+            files[i].url = "http://origin/file" + std::to_string(i);
+            files[i].length = i;
+            files[i].has_length = true;
+        }
+        auto start = bench_clock::now();
+        std::string entries_path = path + "." + std::to_string(entries);
+        if (write_manifest(entries_path.c_str(), std::move(files)) < 0) {
+            perror("write_manifest");
+            return 1;
+        }
+        written.emplace_back(entries, elapsed_ms(start));
+    }
+
+    // Files materialized from a manifest get their blocks in a cache.
+    cache c(CACHE_SIZE, BLOCK_SIZE);
+    printf("%10s %10s %10s %12s %12s\n", "entries", "write_ms", "ready_ms", "lookup_us", "list_dir_ms");
+    for (auto& w : written) {
+        uint64_t entries = w.first;
+        std::string entries_path = path + "." + std::to_string(entries);
+
+        // Getting ready is opening the manifest, the rest is done on demand.
+        auto start = bench_clock::now();
+        ghost_namespace ns;
+        std::unique_ptr<manifest> m(new manifest);
+        if (m->open(entries_path.c_str()) < 0) {
+            perror("manifest");
+            return 1;
+        }
+        ns.set_manifest(std::move(m), c, nullptr);
+        double ready_ms = elapsed_ms(start);
+
+        start = bench_clock::now();
+        std::string last = "/dir" + std::to_string((entries - 1) % BENCH_DIRS) + "/file"
+            + std::to_string(entries - 1);
+        auto file = ns.find_file(last.c_str());
+        double lookup_us = elapsed_ms(start) * 1000;
+        if (!file || file->length() != entries - 1) {
+            fprintf(stderr, "%s not found\n", last.c_str());
+            return 1;
+        }
+
+        start = bench_clock::now();
+        ghost_inode* d;
+        {
+            epoch_guard guard;
+            d = ns.lookup(GHOST_ROOT_INO, "dir0");
+        }
+        size_t listed = 0;
+        ns.for_each_child(d->ino, 0, [&] (const char*, ghost_inode&) {
+            listed++;
+            return true;
+        });
+        double list_ms = elapsed_ms(start);
+
+        printf("%10lu %10.1f %10.3f %12.1f %12.3f (%lu files)\n", (unsigned long)entries,
+               w.second, ready_ms, lookup_us, list_ms, listed);
+        unlink(entries_path.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// Stress benchmark of the namespace: reader threads look files up, by path
+// and by inode, while writer threads keep creating and removing files and
+// directories next to them.
+//
+// Usage: namespace_bench [readers] [writers] [seconds] [files]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ghost_namespace.h"
+
+#define BENCH_DIRS 16
+
+int main(int argc, char *argv[]) {
+    unsigned readers = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    unsigned writers = argc > 2 ? atoi(argv[2]) : 2;
+    unsigned seconds = argc > 3 ? atoi(argv[3]) : 5;
+    unsigned files = argc > 4 ? atoi(argv[4]) : 100000;
+
+    ghost_namespace ns;
+    std::vector<uint64_t> dirs;
+    std::vector<std::string> paths;
+
+    for (unsigned i = 0; i < BENCH_DIRS; i++) {
+        ghost_inode* dir;
+        ns.create(GHOST_ROOT_INO, ("dir" + std::to_string(i)).c_str(), true, &dir);
+        dirs.push_back(dir->ino);
+    }
+    for (unsigned i = 0; i < files; i++) {
+        paths.push_back("/dir" + std::to_string(i % BENCH_DIRS) + "/file" + std::to_string(i));
+        ns.add_file(paths.back().c_str());
+    }
+
+    std::atomic<bool> stop { false };
+    std::atomic<uint64_t> lookups { 0 };
+    std::atomic<uint64_t> misses { 0 };
+    std::atomic<uint64_t> mutations { 0 };
+    std::vector<std::thread> threads;
+
+    for (unsigned i = 0; i < readers; i++) {
+        threads.emplace_back([&, i] {
+            std::mt19937 rng(i);
+            uint64_t n = 0, missed = 0;
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                size_t file = rng() % paths.size();
+                const std::string& path = paths[file];
+                // Lookup from FUSE: parent by inode, then child by name.
+                epoch_guard guard;
+                ghost_inode* dir = ns.find_inode(dirs[file % BENCH_DIRS]);
+                ghost_inode* inode = ns.lookup(dir->ino, path.c_str() + path.rfind('/') + 1);
+                if (!inode || !ns.find_inode(inode->ino)) {
+                    missed++;
+                }
+                n++;
+            }
+            lookups += n;
+            misses += missed;
+        });
+    }
+    for (unsigned i = 0; i < writers; i++) {
+        threads.emplace_back([&, i] {
+            std::mt19937 rng(readers + i);
+            uint64_t n = 0;
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                uint64_t parent = dirs[rng() % dirs.size()];
+                std::string name = "tmp" + std::to_string(i) + "_" + std::to_string(n);
+                ghost_inode* inode;
+
+                if (rng() % 2) {
+                    ns.create(parent, name.c_str(), true, &inode);
+                    ns.remove_dir(parent, name.c_str());
+                } else {
+                    std::string path = "/dir" + std::to_string(rng() % BENCH_DIRS) + "/" + name;
+                    ns.add_file(path.c_str());
+                    ns.remove_file(path.c_str());
+                }
+                n += 2;
+            }
+            mutations += n;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    printf("readers=%u writers=%u files=%u seconds=%u\n", readers, writers, files, seconds);
+    printf("lookups: %.0f/s, %lu missed\n",
+           double(lookups) / seconds, (unsigned long)misses.load());
+    printf("mutations: %.0f/s\n", double(mutations) / seconds);
+    return 0;
+}
@@ -0,0 +1,324 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// Microbenchmarks of the read path, driven through ghost_fs without mounting
+// it, with files served by a sim origin, see sim_protocol:
+//   hit: reads of blocks in cache, from every thread at once, which fail the
+//     benchmark if they allocate memory.
+//   miss: reads of blocks never read, each one fetched from origin.
+//   allocate: cache::allocate_block() by threads contending for the cache,
+//     which mostly evicts, with 1, 2, 4... up to the given number of threads.
+//   prefetch: sequential reads from an origin taking latency_us per fetch,
+//     whose following blocks get prefetched.
+//   faults: sequential reads from an origin also failing error_rate of
+//     fetches, which get retried.
+//
+// Usage: read_bench [threads] [reads] [block_kb] [latency_us] [error_rate]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ghost_fs.h"
+#include "protocol/sim_protocol.h"
+
+#define MAX_CACHE_BYTES (512 << 20)
+
+// Allocations made by threads while their count_allocations is set.
+static thread_local bool count_allocations = false;
+static std::atomic<uint64_t> allocations { 0 };
+
+void* operator new(size_t size) {
+    if (count_allocations) {
+        allocations++;
+    }
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+struct bench_result {
+    uint64_t reads = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    double seconds = 0;
+};
+
+static void print_result(const char* name, unsigned threads, const bench_result& r) {
+    printf("%-9s threads=%-3u %10.0f ops/s %9.0f ns/op %9.1f MB/s errors=%lu\n", name, threads,
+           r.reads / r.seconds, r.seconds * 1e9 * threads / std::max<uint64_t>(r.reads, 1),
+           r.bytes / r.seconds / (1024 * 1024), (unsigned long) r.errors);
+}
+
+// Run body(thread) on threads threads at once, and return how long it took.
+template <typename Body>
+static double run_threads(unsigned threads, Body body) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(body, i);
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Create file name, served by sim origin with the given parameters as an
+// object named after its inode.
+static std::shared_ptr<ghost_file> make_file(ghost_fs& fs, const std::string& name, uint64_t length,
+                                             const std::string& params = std::string()) {
+    std::shared_ptr<ghost_file> file = fs.create_file(("/" + name).c_str());
+    std::string url = "sim://bench/" + std::to_string(file->ino()) + "?size=" +
+        std::to_string(length) + params;
+
+    fs.set_url(file, url.c_str());
+    fs.resolver().wait(*file);
+    return file;
+}
+
+// Wait for prefetches of file still in flight, which hold locks of their blocks.
+static void drain(ghost_file& file) {
+    for (auto& info : file.get_blocks()->blocks) {
+        info._mtx.lock();
+        info._mtx.unlock();
+    }
+}
+
+// Read at offset and check the first byte, without copying anything.
+// Allocations made by the read are counted if counted is set.
+static bool read_at(ghost_fs& fs, const std::shared_ptr<ghost_file>& file, size_t size,
+                    uint64_t offset, bench_result& r, bool counted = false) {
+    char expected;
+    bool valid = false;
+    sim_content("/" + std::to_string(file->ino()), offset, 1, &expected);
+    count_allocations = counted;
+    int res = fs.read_file(file, size, offset, [&] (const read_segment* segments, size_t count) {
+        valid = segments[0].data[0] == expected;
+    });
+    count_allocations = false;
+    if (res <= 0 || !valid) {
+        r.errors++;
+        return false;
+    }
+    r.reads++;
+    r.bytes += res;
+    return true;
+}
+
+static void add_result(bench_result& total, const bench_result& r, std::mutex& mtx) {
+    std::lock_guard<std::mutex> lock(mtx);
+    total.reads += r.reads;
+    total.bytes += r.bytes;
+    total.errors += r.errors;
+}
+
+// Blocks of a file fitting in cache are all read once, and then read again
+// at random offsets, each read staying within a block. Return false if those
+// reads allocated memory, except for the first one of each thread, which sets
+// up what it reuses.
+static bool bench_hit(unsigned threads, unsigned reads, size_t block_size) {
+    const size_t blocks = 256;
+    const size_t read_size = std::min<size_t>(4096, block_size);
+    ghost_fs fs(blocks * 2, block_size);
+    fs.start();
+
+    auto file = make_file(fs, "hit", blocks * block_size);
+    bench_result warm, total;
+    for (size_t blk_id = 0; blk_id < blocks; blk_id++) {
+        read_at(fs, file, block_size, blk_id * block_size, warm);
+    }
+    drain(*file);
+
+    std::mutex mtx;
+    allocations = 0;
+    total.seconds = run_threads(threads, [&] (unsigned thread) {
+        std::mt19937_64 rng(thread);
+        bench_result r;
+        for (unsigned i = 0; i < reads; i++) {
+            uint64_t offset = (rng() % blocks) * block_size + rng() % (block_size - read_size + 1);
+            read_at(fs, file, read_size, offset, r, i > 0);
+        }
+        add_result(total, r, mtx);
+    });
+    print_result("hit", threads, total);
+    fs.stop();
+
+    if (allocations) {
+        printf("          %lu allocations in cache hits\n", (unsigned long) allocations.load());
+        return false;
+    }
+    return true;
+}
+
+// Every thread reads its own file one block at a time, from last block to
+// first, so that blocks following a read are already cached and nothing gets
+// prefetched.
+static void bench_miss(unsigned threads, unsigned reads, size_t block_size) {
+    ghost_fs fs(threads * reads + 1, block_size);
+    fs.start();
+
+    std::vector<std::shared_ptr<ghost_file>> files;
+    for (unsigned i = 0; i < threads; i++) {
+        files.push_back(make_file(fs, "miss" + std::to_string(i), uint64_t(reads) * block_size));
+    }
+
+    bench_result total;
+    std::mutex mtx;
+    total.seconds = run_threads(threads, [&] (unsigned thread) {
+        bench_result r;
+        for (unsigned i = reads; i > 0; i--) {
+            read_at(fs, files[thread], block_size, uint64_t(i - 1) * block_size, r);
+        }
+        add_result(total, r, mtx);
+    });
+    print_result("miss", threads, total);
+    for (auto& file : files) {
+        drain(*file);
+    }
+    fs.stop();
+}
+
+// Every thread cycles through four times as many blocks as cache holds, so
+// that most allocations evict the least recently used block, and the other
+// ones only move their block to the front of the LRU.
+static void bench_allocate(unsigned max_threads, unsigned reads, size_t block_size) {
+    const size_t blocks = 1024;
+
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        cache c(blocks, block_size);
+        std::vector<std::vector<block_info>> infos(threads);
+        for (auto& thread_infos : infos) {
+            thread_infos.resize(blocks * 4);
+        }
+
+        bench_result total;
+        std::mutex mtx;
+        total.seconds = run_threads(threads, [&] (unsigned thread) {
+            std::vector<block_info>& thread_infos = infos[thread];
+            bench_result r;
+            for (unsigned i = 0; i < reads; i++) {
+                block_info& info = thread_infos[i % thread_infos.size()];
+                std::lock_guard<metered_mutex<LOCK_CACHE>> lock(c._mtx);
+
+                if (info._present) {
+                    c.lock_block(info._blk);
+                    c.unlock_block(info._blk);
+                } else {
+                    c.unlock_block(c.allocate_block(&info));
+                }
+                r.reads++;
+            }
+            add_result(total, r, mtx);
+        });
+        print_result("allocate", threads, total);
+    }
+}
+
+// Every thread reads its own file sequentially, a block at a time, from an
+// origin served with params, and return what stats() got through it.
+static ghost_stats read_sequential(const char* name, unsigned threads, unsigned reads,
+                                   size_t block_size, const std::string& params) {
+    ghost_fs fs(threads * (reads + PREFETCH_WINDOW) + 1, block_size);
+    fs.start();
+
+    std::vector<std::shared_ptr<ghost_file>> files;
+    for (unsigned i = 0; i < threads; i++) {
+        files.push_back(make_file(fs, name + std::to_string(i), uint64_t(reads) * block_size,
+                                  params));
+    }
+    for (auto& file : files) {
+        drain(*file);
+    }
+    ghost_stats before = fs.stats();
+
+    bench_result total;
+    std::mutex mtx;
+    total.seconds = run_threads(threads, [&] (unsigned thread) {
+        bench_result r;
+        for (unsigned i = 0; i < reads; i++) {
+            read_at(fs, files[thread], block_size, uint64_t(i) * block_size, r);
+        }
+        add_result(total, r, mtx);
+    });
+    for (auto& file : files) {
+        drain(*file);
+    }
+    print_result(name, threads, total);
+
+    ghost_stats after = fs.stats();
+    after.cache_misses -= before.cache_misses;
+    after.prefetched -= before.prefetched;
+    after.prefetch_hits -= before.prefetch_hits;
+    after.fetch_timeouts -= before.fetch_timeouts;
+    after.fetch_retries -= before.fetch_retries;
+    after.fetch_failures -= before.fetch_failures;
+    fs.stop();
+    return after;
+}
+
+// Reads only wait for blocks that prefetching didn't get in time.
+static void bench_prefetch(unsigned threads, unsigned reads, size_t block_size,
+                           unsigned latency_us) {
+    std::string params = "&latency_ms=" + std::to_string(latency_us / 1000.0);
+    ghost_stats s = read_sequential("prefetch", threads, reads, block_size, params);
+
+    printf("          latency=%uus misses=%lu prefetched=%lu prefetch_hits=%lu\n", latency_us,
+           (unsigned long) s.cache_misses, (unsigned long) s.prefetched,
+           (unsigned long) s.prefetch_hits);
+}
+
+// Failed fetches are retried after a backoff, which reads wait for.
+static void bench_faults(unsigned threads, unsigned reads, size_t block_size,
+                         unsigned latency_us, double error_rate) {
+    std::string params = "&latency_ms=" + std::to_string(latency_us / 1000.0) +
+        "&error_rate=" + std::to_string(error_rate) + "&seed=1";
+    ghost_stats s = read_sequential("faults", threads, reads, block_size, params);
+
+    printf("          error_rate=%g retries=%lu timeouts=%lu failures=%lu\n", error_rate,
+           (unsigned long) s.fetch_retries, (unsigned long) s.fetch_timeouts,
+           (unsigned long) s.fetch_failures);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    unsigned reads = argc > 2 ? atoi(argv[2]) : 100000;
+    size_t block_size = (argc > 3 ? atoi(argv[3]) : 64) * 1024;
+    unsigned latency_us = argc > 4 ? atoi(argv[4]) : 100;
+    double error_rate = argc > 5 ? atof(argv[5]) : 0.01;
+
+    threads = std::max(1u, threads);
+    register_handler(new sim_protocol);
+
+    printf("threads=%u reads=%u block_kb=%lu\n", threads, reads, (unsigned long) block_size / 1024);
+    // Every miss and prefetch uses a block of its own, so there are fewer of
+    // them, and no more than MAX_CACHE_BYTES worth of blocks.
+    unsigned max_blocks = std::max<size_t>(1, MAX_CACHE_BYTES / block_size / threads);
+    unsigned sequential_reads = std::min(max_blocks, std::max(1u, reads / 100));
+    bool hits_allocate = !bench_hit(threads, reads, block_size);
+    bench_miss(threads, std::min(max_blocks, std::max(1u, reads / 10)), block_size);
+    bench_allocate(threads, reads, block_size);
+    bench_prefetch(threads, sequential_reads, block_size, latency_us);
+    bench_faults(threads, sequential_reads, block_size, latency_us, error_rate);
+    return hits_allocate ? 1 : 0;
+}
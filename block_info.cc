@@ -11,6 +11,8 @@
 void block_info::reset() {
     _present = false;
     _blk = nullptr;
+    _prefetched = false;
+    _fetching = false;
 }
 
 void block_info::set_block(block *blk) {
@@ -12,7 +12,7 @@
 #include <boost/intrusive/unordered_set.hpp>
 #include <boost/intrusive/list.hpp>
 
-#include <mutex>
+#include "metrics.h"
 
 struct block_info;
 
@@ -28,10 +28,23 @@ struct block {
     block() = delete;
 };
 
+// Set in block_info::_checksum once it holds the checksum of the block.
+#define BLOCK_CHECKSUM_KNOWN (uint64_t(1) << 32)
+
 struct block_info {
     bool _present = false;
     block* _blk = nullptr;
-    std::mutex _mtx;
+    // Whether block was prefetched and hasn't been read since.
+    bool _prefetched = false;
+    // Set, with the lock of cache held, while block is fetched in background
+    // by a prefetch, or by a read that was replied to early, without _mtx
+    // held. Content is only valid once it's cleared, see cache::_fetched.
+    bool _fetching = false;
+    // CRC32C of content together with BLOCK_CHECKSUM_KNOWN, once learned
+    // from a fetch. Unlike the fields above, it survives eviction, so that
+    // the block is verified when fetched again.
+    std::atomic<uint64_t> _checksum { 0 };
+    metered_mutex<LOCK_BLOCK> _mtx;
 
     block_info() = default;
     block_info(block_info&&) {}
@@ -6,7 +6,11 @@
   See the file COPYING.
 */
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "cache.h"
+#include "utils.h"
 
 size_t cache::blocks_used() {
     return _blocks_used;
@@ -14,10 +18,30 @@ size_t cache::blocks_used() {
 
 cache::cache(size_t blocks, size_t block_size)
     : _blocks_available(blocks)
-    , _block_size(block_size) {}
+    , _block_size(block_size) {
+    size_t arena_size = blocks * block_size;
+
+    _arena_fd = memfd_create("ghostfs_cache", 0);
+    if (_arena_fd >= 0 && ftruncate(_arena_fd, arena_size) < 0) {
+        close(_arena_fd);
+        _arena_fd = -1;
+    }
+
+    int flags = MAP_SHARED | MAP_NORESERVE | ((_arena_fd < 0) ? MAP_ANONYMOUS : 0);
+    void* arena = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, flags, _arena_fd, 0);
+    if (arena == MAP_FAILED) {
+        log("Unable to map %ld bytes for cache\n", arena_size);
+        abort();
+    }
+    _arena = static_cast<char*>(arena);
+}
 
 cache::~cache() {
     _lru.clear();
+    munmap(_arena, _blocks_available * _block_size);
+    if (_arena_fd >= 0) {
+        close(_arena_fd);
+    }
 }
 
 block *cache::allocate_block(block_info *info) {
@@ -29,7 +53,7 @@ block *cache::allocate_block(block_info *info) {
     block *blk = nullptr;
 
     if (blocks_used() < _blocks_available) {
-        char *data = new char[_block_size];
+        char *data = _arena + blocks_used() * _block_size;
 
         blk = new block(info, data);
         // Make block_info of the caller store allocated block.
@@ -41,14 +65,20 @@ block *cache::allocate_block(block_info *info) {
         // XXX: possible race condition with eviction.
         // If we evict a block which is about to be used but wasn't locked yet.
 
-        assert(!_lru.empty());
+        if (_lru.empty()) {
+            return nullptr;
+        }
 
         block& victim = reinterpret_cast<block&>(_lru.back());
         _lru.erase(_lru.iterator_to(victim)); // lock evicted block.
-        assert(victim._info);
 
-        // Reset block_info of the evicted block.
-        victim._info->reset();
+        // Reset block_info of the evicted block, unless it was freed.
+        if (victim._info) {
+            if (victim._info->_prefetched) {
+                get_read_metrics().prefetch_wasted.add();
+            }
+            victim._info->reset();
+        }
         // Make block_info of the caller store evicted block.
         info->set_block(&victim);
         // Make evicted block store block_info of the caller.
@@ -59,6 +89,14 @@ block *cache::allocate_block(block_info *info) {
     return blk;
 }
 
+void cache::free_block(block *blk) {
+    auto& blk_ref = reinterpret_cast<block&>(*blk);
+    assert(blk->_info);
+    blk->_info->reset();
+    blk->_info = nullptr;
+    _lru.push_back(blk_ref);
+}
+
 void cache::lock_block(block *blk) {
     auto& blk_ref = reinterpret_cast<block&>(*blk);
     _lru.erase(_lru.iterator_to(blk_ref));
@@ -73,6 +111,34 @@ size_t cache::block_size() {
     return _block_size;
 }
 
+size_t cache::capacity() {
+    return _blocks_available;
+}
+
+int cache::arena_fd() {
+    return _arena_fd;
+}
+
+size_t cache::arena_offset(const char *data) {
+    assert(arena_contains(data, 0));
+    return data - _arena;
+}
+
+bool cache::arena_contains(const char *data, size_t size) {
+    return data >= _arena && data + size <= _arena + _blocks_available * _block_size;
+}
+
 float cache::get_hit_ratio() {
     return (float(_hits) / (_hits + _misses)) * 100.0;
 }
+
+std::vector<const block_info*> cache::lru_blocks() {
+    std::vector<const block_info*> blocks;
+
+    for (auto& blk : _lru) {
+        if (blk._info && blk._info->_present) {
+            blocks.push_back(blk._info);
+        }
+    }
+    return blocks;
+}
@@ -9,7 +9,8 @@
 #ifndef CACHE_H
 #define CACHE_H
 
-#include <mutex>
+#include <condition_variable>
+#include <vector>
 
 #include "block_info.h"
 
@@ -20,10 +21,18 @@ private:
     size_t _blocks_used = 0;
     size_t _blocks_available;
     size_t _block_size;
+    // Content of all blocks is stored in a single shared mapping, backed by
+    // _arena_fd if possible, so that it can be shared with other processes.
+    // Pages are only populated when a block is first used.
+    char* _arena = nullptr;
+    int _arena_fd = -1;
 
     size_t blocks_used();
 public:
-    std::mutex _mtx;
+    metered_mutex<LOCK_CACHE> _mtx;
+    // Notified, with _mtx held, whenever blocks stop being fetched in
+    // background, see block_info::_fetching.
+    std::condition_variable_any _fetched;
     size_t _hits = 0;
     size_t _misses = 0;
 
@@ -31,17 +40,37 @@ public:
 
     ~cache();
 
-    // Return a block which isn't inserted to lru yet, i.e. the block is locked.
+    // Return a block which isn't inserted to lru yet, i.e. the block is locked,
+    // or nullptr if all blocks are locked.
     block* allocate_block(block_info* info);
 
+    // Give back a block whose content is invalid, e.g. because fetching it
+    // failed. Block info is reset and block becomes the next one to be evicted.
+    void free_block(block* blk);
+
     void lock_block(block* blk);
 
     void unlock_block(block* blk);
 
     size_t block_size();
 
+    // Return number of blocks content can be stored in.
+    size_t capacity();
+
+    // Return file descriptor backing block content, or -1 if there is none.
+    int arena_fd();
+
+    // Return offset of data in the file backing block content.
+    size_t arena_offset(const char* data);
+
+    bool arena_contains(const char* data, size_t size);
+
     float get_hit_ratio();
 
+    // Return info of blocks storing content, most recently used first,
+    // except the ones being read. Must be called with _mtx held.
+    std::vector<const block_info*> lru_blocks();
+
     friend struct ghost_fs;
 };
 
@@ -0,0 +1,191 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#include "checksum.h"
+
+// Polynomial of CRC32C, bit-reflected.
+#define CRC32C_POLY 0x82f63b78
+
+// Tables of software CRC32C, which processes 8 bytes at a time: entry i of
+// table k is the CRC of byte i followed by k zero bytes.
+struct crc_tables {
+    uint32_t t[8][256];
+
+    crc_tables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+            }
+            t[0][i] = crc;
+        }
+        for (int k = 1; k < 8; k++) {
+            for (uint32_t i = 0; i < 256; i++) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+static uint32_t crc32c_software(uint32_t crc, const unsigned char* p, size_t size) {
+    static const crc_tables tables;
+    const auto& t = tables.t;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[5][(v >> 16) & 0xff] ^
+              t[4][(v >> 24) & 0xff] ^ t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^
+              t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+    }
+#endif
+    for (; size; p++, size--) {
+        crc = t[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+// Buffers are split in three streams of CRC_LONG bytes, or CRC_SHORT bytes
+// once fewer remain, whose CRCs are computed at once, hiding the latency of
+// the crc32 instruction, and then combined.
+#define CRC_LONG 8192
+#define CRC_SHORT 256
+
+// Return x^(8 * n - 33) modulo the polynomial, bit-reflected. CRC of n zero
+// bytes following a CRC c is the CRC of the carry-less product of c with it.
+static uint32_t crc_shift_constant(size_t n) {
+    uint32_t x = 0x80000000; // x^0
+
+    for (size_t i = 0; i < 8 * n - 33; i++) {
+        x = (x >> 1) ^ ((x & 1) ? CRC32C_POLY : 0);
+    }
+    return x;
+}
+
+struct crc_shifts {
+    uint32_t long_1 = crc_shift_constant(CRC_LONG);
+    uint32_t long_2 = crc_shift_constant(2 * CRC_LONG);
+    uint32_t short_1 = crc_shift_constant(CRC_SHORT);
+    uint32_t short_2 = crc_shift_constant(2 * CRC_SHORT);
+};
+
+// Shift crc over the zero bytes whose constant is k.
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc_shift(uint32_t crc, uint32_t k) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(k), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+static inline uint64_t load_u64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Compute CRC of streams of len bytes while there are three of them left.
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc32c_streams(uint32_t crc, const unsigned char*& p, size_t& size,
+                                      size_t len, uint32_t k1, uint32_t k2) {
+    while (size >= 3 * len) {
+        uint64_t c0 = crc, c1 = 0, c2 = 0;
+        for (size_t i = 0; i < len; i += 8) {
+            c0 = _mm_crc32_u64(c0, load_u64(p + i));
+            c1 = _mm_crc32_u64(c1, load_u64(p + len + i));
+            c2 = _mm_crc32_u64(c2, load_u64(p + 2 * len + i));
+        }
+        crc = crc_shift(c0, k2) ^ crc_shift(c1, k1) ^ uint32_t(c2);
+        p += 3 * len;
+        size -= 3 * len;
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, size_t size) {
+    static const crc_shifts shifts;
+
+    for (; size && (uintptr_t(p) & 7); p++, size--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    crc = crc32c_streams(crc, p, size, CRC_LONG, shifts.long_1, shifts.long_2);
+    crc = crc32c_streams(crc, p, size, CRC_SHORT, shifts.short_1, shifts.short_2);
+
+    uint64_t crc64 = crc;
+    for (; size >= 8; p += 8, size -= 8) {
+        crc64 = _mm_crc32_u64(crc64, load_u64(p));
+    }
+    crc = crc64;
+    for (; size; p++, size--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+
+#endif
+
+typedef uint32_t (*crc32c_function)(uint32_t, const unsigned char*, size_t);
+
+static crc32c_function select_crc32c() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        return crc32c_sse42;
+    }
+#endif
+    return crc32c_software;
+}
+
+static crc32c_function crc32c_impl() {
+    static const crc32c_function impl = select_crc32c();
+    return impl;
+}
+
+uint32_t crc32c(const void* data, size_t size, uint32_t crc) {
+    return ~crc32c_impl()(~crc, static_cast<const unsigned char*>(data), size);
+}
+
+bool crc32c_hardware() {
+    return crc32c_impl() != crc32c_software;
+}
+
+int load_block_checksums(const char* path, block_checksums& checksums) {
+    std::ifstream in(path);
+    std::string line;
+
+    if (!in) {
+        return errno ? -errno : -ENOENT;
+    }
+    if (!std::getline(in, line) || (checksums.block_size = strtoul(line.c_str(), nullptr, 10)) == 0) {
+        return -EINVAL;
+    }
+    checksums.crcs.clear();
+    while (std::getline(in, line)) {
+        char* end;
+        unsigned long crc = strtoul(line.c_str(), &end, 16);
+        if (end == line.c_str()) {
+            return -EINVAL;
+        }
+        checksums.crcs.push_back(crc);
+    }
+    return 0;
+}
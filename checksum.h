@@ -0,0 +1,44 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Attribute of a file naming a sidecar with the checksums of its blocks.
+#define CHECKSUMS_ATTRIBUTE "checksums"
+
+// Number of times a block whose checksum doesn't match is fetched again
+// before the fetch is considered failed.
+#define CHECKSUM_REFETCHES 2
+
+// Return CRC32C, whose polynomial is the one used by iSCSI and ext4, of
+// size bytes of data, continuing from crc of the preceding bytes. It uses
+// the crc32 instruction of SSE4.2 on three streams at once, combined with
+// carry-less multiplication, when the CPU has both, and tables otherwise.
+uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+// Whether crc32c() is computed by hardware.
+bool crc32c_hardware();
+
+// Checksums of the blocks of an object, given by a sidecar: a text file with
+// the block size in bytes on the first line, followed by the CRC32C of each
+// block in hexadecimal, one per line.
+struct block_checksums {
+    size_t block_size = 0;
+    std::vector<uint32_t> crcs;
+};
+
+// Load checksums from sidecar at path. Return 0 on success, or a negative
+// error.
+int load_block_checksums(const char* path, block_checksums& checksums);
+
+#endif // CHECKSUM_H
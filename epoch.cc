@@ -0,0 +1,163 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include "epoch.h"
+
+// Number of retired objects from which retiring also tries to free them.
+#define EPOCH_RECLAIM_THRESHOLD 64
+
+namespace {
+
+// Epoch observed by a thread when it entered its critical section, or zero
+// if it's outside of one. Records are never freed, but given back for reuse
+// by another thread when their thread exits.
+struct thread_record {
+    std::atomic<uint64_t> epoch { 0 };
+    std::atomic<bool> in_use { true };
+    unsigned depth = 0;
+    thread_record* next = nullptr;
+    // Keep epochs of different threads in different cache lines.
+    char padding[64];
+};
+
+struct retired {
+    uint64_t epoch;
+    std::function<void ()> free;
+};
+
+std::atomic<uint64_t> global_epoch { 1 };
+std::atomic<thread_record*> records { nullptr };
+
+std::mutex retired_mtx;
+std::vector<retired> retired_list;
+// Size of retired_list from which retiring tries to free. It grows with what
+// couldn't be freed, so that a long critical section doesn't make every
+// retirement scan the whole list.
+size_t reclaim_threshold = EPOCH_RECLAIM_THRESHOLD;
+
+struct record_owner {
+    thread_record* rec = nullptr;
+
+    ~record_owner() {
+        if (rec) {
+            rec->in_use.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_record* get_record() {
+    static thread_local record_owner owner;
+
+    if (owner.rec) {
+        return owner.rec;
+    }
+    for (auto rec = records.load(std::memory_order_acquire); rec; rec = rec->next) {
+        bool expected = false;
+        if (rec->in_use.compare_exchange_strong(expected, true)) {
+            owner.rec = rec;
+            return rec;
+        }
+    }
+    auto rec = new thread_record;
+    rec->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(rec->next, rec, std::memory_order_release)) {}
+    owner.rec = rec;
+    return rec;
+}
+
+// Lowest epoch of a thread in a critical section. Everything retired before
+// that epoch can be freed.
+uint64_t oldest_epoch() {
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (auto rec = records.load(std::memory_order_acquire); rec; rec = rec->next) {
+        uint64_t epoch = rec->epoch.load(std::memory_order_seq_cst);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+// Take out of retired_list what can be freed, which must be locked by caller.
+std::vector<retired> take_reclaimable() {
+    uint64_t oldest = oldest_epoch();
+    std::vector<retired> reclaimable;
+
+    auto it = retired_list.begin();
+    for (auto& r : retired_list) {
+        if (r.epoch < oldest) {
+            reclaimable.push_back(std::move(r));
+        } else {
+            if (&*it != &r) {
+                *it = std::move(r);
+            }
+            it++;
+        }
+    }
+    retired_list.erase(it, retired_list.end());
+    reclaim_threshold = std::max<size_t>(EPOCH_RECLAIM_THRESHOLD, retired_list.size() * 2);
+    return reclaimable;
+}
+
+}
+
+epoch_guard::epoch_guard() {
+    thread_record* rec = get_record();
+
+    if (rec->depth++ == 0) {
+        rec->epoch.store(global_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+epoch_guard::~epoch_guard() {
+    thread_record* rec = get_record();
+
+    if (--rec->depth == 0) {
+        rec->epoch.store(0, std::memory_order_release);
+    }
+}
+
+// A reader that entered at the epoch an object was retired in may have seen
+// it, but one that entered later can't, as epoch is advanced only after the
+// object got unlinked.
+void epoch_retire(std::function<void ()> free) {
+    std::vector<retired> reclaimable;
+    {
+        std::lock_guard<std::mutex> lock(retired_mtx);
+        uint64_t epoch = global_epoch.fetch_add(1, std::memory_order_seq_cst);
+        retired_list.push_back(retired{ epoch, std::move(free) });
+
+        if (retired_list.size() >= reclaim_threshold) {
+            reclaimable = take_reclaimable();
+        }
+    }
+    for (auto& r : reclaimable) {
+        r.free();
+    }
+}
+
+void epoch_reclaim() {
+    std::vector<retired> reclaimable;
+    {
+        std::lock_guard<std::mutex> lock(retired_mtx);
+        reclaimable = take_reclaimable();
+    }
+    for (auto& r : reclaimable) {
+        r.free();
+    }
+}
@@ -0,0 +1,40 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <functional>
+
+// Epoch based reclamation, which lets readers traverse shared structures
+// without taking any lock. Readers hold an epoch_guard for as long as they
+// use anything reachable from a shared structure, and writers retire what
+// they unlink instead of freeing it, so that it only gets freed once every
+// reader that could have seen it is gone.
+
+// Critical section of a reader. Guards can be nested.
+struct epoch_guard {
+    epoch_guard();
+    ~epoch_guard();
+
+    epoch_guard(const epoch_guard&) = delete;
+    epoch_guard& operator=(const epoch_guard&) = delete;
+};
+
+// Call free once no reader can still use what was unlinked before the call.
+void epoch_retire(std::function<void ()> free);
+
+template <typename T>
+void epoch_retire(T* ptr) {
+    epoch_retire([ptr] { delete ptr; });
+}
+
+// Free whatever was retired and can no longer be used by readers.
+void epoch_reclaim();
+
+#endif // EPOCH_H
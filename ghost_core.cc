@@ -0,0 +1,1489 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+
+#include "ghost_fs.h"
+#include "seek_index.h"
+#include "trace.h"
+#include "utils.h"
+
+ghost_fs::ghost_fs()
+    : ghost_fs(CACHE_SIZE, BLOCK_SIZE) {}
+
+ghost_fs::ghost_fs(size_t cache_blocks, size_t block_size)
+    : _c(cache_blocks, block_size)
+    , _resolver(_c) {
+    _files.set_fetch_context_observer([this] (const std::shared_ptr<ghost_file>& file) {
+        index_peer_file(file);
+    });
+}
+
+ghost_namespace &ghost_fs::files() {
+    return _files;
+}
+
+size_t ghost_fs::get_block_size() {
+    return _c.block_size();
+}
+
+cache &ghost_fs::get_cache() {
+    return _c;
+}
+
+ghost_options &ghost_fs::options() {
+    return _options;
+}
+
+kernel_notifier &ghost_fs::notifier() {
+    return _notifier;
+}
+
+metadata_resolver &ghost_fs::resolver() {
+    return _resolver;
+}
+
+ghost_journal &ghost_fs::journal() {
+    return _journal;
+}
+
+// Fetch requested blocks from an origin that doesn't serve ranges, with a
+// transfer of the object from its start, which ends once past the last one.
+// A transfer failing before then is retried from the start, as many times as
+// the fetch policy of ctx allows.
+static void stream_requests(const fetch_context& ctx, size_t block_size,
+                            std::vector<block_request>& requests) {
+    uint64_t end = 0;
+
+    for (auto& req : requests) {
+        end = std::max(end, (uint64_t(req.block_id) + 1) * block_size);
+    }
+    for (unsigned attempt = 0;; attempt++) {
+        uint64_t offset = 0;
+        for (auto& req : requests) {
+            req.bytes_read = 0;
+        }
+        bool done = ctx.handler->get_stream(ctx, [&] (const char* data, size_t size) {
+            for (auto& req : requests) {
+                uint64_t blk_start = uint64_t(req.block_id) * block_size;
+                uint64_t from = std::max(offset, blk_start);
+                uint64_t to = std::min(offset + size, blk_start + block_size);
+                if (from < to) {
+                    memcpy(req.data + (from - blk_start), data + (from - offset), to - from);
+                    req.bytes_read = to - blk_start;
+                }
+            }
+            offset += size;
+            return offset < end;
+        });
+        if (done || offset >= end || attempt == ctx.policy.max_retries) {
+            return;
+        }
+        get_fetch_stats().retries++;
+        std::this_thread::sleep_for(fetch_backoff(attempt));
+    }
+}
+
+// Fetch requested blocks through the handler of ctx, using the vectored
+// interface whenever more than one block is needed.
+static void call_handler(const fetch_context& ctx, size_t block_size,
+                         std::vector<block_request>& requests) {
+    if (!ctx.ranges) {
+        // Handled below.
+    } else if (requests.size() == 1 && !requests.front().progress) {
+        latency_timer timer(ctx.metrics->get_block);
+        auto& req = requests.front();
+        req.bytes_read = ctx.handler->get_block(ctx, req.block_id, block_size, req.data);
+    } else if (!requests.empty()) {
+        // Progress is only reported through the vectored interface.
+        latency_timer timer(requests.size() == 1 ? ctx.metrics->get_block
+                                                 : ctx.metrics->get_blocks);
+        ctx.handler->get_blocks(ctx, block_size, requests);
+    }
+    // Handler may have just found out that origin doesn't serve ranges.
+    if (!ctx.ranges && !requests.empty()) {
+        latency_timer timer(ctx.metrics->get_blocks);
+        stream_requests(ctx, block_size, requests);
+    }
+
+    for (auto& req : requests) {
+        ctx.metrics->bytes.add(req.bytes_read);
+    }
+}
+
+// Return number of bytes a block must have, which is smaller than block size
+// only for the last block of the file.
+static size_t expected_block_length(const block_table& table, size_t blk_id, size_t block_size) {
+    size_t blk_start = blk_id * block_size;
+    return std::min(table.length, blk_start + block_size) - blk_start;
+}
+
+// Return checksum of block blk_id of table together with BLOCK_CHECKSUM_KNOWN,
+// or 0 if it isn't known. Checksums given by ctx take precedence over the
+// ones learned from previous fetches.
+static uint64_t expected_checksum(block_table& table, const fetch_context& ctx, size_t blk_id,
+                                  size_t block_size) {
+    const block_checksums* checksums = ctx.checksums.get();
+    if (checksums && checksums->block_size == block_size && blk_id < checksums->crcs.size()) {
+        return checksums->crcs[blk_id] | BLOCK_CHECKSUM_KNOWN;
+    }
+    return table.blocks[blk_id]._checksum.load(std::memory_order_relaxed);
+}
+
+// Fetch requested blocks of file from their owner among peers, if any, and
+// the ones peers didn't serve whole through the handler of ctx. Objects
+// without a validator are only fetched from origin, as peers couldn't tell
+// whether they cache the same content.
+static void fetch_from_peers(ghost_file& file, const block_table& table, const fetch_context& ctx,
+                             size_t block_size, std::vector<block_request>& requests,
+                             peer_tier* peers) {
+    if (!peers || !peers->enabled() || !ctx.ranges) {
+        call_handler(ctx, block_size, requests);
+        return;
+    }
+    peer_object object{ ctx.handler->name(), ctx.url, file.validator() };
+    if (object.validator.empty()) {
+        call_handler(ctx, block_size, requests);
+        return;
+    }
+    peers->get_blocks(object, ctx.policy, block_size, requests);
+
+    std::vector<block_request> remaining;
+    std::vector<size_t> indexes;
+    for (size_t i = 0; i < requests.size(); i++) {
+        block_request& req = requests[i];
+        if (req.bytes_read == expected_block_length(table, req.block_id, block_size)) {
+            if (req.progress) {
+                (*req.progress)(req.bytes_read);
+            }
+            continue;
+        }
+        remaining.push_back(req);
+        indexes.push_back(i);
+    }
+    call_handler(ctx, block_size, remaining);
+    for (size_t i = 0; i < remaining.size(); i++) {
+        requests[indexes[i]].bytes_read = remaining[i].bytes_read;
+    }
+}
+
+// Fetch requested blocks of table of file, which must be locked by the caller, asking
+// peers first if given. Blocks fetched whole whose checksum is known are
+// verified, and fetched again from origin up to CHECKSUM_REFETCHES times if
+// they don't match, before being failed with bytes_read set to 0. Checksums
+// of the other ones are learned if learn is set. A learned checksum is
+// replaced if two fetches in a row agree on another one, as the object
+// changed rather than got corrupted.
+static void fetch_blocks(ghost_file& file, block_table& table, const fetch_context& ctx,
+                         size_t block_size, std::vector<block_request>& requests, bool learn,
+                         peer_tier* peers) {
+    fetch_from_peers(file, table, ctx, block_size, requests, peers);
+    if (!learn && !ctx.checksums) {
+        bool any_known = false;
+        for (auto& req : requests) {
+            any_known |= table.blocks[req.block_id]._checksum.load(std::memory_order_relaxed) != 0;
+        }
+        if (!any_known) {
+            return;
+        }
+    }
+
+    // Requests to be verified, and checksum they got on the previous fetch.
+    std::vector<std::pair<size_t, uint32_t>> pending;
+    for (size_t i = 0; i < requests.size(); i++) {
+        pending.emplace_back(i, 0);
+    }
+
+    for (unsigned attempt = 0; !pending.empty(); attempt++) {
+        std::vector<std::pair<size_t, uint32_t>> mismatched;
+
+        for (auto& p : pending) {
+            block_request& req = requests[p.first];
+            block_info& info = table.blocks[req.block_id];
+            if (req.bytes_read < expected_block_length(table, req.block_id, block_size)) {
+                continue;
+            }
+            uint64_t expected = expected_checksum(table, ctx, req.block_id, block_size);
+            if (!expected && !learn) {
+                continue;
+            }
+            uint32_t crc = crc32c(req.data, req.bytes_read);
+            bool learned = expected == info._checksum.load(std::memory_order_relaxed);
+            if (!expected || (learned && attempt && crc == p.second)) {
+                info._checksum.store(crc | BLOCK_CHECKSUM_KNOWN, std::memory_order_relaxed);
+                continue;
+            }
+            if (crc == uint32_t(expected)) {
+                continue;
+            }
+            TRACE_ERROR(TRACE_CHECKSUM_MISMATCH, file.ino(), req.block_id, crc, 0);
+            ctx.metrics->checksum_mismatches.add();
+            mismatched.emplace_back(p.first, crc);
+        }
+
+        if (mismatched.empty()) {
+            break;
+        }
+        if (attempt == CHECKSUM_REFETCHES) {
+            for (auto& p : mismatched) {
+                log("Checksum of block %lu of %s doesn't match\n", requests[p.first].block_id,
+                    ctx.url.c_str());
+                requests[p.first].bytes_read = 0;
+            }
+            break;
+        }
+        std::vector<block_request> refetch;
+        for (auto& p : mismatched) {
+            refetch.emplace_back(requests[p.first].block_id, requests[p.first].data);
+        }
+        call_handler(ctx, block_size, refetch);
+        for (size_t i = 0; i < mismatched.size(); i++) {
+            requests[mismatched[i].first].bytes_read = refetch[i].bytes_read;
+        }
+        pending.swap(mismatched);
+    }
+}
+
+// Release a block fetched by the caller, giving it back to cache if fetching
+// failed, and wake up whoever waits for it if it was fetched in background.
+static void release_fetched_block(cache& c, block_info& info, bool failed) {
+    std::lock_guard<metered_mutex<LOCK_CACHE>> lock(c._mtx);
+    bool fetching = info._fetching;
+    info._fetching = false;
+    if (failed) {
+        c.free_block(info._blk);
+    } else {
+        c.unlock_block(info._blk);
+    }
+    if (fetching) {
+        c._fetched.notify_all();
+    }
+}
+
+// Wait, with the lock of cache c held, until block of info isn't fetched in
+// background anymore. Time waited counts as waiting for the block.
+static void wait_fetched(cache& c, block_info& info) {
+    if (info._fetching) {
+        latency_timer timer(lock_wait(LOCK_BLOCK));
+        c._fetched.wait(c._mtx, [&] { return !info._fetching; });
+    }
+}
+
+static void do_prefetch(cache& c, std::shared_ptr<ghost_file> file_ptr,
+                        std::shared_ptr<block_table> table, std::vector<size_t> blk_ids,
+                        std::shared_ptr<fetch_context> ctx, bool verify, peer_tier* peers) {
+    uint64_t start = TRACE_CLOCK(TRACE_LEVEL_DEBUG);
+    ghost_file& file = *file_ptr;
+    std::vector<block_info>& file_blocks = table->blocks;
+    std::vector<block_request> requests;
+
+    for (auto blk_id : blk_ids) {
+        requests.emplace_back(blk_id, file_blocks[blk_id]._blk->_data);
+    }
+    fetch_blocks(file, *table, *ctx, c.block_size(), requests, verify, peers);
+
+    for (auto& req : requests) {
+        block_info& info = file_blocks[req.block_id];
+        bool failed = req.bytes_read < expected_block_length(*table, req.block_id, c.block_size());
+
+        if (failed) {
+            ctx->metrics->failures.add();
+        } else {
+            info._prefetched = true;
+            get_read_metrics().prefetched.add();
+        }
+        release_fetched_block(c, info, failed);
+        TRACE_DEBUG(TRACE_PREFETCH_DONE, file.ino(), req.block_id, failed, trace_since(start));
+    }
+}
+
+// Number of blocks to be prefetched, which is increased to cover the fetch
+// size preferred by the handler, if any, as long as it stays a small share of
+// cache c, whose blocks are locked until prefetched.
+static size_t prefetch_window(base_protocol* handler, cache& c) {
+    size_t block_size = c.block_size();
+    size_t preferred_blocks = (handler->preferred_fetch_size() + block_size - 1) / block_size;
+    size_t max_blocks = std::max(size_t(1), c.capacity() / PREFETCH_CACHE_SHARE);
+    return std::min(std::max(size_t(PREFETCH_WINDOW), preferred_blocks), max_blocks);
+}
+
+// Allocate blocks of table of file from blk_id up to end which are neither
+// cached nor being read, and return their numbers. They're marked as being
+// fetched until do_prefetch() is done with them, rather than staying locked,
+// so that the thread locking them is the one unlocking them. Stops early once
+// all blocks of cache are locked.
+static std::vector<size_t> reserve_blocks(cache& c, ghost_file& file, block_table& table,
+                                          size_t blk_id, size_t end) {
+    std::vector<block_info>& file_blocks = table.blocks;
+    std::vector<size_t> blk_ids;
+
+    end = std::min(end, file_blocks.size());
+    for (; blk_id < end; blk_id++) {
+        block_info& info = file_blocks[blk_id];
+
+        if (!info._mtx.try_lock()) {
+            continue;
+        }
+        c._mtx.lock();
+
+        if (info._present) {
+            c._mtx.unlock();
+            info._mtx.unlock();
+            continue;
+        }
+        block* blk = c.allocate_block(&info);
+        if (blk) {
+            info._fetching = true;
+        }
+        c._mtx.unlock();
+        info._mtx.unlock();
+        if (!blk) {
+            break;
+        }
+        TRACE_DEBUG(TRACE_PREFETCH, file.ino(), blk_id, 0, 0);
+        assert(info._blk == blk);
+
+        blk_ids.push_back(blk_id);
+    }
+    return blk_ids;
+}
+
+// Try to prefetch blocks starting from blk_id. Blocks that are either cached
+// or being read are skipped, and the remaining ones are fetched in background
+// with a single request to the handler, which keeps file and its blocks
+// alive until done.
+// Checksums of blocks are learned if verify is set, see fetch_blocks().
+// Objects that aren't served by ranges are only read ahead by their stream.
+static void try_prefetch(cache& c, const std::shared_ptr<ghost_file>& file, size_t blk_id,
+                         const std::shared_ptr<fetch_context>& ctx, bool verify,
+                         peer_tier* peers) {
+    std::shared_ptr<block_table> table = file->get_blocks();
+    if (!ctx->ranges || !table) {
+        return;
+    }
+    size_t end = blk_id + prefetch_window(ctx->handler, c);
+    std::vector<size_t> blk_ids = reserve_blocks(c, *file, *table, blk_id, end);
+
+    if (blk_ids.empty()) {
+        return;
+    }
+
+    std::thread t(do_prefetch, std::ref(c), file, table, std::move(blk_ids), ctx, verify, peers);
+    t.detach();
+}
+
+// Fetch of the blocks a read misses, made in background so that the read can
+// be replied to as soon as the bytes it needs are stored, see
+// start_early_fetch().
+struct early_fetch {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<block_request> requests;
+    std::vector<block_progress> progress;
+    // Number of requests whose bytes needed by the read aren't stored yet.
+    size_t pending = 0;
+    // Set once requests are fetched, and once read got replied to before
+    // that, in which case missing blocks are marked as being fetched, and
+    // the fetch releases them once the reply is sent.
+    bool fetched = false;
+    bool early = false;
+    bool replied = false;
+};
+
+static void do_early_fetch(cache& c, std::shared_ptr<ghost_file> file_ptr,
+                           std::shared_ptr<block_table> table, std::shared_ptr<fetch_context> ctx,
+                           std::shared_ptr<early_fetch> f, bool verify, peer_tier* peers) {
+    uint64_t start = TRACE_CLOCK(TRACE_LEVEL_DEBUG);
+    ghost_file& file = *file_ptr;
+    fetch_blocks(file, *table, *ctx, c.block_size(), f->requests, verify, peers);
+    TRACE_DEBUG(TRACE_FETCH, file.ino(), f->requests.front().block_id, f->requests.size(),
+                trace_since(start));
+
+    std::unique_lock<std::mutex> lock(f->mtx);
+    f->fetched = true;
+    f->cv.notify_all();
+    if (!f->early) {
+        return;
+    }
+    f->cv.wait(lock, [&] { return f->replied; });
+    lock.unlock();
+
+    for (auto& req : f->requests) {
+        block_info& info = table->blocks[req.block_id];
+        bool failed = req.bytes_read < expected_block_length(*table, req.block_id, c.block_size());
+
+        if (failed) {
+            TRACE_ERROR(TRACE_FETCH_FAILED, file.ino(), req.block_id, req.bytes_read, 0);
+            ctx->metrics->failures.add();
+        }
+        release_fetched_block(c, info, failed);
+    }
+}
+
+// Start fetching missing blocks of a read ending at end in background, if
+// the read only needs the start of its last block and the handler reports
+// progress. Blocks whose checksum is known are only handed to a read once
+// verified, so they're fetched as usual. Return nullptr if not started, and
+// otherwise the fetch, which takes over missing.
+static std::shared_ptr<early_fetch> start_early_fetch(cache& c,
+                                                      const std::shared_ptr<ghost_file>& file_ptr,
+                                                      const std::shared_ptr<block_table>& table,
+                                                      const std::shared_ptr<fetch_context>& ctx,
+                                                      std::vector<block_request>& missing,
+                                                      size_t end, bool verify,
+                                                      peer_tier* peers) {
+    size_t block_size = c.block_size();
+    size_t last_blk_id = (end - 1) / block_size;
+
+    if (!ctx->ranges || !ctx->handler->reports_progress() ||
+        missing.back().block_id != last_blk_id ||
+        end == last_blk_id * block_size + expected_block_length(*table, last_blk_id, block_size)) {
+        return nullptr;
+    }
+    for (auto& req : missing) {
+        if (expected_checksum(*table, *ctx, req.block_id, block_size)) {
+            return nullptr;
+        }
+    }
+
+    auto f = std::make_shared<early_fetch>();
+    early_fetch* raw = f.get();
+    f->requests.swap(missing);
+    f->pending = f->requests.size();
+    f->progress.reserve(f->requests.size());
+    for (auto& req : f->requests) {
+        size_t blk_start = req.block_id * block_size;
+        size_t needed = std::min(end, blk_start + block_size) - blk_start;
+        bool reached = false;
+
+        f->progress.emplace_back([raw, needed, reached] (size_t valid) mutable {
+            if (reached || valid < needed) {
+                return;
+            }
+            reached = true;
+            std::lock_guard<std::mutex> lock(raw->mtx);
+            if (--raw->pending == 0) {
+                raw->cv.notify_all();
+            }
+        });
+        req.progress = &f->progress.back();
+    }
+
+    std::thread t(do_early_fetch, std::ref(c), file_ptr, table, ctx, f, verify, peers);
+    t.detach();
+    return f;
+}
+
+// Cache hits must not allocate memory, so fetch context is resolved in advance
+// and the only containers used are either reused or populated on misses.
+//
+// A read missing only the start of its last block is replied to as soon as
+// the watermark of the blocks it misses covers it, while the rest of them
+// keeps landing in background.
+int ghost_fs::read_file(const std::shared_ptr<ghost_file>& file_ptr, size_t size, off_t offset,
+                        const read_reply& reply)
+{
+    static thread_local std::vector<read_segment> segments;
+    uint64_t start = trace_clock();
+    ghost_file& file = *file_ptr;
+    segments.clear();
+    _resolver.wait(file);
+
+    // Length and blocks are the ones of the table, which stays the same for
+    // the whole read even if the content of the file changes meanwhile.
+    std::shared_ptr<block_table> table = file.get_blocks();
+    size_t len = file.is_static() ? file.length() : table ? table->length : 0;
+    if (size_t(offset) < len) {
+        if (offset + size > len) {
+            size = len - offset;
+        }
+    } else {
+        return 0;
+    }
+
+    if (file.is_static()) {
+        segments.push_back(read_segment{ file.data() + offset, size, false });
+        reply(segments.data(), segments.size());
+        return size;
+    }
+
+    std::shared_ptr<fetch_context> ctx = file.get_fetch_context();
+
+    if (!ctx) {
+        return 0;
+    }
+
+    std::vector<block_info>& file_blocks = table->blocks;
+    cache& c = _c;
+    read_metrics& metrics = get_read_metrics();
+    size_t end = offset + size;
+    size_t block_size = c.block_size();
+    size_t first_blk_id = offset / block_size;
+    size_t last_blk_id = (end - 1) / block_size;
+    std::vector<block_request> missing;
+
+    size_t max_blocks = std::max(size_t(1), c.capacity() / READ_CACHE_SHARE);
+    if (last_blk_id - first_blk_id >= max_blocks) {
+        return read_in_pieces(file_ptr, size, offset, max_blocks, reply);
+    }
+
+    if (!ctx->ranges) {
+        wait_for_stream(file_ptr, table, ctx, first_blk_id, last_blk_id);
+    }
+
+    // Lock all blocks in the range, in ascending order, and allocate the ones
+    // that aren't cached, so that they can be fetched with a single request.
+    // If every block of cache is pinned by other reads and fetches, the ones
+    // pinned so far are given back, and the read tries again until one got
+    // unpinned or PIN_WAIT_MS passed.
+    auto pin_blocks = [&] {
+        for (size_t blk_id = first_blk_id; blk_id <= last_blk_id; blk_id++) {
+            block_info& info = file_blocks[blk_id];
+
+            info._mtx.lock();
+            c._mtx.lock();
+            wait_fetched(c, info);
+
+            if (!info._present) {
+                block* blk = c.allocate_block(&info);
+                if (!blk) {
+                    c._mtx.unlock();
+                    info._mtx.unlock();
+                    while (blk_id-- > first_blk_id) {
+                        bool allocated = !missing.empty() && missing.back().block_id == blk_id;
+                        if (allocated) {
+                            missing.pop_back();
+                        }
+                        release_fetched_block(c, file_blocks[blk_id], allocated);
+                        file_blocks[blk_id]._mtx.unlock();
+                    }
+                    return false;
+                }
+                c._misses++;
+                metrics.cache_misses.add();
+                TRACE_DEBUG(TRACE_CACHE_MISS, file.ino(), blk_id, 0, 0);
+                missing.emplace_back(blk_id, blk->_data);
+            } else {
+                c._hits++;
+                metrics.cache_hits.add();
+                TRACE_DEBUG(TRACE_CACHE_HIT, file.ino(), blk_id, 0, 0);
+                c.lock_block(info._blk);
+            }
+            c._mtx.unlock();
+
+            if (info._prefetched) {
+                metrics.prefetch_hits.add();
+                info._prefetched = false;
+            }
+        }
+        return true;
+    };
+    if (!pin_blocks()) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PIN_WAIT_MS);
+        do {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return -ENOBUFS;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        } while (!pin_blocks());
+    }
+
+    auto reply_from_blocks = [&] {
+        size_t read_offset = offset;
+        for (size_t blk_id = first_blk_id; blk_id <= last_blk_id; blk_id++) {
+            block* blk = file_blocks[blk_id]._blk;
+            assert(blk->_info == &file_blocks[blk_id]);
+
+            size_t blk_offset = read_offset % block_size;
+            size_t to_read = std::min(end - read_offset, block_size - blk_offset);
+
+            segments.push_back(read_segment{ blk->_data + blk_offset, to_read, true });
+            read_offset += to_read;
+        }
+        assert(read_offset == end);
+        reply(segments.data(), segments.size());
+    };
+
+    uint64_t fetch_duration = 0;
+    if (!missing.empty()) {
+        uint64_t fetch_start = TRACE_CLOCK(TRACE_LEVEL_INFO);
+        std::shared_ptr<early_fetch> f = start_early_fetch(c, file_ptr, table, ctx, missing,
+                                                           end, _options.verify_blocks, &_peers);
+        if (f) {
+            std::unique_lock<std::mutex> lock(f->mtx);
+            f->cv.wait(lock, [&] { return !f->pending || f->fetched; });
+            f->early = !f->fetched;
+            if (f->early) {
+                lock.unlock();
+                {
+                    std::lock_guard<metered_mutex<LOCK_CACHE>> cache_lock(c._mtx);
+                    for (auto& req : f->requests) {
+                        file_blocks[req.block_id]._fetching = true;
+                    }
+                }
+                reply_from_blocks();
+                fetch_duration = trace_since(fetch_start);
+
+                // Blocks that were cached are released here, and the
+                // missing ones by the fetch, while all of them are
+                // unlocked here.
+                size_t next = 0;
+                for (size_t blk_id = first_blk_id; blk_id <= last_blk_id; blk_id++) {
+                    block_info& info = file_blocks[blk_id];
+                    if (next < f->requests.size() && f->requests[next].block_id == blk_id) {
+                        next++;
+                    } else {
+                        release_fetched_block(c, info, false);
+                    }
+                    info._mtx.unlock();
+                }
+                lock.lock();
+                f->replied = true;
+                f->cv.notify_all();
+                lock.unlock();
+
+                if ((last_blk_id + 1) < file_blocks.size()) {
+                    try_prefetch(c, file_ptr, last_blk_id + 1, ctx, _options.verify_blocks,
+                                 &_peers);
+                }
+                uint64_t duration = trace_clock() - start;
+                metrics.miss.record(duration);
+                TRACE_DEBUG(TRACE_READ, file.ino(), first_blk_id, size, duration);
+                TRACE_INFO(TRACE_ACCESS, file.ino(), offset, size, fetch_duration);
+                return size;
+            }
+            missing.swap(f->requests);
+        } else {
+            fetch_blocks(file, *table, *ctx, block_size, missing, _options.verify_blocks, &_peers);
+        }
+        fetch_duration = trace_since(fetch_start);
+        TRACE_DEBUG(TRACE_FETCH, file.ino(), missing.front().block_id, missing.size(),
+                    fetch_duration);
+    }
+
+    // If get_block() was unable to get the whole block, then we should return EIO.
+    auto fetch_failed = [&] (size_t blk_id) {
+        for (auto& req : missing) {
+            if (req.block_id == blk_id) {
+                return req.bytes_read < expected_block_length(*table, blk_id, block_size);
+            }
+        }
+        return false;
+    };
+    bool failed = false;
+    for (auto& req : missing) {
+        if (fetch_failed(req.block_id)) {
+            TRACE_ERROR(TRACE_FETCH_FAILED, file.ino(), req.block_id, req.bytes_read, 0);
+            ctx->metrics->failures.add();
+            failed = true;
+        }
+        // If bytes read is greater than block size, then there is an overflow in blk->_data
+        assert(req.bytes_read <= block_size);
+    }
+
+    if (!failed) {
+        reply_from_blocks();
+    }
+
+    for (size_t blk_id = first_blk_id; blk_id <= last_blk_id; blk_id++) {
+        block_info& info = file_blocks[blk_id];
+
+        release_fetched_block(c, info, fetch_failed(blk_id));
+        info._mtx.unlock();
+    }
+
+    if (failed) {
+        return -EIO;
+    }
+
+    // Try to prefetch subsequent blocks.
+    if ((last_blk_id + 1) < file_blocks.size()) {
+        try_prefetch(c, file_ptr, last_blk_id + 1, ctx, _options.verify_blocks, &_peers);
+    }
+
+    uint64_t duration = trace_clock() - start;
+    (missing.empty() ? metrics.hit : metrics.miss).record(duration);
+    TRACE_DEBUG(TRACE_READ, file.ino(), first_blk_id, size, duration);
+    TRACE_INFO(TRACE_ACCESS, file.ino(), offset, size, fetch_duration);
+    return size;
+}
+
+// Stream of the object of a file, see ghost_fs::wait_for_stream().
+struct file_stream {
+    std::shared_ptr<ghost_file> file;
+    std::shared_ptr<block_table> table;
+    std::shared_ptr<fetch_context> ctx;
+    std::thread thread;
+    // Block stream is at, and block following the last one readers wait for.
+    size_t position = 0;
+    size_t wanted = 0;
+    bool running = false;
+    // Whether readers wait for blocks stream went past, or for content of
+    // another object, in which case it ends once past the ones it's wanted
+    // for, and a new one is started from the start of the object.
+    bool restart = false;
+};
+
+void ghost_fs::wait_for_stream(const std::shared_ptr<ghost_file>& file_ptr,
+                               const std::shared_ptr<block_table>& table,
+                               const std::shared_ptr<fetch_context>& ctx, size_t first_blk_id,
+                               size_t last_blk_id) {
+    ghost_file& file = *file_ptr;
+    std::vector<block_info>& file_blocks = table->blocks;
+    size_t missing = first_blk_id;
+
+    // Blocks being filled are locked, so this waits for them.
+    for (; missing <= last_blk_id; missing++) {
+        block_info& info = file_blocks[missing];
+        std::lock_guard<metered_mutex<LOCK_BLOCK>> info_lock(info._mtx);
+        std::lock_guard<metered_mutex<LOCK_CACHE>> lock(_c._mtx);
+        if (!info._present) {
+            break;
+        }
+    }
+    if (missing > last_blk_id) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_streams_mtx);
+    std::shared_ptr<file_stream> s;
+    for (;;) {
+        if (_streams_stopped) {
+            return;
+        }
+        std::shared_ptr<file_stream>& entry = _streams[file.ino()];
+        if (!entry) {
+            entry = std::make_shared<file_stream>();
+            entry->file = file_ptr;
+            entry->table = table;
+            entry->ctx = ctx;
+            entry->running = true;
+            entry->thread = std::thread(&ghost_fs::run_stream, this, entry);
+            _stream_threads++;
+        }
+        if (entry->ctx == ctx && entry->table == table && entry->position <= missing) {
+            s = entry;
+            break;
+        }
+        std::shared_ptr<file_stream> current = entry;
+        current->restart = true;
+        _streams_cv.notify_all();
+        _streams_cv.wait(lock, [&] { return !current->running || _streams_stopped; });
+    }
+    s->wanted = std::max(s->wanted, last_blk_id + 1);
+    _streams_cv.notify_all();
+    _streams_cv.wait(lock, [&] {
+        return !s->running || s->position > last_blk_id || _streams_stopped;
+    });
+}
+
+// Fill blocks of the file of s in order with the stream of its object, as
+// long as readers wait for them or for the ones preceding them by up to a
+// prefetch window. Blocks already cached are skipped over. The stream ends
+// once it waited STREAM_LINGER_MS for readers, once it's past the blocks it's
+// wanted for if it's to be restarted, or if the object or the blocks of the
+// file change.
+void ghost_fs::run_stream(std::shared_ptr<file_stream> s) {
+    uint64_t start = TRACE_CLOCK(TRACE_LEVEL_DEBUG);
+    ghost_file& file = *s->file;
+    const fetch_context& ctx = *s->ctx;
+    block_table& table = *s->table;
+    std::vector<block_info>& file_blocks = table.blocks;
+    cache& c = _c;
+    size_t block_size = c.block_size();
+    size_t window = prefetch_window(ctx.handler, c);
+    // Block being received and bytes of it received so far. Block is locked
+    // in info while it's being filled, and info is nullptr if it's skipped.
+    size_t blk_id = 0;
+    size_t received = 0;
+    bool entered = false;
+    block_info* info = nullptr;
+    // Whether block is ahead of the ones readers wait for.
+    bool ahead = false;
+    bool aborted = false;
+
+    auto enter_block = [&] {
+        {
+            std::unique_lock<std::mutex> lock(_streams_mtx);
+            bool wanted = _streams_cv.wait_for(lock, std::chrono::milliseconds(STREAM_LINGER_MS),
+                                               [&] {
+                return _streams_stopped || blk_id < s->wanted + window ||
+                    (s->restart && blk_id >= s->wanted);
+            });
+            if (!wanted || _streams_stopped || (s->restart && blk_id >= s->wanted)) {
+                return false;
+            }
+            ahead = blk_id >= s->wanted;
+        }
+        if (file.get_fetch_context() != s->ctx || file.get_blocks() != s->table) {
+            return false;
+        }
+        block_info& blk_info = file_blocks[blk_id];
+        blk_info._mtx.lock();
+        c._mtx.lock();
+        if (blk_info._present) {
+            c._mtx.unlock();
+            blk_info._mtx.unlock();
+            info = nullptr;
+        } else if (c.allocate_block(&blk_info)) {
+            info = &blk_info;
+            c._mtx.unlock();
+        } else {
+            // All blocks of cache are locked, so block is skipped, and gets
+            // fetched on its own when read.
+            c._mtx.unlock();
+            blk_info._mtx.unlock();
+            info = nullptr;
+        }
+        entered = true;
+        return true;
+    };
+
+    auto leave_block = [&] (size_t length) {
+        if (info) {
+            uint64_t expected = expected_checksum(table, ctx, blk_id, block_size);
+            bool failed = false;
+            if (expected || _options.verify_blocks) {
+                uint32_t crc = crc32c(info->_blk->_data, length);
+                if (!expected) {
+                    info->_checksum.store(crc | BLOCK_CHECKSUM_KNOWN, std::memory_order_relaxed);
+                } else if (crc != uint32_t(expected)) {
+                    // Block gets fetched on its own when read, which
+                    // verifies it again.
+                    TRACE_ERROR(TRACE_CHECKSUM_MISMATCH, file.ino(), blk_id, crc, 0);
+                    ctx.metrics->checksum_mismatches.add();
+                    failed = true;
+                }
+            }
+            if (!failed && ahead) {
+                info->_prefetched = true;
+                get_read_metrics().prefetched.add();
+            }
+            release_fetched_block(c, *info, failed);
+            info->_mtx.unlock();
+        }
+        TRACE_DEBUG(TRACE_STREAM, file.ino(), blk_id, info == nullptr, trace_since(start));
+        {
+            std::lock_guard<std::mutex> lock(_streams_mtx);
+            s->position = ++blk_id;
+        }
+        _streams_cv.notify_all();
+        received = 0;
+        entered = false;
+        info = nullptr;
+    };
+
+    bool done = ctx.handler->get_stream(ctx, [&] (const char* data, size_t size) {
+        while (size) {
+            if (!entered && (blk_id >= file_blocks.size() || !enter_block())) {
+                aborted = true;
+                return false;
+            }
+            size_t length = expected_block_length(table, blk_id, block_size);
+            size_t n = std::min(size, length - received);
+            if (info) {
+                memcpy(info->_blk->_data + received, data, n);
+            }
+            received += n;
+            data += n;
+            size -= n;
+            if (received == length) {
+                leave_block(length);
+            }
+        }
+        return true;
+    });
+
+    if (info) {
+        release_fetched_block(c, *info, true);
+        info->_mtx.unlock();
+    }
+    // Stream ending before the length of the object failed too.
+    if ((!done || uint64_t(blk_id) * block_size < table.length) && !aborted) {
+        log("Stream of %s failed at block %lu\n", ctx.url.c_str(), blk_id);
+        ctx.metrics->failures.add();
+    }
+
+    // Streams taken by stop() are joined by it instead.
+    std::lock_guard<std::mutex> lock(_streams_mtx);
+    s->running = false;
+    auto it = _streams.find(file.ino());
+    if (it != _streams.end() && it->second == s) {
+        _streams.erase(it);
+        s->thread.detach();
+    }
+    _stream_threads--;
+    _streams_cv.notify_all();
+}
+
+// Drop content of file cached either by ghostfs or by kernel, so that it gets
+// fetched again, along with checksums learned from it. Blocks are replaced
+// rather than emptied, as reads in flight may still use them.
+static void drop_cached_content(struct ghost_fs* ghost, ghost_file& file) {
+    file.reset_blocks(ghost->get_cache());
+    ghost->notifier().inval_inode(file.ino());
+}
+
+// Check whether remote objects of files changed since they were last
+// checked, in which case their cached content is dropped.
+static void revalidate_files(struct ghost_fs* ghost) {
+    std::vector<std::shared_ptr<ghost_file>> files;
+
+    ghost->files().for_each_file([&] (const std::shared_ptr<ghost_file>& file) {
+        if (!file->is_static()) {
+            files.push_back(file);
+        }
+    });
+
+    for (auto& file : files) {
+        std::shared_ptr<fetch_context> ctx = file->get_fetch_context();
+        remote_metadata metadata;
+
+        if (!ctx) {
+            continue;
+        }
+        uint64_t start = trace_clock();
+        bool found = ctx->handler->get_metadata(*ctx, metadata);
+        ctx->metrics->get_metadata.record(trace_clock() - start);
+        if (!found) {
+            continue;
+        }
+        if (metadata.length == file->length() && metadata.validator == file->validator()) {
+            continue;
+        }
+        log("Content of %s changed, length=%ld, validator=%s\n", ctx->url.c_str(),
+            metadata.length, metadata.validator.c_str());
+
+        // Blocks are replaced along with the length, and the ones reads in
+        // flight still use are given back to cache once they're done.
+        file->update_length(metadata.length, ghost->get_cache());
+        file->set_validator(std::move(metadata.validator));
+        ghost->notifier().inval_inode(file->ino());
+        ghost->journal().set_metadata(*file);
+    }
+}
+
+std::shared_ptr<ghost_file> ghost_fs::create_file(const char* path) {
+    std::shared_ptr<ghost_file> file = _files.add_file(path);
+    if (file) {
+        _journal.add_file(file->ino());
+    }
+    return file;
+}
+
+int ghost_fs::create_file(uint64_t parent, const char* name, ghost_inode** inode) {
+    int res = _files.create(parent, name, false, inode);
+    if (res == 0) {
+        _journal.add_file((*inode)->ino);
+    }
+    return res;
+}
+
+int ghost_fs::set_attribute(const std::shared_ptr<ghost_file>& file_ptr, const char* name,
+                            const char* value, int flags) {
+    ghost_file& file = *file_ptr;
+
+    if ((flags & XATTR_CREATE) && file.attribute_exists(name)) {
+        return -EEXIST;
+    } else if ((flags & XATTR_REPLACE) && !file.attribute_exists(name)) {
+        return -ENOATTR;
+    }
+
+    file.add_attribute(name, value);
+    index_peer_file(file_ptr);
+    _journal.set_attributes(file);
+
+    if (strcmp(name, "url") == 0 || strcmp(name, COMPRESSION_ATTRIBUTE) == 0) {
+        resolve_content(file_ptr);
+    }
+    return 0;
+}
+
+// Content of file changes along with its url or compression.
+void ghost_fs::resolve_content(const std::shared_ptr<ghost_file>& file_ptr) {
+    ghost_file& file = *file_ptr;
+
+    // Reads wait for the new content before whatever is cached for the
+    // previous one gets dropped, so that none of them starts in between.
+    file.set_resolving(true);
+    drop_cached_content(this, file);
+
+    std::shared_ptr<fetch_context> ctx = file.get_fetch_context();
+
+    // Need to check if URL accepts range request, if not, we need to do something.
+    // Length is resolved in background, and whoever needs it waits for it.
+    if (ctx && ctx->handler->is_url_valid(ctx->url.c_str())) {
+        _resolver.submit(file_ptr, true);
+    } else {
+        _resolver.cancel(file_ptr);
+    }
+}
+
+int ghost_fs::read_in_pieces(const std::shared_ptr<ghost_file>& file, size_t size, off_t offset,
+                             size_t max_blocks, const read_reply& reply) {
+    // Reads this large are rare, so their buffer isn't kept around after.
+    std::unique_ptr<char[]> buf(new char[size]);
+    size_t block_size = _c.block_size();
+    size_t done = 0;
+
+    while (done < size) {
+        size_t piece_offset = offset + done;
+        size_t piece = std::min(size - done, max_blocks * block_size - piece_offset % block_size);
+        char* dst = buf.get() + done;
+        int res = read_file(file, piece, piece_offset,
+                            [dst] (const read_segment* segments, size_t count) {
+            char* p = dst;
+            for (size_t i = 0; i < count; i++) {
+                memcpy(p, segments[i].data, segments[i].size);
+                p += segments[i].size;
+            }
+        });
+        if (res < 0) {
+            return res;
+        }
+        done += res;
+        if (size_t(res) < piece) {
+            break;
+        }
+    }
+    if (done) {
+        read_segment segment{ buf.get(), done, false };
+        reply(&segment, 1);
+    }
+    return done;
+}
+
+int ghost_fs::set_url(const std::shared_ptr<ghost_file>& file, const char* url) {
+    return set_attribute(file, "url", url);
+}
+
+int ghost_fs::remove_attribute(const std::shared_ptr<ghost_file>& file, const char* name) {
+    if (!file->attribute_exists(name)) {
+        return -ENOATTR;
+    }
+    file->remove_attribute(name);
+    index_peer_file(file);
+    _journal.set_attributes(*file);
+
+    if (strcmp(name, COMPRESSION_ATTRIBUTE) == 0) {
+        resolve_content(file);
+    }
+    return 0;
+}
+
+ssize_t ghost_fs::read(const std::shared_ptr<ghost_file>& file, char* buf, size_t size, off_t offset) {
+    return read_file(file, size, offset, [&buf] (const read_segment* segments, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            memcpy(buf, segments[i].data, segments[i].size);
+            buf += segments[i].size;
+        }
+    });
+}
+
+static std::string peer_file_key(const char* handler, const std::string& url) {
+    return std::string(handler) + '\n' + url;
+}
+
+void ghost_fs::index_peer_file(const std::shared_ptr<ghost_file>& file) {
+    std::shared_ptr<fetch_context> ctx = file->get_fetch_context();
+    if (!ctx) {
+        return;
+    }
+    std::string key = peer_file_key(ctx->handler->name(), ctx->url);
+    std::lock_guard<std::mutex> lock(_peer_files_mtx);
+    _peer_files[key] = file;
+}
+
+// Return file whose content is the one of object, or nullptr if there's none.
+std::shared_ptr<ghost_file> ghost_fs::find_peer_file(const peer_object& object) {
+    std::string key = peer_file_key(object.handler.c_str(), object.url);
+    std::lock_guard<std::mutex> lock(_peer_files_mtx);
+
+    auto it = _peer_files.find(key);
+    if (it == _peer_files.end()) {
+        return nullptr;
+    }
+    std::shared_ptr<ghost_file> file = it->second.lock();
+    std::shared_ptr<fetch_context> ctx = file ? file->get_fetch_context() : nullptr;
+    if (!ctx || ctx->url != object.url || object.handler != ctx->handler->name()) {
+        _peer_files.erase(it);
+        return nullptr;
+    }
+    return file;
+}
+
+int ghost_fs::serve_peer_block(const peer_object& object, size_t block_size, size_t blk_id,
+                               std::vector<char>& data) {
+    if (block_size != get_block_size()) {
+        return -EINVAL;
+    }
+    std::shared_ptr<ghost_file> file_ptr = find_peer_file(object);
+    if (!file_ptr) {
+        return -ENOENT;
+    }
+    ghost_file& file = *file_ptr;
+    _resolver.wait(file);
+
+    // File may have changed since it was indexed, and content is only the
+    // same if the validator is.
+    std::shared_ptr<fetch_context> ctx = file.get_fetch_context();
+    if (!ctx || !ctx->ranges || ctx->url != object.url ||
+        object.handler != ctx->handler->name()) {
+        return -ENOENT;
+    }
+    if (object.validator.empty() || file.validator() != object.validator) {
+        return -ESTALE;
+    }
+    std::shared_ptr<block_table> table = file.get_blocks();
+    if (!table || blk_id >= table->blocks.size()) {
+        return -EINVAL;
+    }
+
+    // Block is locked by a read of this instance fetching it, or being
+    // fetched in background, either of which may itself wait for the peer
+    // asking for it, so the peer is only made to wait PEER_BUSY_WAIT_MS
+    // before fetching it from origin.
+    cache& c = _c;
+    block_info& info = table->blocks[blk_id];
+    std::unique_lock<metered_mutex<LOCK_BLOCK>> info_lock(info._mtx, std::defer_lock);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PEER_BUSY_WAIT_MS);
+    while (!info_lock.try_lock()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return -EBUSY;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::vector<block_request> requests;
+    {
+        std::lock_guard<metered_mutex<LOCK_CACHE>> lock(c._mtx);
+        if (!c._fetched.wait_until(c._mtx, deadline, [&] { return !info._fetching; })) {
+            return -EBUSY;
+        }
+        if (info._present) {
+            c.lock_block(info._blk);
+        } else {
+            block* blk = c.allocate_block(&info);
+            if (!blk) {
+                return -EBUSY;
+            }
+            requests.emplace_back(blk_id, blk->_data);
+        }
+    }
+
+    // Blocks asked for by peers are only fetched from origin, so that
+    // instances whose peer lists differ don't ask each other in a loop.
+    size_t length = expected_block_length(*table, blk_id, block_size);
+    bool failed = false;
+    if (!requests.empty()) {
+        fetch_blocks(file, *table, *ctx, block_size, requests, _options.verify_blocks, nullptr);
+        failed = requests[0].bytes_read < length;
+        if (failed) {
+            TRACE_ERROR(TRACE_FETCH_FAILED, file.ino(), blk_id, requests[0].bytes_read, 0);
+            ctx->metrics->failures.add();
+        }
+    }
+    if (!failed) {
+        data.assign(info._blk->_data, info._blk->_data + length);
+    }
+    release_fetched_block(c, info, failed);
+    return failed ? -EIO : 0;
+}
+
+ghost_stats ghost_fs::stats() {
+    ghost_stats s;
+    {
+        std::lock_guard<metered_mutex<LOCK_CACHE>> lock(_c._mtx);
+        s.cache_hits = _c._hits;
+        s.cache_misses = _c._misses;
+        s.blocks_used = _c._blocks_used;
+        s.blocks_available = _c._blocks_available;
+    }
+
+    read_metrics& metrics = get_read_metrics();
+    s.prefetched = metrics.prefetched.value();
+    s.prefetch_hits = metrics.prefetch_hits.value();
+    s.prefetch_wasted = metrics.prefetch_wasted.value();
+
+    fetch_stats& fetches = get_fetch_stats();
+    s.fetch_timeouts = fetches.timeouts;
+    s.fetch_retries = fetches.retries;
+    s.fetch_failures = fetches.failures;
+
+    peer_metrics& peers = get_peer_metrics();
+    s.peer_hits = peers.hits.value();
+    s.peer_misses = peers.misses.value();
+    s.peer_bytes = peers.bytes.value();
+    s.peer_served = peers.served.value();
+    return s;
+}
+
+void ghost_fs::run_revalidator() {
+    std::chrono::seconds interval(_options.revalidate);
+    std::unique_lock<std::mutex> lock(_revalidator_mtx);
+
+    while (!_revalidator_cv.wait_for(lock, interval, [this] { return _revalidator_stopped; })) {
+        lock.unlock();
+        revalidate_files(this);
+        lock.lock();
+    }
+}
+
+// Blocks in cache are listed in <journal>.hot, most recently used first, as
+// path of their file followed by a tab, the block number, and another tab and
+// its checksum in hexadecimal if known, so that they get fetched again, and
+// verified, when ghostfs restarts.
+static void save_hot_blocks(struct ghost_fs* ghost) {
+    cache& c = ghost->get_cache();
+
+    // Blocks of a file are stored contiguously, so the file of a block is
+    // found by searching the ranges of blocks of files. Tables are held from
+    // before blocks are listed, so that blocks of tables replaced meanwhile
+    // can't be mistaken for blocks of the ones listed.
+    struct block_range {
+        const block_info* first;
+        size_t count;
+        std::shared_ptr<ghost_file> file;
+        std::shared_ptr<block_table> table;
+    };
+    std::vector<block_range> ranges;
+    ghost->files().for_each_file([&] (const std::shared_ptr<ghost_file>& file) {
+        std::shared_ptr<block_table> table = file->is_static() ? nullptr : file->get_blocks();
+        if (table) {
+            ranges.push_back(block_range{ table->blocks.data(), table->blocks.size(), file, table });
+        }
+    });
+    std::vector<const block_info*> blocks;
+    {
+        std::lock_guard<metered_mutex<LOCK_CACHE>> lock(c._mtx);
+        blocks = c.lru_blocks();
+    }
+    std::less<const block_info*> less;
+    std::sort(ranges.begin(), ranges.end(), [&] (const block_range& a, const block_range& b) {
+        return less(a.first, b.first);
+    });
+
+    std::string hot_path = ghost->journal().path() + ".hot";
+    std::string tmp_path = hot_path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::trunc);
+    epoch_guard guard;
+
+    for (const block_info* info : blocks) {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), info,
+                                   [&] (const block_info* info, const block_range& range) {
+            return less(info, range.first);
+        });
+        if (it == ranges.begin() || size_t(info - (--it)->first) >= it->count) {
+            continue;
+        }
+        std::string path = ghost->files().path(it->file->ino());
+        if (path.empty()) {
+            continue;
+        }
+        out << path << '\t' << (info - it->first);
+        uint64_t checksum = info->_checksum.load(std::memory_order_relaxed);
+        if (checksum) {
+            char hex[16];
+            snprintf(hex, sizeof(hex), "\t%08x", uint32_t(checksum));
+            out << hex;
+        }
+        out << '\n';
+    }
+    out.close();
+    if (!out || rename(tmp_path.c_str(), hot_path.c_str()) < 0) {
+        log("Unable to save blocks in cache to %s\n", hot_path.c_str());
+    }
+}
+
+void ghost_fs::warm_up(std::string hot_path) {
+    std::ifstream in(hot_path);
+    // Blocks by path of their file, in the order files are first listed,
+    // with their checksum, or 0 if unknown.
+    typedef std::pair<size_t, uint64_t> hot_block;
+    std::vector<std::pair<std::string, std::vector<hot_block>>> hot_files;
+    std::unordered_map<std::string, size_t> hot_index;
+    std::string line;
+
+    while (std::getline(in, line)) {
+        // Lists saved before checksums were have no third column.
+        size_t tab = line.rfind('\t');
+        if (tab == std::string::npos) {
+            continue;
+        }
+        uint64_t checksum = 0;
+        size_t blk_tab = tab ? line.rfind('\t', tab - 1) : std::string::npos;
+        if (blk_tab != std::string::npos && line.find('/', blk_tab) == std::string::npos) {
+            checksum = strtoul(line.c_str() + tab + 1, nullptr, 16) | BLOCK_CHECKSUM_KNOWN;
+            tab = blk_tab;
+        }
+        std::string path = line.substr(0, tab);
+        auto res = hot_index.emplace(path, hot_files.size());
+        if (res.second) {
+            hot_files.emplace_back(std::move(path), std::vector<hot_block>());
+        }
+        hot_files[res.first->second].second.emplace_back(
+            strtoul(line.c_str() + tab + 1, nullptr, 10), checksum);
+    }
+
+    cache& c = _c;
+    size_t warmed = 0;
+
+    for (auto& hot_file : hot_files) {
+        std::shared_ptr<ghost_file> file = _files.find_file(hot_file.first.c_str());
+        if (_warmer_stopped) {
+            break;
+        }
+        if (!file || file->is_static()) {
+            continue;
+        }
+        _resolver.wait(*file);
+        std::shared_ptr<fetch_context> ctx = file->get_fetch_context();
+        if (!ctx) {
+            continue;
+        }
+
+        // Runs of consecutive blocks are fetched with a single request.
+        std::vector<size_t> blk_ids;
+        std::shared_ptr<block_table> table = file->get_blocks();
+        if (!table) {
+            continue;
+        }
+        std::vector<block_info>& file_blocks = table->blocks;
+        for (auto& hot_block : hot_file.second) {
+            blk_ids.push_back(hot_block.first);
+            if (hot_block.second && hot_block.first < file_blocks.size()) {
+                uint64_t unknown = 0;
+                file_blocks[hot_block.first]._checksum.compare_exchange_strong(unknown,
+                                                                               hot_block.second);
+            }
+        }
+        std::sort(blk_ids.begin(), blk_ids.end());
+        blk_ids.erase(std::unique(blk_ids.begin(), blk_ids.end()), blk_ids.end());
+        blk_ids.erase(std::remove_if(blk_ids.begin(), blk_ids.end(), [&] (size_t blk_id) {
+            return blk_id >= file_blocks.size();
+        }), blk_ids.end());
+        if (!ctx->ranges) {
+            if (!blk_ids.empty()) {
+                wait_for_stream(file, table, ctx, blk_ids.front(), blk_ids.back());
+            }
+            continue;
+        }
+        size_t window = prefetch_window(ctx->handler, c);
+
+        for (size_t i = 0; i < blk_ids.size() && !_warmer_stopped;) {
+            size_t j = i + 1;
+            while (j < blk_ids.size() && blk_ids[j] == blk_ids[j - 1] + 1 && j - i < window) {
+                j++;
+            }
+            std::vector<size_t> reserved = reserve_blocks(c, *file, *table, blk_ids[i],
+                                                          blk_ids[j - 1] + 1);
+            warmed += reserved.size();
+            if (!reserved.empty()) {
+                do_prefetch(c, file, table, std::move(reserved), ctx, _options.verify_blocks,
+                            &_peers);
+            }
+            i = j;
+        }
+    }
+    log("Warmed up %lu blocks listed by %s\n", warmed, hot_path.c_str());
+}
+
+
+void ghost_fs::start() {
+    {
+        std::lock_guard<std::mutex> lock(_streams_mtx);
+        _streams_stopped = false;
+    }
+    // Only files whose url was just set get their first block prefetched, as
+    // the ones resolved from a manifest or journal are resolved in batches,
+    // e.g. for a listing, and most of them may never be read.
+    _resolver.start(RESOLVER_THREADS,
+                    [this] (const std::shared_ptr<ghost_file>& file,
+                            const std::shared_ptr<fetch_context>& ctx, bool prefetch) {
+        _journal.set_metadata(*file);
+        if (prefetch && file->length()) {
+            try_prefetch(_c, file, 0, ctx, _options.verify_blocks, &_peers);
+        }
+    });
+    if (_options.revalidate) {
+        _revalidator_stopped = false;
+        _revalidator = std::thread(&ghost_fs::run_revalidator, this);
+    }
+
+    // Replay takes time proportional to the size of the journal, as the
+    // snapshot is loaded lazily, like a manifest.
+    if (_journal.is_open()) {
+        std::vector<std::shared_ptr<ghost_file>> unresolved;
+        int res = _journal.replay(_c, unresolved);
+        if (res < 0) {
+            log("Unable to replay journal %s: %s\n", _journal.path().c_str(), strerror(-res));
+        } else {
+            log("Replayed %d records of journal %s\n", res, _journal.path().c_str());
+        }
+        for (auto& file : unresolved) {
+            _resolver.submit(file);
+        }
+        _journal.start([this] { save_hot_blocks(this); });
+
+        _warmer_stopped = false;
+        _warmer = std::thread(&ghost_fs::warm_up, this, _journal.path() + ".hot");
+    }
+
+    if (!_options.peers.empty() || _options.peer_port) {
+        int res = _peers.start(_options.peers, _options.peer_port,
+                               [this] (const peer_object& object, size_t block_size,
+                                       size_t blk_id, std::vector<char>& data) {
+            return serve_peer_block(object, block_size, blk_id, data);
+        });
+        if (res < 0) {
+            log("Unable to share cache with peers on port %u: %s\n", _options.peer_port,
+                strerror(-res));
+        }
+    }
+}
+
+void ghost_fs::stop() {
+    // Peers being served may wait for metadata or fetches.
+    _peers.stop();
+
+    std::unordered_map<uint64_t, std::shared_ptr<file_stream>> streams;
+    {
+        std::lock_guard<std::mutex> lock(_streams_mtx);
+        _streams_stopped = true;
+        streams.swap(_streams);
+    }
+    _streams_cv.notify_all();
+    for (auto& entry : streams) {
+        if (entry.second->thread.joinable()) {
+            entry.second->thread.join();
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(_streams_mtx);
+        _streams_cv.wait(lock, [this] { return _stream_threads == 0; });
+    }
+    if (_warmer.joinable()) {
+        _warmer_stopped = true;
+        _warmer.join();
+    }
+    if (_revalidator.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(_revalidator_mtx);
+            _revalidator_stopped = true;
+        }
+        _revalidator_cv.notify_one();
+        _revalidator.join();
+    }
+    _resolver.stop();
+    _journal.stop();
+}
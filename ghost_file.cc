@@ -7,15 +7,39 @@
 */
 
 #include "ghost_file.h"
+#include "cache.h"
 #include "utils.h"
 
+block_table::block_table(cache& c, size_t length)
+    : c(c)
+    , length(length)
+    , blocks(length / c.block_size() + 1) {}
+
+// Nobody uses the table anymore, so its blocks are neither locked nor being
+// read, and cached ones are only referenced by the LRU of cache.
+block_table::~block_table() {
+    std::lock_guard<metered_mutex<LOCK_CACHE>> lock(c._mtx);
+    for (auto& info : blocks) {
+        if (info._present) {
+            c.lock_block(info._blk);
+            c.free_block(info._blk);
+        }
+    }
+}
+
 ghost_file::ghost_file(const char *data)
     : _data(data)
-    , _length(strlen(data)) {}
+    , _length(strlen(data))
+    , _ino(0)
+    , _attributes(std::make_shared<std::unordered_map<std::string, std::string>>())
+    , _resolving(false) {}
 
 ghost_file::ghost_file()
     : _data(nullptr)
-    , _length(0) {}
+    , _length(0)
+    , _ino(0)
+    , _attributes(std::make_shared<std::unordered_map<std::string, std::string>>())
+    , _resolving(false) {}
 
 const char *ghost_file::data() const {
     return _data;
@@ -25,43 +49,104 @@ bool ghost_file::is_static() const {
     return _data != nullptr;
 }
 
+uint64_t ghost_file::ino() const {
+    return _ino;
+}
+
+void ghost_file::set_ino(uint64_t ino) {
+    _ino = ino;
+}
+
 size_t ghost_file::length() const {
-    return _length;
+    return _length.load(std::memory_order_relaxed);
 }
 
-void ghost_file::update_length(size_t new_length, size_t block_size) {
-    _length = new_length;
+void ghost_file::update_length(size_t new_length, cache& c) {
+    std::atomic_store(&_blocks, std::make_shared<block_table>(c, new_length));
+    _length.store(new_length, std::memory_order_relaxed);
     log("File length: %ld\n", new_length);
+}
+
+void ghost_file::reset_blocks(cache& c) {
+    std::shared_ptr<block_table> table = get_blocks();
+    if (table) {
+        std::atomic_store(&_blocks, std::make_shared<block_table>(c, table->length));
+    }
+}
+
+std::string ghost_file::validator() const {
+    std::shared_ptr<const std::string> validator = std::atomic_load(&_validator);
+    return validator ? *validator : std::string();
+}
+
+void ghost_file::set_validator(std::string validator) {
+    std::atomic_store(&_validator, std::shared_ptr<const std::string>(
+        std::make_shared<std::string>(std::move(validator))));
+}
 
-    auto blocks = new_length / block_size + 1;
-    _file_blocks.resize(blocks);
+bool ghost_file::resolving() const {
+    return _resolving.load(std::memory_order_acquire);
+}
+
+void ghost_file::set_resolving(bool resolving) {
+    _resolving.store(resolving, std::memory_order_release);
 }
 
 void ghost_file::add_attribute(const char *attribute, const char *value) {
-    _attributes.emplace(std::string(attribute), std::string(value));
+    std::lock_guard<std::mutex> lock(_attributes_mtx);
+    auto attributes = *this->attributes();
+    attributes[std::string(attribute)] = std::string(value);
+    update_attributes(std::move(attributes));
 }
 
 void ghost_file::remove_attribute(const char *attribute) {
-    _attributes.erase(std::string(attribute));
+    std::lock_guard<std::mutex> lock(_attributes_mtx);
+    auto attributes = *this->attributes();
+    attributes.erase(std::string(attribute));
+    update_attributes(std::move(attributes));
+}
+
+void ghost_file::set_attributes(std::unordered_map<std::string, std::string> attributes) {
+    std::lock_guard<std::mutex> lock(_attributes_mtx);
+    update_attributes(std::move(attributes));
 }
 
 bool ghost_file::attribute_exists(const char *attribute) const {
-    auto it = _attributes.find(std::string(attribute));
-    return (it == _attributes.end()) ? false : true;
+    auto attributes = this->attributes();
+    return attributes->find(std::string(attribute)) != attributes->end();
 }
 
-const std::unordered_map<std::string, std::string> &ghost_file::attributes() const {
-    return _attributes;
+std::shared_ptr<const std::unordered_map<std::string, std::string>> ghost_file::attributes() const {
+    return std::atomic_load(&_attributes);
 }
 
-std::vector<block_info> &ghost_file::get_file_blocks() {
-    return _file_blocks;
+std::shared_ptr<block_table> ghost_file::get_blocks() const {
+    return std::atomic_load(&_blocks);
 }
 
-const char *ghost_file::get_url() const {
-    auto it = _attributes.find(std::string("url"));
-    if (it == _attributes.end()) {
-        return nullptr;
+std::string ghost_file::get_url() const {
+    auto attributes = this->attributes();
+    auto it = attributes->find(std::string("url"));
+    if (it == attributes->end()) {
+        return std::string();
     }
-    return it->second.data();
+    return it->second;
+}
+
+// Attributes are published before the context made of them, which is
+// recreated along with them.
+void ghost_file::update_attributes(std::unordered_map<std::string, std::string> attributes) {
+    auto it = attributes.find(std::string("url"));
+    std::shared_ptr<fetch_context> ctx;
+
+    if (it != attributes.end()) {
+        ctx = make_fetch_context(it->second.c_str(), attributes);
+    }
+    std::atomic_store(&_attributes, std::shared_ptr<const std::unordered_map<std::string, std::string>>(
+        std::make_shared<std::unordered_map<std::string, std::string>>(std::move(attributes))));
+    std::atomic_store(&_fetch_ctx, ctx);
+}
+
+std::shared_ptr<fetch_context> ghost_file::get_fetch_context() const {
+    return std::atomic_load(&_fetch_ctx);
 }
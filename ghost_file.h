@@ -9,41 +9,115 @@
 #ifndef GHOST_FILE_H
 #define GHOST_FILE_H
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 
 #include "block_info.h"
+#include "protocol/base_protocol.h"
+
+struct cache;
+
+// Blocks of the content of a file, which are replaced as a whole whenever
+// the content changes, so that reads and fetches in flight keep using the
+// blocks they started with. Blocks of a table which are still cached are
+// given back to cache once the last user of the table is done with it.
+struct block_table {
+    cache& c;
+    // Length of the content, which all blocks but the last one are full of.
+    size_t length;
+    std::vector<block_info> blocks;
+
+    block_table(cache& c, size_t length);
+    ~block_table();
+
+    block_table(const block_table&) = delete;
+    block_table& operator=(const block_table&) = delete;
+};
 
 struct ghost_file {
 private:
     const char *_data;
-    size_t _length;
-    std::unordered_map<std::string, std::string> _attributes;
-    std::vector<block_info> _file_blocks;
+    std::atomic<size_t> _length;
+    // Inode number, which never changes nor gets reused by another file.
+    uint64_t _ino;
+    // Replaced rather than modified, and swapped atomically, so that the
+    // journal and getxattr can read them while they're set. Setters are
+    // serialized by _attributes_mtx.
+    std::shared_ptr<const std::unordered_map<std::string, std::string>> _attributes;
+    std::mutex _attributes_mtx;
+    // Swapped atomically, like the fetch context.
+    std::shared_ptr<block_table> _blocks;
+    // Validator of remote content when it was last checked, see
+    // remote_metadata. Swapped atomically, as revalidation and resolution set
+    // it while reads and peers compare it.
+    std::shared_ptr<const std::string> _validator;
+    // Recreated whenever attributes change, and swapped atomically so that
+    // reads in flight keep using the context they started with.
+    std::shared_ptr<fetch_context> _fetch_ctx;
+    // Set while metadata of remote object is being resolved, see
+    // metadata_resolver.
+    std::atomic<bool> _resolving;
+
+    void update_attributes(std::unordered_map<std::string, std::string> attributes);
 public:
     ghost_file(const char* data);
 
     ghost_file();
 
+    ghost_file(const ghost_file&) = delete;
+    ghost_file& operator=(const ghost_file&) = delete;
+
     const char* data() const;
 
     bool is_static() const;
 
+    uint64_t ino() const;
+
+    void set_ino(uint64_t ino);
+
     size_t length() const;
 
-    void update_length(size_t new_length, size_t block_size);
+    // Set length of the file, replacing its blocks with empty ones of cache c.
+    void update_length(size_t new_length, cache& c);
+
+    // Replace blocks of the file with empty ones, so that whatever is cached
+    // gets fetched again.
+    void reset_blocks(cache& c);
+
+    std::string validator() const;
+
+    void set_validator(std::string validator);
+
+    // Whether length and validator are yet to be resolved.
+    bool resolving() const;
+
+    void set_resolving(bool resolving);
 
     void add_attribute(const char* attribute, const char* value);
 
     void remove_attribute(const char* attribute);
 
+    // Replace all attributes at once.
+    void set_attributes(std::unordered_map<std::string, std::string> attributes);
+
     bool attribute_exists(const char* attribute) const;
 
-    const std::unordered_map<std::string, std::string>& attributes() const;
+    // Return attributes of the file, which stay the same even if attributes
+    // of the file get set meanwhile.
+    std::shared_ptr<const std::unordered_map<std::string, std::string>> attributes() const;
+
+    // Return blocks of the file, or nullptr if its length was never set.
+    std::shared_ptr<block_table> get_blocks() const;
 
-    std::vector<block_info>& get_file_blocks();
+    // Return url of the file, or an empty string if it has none.
+    std::string get_url() const;
 
-    const char* get_url() const;
+    // Return context used to fetch content of the file, or nullptr if the
+    // file has no url or there is no handler for it.
+    std::shared_ptr<fetch_context> get_fetch_context() const;
 };
 
 #endif // GHOST_FILE_H
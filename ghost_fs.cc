@@ -8,393 +8,555 @@
 
 #define FUSE_USE_VERSION 26
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/sysmacros.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <thread>
 #include <boost/filesystem.hpp>
 
 #include "ghost_fs.h"
+#include "trace.h"
 #include "utils.h"
 
 #include "protocol/http_protocol.h"
 #include "protocol/load_drivers.h"
 #include "protocol/python_driver.h"
+#include "protocol/python_pool.h"
+#include "protocol/sim_protocol.h"
+
+struct ghost_fs ghost;
 
 ghost_fs *get_ghost_fs() {
-    struct fuse_context* context = fuse_get_context();
-    return (struct ghost_fs*) context->private_data;
+    return &ghost;
 }
 
-ghost_fs::ghost_fs()
-    : _c(CACHE_SIZE, BLOCK_SIZE) {}
+// fuse handlers
 
-void ghost_fs::add_file(const char *file_path, const char *content) {
-    _files.emplace(std::string(file_path), ghost_file(content));
-}
+// State of an open file, stored in fi->fh. It keeps the file alive, even
+// if it gets removed from the namespace while open.
+struct ghost_handle {
+    std::shared_ptr<ghost_file> file;
+};
 
-void ghost_fs::add_file(const char *file_path) {
-    _files.emplace(std::string(file_path), ghost_file());
+static ghost_fs* get_ghost_fs(fuse_req_t req) {
+    return static_cast<ghost_fs*>(fuse_req_userdata(req));
 }
 
-void ghost_fs::remove_file(const char *file_path) {
-    _files.erase(std::string(file_path));
+static ghost_handle* get_handle(struct fuse_file_info *fi) {
+    return reinterpret_cast<ghost_handle*>(fi->fh);
 }
 
-bool ghost_fs::file_exists(const char *file_path) {
-    auto it = _files.find(std::string(file_path));
-    return (it == _files.end()) ? false : true;
+static void fill_stat(ghost_inode& inode, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = inode.ino;
+    if (inode.is_dir()) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        // Subdirectories are only known once the directory is materialized,
+        // and a link count of 1 tells tools like find not to rely on it.
+        stbuf->st_nlink = inode.dir->materialized ? 2 + inode.dir->subdirs : 1;
+    } else {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        ghost.resolver().wait(*inode.file);
+        stbuf->st_size = inode.file->length();
+    }
 }
 
-std::unordered_map<std::string, ghost_file> &ghost_fs::files() {
-    return _files;
-}
+static void fill_entry(fuse_req_t req, ghost_inode& inode, struct fuse_entry_param *e) {
+    const ghost_options& options = get_ghost_fs(req)->options();
 
-size_t ghost_fs::get_block_size() {
-    return _c.block_size();
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = inode.ino;
+    e->attr_timeout = options.attr_timeout;
+    e->entry_timeout = options.entry_timeout;
+    fill_stat(inode, &e->attr);
 }
 
-cache &ghost_fs::get_cache() {
-    return _c;
+static void reply_entry(fuse_req_t req, ghost_inode& inode) {
+    struct fuse_entry_param e;
+    fill_entry(req, inode, &e);
+    fuse_reply_entry(req, &e);
 }
 
-// fuse handlers
-
-static int ghost_getattr(const char *path, struct stat *stbuf)
+static void ghost_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    struct ghost_fs* ghost = get_ghost_fs();
-    int res = 0;
+    latency_timer timer(fuse_latency(OP_LOOKUP));
+    struct ghost_fs* ghost = get_ghost_fs(req);
+    epoch_guard guard;
 
-    memset(stbuf, 0, sizeof(struct stat));
-    if (strcmp(path, "/") == 0) {
-            stbuf->st_mode = S_IFDIR | 0755;
-            stbuf->st_nlink = 2;
-    } else {
-        auto& files = ghost->files();
-        auto it = files.find(path);
-        if (it == files.end()) {
-            res = -ENOENT;
-        } else {
-            stbuf->st_mode = S_IFREG | 0444;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = it->second.length();
-        }
+    ghost_inode* inode = ghost->files().lookup(parent, name);
+    if (!inode) {
+        fuse_reply_err(req, ENOENT);
+        return;
     }
 
-    return res;
+    reply_entry(req, *inode);
 }
 
-static int ghost_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi)
+static void ghost_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    struct ghost_fs* ghost = get_ghost_fs();
+    latency_timer timer(fuse_latency(OP_GETATTR));
+    struct ghost_fs* ghost = get_ghost_fs(req);
+    struct stat stbuf;
+    epoch_guard guard;
+
+    ghost_inode* inode = ghost->files().find_inode(ino);
+    if (!inode) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fill_stat(*inode, &stbuf);
+
+    fuse_reply_attr(req, &stbuf, ghost->options().attr_timeout);
+}
 
-    (void) offset;
-    (void) fi;
+// Offset of an entry is the one of the entry following it: 1 and 2 for "."
+// and "..", and inode number plus one for children, see ghost_dir. Listing
+// only visits entries fitting in the reply, however large the directory is.
+static void ghost_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t offset, struct fuse_file_info *fi)
+{
+    latency_timer timer(fuse_latency(OP_READDIR));
+    struct ghost_fs* ghost = get_ghost_fs(req);
+    epoch_guard guard;
 
-    // Root is the unique directory supported so far.
-    if (strcmp(path, "/") != 0) {
-        return -ENOENT;
+    ghost_inode* dir = ghost->files().find_inode(ino);
+    if (!dir) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!dir->is_dir()) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
     }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    std::vector<char> buf(size);
+    size_t buf_size = 0;
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+
+    auto add_entry = [&] (const char* name, fuse_ino_t entry_ino, mode_t mode, off_t next) {
+        stbuf.st_ino = entry_ino;
+        stbuf.st_mode = mode;
+        size_t entry_size = fuse_add_direntry(req, buf.data() + buf_size, size - buf_size,
+                                              name, &stbuf, next);
+        if (entry_size > size - buf_size) {
+            return false;
+        }
+        buf_size += entry_size;
+        return true;
+    };
 
-    for (auto& it : ghost->files()) {
-        filler(buf, it.first.data() + 1, NULL, 0);
+    if (offset < 1 && !add_entry(".", dir->ino, S_IFDIR, 1)) {
+        fuse_reply_buf(req, buf.data(), buf_size);
+        return;
+    }
+    if (offset < 2 && !add_entry("..", dir->parent, S_IFDIR, 2)) {
+        fuse_reply_buf(req, buf.data(), buf_size);
+        return;
     }
 
-    return 0;
+    ghost->files().for_each_child(ino, std::max<off_t>(offset, GHOST_ROOT_INO + 1),
+                          [&] (const char* name, ghost_inode& child) {
+        return add_entry(name, child.ino, child.is_dir() ? S_IFDIR : S_IFREG, child.ino + 1);
+    });
+
+    fuse_reply_buf(req, buf.data(), buf_size);
 }
 
-static int ghost_open(const char *path, struct fuse_file_info *fi)
+static void ghost_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-    struct ghost_fs* ghost = get_ghost_fs();
-
-    log("fi=%p, path=%s\n", fi, path);
-
-    if (!ghost->file_exists(path)) {
-        return -ENOENT;
-    }
-
-    if ((fi->flags & 3) != O_RDONLY) {
-        return -EACCES;
+    latency_timer timer(fuse_latency(OP_MKDIR));
+    struct ghost_fs* ghost = get_ghost_fs(req);
+    epoch_guard guard;
+    ghost_inode* inode;
+
+    int res = ghost->files().create(parent, name, true, &inode);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
     }
+    ghost->journal().add_dir(inode->ino);
 
-    return 0;
+    reply_entry(req, *inode);
 }
 
-static int ghost_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static void ghost_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    struct ghost_fs* ghost = get_ghost_fs();
-    bool exclusive = fi->flags & O_EXCL; // CHECK if it's correct
+    latency_timer timer(fuse_latency(OP_RMDIR));
+    struct ghost_fs* ghost = get_ghost_fs(req);
 
-    //log("CREATE: path=%s, create=%d, rdonly=%d, exclusive=%d\n", path, create, read_only, exclusive);
-#if 0 /* Otherwise, command touch will not work */
-    if ((fi->flags & 3) != O_RDONLY) {
-        return -EACCES;
+    int res = ghost->files().remove_dir(parent, name);
+    if (res == 0) {
+        ghost->journal().remove(parent, name);
     }
-#endif
+    fuse_reply_err(req, -res);
+}
 
-    if (ghost->file_exists(path)) {
-        if (exclusive) {
-            return -EEXIST;
-        }
+// Reply with a handle for file, which is released if open got interrupted.
+// Content of a file only changes along with its url or validator, when it's
+// invalidated explicitly, so kernel keeps it cached across opens.
+static void reply_open(fuse_req_t req, ghost_inode& inode, struct fuse_file_info *fi,
+                       bool created)
+{
+    fi->fh = reinterpret_cast<uint64_t>(new ghost_handle{ inode.file });
+    fi->keep_cache = 1;
+
+    int res;
+    if (created) {
+        struct fuse_entry_param e;
+        fill_entry(req, inode, &e);
+        res = fuse_reply_create(req, &e, fi);
     } else {
-        ghost->add_file(path);
+        res = fuse_reply_open(req, fi);
+    }
+    if (res == -ENOENT) {
+        delete get_handle(fi);
     }
-
-    return 0;
 }
 
-static void do_prefetch(cache& c, ghost_file& file, size_t blk_id, std::string file_url) {
-    std::vector<block_info>& file_blocks = file.get_file_blocks();
-    block_info& info = file_blocks[blk_id];
-    base_protocol* handler = get_handler(file_url.data());
+static void ghost_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    latency_timer timer(fuse_latency(OP_OPEN));
+    struct ghost_fs* ghost = get_ghost_fs(req);
 
-    if (!handler) return;
+    epoch_guard guard;
 
-    // XXX: handle possible failure here, so we will have to deallocate block, provide
-    // the function in cache.
-    handler->get_block(file_url.data(), blk_id, c.block_size(),
-        file.attributes(), info._blk->_data);
+    ghost_inode* inode = ghost->files().find_inode(ino);
+    if (!inode) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (inode->is_dir()) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+    TRACE_INFO(TRACE_OPEN, ino, 0, inode->file->resolving() ? 0 : inode->file->length(), 0);
 
-    c.unlock_block(info._blk);
+    if ((fi->flags & 3) != O_RDONLY) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
 
-    info._mtx.unlock();
-    log("Prefetched block %ld\n", blk_id);
+    reply_open(req, *inode, fi, false);
 }
 
-static void try_prefetch(cache& c, ghost_file& file, size_t blk_id, const char* file_url) {
-    std::vector<block_info>& file_blocks = file.get_file_blocks();
-    block_info& info = file_blocks[blk_id];
+static void ghost_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode, struct fuse_file_info *fi)
+{
+    latency_timer timer(fuse_latency(OP_CREATE));
+    struct ghost_fs* ghost = get_ghost_fs(req);
+    bool exclusive = fi->flags & O_EXCL; // CHECK if it's correct
 
-    if (!info._mtx.try_lock()) {
+    //log("CREATE: name=%s, create=%d, rdonly=%d, exclusive=%d\n", name, create, read_only, exclusive);
+#if 0 /* Otherwise, command touch will not work */
+    if ((fi->flags & 3) != O_RDONLY) {
+        fuse_reply_err(req, EACCES);
         return;
     }
-    c._mtx.lock();
+#endif
 
-    if (info._present) {
-        c._mtx.unlock();
-        info._mtx.unlock();
+    epoch_guard guard;
+    ghost_inode* inode;
+    int res = ghost->create_file(parent, name, &inode);
+    if (res == -EEXIST) {
+        if (exclusive) {
+            fuse_reply_err(req, EEXIST);
+            return;
+        }
+        if (inode->is_dir()) {
+            fuse_reply_err(req, EISDIR);
+            return;
+        }
+    } else if (res < 0) {
+        fuse_reply_err(req, -res);
         return;
     }
-    log("Prefetching block %ld\n", blk_id);
-    block* blk = c.allocate_block(&info);
-    c._mtx.unlock();
-    assert(info._blk == blk);
 
-    std::thread t(do_prefetch, std::ref(c), std::ref(file), blk_id, std::string(file_url));
-    t.detach();
+    reply_open(req, *inode, fi, true);
 }
 
-static int ghost_read(const char *path, char *buf, size_t size, off_t offset,
-                      struct fuse_file_info *fi)
+static void ghost_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    struct ghost_fs* ghost = get_ghost_fs();
+    latency_timer timer(fuse_latency(OP_RELEASE));
+    delete get_handle(fi);
+    fuse_reply_err(req, 0);
+}
 
-    auto& files = ghost->files();
-    auto it = files.find(path);
-    if (it == files.end()) {
-        return -ENOENT;
-    }
-    auto& file = it->second;
+// Whether kernel accepts replies spliced into the FUSE device.
+static std::atomic<bool> splice_write { false };
+
+// Reply with segments spliced from the file backing cache, so that neither
+// ghostfs nor libfuse copy content of cached blocks.
+static void reply_spliced(fuse_req_t req, cache& c, const read_segment* segments,
+                          size_t count) {
+    static thread_local std::vector<char> storage;
+    size_t bufv_size = sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf);
 
-    size_t len = file.length();
-    if (offset < len) {
-        if (offset + size > len) {
-            size = len - offset;
+    if (storage.size() < bufv_size) {
+        storage.resize(bufv_size);
+    }
+    auto bufv = reinterpret_cast<struct fuse_bufvec*>(storage.data());
+    bufv->count = count;
+    bufv->idx = 0;
+    bufv->off = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct fuse_buf& buf = bufv->buf[i];
+        buf.size = segments[i].size;
+        if (segments[i].cached) {
+            buf.flags = fuse_buf_flags(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            buf.mem = nullptr;
+            buf.fd = c.arena_fd();
+            buf.pos = c.arena_offset(segments[i].data);
+        } else {
+            buf.flags = fuse_buf_flags(0);
+            buf.mem = const_cast<char*>(segments[i].data);
+            buf.fd = -1;
+            buf.pos = 0;
         }
-    } else {
-        return 0;
     }
 
-    if (file.is_static()) {
-        memcpy(buf, file.data() + offset, size);
-        return size;
-    }
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+}
 
-    const char *file_url = file.get_url();
+// Reply with segments written to the FUSE device straight from their memory.
+static void reply_iov(fuse_req_t req, const read_segment* segments, size_t count) {
+    static thread_local std::vector<struct iovec> iov;
 
-    if (!file_url) {
-        return 0;
+    iov.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = const_cast<char*>(segments[i].data);
+        iov[i].iov_len = segments[i].size;
     }
 
-    log("\nURL: %s\n", file_url);
-
-    base_protocol* handler = get_handler(file_url);
-
-    if (!handler) return 0;
+    fuse_reply_iov(req, iov.data(), count);
+}
 
-    std::vector<block_info>& file_blocks = file.get_file_blocks();
+// Content is never copied to an intermediate buffer: reply is sent while
+// blocks are pinned in cache, straight from the memory storing them.
+static void ghost_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    latency_timer timer(fuse_latency(OP_READ));
+    struct ghost_fs* ghost = get_ghost_fs(req);
     cache& c = ghost->get_cache();
-    size_t end = offset + size;
-    size_t buf_offset = 0;
-    size_t block_size = ghost->get_block_size();
-    size_t blk_id;
-
-    while (offset < end) {
-        blk_id = offset / block_size;
-        size_t blk_offset = offset % block_size;
-        size_t remaining = end - offset;
-        size_t to_read = std::min(remaining, block_size - blk_offset);
-
-        log("blk_id=%ld, blk_offset=%ld, to_read=%ld\n", blk_id, blk_offset, to_read);
-
-        block_info& info = file_blocks[blk_id];
-        block* blk = nullptr;
-
-        info._mtx.lock();
-        c._mtx.lock();
-
-        if (!info._present) {
-            c._misses++;
-            log("\tnot cached, hit ratio=%6.2f%%\n", c.get_hit_ratio());
-            blk = c.allocate_block(&info);
-            c._mtx.unlock();
-            size_t bytes_read = handler->get_block(file_url, blk_id, block_size, file.attributes(), blk->_data);
-            // If get_block() was unable to get the amount of bytes asked, then we should return EIO.
-            if (bytes_read < to_read) {
-                log("get_block failed for block %ld, expected=%ld, actual=%ld\n", blk_id, to_read, bytes_read);
-                // TODO: we're still leaking the block previously allocated, so let's provide a function
-                // in cache to deallocate a block. This function will have to reset block info because
-                // block content is invalid if get_block() failed.
-                info._mtx.unlock();
-                return -EIO;
-            }
-            // If bytes read is greater than block size, then there is an overflow in blk->_data
-            assert(bytes_read <= block_size);
+
+    int res = ghost->read_file(get_handle(fi)->file, size, offset,
+                               [&] (const read_segment* segments, size_t count) {
+        if (splice_write && c.arena_fd() >= 0) {
+            reply_spliced(req, c, segments, count);
         } else {
-            c._hits++;
-            log("\tcached, hit ratio=%6.2f%%\n", c.get_hit_ratio());
-            blk = info._blk;
-            c.lock_block(blk);
-            c._mtx.unlock();
+            reply_iov(req, segments, count);
         }
-        assert(info._blk->_info == &info);
-        assert(info._blk->_data == blk->_data);
-
-        assert(buf_offset + to_read <= size);
-        memcpy(buf + buf_offset, blk->_data + blk_offset, to_read);
-
-        // TODO: Possibly, we will have to acquire cache mutex to unlock block.
-        c.unlock_block(blk);
-        info._mtx.unlock();
-
-        buf_offset += to_read;
-        offset += to_read;
-    }
-
-    // Try to prefetch subsequent block.
-    if ((blk_id + 1) < file_blocks.size()) {
-        try_prefetch(c, file, blk_id+1, file_url);
+    });
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else if (res == 0) {
+        fuse_reply_buf(req, nullptr, 0);
     }
-
-    return size;
 }
 
-int ghost_setxattr(const char *path, const char *name,
-                   const char *value, size_t size, int flags) {
+static void ghost_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                           const char *value, size_t size, int flags) {
+    latency_timer timer(fuse_latency(OP_SETXATTR));
     char value_buf[size+1];
     memcpy((void*) &value_buf, value, size);
     value_buf[size] = '\0';
 
-    log("* setxattr: path=%s, name=%s, value=%s, size=%ld\n",
-           path, name, value_buf, size);
-    struct ghost_fs* ghost = get_ghost_fs();
+    TRACE_INFO(TRACE_SETXATTR, ino, 0, size, 0);
+    struct ghost_fs* ghost = get_ghost_fs(req);
+    std::shared_ptr<ghost_file> file_ptr;
+
+    // Setting url fetches metadata, so file is held by reference instead of
+    // staying in a critical section across the fetch.
+    {
+        epoch_guard guard;
+        ghost_inode* inode = ghost->files().find_inode(ino);
+        if (!inode) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        if (inode->is_dir()) {
+            fuse_reply_err(req, ENOTSUP);
+            return;
+        }
+        file_ptr = inode->file;
+    }
+    fuse_reply_err(req, -ghost->set_attribute(file_ptr, name, value_buf, flags));
+}
+
+static void ghost_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    latency_timer timer(fuse_latency(OP_GETXATTR));
+    TRACE_DEBUG(TRACE_GETXATTR, ino, 0, size, 0);
+    struct ghost_fs* ghost = get_ghost_fs(req);
+    epoch_guard guard;
+
+    ghost_inode* inode = ghost->files().find_inode(ino);
+    if (!inode) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (inode->is_dir()) {
+        fuse_reply_err(req, ENOATTR);
+        return;
+    }
+    ghost_file* file = inode->file.get();
 
-    auto& files = ghost->files();
-    auto it = files.find(path);
-    if (it == files.end()) {
-        return -ENOENT;
+    auto attributes = file->attributes();
+    auto it = attributes->find(name);
+    if (it == attributes->end()) {
+        fuse_reply_err(req, ENOATTR);
+        return;
     }
-    auto& file = it->second;
+    auto& attribute_value = it->second;
+    size_t attribute_value_size = attribute_value.size();
 
-    if ((flags & XATTR_CREATE) && file.attribute_exists(name)) {
-        return -EEXIST;
-    } else if ((flags & XATTR_REPLACE) && !file.attribute_exists(name)) {
-        return -ENOATTR;
+    if (size == 0) {
+        fuse_reply_xattr(req, attribute_value_size);
+    } else if (attribute_value_size > size) {
+        // Size of buffer is small to hold the result.
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, attribute_value.data(), attribute_value_size);
     }
+}
 
-    // WARNING: if url attribute gets replaced, we need to invalidate
-    // all cache entries of the file and update file size
-    file.add_attribute(name, value_buf);
+static void ghost_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+    latency_timer timer(fuse_latency(OP_REMOVEXATTR));
+    struct ghost_fs* ghost = get_ghost_fs(req);
+    epoch_guard guard;
 
-    base_protocol* handler = get_handler(value_buf);
+    ghost_inode* inode = ghost->files().find_inode(ino);
+    if (!inode) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (inode->is_dir()) {
+        fuse_reply_err(req, ENOATTR);
+        return;
+    }
+    fuse_reply_err(req, -ghost->remove_attribute(inode->file, name));
+}
 
-    if (!handler) return 0;
+namespace fs = boost::filesystem;
 
-    // Need to check if URL accepts range request, if not, we need to do something.
-    if (strcmp(name, "url") == 0 &&
-            handler->is_url_valid(value_buf)) {
-        file.update_length(handler->get_content_length_for_url(value_buf),
-                           ghost->get_block_size());
-        try_prefetch(ghost->get_cache(), file, 0, value_buf);
+static fs::path current_path;
+static std::string mountpoint_path;
+// When ghostfs started, to measure how long it takes to be ready.
+static std::chrono::steady_clock::time_point start_time;
+static struct fuse_chan *session_chan;
+
+// Kernel only lets FUSE lower readahead below the size of the backing device
+// info, which is therefore set directly. It can only be done once mount is
+// complete, as it requires looking up the device of the mount point.
+static void set_readahead(std::string mountpoint, unsigned readahead_kb) {
+    struct stat st;
+    if (stat(mountpoint.c_str(), &st) < 0) {
+        log("Unable to stat %s: %s\n", mountpoint.c_str(), strerror(errno));
+        return;
     }
 
-    return 0;
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/class/bdi/%u:%u/read_ahead_kb",
+             major(st.st_dev), minor(st.st_dev));
+    FILE *f = fopen(path, "w");
+    if (!f || fprintf(f, "%u\n", readahead_kb) < 0 || fclose(f) != 0) {
+        log("Unable to set readahead of %s to %u KB\n", mountpoint.c_str(), readahead_kb);
+        if (f) {
+            fclose(f);
+        }
+    }
 }
 
-int ghost_getxattr(const char *path, const char *name, char *value, size_t size) {
-    log("* getxattr: path=%s, name=%s, value=%p, %s, size=%ld\n",
-           path, name, value, value, size);
-    struct ghost_fs* ghost = get_ghost_fs();
+// Called once mount is done and ghostfs is running in background, so it's
+// the place to start anything that involves threads or child processes.
+static void ghost_init(void *userdata, struct fuse_conn_info *conn) {
+    struct ghost_fs* ghost = static_cast<ghost_fs*>(userdata);
+    ghost_options& options = ghost->options();
 
-    auto& files = ghost->files();
-    auto it = files.find(path);
-    if (it == files.end()) {
-        return -ENOENT;
+    if (options.max_background) {
+        conn->max_background = options.max_background;
+        // Same ratio kernel uses by default.
+        conn->congestion_threshold = options.max_background * 3 / 4;
     }
-    auto& file = it->second;
 
-    auto& attributes = file.attributes();
-    auto it2 = attributes.find(name);
-    if (it2 == attributes.end()) {
-        return -ENOATTR;
+    if (options.splice && (conn->capable & FUSE_CAP_SPLICE_WRITE)) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+        splice_write = true;
+    }
+    if (options.splice && (conn->capable & FUSE_CAP_SPLICE_MOVE)) {
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
     }
-    auto& attribute_value = it2->second;
-    size_t attribute_value_size = attribute_value.size();
 
-    log("\tattribute=%s, attribute_value_size=%ld\n",
-           attribute_value.data(), attribute_value_size);
+    if (options.readahead_kb) {
+        conn->max_readahead = options.readahead_kb * 1024;
+        std::thread(set_readahead, mountpoint_path, options.readahead_kb).detach();
+    }
 
-    if (size > 0) {
-        // Size of buffer is small to hold the result.
-        if (attribute_value_size > size) {
-            return -ERANGE;
+    if (!options.trace.empty()) {
+        int res = trace_start(options.trace.c_str(), options.trace_level);
+        if (res < 0) {
+            log("Unable to trace to %s: %s\n", options.trace.c_str(), strerror(-res));
         }
-        memcpy(value, attribute_value.data(), attribute_value_size);
     }
+    if (!options.metrics.empty()) {
+        metrics_start(options.metrics.c_str(), options.metrics_interval);
+    }
+
+    if (options.python_workers) {
+        start_python_pool(options.python_workers, options.python_affinity,
+                          ghost->get_cache(), current_path);
+    }
+
+    ghost->notifier().start(session_chan);
+    ghost->start();
 
-    return attribute_value_size;
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+    log("Ready in %.3f ms\n", elapsed.count());
 }
 
-int ghost_removexattr(const char *path, const char *name) {
-    struct ghost_fs* ghost = get_ghost_fs();
+static void ghost_destroy(void *userdata) {
+    struct ghost_fs* ghost = static_cast<ghost_fs*>(userdata);
 
-    auto& files = ghost->files();
-    auto it = files.find(path);
-    if (it == files.end()) {
-        return -ENOENT;
-    }
-    auto& file = it->second;
+    ghost->stop();
+    ghost->notifier().stop();
+    stop_python_pool();
 
-    if (!file.attribute_exists(name)) {
-        return -ENOATTR;
+    auto& stats = get_fetch_stats();
+    log("Fetches: %lu timeouts, %lu retries, %lu failures\n", stats.timeouts.load(),
+        stats.retries.load(), stats.failures.load());
+    if (!ghost->options().peers.empty()) {
+        ghost_stats s = ghost->stats();
+        log("Peers: %lu blocks served by them, saving %lu bytes from origin, %lu served to them\n",
+            s.peer_hits, s.peer_bytes, s.peer_served);
     }
-    file.remove_attribute(name);
-    return 0;
+    log("Cache hit ratio: %.2f%%\n", ghost->get_cache().get_hit_ratio());
+    metrics_stop();
+    trace_stop();
 }
 
-
 // Utility functions
-struct fuse_operations ghost_oper;
-struct ghost_fs ghost;
+struct fuse_lowlevel_ops ghost_oper;
 
 void set_ghost_oper() {
+    ghost_oper.init = ghost_init;
+    ghost_oper.destroy = ghost_destroy;
+    ghost_oper.lookup = ghost_lookup;
     ghost_oper.getattr = ghost_getattr;
     ghost_oper.readdir = ghost_readdir;
+    ghost_oper.mkdir = ghost_mkdir;
+    ghost_oper.rmdir = ghost_rmdir;
     ghost_oper.open = ghost_open;
     ghost_oper.create = ghost_create;
     ghost_oper.read = ghost_read;
+    ghost_oper.release = ghost_release;
     ghost_oper.setxattr = ghost_setxattr;
     ghost_oper.getxattr = ghost_getxattr;
     ghost_oper.removexattr = ghost_removexattr;
@@ -403,23 +565,285 @@ void set_ghost_oper() {
 void add_static_files() {
     static const char *ghost_path = "/HELLO";
     static const char *ghost_str = "Hello World!\n";
-    ghost.add_file(ghost_path, ghost_str);
+    ghost.files().add_file(ghost_path, ghost_str);
 
     static const char *credits_path = "/CREDITS";
     static const char *credits_str = "Raphael S. Carvalho <raphael.scarv@gmail.com>\n";
-    ghost.add_file(credits_path, credits_str);
+    ghost.files().add_file(credits_path, credits_str);
 }
 
 void register_handlers() {
     register_handler(new http_protocol);
     register_handler(new https_protocol);
     register_handler(new file_protocol);
+    register_handler(new sim_protocol);
 }
 
-namespace fs = boost::filesystem;
+enum {
+    KEY_PYTHON_WORKERS,
+    KEY_PYTHON_AFFINITY,
+    KEY_FETCH_BUDGET,
+    KEY_CONNECT_TIMEOUT,
+    KEY_FIRST_BYTE_TIMEOUT,
+    KEY_STALL_TIMEOUT,
+    KEY_FETCH_RETRIES,
+    KEY_THREADS,
+    KEY_MAX_BACKGROUND,
+    KEY_ATTR_TIMEOUT,
+    KEY_ENTRY_TIMEOUT,
+    KEY_REVALIDATE,
+    KEY_VERIFY_BLOCKS,
+    KEY_READAHEAD_KB,
+    KEY_NO_SPLICE,
+    KEY_MANIFEST,
+    KEY_JOURNAL,
+    KEY_TRACE,
+    KEY_TRACE_LEVEL,
+    KEY_METRICS,
+    KEY_METRICS_INTERVAL,
+    KEY_PEER,
+    KEY_PEER_PORT,
+};
+
+static struct fuse_opt ghost_opts[] = {
+    FUSE_OPT_KEY("python_workers=", KEY_PYTHON_WORKERS),
+    FUSE_OPT_KEY("python_affinity=", KEY_PYTHON_AFFINITY),
+    FUSE_OPT_KEY("fetch_budget_ms=", KEY_FETCH_BUDGET),
+    FUSE_OPT_KEY("connect_timeout_ms=", KEY_CONNECT_TIMEOUT),
+    FUSE_OPT_KEY("first_byte_timeout_ms=", KEY_FIRST_BYTE_TIMEOUT),
+    FUSE_OPT_KEY("stall_timeout_ms=", KEY_STALL_TIMEOUT),
+    FUSE_OPT_KEY("fetch_retries=", KEY_FETCH_RETRIES),
+    FUSE_OPT_KEY("threads=", KEY_THREADS),
+    FUSE_OPT_KEY("max_background=", KEY_MAX_BACKGROUND),
+    FUSE_OPT_KEY("attr_timeout=", KEY_ATTR_TIMEOUT),
+    FUSE_OPT_KEY("entry_timeout=", KEY_ENTRY_TIMEOUT),
+    FUSE_OPT_KEY("revalidate=", KEY_REVALIDATE),
+    FUSE_OPT_KEY("verify_blocks", KEY_VERIFY_BLOCKS),
+    FUSE_OPT_KEY("readahead_kb=", KEY_READAHEAD_KB),
+    FUSE_OPT_KEY("no_splice", KEY_NO_SPLICE),
+    FUSE_OPT_KEY("manifest=", KEY_MANIFEST),
+    FUSE_OPT_KEY("journal=", KEY_JOURNAL),
+    FUSE_OPT_KEY("trace=", KEY_TRACE),
+    FUSE_OPT_KEY("trace_level=", KEY_TRACE_LEVEL),
+    FUSE_OPT_KEY("metrics=", KEY_METRICS),
+    FUSE_OPT_KEY("metrics_interval=", KEY_METRICS_INTERVAL),
+    FUSE_OPT_KEY("peer=", KEY_PEER),
+    FUSE_OPT_KEY("peer_port=", KEY_PEER_PORT),
+    FUSE_OPT_END
+};
+
+// Consume options handled by ghostfs, and keep the other ones for FUSE.
+static int ghost_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    ghost_options* options = static_cast<ghost_options*>(data);
+    const char* value = strchr(arg, '=');
+
+    switch (key) {
+    case KEY_PYTHON_WORKERS:
+        options->python_workers = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_PYTHON_AFFINITY:
+        options->python_affinity.push_back(value + 1);
+        return 0;
+    case KEY_FETCH_BUDGET:
+        options->fetch.budget_ms = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_CONNECT_TIMEOUT:
+        options->fetch.connect_timeout_ms = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_FIRST_BYTE_TIMEOUT:
+        options->fetch.first_byte_timeout_ms = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_STALL_TIMEOUT:
+        options->fetch.stall_timeout_ms = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_FETCH_RETRIES:
+        options->fetch.max_retries = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_THREADS:
+        options->threads = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_MAX_BACKGROUND:
+        options->max_background = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_ATTR_TIMEOUT:
+        options->attr_timeout = strtod(value + 1, nullptr);
+        return 0;
+    case KEY_ENTRY_TIMEOUT:
+        options->entry_timeout = strtod(value + 1, nullptr);
+        return 0;
+    case KEY_REVALIDATE:
+        options->revalidate = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_VERIFY_BLOCKS:
+        options->verify_blocks = true;
+        return 0;
+    case KEY_READAHEAD_KB:
+        options->readahead_kb = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_NO_SPLICE:
+        options->splice = false;
+        return 0;
+    case KEY_MANIFEST:
+        options->manifest = value + 1;
+        return 0;
+    case KEY_JOURNAL:
+        options->journal = value + 1;
+        return 0;
+    case KEY_TRACE:
+        options->trace = value + 1;
+        return 0;
+    case KEY_TRACE_LEVEL:
+        options->trace_level = strtol(value + 1, nullptr, 10);
+        return 0;
+    case KEY_METRICS:
+        options->metrics = value + 1;
+        return 0;
+    case KEY_METRICS_INTERVAL:
+        options->metrics_interval = strtoul(value + 1, nullptr, 10);
+        return 0;
+    case KEY_PEER:
+        options->peers.push_back(value + 1);
+        return 0;
+    case KEY_PEER_PORT:
+        options->peer_port = strtoul(value + 1, nullptr, 10);
+        return 0;
+    }
+    return 1;
+}
+
+// Each worker receives and processes requests on its own. Workers are only
+// cancelled while waiting for a request, never in the middle of one.
+static sem_t session_done;
+
+static void* session_worker(void *arg) {
+    struct fuse_session* se = static_cast<struct fuse_session*>(arg);
+    struct fuse_chan* ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    std::unique_ptr<char[]> buf(new char[bufsize]);
+
+    while (!fuse_session_exited(se)) {
+        struct fuse_chan* tmpch = ch;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int res = fuse_chan_recv(&tmpch, buf.get(), bufsize);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (res == -EINTR || res == -EAGAIN) {
+            continue;
+        }
+        if (res <= 0) {
+            break;
+        }
+        fuse_session_process(se, buf.get(), res, tmpch);
+    }
+
+    fuse_session_exit(se);
+    sem_post(&session_done);
+    return nullptr;
+}
+
+// Process requests of se with the given number of worker threads until
+// file system is unmounted or ghostfs gets a termination signal.
+static int run_session(struct fuse_session* se, unsigned workers) {
+    std::vector<pthread_t> threads;
+    sigset_t signals, old_signals;
+
+    sem_init(&session_done, 0, 0);
+
+    // Termination signals are handled by this thread only.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+    for (unsigned i = 0; i < workers; i++) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, session_worker, se);
+        if (err) {
+            log("Unable to create FUSE worker: %s\n", strerror(err));
+            break;
+        }
+        threads.push_back(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    if (threads.empty()) {
+        sem_destroy(&session_done);
+        return -1;
+    }
+    log("Processing FUSE requests with %ld workers\n", threads.size());
+
+    while (!fuse_session_exited(se)) {
+        sem_wait(&session_done);
+    }
+
+    for (auto thread : threads) {
+        pthread_cancel(thread);
+    }
+    for (auto thread : threads) {
+        pthread_join(thread, NULL);
+    }
+    sem_destroy(&session_done);
+    fuse_session_reset(se);
+
+    return 0;
+}
 
 int ghost_main(int argc, char *argv[]) {
-    fs::path current_path = fs::system_complete(fs::path(argv[0])).parent_path();
+    if (argc > 1 && strcmp(argv[1], GHOSTFS_PYTHON_WORKER_ARG) == 0) {
+        return python_worker_main(argc, argv);
+    }
+
+    start_time = std::chrono::steady_clock::now();
+    current_path = fs::system_complete(fs::path(argv[0])).parent_path();
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &ghost.options(), ghost_opts, ghost_opt_proc) < 0) {
+        return 1;
+    }
+    default_fetch_policy() = ghost.options().fetch;
+
+    // Snapshot of the journal already covers whatever the manifest lists.
+    const std::string& journal_path = ghost.options().journal;
+    std::unique_ptr<manifest> m;
+    if (!journal_path.empty()) {
+        int res = ghost.journal().open(journal_path.c_str(), ghost.files());
+        if (res < 0) {
+            fprintf(stderr, "Unable to open journal %s: %s\n", journal_path.c_str(), strerror(-res));
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+        m.reset(new manifest);
+        res = ghost.journal().open_snapshot(*m);
+        if (res == 0) {
+            log("Snapshot of journal %s lists %lu entries\n", journal_path.c_str(), m->size());
+        } else {
+            if (res != -ENOENT) {
+                log("Unable to open snapshot of journal %s: %s\n", journal_path.c_str(), strerror(-res));
+            }
+            m.reset();
+        }
+    }
+
+    const std::string& manifest_path = ghost.options().manifest;
+    if (!m && !manifest_path.empty()) {
+        m.reset(new manifest);
+        int res = m->open(manifest_path.c_str());
+        if (res < 0) {
+            fprintf(stderr, "Unable to open manifest %s: %s\n", manifest_path.c_str(), strerror(-res));
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+        log("Manifest %s lists %lu files\n", manifest_path.c_str(), m->size());
+    }
+    if (m) {
+        ghost.files().set_manifest(std::move(m), ghost.get_cache(),
+                                   [] (const std::shared_ptr<ghost_file>& file) {
+            ghost.resolver().submit(file);
+        });
+    }
 
     set_ghost_oper();
     add_static_files();
@@ -428,8 +852,47 @@ int ghost_main(int argc, char *argv[]) {
     //load extern drivers
     load_drivers(current_path);
 
-    python::initialize initialize;
-    load_python_drivers(current_path);
+    // Python drivers are loaded by worker processes if they are enabled.
+    std::unique_ptr<python::initialize> initialize;
+    if (!ghost.options().python_workers) {
+        initialize.reset(new python::initialize);
+        load_python_drivers(current_path);
+    }
+
+    char *mountpoint = nullptr;
+    int multithreaded, foreground;
+    int ret = 1;
+    struct fuse_chan *ch;
+
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
+            (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(&args, &ghost_oper, sizeof(ghost_oper),
+                                                    (void*) &ghost);
+        if (se) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                unsigned workers = ghost.options().threads;
+                if (!multithreaded) {
+                    workers = 1;
+                } else if (!workers) {
+                    workers = std::max(1u, std::thread::hardware_concurrency());
+                }
+
+                mountpoint_path = mountpoint;
+                session_chan = ch;
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                ret = run_session(se, workers) ? 1 : 0;
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+
+    unload_drivers();
+    free(mountpoint);
+    fuse_opt_free_args(&args);
 
-    return fuse_main(argc, argv, &ghost_oper, (void*) &ghost);
+    return ret;
 }
@@ -10,9 +10,23 @@
 #define GHOST_FS_H
 
 #include "ghost_file.h"
+#include "ghost_namespace.h"
 #include "cache.h"
+#include "journal.h"
+#include "kernel_notifier.h"
+#include "metadata_resolver.h"
+#include "metrics.h"
+#include "peer_tier.h"
+#include "trace.h"
 
 #include <sys/xattr.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #ifndef ENOATTR
 #define ENOATTR ENODATA /* Attribute not found */
@@ -20,29 +34,238 @@
 
 #define BLOCK_SIZE (1024*1024)
 #define CACHE_SIZE 1024 // Maximum number of cache entries
+#define PREFETCH_WINDOW 2 // Maximum number of subsequent blocks to be prefetched
+#define PREFETCH_CACHE_SHARE 16 // Prefetches lock at most 1/N of cache blocks at once
+#define READ_CACHE_SHARE 4 // Reads lock at most 1/N of cache blocks at once
+#define PIN_WAIT_MS 1000 // Time a read waits for a cache block to get unpinned before failing
+#define RESOLVER_THREADS 2 // Number of threads resolving metadata of remote objects
+#define STREAM_LINGER_MS 10000 // Time a stream waits for readers to catch up before ending
+#define PEER_BUSY_WAIT_MS 100 // Time a peer waits for a block being fetched before going to origin
 
+// Mount options, given with -o <option>=<value>.
+struct ghost_options {
+    // Number of worker processes running python drivers. If zero, python
+    // drivers run in ghostfs process.
+    unsigned python_workers = 0;
+    // Workers a python driver is restricted to, as <driver>:<first>[-<last>].
+    std::vector<std::string> python_affinity;
+    // Limits on fetches from origins, see fetch_policy.
+    fetch_policy fetch;
+    // Number of threads processing FUSE requests. If zero, there is one
+    // per CPU.
+    unsigned threads = 0;
+    // Maximum number of background requests, e.g. readahead, the kernel
+    // keeps in flight. If zero, kernel default is used.
+    unsigned max_background = 0;
+    // Time, in seconds, for which kernel caches attributes and lookups.
+    // Kernel is told explicitly when they change, so it can be long.
+    double attr_timeout = 3600;
+    double entry_timeout = 3600;
+    // Interval, in seconds, at which remote objects of files are checked for
+    // changes. If zero, they are assumed not to change.
+    unsigned revalidate = 0;
+    // Whether checksums of blocks of files without a sidecar, see
+    // CHECKSUMS_ATTRIBUTE, are learned when they're first fetched, so that
+    // later fetches get verified.
+    bool verify_blocks = false;
+    // Kernel readahead, in KB. If zero, kernel default is used.
+    unsigned readahead_kb = 0;
+    // Whether replies to reads are spliced from the file backing cache, when
+    // kernel accepts it, rather than written from memory.
+    bool splice = true;
+    // Manifest listing files to be served, see manifest.h.
+    std::string manifest;
+    // Journal persisting the namespace and the blocks in cache across
+    // restarts, see journal.h. Once it has a snapshot, manifest is ignored.
+    std::string journal;
+    // File events get traced to, see trace.h, and most verbose level traced.
+    std::string trace;
+    int trace_level = TRACE_LEVEL_DEBUG;
+    // File metrics get written to, in Prometheus text format, and interval
+    // in seconds at which it's rewritten.
+    std::string metrics;
+    unsigned metrics_interval = 10;
+    // Instances sharing their cache, as <host>:<port>, this one included,
+    // see peer_tier, and port this one listens on for their requests.
+    std::vector<std::string> peers;
+    unsigned peer_port = 0;
+};
+
+// Part of a read, stored either in cache or in memory of a static file.
+struct read_segment {
+    const char* data;
+    size_t size;
+    bool cached;
+};
+
+// Called with the segments making up a read, which stay valid until it
+// returns. A reply capturing up to two references is stored without
+// allocating memory.
+typedef std::function<void (const read_segment* segments, size_t count)> read_reply;
+
+// Counters of a ghost_fs, see ghost_fs::stats().
+struct ghost_stats {
+    // Blocks found in cache by reads, and blocks reads had to fetch.
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    // Blocks of cache which stored content at some point, out of all of them.
+    uint64_t blocks_used = 0;
+    uint64_t blocks_available = 0;
+    // Blocks prefetched, and how many of them got read or evicted unread.
+    // These and fetch counters are shared by all instances in the process.
+    uint64_t prefetched = 0;
+    uint64_t prefetch_hits = 0;
+    uint64_t prefetch_wasted = 0;
+    // Fetches from origins that timed out, got retried or failed.
+    uint64_t fetch_timeouts = 0;
+    uint64_t fetch_retries = 0;
+    uint64_t fetch_failures = 0;
+    // Blocks peers served, and didn't, along with the bytes they served,
+    // which weren't fetched from origin, and blocks served to peers.
+    uint64_t peer_hits = 0;
+    uint64_t peer_misses = 0;
+    uint64_t peer_bytes = 0;
+    uint64_t peer_served = 0;
+};
+
+struct file_stream;
+
+// File system serving ghost files, which can be used on its own as well as
+// through FUSE: mount only adds handlers translating requests into calls to
+// it and invalidating what kernel caches.
 struct ghost_fs {
 private:
-    // TODO: introduce comparator method to optimize find.
-    std::unordered_map<std::string, ghost_file> _files;
+    // Blocks of files are given back to cache when files go away, so it
+    // outlives them.
     cache _c;
+    ghost_namespace _files;
+    ghost_options _options;
+    kernel_notifier _notifier;
+    metadata_resolver _resolver;
+    ghost_journal _journal;
+
+    // Revalidation of files runs every options().revalidate seconds until
+    // _revalidator_stopped is set.
+    std::thread _revalidator;
+    bool _revalidator_stopped = false;
+    std::mutex _revalidator_mtx;
+    std::condition_variable _revalidator_cv;
+    // Blocks listed by <journal>.hot are fetched in background until they're
+    // all cached or _warmer_stopped is set.
+    std::thread _warmer;
+    std::atomic<bool> _warmer_stopped { false };
+    // Streams of objects whose origin doesn't serve ranges, by inode of
+    // their file, which fill blocks in order as readers wait for them. A
+    // stream removes itself once it ends, and detaches its thread, so
+    // threads are counted until they're done.
+    std::unordered_map<uint64_t, std::shared_ptr<file_stream>> _streams;
+    size_t _stream_threads = 0;
+    bool _streams_stopped = false;
+    std::mutex _streams_mtx;
+    std::condition_variable _streams_cv;
+    // Instances blocks are asked for before origin, and files they ask for,
+    // by handler and url, which are indexed whenever their fetch context is
+    // replaced. Entries of files that went away or changed url are dropped
+    // once found stale.
+    peer_tier _peers;
+    std::unordered_map<std::string, std::weak_ptr<ghost_file>> _peer_files;
+    std::mutex _peer_files_mtx;
+
+    void run_revalidator();
+
+    void run_stream(std::shared_ptr<file_stream> s);
+
+    // Wait until blocks from first_blk_id up to last_blk_id of table of file are
+    // filled by its stream, which is started if it isn't running. If the
+    // stream already went past the first one missing, or streams content
+    // of another table or context, a new stream is started once it ends.
+    void wait_for_stream(const std::shared_ptr<ghost_file>& file,
+                         const std::shared_ptr<block_table>& table,
+                         const std::shared_ptr<fetch_context>& ctx, size_t first_blk_id,
+                         size_t last_blk_id);
+
+    void warm_up(std::string hot_path);
+
+    void resolve_content(const std::shared_ptr<ghost_file>& file);
+
+    // Read size bytes of file from offset in pieces locking up to max_blocks
+    // blocks each, which are copied to a buffer replied with at once, and
+    // freed afterwards.
+    int read_in_pieces(const std::shared_ptr<ghost_file>& file, size_t size, off_t offset,
+                       size_t max_blocks, const read_reply& reply);
+
+    // Index file by the handler and url of its current fetch context.
+    void index_peer_file(const std::shared_ptr<ghost_file>& file);
+
+    std::shared_ptr<ghost_file> find_peer_file(const peer_object& object);
+
+    // Serve block blk_id of object to a peer, from cache or from origin.
+    int serve_peer_block(const peer_object& object, size_t block_size, size_t blk_id,
+                         std::vector<char>& data);
 public:
     // TODO: add option for the user to set cache settings.
     ghost_fs();
 
-    void add_file(const char* file_path, const char* content);
+    // Cache holds cache_blocks blocks of block_size bytes.
+    ghost_fs(size_t cache_blocks, size_t block_size);
+
+    // Start resolving metadata in background, together with revalidation of
+    // files and replay of the journal if options() ask for them. Must be
+    // called before urls of files get set.
+    void start();
+
+    // Stop whatever start() started.
+    void stop();
+
+    // Create file at path, whose parent directory must exist. Return the
+    // file, or nullptr if it can't be created.
+    std::shared_ptr<ghost_file> create_file(const char* path);
+
+    // Create a file named name in directory parent, and store it in inode.
+    // Return 0 on success, or a negative error, -EEXIST meaning that inode
+    // stores the existing entry.
+    int create_file(uint64_t parent, const char* name, ghost_inode** inode);
 
-    void add_file(const char* file_path);
+    // Set attribute name of file to value, flags being the ones of
+    // setxattr(2). Setting url or compression drops whatever is cached for
+    // the file and resolves its length in background. Return 0 on success,
+    // or a negative error.
+    int set_attribute(const std::shared_ptr<ghost_file>& file, const char* name,
+                      const char* value, int flags = 0);
 
-    void remove_file(const char* file_path);
+    int set_url(const std::shared_ptr<ghost_file>& file, const char* url);
 
-    bool file_exists(const char* file_path);
+    // Return 0 on success, or -ENOATTR if file has no attribute name.
+    int remove_attribute(const std::shared_ptr<ghost_file>& file, const char* name);
 
-    std::unordered_map<std::string, ghost_file>& files();
+    // Pin blocks covering the read in cache, fetching the ones that are
+    // missing, and call reply with the segments making up the read. Reads
+    // that would pin more than 1/READ_CACHE_SHARE of cache are read in pieces
+    // and replied with a copy. Return number of bytes read, or a negative
+    // error, -ENOBUFS if all blocks of cache stay pinned. reply is only called
+    // if the number of bytes read is positive.
+    int read_file(const std::shared_ptr<ghost_file>& file, size_t size, off_t offset,
+                  const read_reply& reply);
+
+    // Copy up to size bytes of file from offset to buf. Return number of
+    // bytes read, or a negative error.
+    ssize_t read(const std::shared_ptr<ghost_file>& file, char* buf, size_t size, off_t offset);
+
+    ghost_stats stats();
+
+    ghost_namespace& files();
 
     size_t get_block_size();
 
     cache& get_cache();
+
+    ghost_options& options();
+
+    kernel_notifier& notifier();
+
+    metadata_resolver& resolver();
+
+    ghost_journal& journal();
 };
 
 struct ghost_fs* get_ghost_fs();
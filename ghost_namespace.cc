@@ -0,0 +1,688 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+#include "ghost_namespace.h"
+
+// Initial number of buckets of a directory index, which is a power of 2.
+#define DIR_INDEX_BUCKETS 8
+
+// FNV-1a
+static size_t hash_name(const char* name, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= static_cast<unsigned char>(name[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+dir_index::table::table(size_t size)
+    : mask(size - 1)
+    , buckets(new std::atomic<entry*>[size]) {
+    for (size_t i = 0; i < size; i++) {
+        buckets[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+dir_index::dir_index()
+    : _table(new table(DIR_INDEX_BUCKETS)) {}
+
+// Index is only destroyed along with its directory, once no lookup can use it.
+dir_index::~dir_index() {
+    free_table(_table.load(std::memory_order_relaxed));
+}
+
+void dir_index::free_table(table* t) {
+    for (size_t i = 0; i <= t->mask; i++) {
+        entry* e = t->buckets[i].load(std::memory_order_relaxed);
+        while (e) {
+            entry* next = e->next.load(std::memory_order_relaxed);
+            delete e;
+            e = next;
+        }
+    }
+    delete t;
+}
+
+ghost_inode* dir_index::find(const char* name, size_t len) const {
+    size_t hash = hash_name(name, len);
+    table* t = _table.load(std::memory_order_acquire);
+
+    entry* e = t->buckets[hash & t->mask].load(std::memory_order_acquire);
+    for (; e; e = e->next.load(std::memory_order_acquire)) {
+        const std::string& entry_name = e->inode->name;
+        if (e->hash == hash && entry_name.size() == len && !memcmp(entry_name.data(), name, len)) {
+            return e->inode;
+        }
+    }
+    return nullptr;
+}
+
+// Entries are copied into a table twice as large, and the old table is
+// retired with its entries, as lookups in flight may still walk it.
+void dir_index::grow() {
+    table* old_table = _table.load(std::memory_order_relaxed);
+    table* new_table = new table((old_table->mask + 1) * 2);
+
+    for (size_t i = 0; i <= old_table->mask; i++) {
+        entry* e = old_table->buckets[i].load(std::memory_order_relaxed);
+        for (; e; e = e->next.load(std::memory_order_relaxed)) {
+            auto& bucket = new_table->buckets[e->hash & new_table->mask];
+            bucket.store(new entry{ e->hash, e->inode, { bucket.load(std::memory_order_relaxed) } },
+                         std::memory_order_relaxed);
+        }
+    }
+    _table.store(new_table, std::memory_order_release);
+    epoch_retire([old_table] { free_table(old_table); });
+}
+
+bool dir_index::insert(ghost_inode* inode) {
+    const std::string& name = inode->name;
+    if (find(name.data(), name.size())) {
+        return false;
+    }
+    if (_size > _table.load(std::memory_order_relaxed)->mask) {
+        grow();
+    }
+
+    size_t hash = hash_name(name.data(), name.size());
+    table* t = _table.load(std::memory_order_relaxed);
+    auto& bucket = t->buckets[hash & t->mask];
+    bucket.store(new entry{ hash, inode, { bucket.load(std::memory_order_relaxed) } },
+                 std::memory_order_release);
+    _size++;
+    return true;
+}
+
+void dir_index::erase(ghost_inode* inode) {
+    const std::string& name = inode->name;
+    size_t hash = hash_name(name.data(), name.size());
+    table* t = _table.load(std::memory_order_relaxed);
+
+    std::atomic<entry*>* link = &t->buckets[hash & t->mask];
+    for (entry* e = link->load(std::memory_order_relaxed); e;
+         e = link->load(std::memory_order_relaxed)) {
+        if (e->inode == inode) {
+            link->store(e->next.load(std::memory_order_relaxed), std::memory_order_release);
+            epoch_retire(e);
+            _size--;
+            return;
+        }
+        link = &e->next;
+    }
+}
+
+std::vector<uint64_t>::const_iterator dir_children::lower_bound(uint64_t ino) const {
+    return std::lower_bound(_inos.begin(), _inos.end(), ino,
+                            [] (uint64_t a, uint64_t b) { return (a & ~REMOVED) < b; });
+}
+
+// Compacting once half of the list is removed costs constant time for each
+// removal, amortized.
+void dir_children::erase(uint64_t ino) {
+    auto it = _inos.begin() + (lower_bound(ino) - _inos.cbegin());
+    *it |= REMOVED;
+    if (++_removed * 2 >= _inos.size()) {
+        _inos.erase(std::remove_if(_inos.begin(), _inos.end(),
+                                   [] (uint64_t i) { return (i & REMOVED) != 0; }),
+                    _inos.end());
+        _removed = 0;
+    }
+}
+
+ghost_inode::ghost_inode(uint64_t ino, uint64_t parent, std::string name)
+    : ino(ino)
+    , parent(parent)
+    , name(std::move(name)) {}
+
+bool ghost_inode::is_dir() const {
+    return dir != nullptr;
+}
+
+ghost_namespace::ghost_namespace()
+    : _chunks(new std::atomic<std::atomic<ghost_inode*>*>[INODE_CHUNKS]) {
+    for (size_t i = 0; i < INODE_CHUNKS; i++) {
+        _chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+    ghost_inode* root = new ghost_inode(GHOST_ROOT_INO, GHOST_ROOT_INO, std::string());
+    root->dir.reset(new ghost_dir);
+    set_inode(_next_ino++, root);
+}
+
+ghost_namespace::~ghost_namespace() {
+    for (size_t i = 0; i < INODE_CHUNKS; i++) {
+        std::atomic<ghost_inode*>* chunk = _chunks[i].load(std::memory_order_relaxed);
+        if (!chunk) {
+            break;
+        }
+        for (size_t j = 0; j < INODE_CHUNK_SIZE; j++) {
+            delete chunk[j].load(std::memory_order_relaxed);
+        }
+        delete[] chunk;
+    }
+    epoch_reclaim();
+}
+
+void ghost_namespace::set_inode(uint64_t ino, ghost_inode* inode) {
+    uint64_t index = ino - GHOST_ROOT_INO;
+    auto& slot = _chunks[index / INODE_CHUNK_SIZE];
+
+    std::atomic<ghost_inode*>* chunk = slot.load(std::memory_order_relaxed);
+    if (!chunk) {
+        chunk = new std::atomic<ghost_inode*>[INODE_CHUNK_SIZE];
+        for (size_t i = 0; i < INODE_CHUNK_SIZE; i++) {
+            chunk[i].store(nullptr, std::memory_order_relaxed);
+        }
+        slot.store(chunk, std::memory_order_release);
+    }
+    chunk[index % INODE_CHUNK_SIZE].store(inode, std::memory_order_release);
+}
+
+ghost_inode *ghost_namespace::find_inode(uint64_t ino) {
+    if (ino < GHOST_ROOT_INO) {
+        return nullptr;
+    }
+    uint64_t index = ino - GHOST_ROOT_INO;
+    if (index / INODE_CHUNK_SIZE >= INODE_CHUNKS) {
+        return nullptr;
+    }
+    std::atomic<ghost_inode*>* chunk = _chunks[index / INODE_CHUNK_SIZE].load(std::memory_order_acquire);
+    if (!chunk) {
+        return nullptr;
+    }
+    return chunk[index % INODE_CHUNK_SIZE].load(std::memory_order_acquire);
+}
+
+void ghost_namespace::set_manifest(std::unique_ptr<manifest> m, cache& c,
+                                   std::function<void (const std::shared_ptr<ghost_file>&)> resolve) {
+    ghost_inode* root = find_inode(GHOST_ROOT_INO);
+
+    _manifest = std::move(m);
+    _cache = &c;
+    _resolve = std::move(resolve);
+    root->dir->manifest_path = "/";
+    root->dir->materialized = false;
+}
+
+void ghost_namespace::set_fetch_context_observer(
+        std::function<void (const std::shared_ptr<ghost_file>&)> on_fetch_context) {
+    _on_fetch_context = std::move(on_fetch_context);
+}
+
+void ghost_namespace::set_attributes(const std::shared_ptr<ghost_file>& file,
+                                     std::unordered_map<std::string, std::string> attributes) {
+    file->set_attributes(std::move(attributes));
+    if (_on_fetch_context) {
+        _on_fetch_context(file);
+    }
+}
+
+// Return child named name of directory dir, creating it if it's only listed
+// by the manifest, or nullptr if there is none. locked tells whether caller
+// holds the mutex.
+ghost_inode *ghost_namespace::child(ghost_inode* dir, const char *name, size_t len, bool locked) {
+    ghost_inode* inode = dir->dir->index.find(name, len);
+    if (inode || dir->dir->materialized.load(std::memory_order_acquire)) {
+        return inode;
+    }
+    if (locked) {
+        return materialize_child(dir, name, len);
+    }
+    std::lock_guard<std::mutex> lock(_mtx);
+    return materialize_child(dir, name, len);
+}
+
+// Return directory at path, up to end, or nullptr if there is none.
+ghost_inode *ghost_namespace::walk(const char *path, const char *end, bool locked) {
+    ghost_inode* inode = find_inode(GHOST_ROOT_INO);
+
+    while (path < end) {
+        if (*path == '/') {
+            path++;
+            continue;
+        }
+        const char* next = std::find(path, end, '/');
+        inode = child(inode, path, next - path, locked);
+        path = next;
+
+        if (!inode || !inode->is_dir()) {
+            return nullptr;
+        }
+    }
+    return inode;
+}
+
+// Create child name of dir, which is a directory if file is nullptr, and
+// publish it by number before publishing it by name, so that whoever finds
+// it by name can also find it by number. A directory listed by the manifest
+// is given its path in the manifest. Return nullptr if inode table is full.
+ghost_inode *ghost_namespace::insert_inode(ghost_inode* dir, std::string name,
+                                           std::shared_ptr<ghost_file> file,
+                                           std::string manifest_path) {
+    if ((_next_ino - GHOST_ROOT_INO) / INODE_CHUNK_SIZE >= INODE_CHUNKS) {
+        return nullptr;
+    }
+    uint64_t ino = _next_ino++;
+    ghost_inode* inode = new ghost_inode(ino, dir->ino, std::move(name));
+    if (file) {
+        file->set_ino(ino);
+        inode->file = std::move(file);
+    } else {
+        inode->dir.reset(new ghost_dir);
+        if (!manifest_path.empty()) {
+            inode->dir->manifest_path = std::move(manifest_path);
+            inode->dir->materialized = false;
+        }
+        dir->dir->subdirs++;
+    }
+    set_inode(ino, inode);
+    dir->dir->index.insert(inode);
+    dir->dir->children.push_back(ino);
+    return inode;
+}
+
+int ghost_namespace::add_inode(uint64_t parent, const char *name, std::shared_ptr<ghost_file> file,
+                               ghost_inode **inode) {
+    ghost_inode* dir = find_inode(parent);
+    if (!dir) {
+        return -ENOENT;
+    }
+    if (!dir->is_dir()) {
+        return -ENOTDIR;
+    }
+
+    ghost_inode* existing = child(dir, name, strlen(name), true);
+    if (existing) {
+        *inode = existing;
+        return -EEXIST;
+    }
+    *inode = insert_inode(dir, std::string(name), std::move(file), std::string());
+    return *inode ? 0 : -ENOSPC;
+}
+
+// Inode is unpublished and then retired, so lookups in flight can keep using it.
+void ghost_namespace::remove_inode(ghost_inode* dir, ghost_inode* inode) {
+    dir->dir->children.erase(inode->ino);
+    if (inode->is_dir()) {
+        dir->dir->subdirs--;
+    }
+    dir->dir->index.erase(inode);
+    set_inode(inode->ino, nullptr);
+    epoch_retire(inode);
+}
+
+// Create file from entry i of the manifest. Its length is asked to the origin
+// if the manifest doesn't have it, in background unless there is no resolver.
+ghost_inode *ghost_namespace::materialize_file(ghost_inode* dir, std::string name, uint64_t i) {
+    manifest_file entry;
+    if (!_manifest->get(i, entry)) {
+        return nullptr;
+    }
+
+    auto file = std::make_shared<ghost_file>();
+    entry.attributes["url"] = std::move(entry.url);
+    set_attributes(file, std::move(entry.attributes));
+
+    std::shared_ptr<fetch_context> ctx = file->get_fetch_context();
+    if (entry.has_length) {
+        file->update_length(entry.length, *_cache);
+        file->set_validator(std::move(entry.validator));
+    } else if (ctx && !_resolve) {
+        remote_metadata metadata;
+        ctx->handler->get_metadata(*ctx, metadata);
+        file->update_length(metadata.length, *_cache);
+        file->set_validator(std::move(metadata.validator));
+    }
+
+    // File is marked before being published, so that nobody sees its length
+    // before it's resolved.
+    bool resolve = !entry.has_length && ctx && _resolve;
+    file->set_resolving(resolve);
+
+    ghost_inode* inode = insert_inode(dir, std::move(name), file, std::string());
+    if (inode && resolve) {
+        _resolve(file);
+    }
+    return inode;
+}
+
+// Whether path of entry i of the manifest starts with prefix, or is equal to
+// it if exact is set.
+static bool entry_matches(const manifest& m, uint64_t i, const std::string& prefix, bool exact) {
+    size_t len;
+    const char* path = (i < m.size()) ? m.path(i, len) : nullptr;
+    return path && len >= prefix.size() && (!exact || len == prefix.size())
+        && !memcmp(path, prefix.data(), prefix.size());
+}
+
+// Create child name of dir if the manifest lists it, either as a file or as a
+// directory, i.e. as prefix of other paths or as an entry of its own. Mutex
+// must be held.
+ghost_inode *ghost_namespace::materialize_child(ghost_inode* dir, const char *name, size_t len) {
+    ghost_inode* inode = dir->dir->index.find(name, len);
+    if (inode || dir->dir->materialized.load(std::memory_order_relaxed)) {
+        return inode;
+    }
+
+    std::string path = dir->dir->manifest_path;
+    path.append(name, len);
+    uint64_t i = _manifest->lower_bound(path.data(), path.size());
+    bool exact = entry_matches(*_manifest, i, path, true);
+    path += '/';
+    if (exact && _manifest->is_dir(i)) {
+        return insert_inode(dir, std::string(name, len), nullptr, std::move(path));
+    }
+    if (exact) {
+        return materialize_file(dir, std::string(name, len), i);
+    }
+
+    i = _manifest->lower_bound(path.data(), path.size());
+    if (entry_matches(*_manifest, i, path, false)) {
+        return insert_inode(dir, std::string(name, len), nullptr, std::move(path));
+    }
+    return nullptr;
+}
+
+// Create every child of dir listed by the manifest. Entries below a child
+// directory are skipped with a single search, so it takes time proportional
+// to the number of children. Mutex must be held.
+void ghost_namespace::materialize_dir(ghost_inode* dir) {
+    if (dir->dir->materialized.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    const std::string& prefix = dir->dir->manifest_path;
+    uint64_t i = _manifest->lower_bound(prefix.data(), prefix.size());
+
+    while (i < _manifest->size()) {
+        size_t len;
+        const char* path = _manifest->path(i, len);
+        if (!path) {
+            i++;
+            continue;
+        }
+        if (len < prefix.size() || memcmp(path, prefix.data(), prefix.size())) {
+            break;
+        }
+
+        const char* name = path + prefix.size();
+        const char* end = path + len;
+        const char* slash = std::find(name, end, '/');
+        if (name == slash) {
+            i++;
+            continue;
+        }
+        bool exists = dir->dir->index.find(name, slash - name);
+
+        if (slash == end) {
+            if (!exists && _manifest->is_dir(i)) {
+                insert_inode(dir, std::string(name, end), nullptr, std::string(path, end) + '/');
+            } else if (!exists) {
+                materialize_file(dir, std::string(name, end), i);
+            }
+            i++;
+        } else {
+            std::string child_path(path, slash + 1);
+            if (!exists) {
+                insert_inode(dir, std::string(name, slash), nullptr, child_path);
+            }
+            // Skip entries below the child directory, as '0' follows '/'.
+            child_path.back() = '0';
+            i = _manifest->lower_bound(child_path.data(), child_path.size());
+        }
+    }
+    dir->dir->materialized.store(true, std::memory_order_release);
+}
+
+// Add file, or directory if file is nullptr, at path. Return whether it was
+// created.
+bool ghost_namespace::add_path(const char *path, std::shared_ptr<ghost_file> file) {
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    epoch_guard guard;
+    std::lock_guard<std::mutex> lock(_mtx);
+    ghost_inode* dir = walk(path, name, true);
+    ghost_inode* inode;
+
+    return dir && add_inode(dir->ino, name, std::move(file), &inode) == 0;
+}
+
+std::shared_ptr<ghost_file> ghost_namespace::add_file(const char *file_path, const char *content) {
+    auto file = std::make_shared<ghost_file>(content);
+    return add_path(file_path, file) ? file : nullptr;
+}
+
+std::shared_ptr<ghost_file> ghost_namespace::add_file(const char *file_path) {
+    auto file = std::make_shared<ghost_file>();
+    return add_path(file_path, file) ? file : nullptr;
+}
+
+bool ghost_namespace::add_dir(const char *dir_path) {
+    return add_path(dir_path, nullptr);
+}
+
+void ghost_namespace::remove_file(const char *file_path) {
+    const char* name = strrchr(file_path, '/');
+    name = name ? name + 1 : file_path;
+
+    epoch_guard guard;
+    std::lock_guard<std::mutex> lock(_mtx);
+    ghost_inode* dir = walk(file_path, name, true);
+    if (!dir) {
+        return;
+    }
+    materialize_dir(dir);
+    ghost_inode* inode = dir->dir->index.find(name, strlen(name));
+    if (!inode || inode->is_dir()) {
+        return;
+    }
+    remove_inode(dir, inode);
+}
+
+std::shared_ptr<ghost_file> ghost_namespace::find_file(const char *file_path) {
+    const char* name = strrchr(file_path, '/');
+    name = name ? name + 1 : file_path;
+
+    epoch_guard guard;
+    ghost_inode* dir = walk(file_path, name, false);
+    if (!dir) {
+        return nullptr;
+    }
+    ghost_inode* inode = child(dir, name, strlen(name), false);
+    return (!inode || inode->is_dir()) ? nullptr : inode->file;
+}
+
+ghost_inode *ghost_namespace::lookup(uint64_t parent, const char *name) {
+    ghost_inode* dir = find_inode(parent);
+    if (!dir || !dir->is_dir()) {
+        return nullptr;
+    }
+    return child(dir, name, strlen(name), false);
+}
+
+int ghost_namespace::create(uint64_t parent, const char *name, bool directory, ghost_inode **inode) {
+    std::lock_guard<std::mutex> lock(_mtx);
+    return add_inode(parent, name, directory ? nullptr : std::make_shared<ghost_file>(), inode);
+}
+
+// Remove empty directory named name in dir. Mutex must be held.
+int ghost_namespace::remove_child_dir(ghost_inode* dir, const char *name) {
+    if (!dir) {
+        return -ENOENT;
+    }
+    if (!dir->is_dir()) {
+        return -ENOTDIR;
+    }
+    materialize_dir(dir);
+    ghost_inode* inode = dir->dir->index.find(name, strlen(name));
+    if (!inode) {
+        return -ENOENT;
+    }
+    if (!inode->is_dir()) {
+        return -ENOTDIR;
+    }
+    materialize_dir(inode);
+    if (!inode->dir->children.empty()) {
+        return -ENOTEMPTY;
+    }
+    remove_inode(dir, inode);
+    return 0;
+}
+
+int ghost_namespace::remove_dir(uint64_t parent, const char *name) {
+    epoch_guard guard;
+    std::lock_guard<std::mutex> lock(_mtx);
+    return remove_child_dir(find_inode(parent), name);
+}
+
+int ghost_namespace::remove_dir(const char *dir_path) {
+    const char* name = strrchr(dir_path, '/');
+    name = name ? name + 1 : dir_path;
+
+    epoch_guard guard;
+    std::lock_guard<std::mutex> lock(_mtx);
+    return remove_child_dir(walk(dir_path, name, true), name);
+}
+
+std::string ghost_namespace::path(uint64_t ino) {
+    std::vector<const std::string*> names;
+
+    while (ino != GHOST_ROOT_INO) {
+        ghost_inode* inode = find_inode(ino);
+        if (!inode) {
+            return std::string();
+        }
+        names.push_back(&inode->name);
+        ino = inode->parent;
+    }
+    if (names.empty()) {
+        return "/";
+    }
+
+    std::string path;
+    for (auto it = names.rbegin(); it != names.rend(); it++) {
+        path += '/';
+        path += **it;
+    }
+    return path;
+}
+
+bool ghost_namespace::for_each_child(uint64_t ino, uint64_t first_ino,
+                                     const std::function<bool (const char*, ghost_inode&)>& func) {
+    epoch_guard guard;
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    ghost_inode* dir = find_inode(ino);
+    if (!dir || !dir->is_dir()) {
+        return false;
+    }
+    materialize_dir(dir);
+    dir->dir->children.for_each(first_ino, [&] (uint64_t child_ino) {
+        ghost_inode* child = find_inode(child_ino);
+        return func(child->name.c_str(), *child);
+    });
+    return true;
+}
+
+// Copy entries of the manifest below unmaterialized dir, unless they're
+// shadowed by a child created in memory, which gets visited on its own.
+void ghost_namespace::snapshot_manifest(ghost_inode* dir, std::vector<manifest_file>& files) {
+    const std::string& prefix = dir->dir->manifest_path;
+    uint64_t i = _manifest->lower_bound(prefix.data(), prefix.size());
+
+    while (entry_matches(*_manifest, i, prefix, false)) {
+        size_t len;
+        const char* path = _manifest->path(i, len);
+        const char* name = path + prefix.size();
+        const char* slash = std::find(name, path + len, '/');
+
+        if (name == slash) {
+            i++;
+        } else if (!dir->dir->index.find(name, slash - name)) {
+            manifest_file file;
+            if (_manifest->get(i, file)) {
+                files.push_back(std::move(file));
+            }
+            i++;
+        } else if (slash == path + len) {
+            i++;
+        } else {
+            std::string child_path(path, slash);
+            child_path += '0';
+            i = _manifest->lower_bound(child_path.data(), child_path.size());
+        }
+    }
+}
+
+// Directories are listed even if they aren't empty, which costs an entry
+// each and saves finding out whether they are.
+void ghost_namespace::snapshot(std::vector<manifest_file>& files) {
+    epoch_guard guard;
+    std::lock_guard<std::mutex> lock(_mtx);
+    std::vector<std::pair<ghost_inode*, std::string>> dirs;
+
+    dirs.emplace_back(find_inode(GHOST_ROOT_INO), std::string());
+    while (!dirs.empty()) {
+        ghost_inode* dir = dirs.back().first;
+        std::string dir_path = std::move(dirs.back().second);
+        dirs.pop_back();
+
+        if (!dir->dir->materialized.load(std::memory_order_relaxed)) {
+            snapshot_manifest(dir, files);
+        }
+        dir->dir->children.for_each(0, [&] (uint64_t ino) {
+            ghost_inode* inode = find_inode(ino);
+            std::string path = dir_path + '/' + inode->name;
+
+            if (inode->is_dir()) {
+                manifest_file entry;
+                entry.path = path;
+                entry.is_dir = true;
+                files.push_back(std::move(entry));
+                dirs.emplace_back(inode, std::move(path));
+                return true;
+            }
+            ghost_file& file = *inode->file;
+            if (file.is_static()) {
+                return true;
+            }
+            manifest_file entry;
+            entry.path = std::move(path);
+            entry.attributes = *file.attributes();
+            auto url = entry.attributes.find("url");
+            if (url != entry.attributes.end()) {
+                entry.url = std::move(url->second);
+                entry.attributes.erase(url);
+            }
+            entry.has_length = !file.resolving();
+            if (entry.has_length) {
+                entry.length = file.length();
+                entry.validator = file.validator();
+            }
+            files.push_back(std::move(entry));
+            return true;
+        });
+    }
+}
+
+void ghost_namespace::for_each_file(const std::function<void (const std::shared_ptr<ghost_file>&)>& func) {
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    for (uint64_t ino = GHOST_ROOT_INO; ino < _next_ino; ino++) {
+        ghost_inode* inode = find_inode(ino);
+        if (inode && !inode->is_dir()) {
+            func(inode->file);
+        }
+    }
+}
@@ -0,0 +1,244 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef GHOST_NAMESPACE_H
+#define GHOST_NAMESPACE_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "epoch.h"
+#include "ghost_file.h"
+#include "manifest.h"
+
+// Inode of root directory.
+#define GHOST_ROOT_INO 1
+
+// Inode table is made of up to INODE_CHUNKS chunks of INODE_CHUNK_SIZE inodes.
+#define INODE_CHUNK_SIZE 4096
+#define INODE_CHUNKS (1 << 16)
+
+struct ghost_inode;
+
+// Index from name to child of a directory. Lookups take no lock and must be
+// done under an epoch_guard, while updates are serialized by the caller.
+// Chains are changed so that a concurrent lookup sees either the old or the
+// new chain, and buckets are replaced as a whole when the index grows.
+struct dir_index {
+private:
+    struct entry {
+        size_t hash;
+        ghost_inode* inode;
+        std::atomic<entry*> next;
+    };
+    struct table {
+        size_t mask;
+        std::unique_ptr<std::atomic<entry*>[]> buckets;
+
+        explicit table(size_t size);
+    };
+    std::atomic<table*> _table;
+    size_t _size = 0;
+
+    void grow();
+    static void free_table(table* t);
+public:
+    dir_index();
+    ~dir_index();
+
+    dir_index(const dir_index&) = delete;
+    dir_index& operator=(const dir_index&) = delete;
+
+    // Return child named name, or nullptr if there is none.
+    ghost_inode* find(const char* name, size_t len) const;
+
+    // Add inode, unless there is a child with the same name.
+    bool insert(ghost_inode* inode);
+
+    void erase(ghost_inode* inode);
+};
+
+// Inode numbers of children of a directory, in increasing order. Removed
+// children are only marked, and dropped all at once when they're half of the
+// list, so that emptying a large directory doesn't take quadratic time.
+// Updates and iterations are serialized by the caller.
+struct dir_children {
+private:
+    // Set on inode number of a removed child.
+    static const uint64_t REMOVED = uint64_t(1) << 63;
+    std::vector<uint64_t> _inos;
+    size_t _removed = 0;
+
+    std::vector<uint64_t>::const_iterator lower_bound(uint64_t ino) const;
+public:
+    // Inode numbers only grow, so a new child goes last.
+    void push_back(uint64_t ino) {
+        _inos.push_back(ino);
+    }
+
+    void erase(uint64_t ino);
+
+    bool empty() const {
+        return _inos.size() == _removed;
+    }
+
+    // Call func with every child from inode number first_ino on, until it
+    // returns false.
+    template <typename Func>
+    void for_each(uint64_t first_ino, Func func) const {
+        for (auto it = lower_bound(first_ino); it != _inos.end(); it++) {
+            if (!(*it & REMOVED) && !func(*it)) {
+                return;
+            }
+        }
+    }
+};
+
+// Children of a directory. Listings go through children, which is sorted by
+// inode number. As inode numbers only grow, a child is appended on creation,
+// and a listing can resume from the inode number of the next child, even if
+// children were created or removed in the meantime.
+struct ghost_dir {
+    dir_index index;
+    dir_children children;
+    // Number of children which are directories.
+    std::atomic<size_t> subdirs { 0 };
+    // Whether every child listed by the manifest was created, in which case
+    // the manifest is no longer looked at, see ghost_namespace.
+    std::atomic<bool> materialized { true };
+    // Path of the directory in the manifest, followed by a slash.
+    std::string manifest_path;
+};
+
+// Entry of the namespace, which is either a file or a directory.
+struct ghost_inode {
+    uint64_t ino;
+    uint64_t parent;
+    std::string name;
+    // Set for directories only.
+    std::unique_ptr<ghost_dir> dir;
+    // Set for files only. Open files and background fetches hold a reference,
+    // so that a file outlives its removal from the namespace.
+    std::shared_ptr<ghost_file> file;
+
+    ghost_inode(uint64_t ino, uint64_t parent, std::string name);
+
+    bool is_dir() const;
+};
+
+// Tree of files and directories. Inodes are looked up, either by inode number
+// or by name, without taking any lock. Lookups must be done under an
+// epoch_guard, which must be held for as long as returned inodes are used.
+// Updates and listings are serialized by a mutex. Removed inodes are retired,
+// so they stay valid until lookups that could have seen them are done.
+// Files listed by a manifest are created on their first lookup, so a lookup
+// that misses in a directory not yet materialized falls back to the manifest
+// under the mutex. A directory gets materialized before it's listed or any
+// of its children is removed, so that removed children don't come back.
+struct ghost_namespace {
+private:
+    // Chunks are never moved nor freed while the namespace exists, so that
+    // looking up an inode number takes two loads.
+    std::unique_ptr<std::atomic<std::atomic<ghost_inode*>*>[]> _chunks;
+    uint64_t _next_ino = GHOST_ROOT_INO;
+    std::mutex _mtx;
+    std::unique_ptr<manifest> _manifest;
+    cache* _cache = nullptr;
+    std::function<void (const std::shared_ptr<ghost_file>&)> _resolve;
+    std::function<void (const std::shared_ptr<ghost_file>&)> _on_fetch_context;
+
+    void set_inode(uint64_t ino, ghost_inode* inode);
+    ghost_inode* child(ghost_inode* dir, const char* name, size_t len, bool locked);
+    ghost_inode* walk(const char* path, const char* end, bool locked);
+    ghost_inode* insert_inode(ghost_inode* dir, std::string name, std::shared_ptr<ghost_file> file,
+                              std::string manifest_path);
+    int add_inode(uint64_t parent, const char* name, std::shared_ptr<ghost_file> file,
+                  ghost_inode** inode);
+    ghost_inode* materialize_file(ghost_inode* dir, std::string name, uint64_t i);
+    ghost_inode* materialize_child(ghost_inode* dir, const char* name, size_t len);
+    void materialize_dir(ghost_inode* dir);
+    void remove_inode(ghost_inode* dir, ghost_inode* inode);
+    int remove_child_dir(ghost_inode* dir, const char* name);
+    bool add_path(const char* path, std::shared_ptr<ghost_file> file);
+    void snapshot_manifest(ghost_inode* dir, std::vector<manifest_file>& files);
+public:
+    ghost_namespace();
+    ~ghost_namespace();
+
+    // Serve files listed by m, whose content is split in blocks of cache c.
+    // Files whose length isn't listed are given to resolve, or resolved
+    // synchronously if it's empty. Must be called before the namespace gets
+    // used.
+    void set_manifest(std::unique_ptr<manifest> m, cache& c,
+                      std::function<void (const std::shared_ptr<ghost_file>&)> resolve);
+
+    // Call on_fetch_context with each file whose fetch context gets replaced
+    // by set_attributes(). Must be called before the namespace gets used.
+    void set_fetch_context_observer(
+        std::function<void (const std::shared_ptr<ghost_file>&)> on_fetch_context);
+
+    // Replace all attributes of file at once, and with them its fetch context.
+    void set_attributes(const std::shared_ptr<ghost_file>& file,
+                        std::unordered_map<std::string, std::string> attributes);
+
+    // Add file at file_path, whose parent directory must exist. Return the
+    // file, or nullptr if it can't be created.
+    std::shared_ptr<ghost_file> add_file(const char* file_path, const char* content);
+
+    std::shared_ptr<ghost_file> add_file(const char* file_path);
+
+    // Add directory at dir_path, whose parent directory must exist. Return
+    // whether it was created.
+    bool add_dir(const char* dir_path);
+
+    void remove_file(const char* file_path);
+
+    // Return file stored at file_path, or nullptr if there is none.
+    std::shared_ptr<ghost_file> find_file(const char* file_path);
+
+    // Return inode named name in directory parent, or nullptr if there is none.
+    ghost_inode* lookup(uint64_t parent, const char* name);
+
+    // Return inode ino, or nullptr if there is none.
+    ghost_inode* find_inode(uint64_t ino);
+
+    // Create a file or directory named name in directory parent, and store
+    // it in inode. Return 0 on success, or a negative error, -EEXIST meaning
+    // that inode stores the existing entry.
+    int create(uint64_t parent, const char* name, bool directory, ghost_inode** inode);
+
+    // Remove empty directory named name in directory parent. Return 0 on
+    // success, or a negative error.
+    int remove_dir(uint64_t parent, const char* name);
+
+    int remove_dir(const char* dir_path);
+
+    // Return path of inode ino, or an empty string if there is none. Caller
+    // must hold an epoch_guard.
+    std::string path(uint64_t ino);
+
+    // Call func with name and inode of each child of directory ino whose
+    // inode number is at least first_ino, in inode order, until func returns
+    // false. Return whether ino is a directory.
+    bool for_each_child(uint64_t ino, uint64_t first_ino,
+                        const std::function<bool (const char*, ghost_inode&)>& func);
+
+    // Call func with each file.
+    void for_each_file(const std::function<void (const std::shared_ptr<ghost_file>&)>& func);
+
+    // Store every file and directory in files, in the format of a manifest,
+    // except static files. Files still listed only by the manifest are
+    // copied from it, without getting created.
+    void snapshot(std::vector<manifest_file>& files);
+};
+
+#endif // GHOST_NAMESPACE_H
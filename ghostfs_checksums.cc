@@ -0,0 +1,51 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// Print the sidecar with checksums of blocks of a local copy of an object,
+// see load_block_checksums(), given the block size (in KB) ghostfs uses.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+
+#include "checksum.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <block_kb> <file>\n", argv[0]);
+        return 1;
+    }
+
+    size_t block_size = strtoul(argv[1], nullptr, 10) * 1024;
+    if (!block_size) {
+        fprintf(stderr, "Invalid block size %s\n", argv[1]);
+        return 1;
+    }
+    FILE* in = fopen(argv[2], "rb");
+    if (!in) {
+        fprintf(stderr, "Unable to open %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    std::unique_ptr<char[]> data(new char[block_size]);
+    size_t size;
+    printf("%lu\n", (unsigned long) block_size);
+    while ((size = fread(data.get(), 1, block_size, in)) > 0) {
+        printf("%08x\n", crc32c(data.get(), size));
+    }
+    bool failed = ferror(in);
+    fclose(in);
+    if (failed) {
+        fprintf(stderr, "Unable to read %s\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
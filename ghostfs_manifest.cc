@@ -0,0 +1,49 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// Convert a manifest in text format, see parse_text_manifest(), to the binary
+// format given to ghostfs with -o manifest=<file>.
+
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+
+#include "manifest.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <text manifest|-> <manifest>\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<manifest_file> files;
+    int line;
+    if (strcmp(argv[1], "-") == 0) {
+        line = parse_text_manifest(std::cin, files);
+    } else {
+        std::ifstream in(argv[1]);
+        if (!in) {
+            fprintf(stderr, "Unable to open %s\n", argv[1]);
+            return 1;
+        }
+        line = parse_text_manifest(in, files);
+    }
+    if (line) {
+        fprintf(stderr, "%s:%d: invalid entry\n", argv[1], line);
+        return 1;
+    }
+
+    int res = write_manifest(argv[2], std::move(files));
+    if (res < 0) {
+        fprintf(stderr, "Unable to write %s: %s\n", argv[2], strerror(-res));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,352 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// Replay reads recorded by ghostfs with -o trace=<file>,trace_level=2 against
+// the cache with different block sizes, cache sizes and prefetch windows, and
+// an origin simulated as a latency and a bandwidth, and print hit ratio, bytes
+// fetched from origin and read latency of each configuration.
+//
+// Time is simulated, so replaying is deterministic and takes no longer than
+// the simulation itself, at whatever speed. Reads are replayed in the order
+// they were recorded, each one starting at the time it was recorded, divided
+// by speed, or once the previous read of its thread is done if that's later.
+// Speed 0 replays every thread back to back. Blocks missing from cache are
+// fetched with a single request, as by read_file(), and subsequent blocks
+// are prefetched with another once the read is done.
+//
+// Usage: ghostfs_replay [-b block KB,...] [-c cache MB,...] [-p prefetch blocks,...]
+//                       [-s speed] [-l latency ms] [-w bandwidth MB/s] <trace>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cache.h"
+#include "ghost_fs.h"
+#include "metrics.h"
+#include "trace.h"
+#include "utils.h"
+
+// Latency of origin if neither given nor recorded, in ms.
+#define REPLAY_DEFAULT_LATENCY 50
+
+struct replay_origin {
+    uint64_t latency_ns;
+    // Bytes per second, unlimited if zero.
+    uint64_t bandwidth;
+
+    uint64_t fetch_time(uint64_t bytes) const {
+        return latency_ns + (bandwidth ? bytes * 1000000000 / bandwidth : 0);
+    }
+};
+
+struct replay_config {
+    size_t block_size;
+    size_t cache_blocks;
+    size_t prefetch_window;
+};
+
+struct replay_result {
+    uint64_t reads = 0;
+    uint64_t read_hits = 0;
+    uint64_t block_hits = 0;
+    uint64_t block_misses = 0;
+    uint64_t origin_bytes = 0;
+    uint64_t prefetched = 0;
+    uint64_t prefetch_hits = 0;
+    uint64_t prefetch_wasted = 0;
+    latency_histogram latency;
+};
+
+// File as seen by the cache, with the time at which each of its blocks is
+// fetched, which is later than the current time while a fetch is in flight.
+struct replay_file {
+    uint64_t length = 0;
+    std::vector<block_info> blocks;
+    std::vector<uint64_t> ready;
+};
+
+struct replay_trace {
+    std::vector<trace_record> reads;
+    // Length of files, as recorded when opened, or as far as they were read.
+    std::unordered_map<uint64_t, uint64_t> lengths;
+    uint64_t dropped = 0;
+};
+
+static int load_trace(const char* path, replay_trace& trace) {
+    std::vector<trace_record> records;
+    int res = read_trace(path, records);
+    if (res < 0) {
+        return res;
+    }
+
+    for (auto& r : records) {
+        if (r.event == TRACE_DROPPED) {
+            trace.dropped += r.value;
+        } else if (r.event == TRACE_OPEN) {
+            trace.lengths[r.ino] = std::max(trace.lengths[r.ino], r.value);
+        } else if (r.event == TRACE_ACCESS && r.value) {
+            trace.reads.push_back(r);
+            trace.lengths[r.ino] = std::max(trace.lengths[r.ino], r.block + r.value);
+        }
+    }
+    return 0;
+}
+
+// Fetch blk_ids of file at time now with a single request, and return when
+// they're ready.
+static uint64_t fetch(replay_file& file, const std::vector<size_t>& blk_ids, uint64_t now,
+                      const replay_config& config, const replay_origin& origin,
+                      replay_result& result) {
+    uint64_t bytes = 0;
+    for (auto blk_id : blk_ids) {
+        uint64_t start = blk_id * config.block_size;
+        bytes += std::min<uint64_t>(file.length, start + config.block_size) - start;
+    }
+    uint64_t ready = now + origin.fetch_time(bytes);
+
+    for (auto blk_id : blk_ids) {
+        file.ready[blk_id] = ready;
+    }
+    result.origin_bytes += bytes;
+    return ready;
+}
+
+static void replay(const replay_trace& trace, const replay_config& config, double speed,
+                   const replay_origin& origin, replay_result& result) {
+    cache c(config.cache_blocks, config.block_size);
+    read_metrics& metrics = get_read_metrics();
+    uint64_t wasted_before = metrics.prefetch_wasted.value();
+
+    std::unordered_map<uint64_t, replay_file> files;
+    for (auto& it : trace.lengths) {
+        replay_file& file = files[it.first];
+        size_t blocks = (it.second + config.block_size - 1) / config.block_size;
+        file.length = it.second;
+        file.blocks = std::vector<block_info>(blocks);
+        file.ready.assign(blocks, 0);
+    }
+
+    uint64_t first_timestamp = trace.reads.empty() ? 0 : trace.reads.front().timestamp;
+    std::unordered_map<uint32_t, uint64_t> thread_done;
+    std::vector<size_t> missing;
+    std::vector<size_t> prefetched;
+
+    for (auto& r : trace.reads) {
+        uint64_t arrival = speed ? (r.timestamp - first_timestamp) / speed : 0;
+        uint64_t now = std::max(arrival, thread_done[r.thread]);
+        replay_file& file = files[r.ino];
+        size_t first_blk_id = r.block / config.block_size;
+        size_t last_blk_id = (r.block + r.value - 1) / config.block_size;
+        uint64_t done = now;
+        missing.clear();
+
+        for (size_t blk_id = first_blk_id; blk_id <= last_blk_id; blk_id++) {
+            block_info& info = file.blocks[blk_id];
+
+            if (!info._present) {
+                result.block_misses++;
+                c.allocate_block(&info);
+                missing.push_back(blk_id);
+                continue;
+            }
+            result.block_hits++;
+            c.lock_block(info._blk);
+            // Block may still be being prefetched.
+            done = std::max(done, file.ready[blk_id]);
+            if (info._prefetched) {
+                result.prefetch_hits++;
+                info._prefetched = false;
+            }
+        }
+
+        if (!missing.empty()) {
+            done = std::max(done, fetch(file, missing, now, config, origin, result));
+        } else {
+            result.read_hits++;
+        }
+        result.reads++;
+        result.latency.record(done - now);
+        thread_done[r.thread] = done;
+
+        for (size_t blk_id = first_blk_id; blk_id <= last_blk_id; blk_id++) {
+            c.unlock_block(file.blocks[blk_id]._blk);
+        }
+
+        // Prefetch blocks following the read which aren't cached, as
+        // reserve_blocks() does.
+        size_t end = std::min(last_blk_id + 1 + config.prefetch_window, file.blocks.size());
+        prefetched.clear();
+        for (size_t blk_id = last_blk_id + 1; blk_id < end; blk_id++) {
+            block_info& info = file.blocks[blk_id];
+            if (!info._present) {
+                c.allocate_block(&info);
+                info._prefetched = true;
+                prefetched.push_back(blk_id);
+            }
+        }
+        if (!prefetched.empty()) {
+            fetch(file, prefetched, done, config, origin, result);
+            for (auto blk_id : prefetched) {
+                c.unlock_block(file.blocks[blk_id]._blk);
+            }
+            result.prefetched += prefetched.size();
+        }
+    }
+
+    result.prefetch_wasted = metrics.prefetch_wasted.value() - wasted_before;
+}
+
+static bool parse_list(const char* arg, std::vector<size_t>& values) {
+    values.clear();
+    for (auto& value : split(arg, ',')) {
+        char* end;
+        values.push_back(strtoul(value.c_str(), &end, 10));
+        if (value.empty() || *end) {
+            return false;
+        }
+    }
+    return !values.empty();
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-b block KB,...] [-c cache MB,...] [-p prefetch blocks,...]\n"
+            "       [-s speed] [-l latency ms] [-w bandwidth MB/s] <trace>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<size_t> block_kbs = { BLOCK_SIZE / 1024 };
+    std::vector<size_t> cache_mbs = { size_t(CACHE_SIZE) * BLOCK_SIZE / (1024 * 1024) };
+    std::vector<size_t> windows = { PREFETCH_WINDOW };
+    double speed = 1;
+    double latency_ms = -1;
+    double bandwidth_mb = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:c:p:s:l:w:")) != -1) {
+        bool valid = true;
+        switch (opt) {
+        case 'b':
+            valid = parse_list(optarg, block_kbs);
+            break;
+        case 'c':
+            valid = parse_list(optarg, cache_mbs);
+            break;
+        case 'p':
+            valid = parse_list(optarg, windows);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'l':
+            latency_ms = atof(optarg);
+            break;
+        case 'w':
+            bandwidth_mb = atof(optarg);
+            break;
+        default:
+            valid = false;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    replay_trace trace;
+    int res = load_trace(argv[optind], trace);
+    if (res < 0) {
+        fprintf(stderr, "Unable to read %s: %s\n", argv[optind], strerror(-res));
+        return 1;
+    }
+    if (trace.reads.empty()) {
+        fprintf(stderr, "%s has no reads, it must be recorded with trace_level=2 or above\n",
+                argv[optind]);
+        return 1;
+    }
+
+    // Unless given, latency of origin is the median time reads took to fetch
+    // what they missed.
+    std::vector<uint64_t> fetch_times;
+    for (auto& r : trace.reads) {
+        if (r.duration) {
+            fetch_times.push_back(r.duration);
+        }
+    }
+    replay_origin origin;
+    if (latency_ms >= 0) {
+        origin.latency_ns = latency_ms * 1e6;
+    } else if (!fetch_times.empty()) {
+        std::nth_element(fetch_times.begin(), fetch_times.begin() + fetch_times.size() / 2,
+                         fetch_times.end());
+        origin.latency_ns = fetch_times[fetch_times.size() / 2];
+    } else {
+        origin.latency_ns = REPLAY_DEFAULT_LATENCY * 1000000ul;
+    }
+    origin.bandwidth = bandwidth_mb * 1024 * 1024;
+
+    printf("Recorded %lu reads of %lu files, %.2f%% served from cache", trace.reads.size(),
+           trace.lengths.size(), 100.0 * (trace.reads.size() - fetch_times.size()) / trace.reads.size());
+    if (trace.dropped) {
+        printf(", %lu records dropped", trace.dropped);
+    }
+    printf("\nOrigin latency %.3f ms, bandwidth ", origin.latency_ns / 1e6);
+    if (origin.bandwidth) {
+        printf("%.1f MB/s", bandwidth_mb);
+    } else {
+        printf("unlimited");
+    }
+    printf(", speed %gx\n\n", speed);
+
+    printf("%8s %8s %8s %8s %8s %10s %9s %9s %9s %9s %9s %9s %9s\n", "block_kb", "cache_mb",
+           "prefetch", "read_hit", "blk_hit", "origin_mb", "pf_blocks", "pf_used", "pf_wasted",
+           "p50_ms", "p90_ms", "p99_ms", "p999_ms");
+
+    for (auto block_kb : block_kbs) {
+        // Largest read, in blocks, which must fit in cache along with the
+        // blocks prefetched after it.
+        size_t block_size = block_kb * 1024;
+        size_t max_span = 0;
+        for (auto& r : trace.reads) {
+            max_span = std::max<size_t>(max_span, (r.block + r.value - 1) / block_size
+                                        - r.block / block_size + 1);
+        }
+        for (auto cache_mb : cache_mbs) {
+            for (auto window : windows) {
+                replay_config config = { block_size, cache_mb * 1024 * 1024 / block_size, window };
+                if (!block_size || config.cache_blocks < max_span + window) {
+                    printf("%8lu %8lu %8lu  cache too small\n", block_kb, cache_mb, window);
+                    continue;
+                }
+                replay_result result;
+                replay(trace, config, speed, origin, result);
+
+                latency_histogram::snapshot s;
+                result.latency.read(s);
+                uint64_t blocks = result.block_hits + result.block_misses;
+                printf("%8lu %8lu %8lu %7.2f%% %7.2f%% %10.1f %9lu %9lu %9lu %9.3f %9.3f %9.3f %9.3f\n",
+                       block_kb, cache_mb, window, 100.0 * result.read_hits / result.reads,
+                       100.0 * result.block_hits / blocks, result.origin_bytes / (1024.0 * 1024),
+                       result.prefetched, result.prefetch_hits, result.prefetch_wasted,
+                       s.quantile(0.5) / 1e6,
+                       s.quantile(0.9) / 1e6, s.quantile(0.99) / 1e6, s.quantile(0.999) / 1e6);
+            }
+        }
+    }
+    return 0;
+}
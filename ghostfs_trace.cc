@@ -0,0 +1,40 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// Print a trace written by ghostfs with -o trace=<file>, one event per line,
+// as time in us since the first event, thread, level, event, inode, block,
+// value and duration in us.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<trace_record> records;
+    int res = read_trace(argv[1], records);
+    if (res < 0) {
+        fprintf(stderr, "Unable to read %s: %s\n", argv[1], strerror(-res));
+        return 1;
+    }
+
+    static const char* levels[] = { "off", "error", "info", "debug" };
+    uint64_t first = records.empty() ? 0 : records.front().timestamp;
+    for (auto& r : records) {
+        printf("%12.3f %6u %-5s %-14s ino=%lu block=%lu value=%lu duration=%.3f\n",
+               (r.timestamp - first) / 1e3, r.thread, levels[r.level & 3],
+               trace_event_name(r.event), r.ino, r.block, r.value, r.duration / 1e3);
+    }
+    return 0;
+}
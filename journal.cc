@@ -0,0 +1,482 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+
+#include "checksum.h"
+#include "journal.h"
+#include "utils.h"
+
+// Size of the header of a record, made of size and CRC32C of its content.
+#define RECORD_HEADER_SIZE 8
+
+static void put_u32(std::string& out, uint32_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put_u64(std::string& out, uint64_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put_string(std::string& out, const std::string& s) {
+    put_u32(out, s.size());
+    out += s;
+}
+
+// Reads fields of a record, failing once any field goes past its end.
+struct record_reader {
+    const char* p;
+    const char* end;
+
+    bool get(void* value, size_t size) {
+        if (size_t(end - p) < size) {
+            return false;
+        }
+        memcpy(value, p, size);
+        p += size;
+        return true;
+    }
+
+    bool get_string(std::string& s) {
+        uint32_t len;
+        if (!get(&len, sizeof(len)) || size_t(end - p) < len) {
+            return false;
+        }
+        s.assign(p, len);
+        p += len;
+        return true;
+    }
+};
+
+// Make a rename or creation of an entry of the directory of path durable.
+static void sync_dir(const std::string& path) {
+    std::vector<char> buf(path.begin(), path.end());
+    buf.push_back('\0');
+
+    int fd = ::open(dirname(buf.data()), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+ghost_journal::~ghost_journal() {
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+int ghost_journal::open(const char *path, ghost_namespace &files) {
+    int fd = ::open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    _path = path;
+    _fd = fd;
+    _files = &files;
+    _size = st.st_size;
+    return 0;
+}
+
+bool ghost_journal::is_open() const {
+    return _fd >= 0;
+}
+
+const std::string &ghost_journal::path() const {
+    return _path;
+}
+
+int ghost_journal::open_snapshot(manifest &m) {
+    int res = m.open((_path + ".snapshot").c_str());
+    if (res == 0) {
+        struct stat st;
+        if (stat((_path + ".snapshot").c_str(), &st) == 0) {
+            _compact_size = std::max<uint64_t>(JOURNAL_COMPACT_SIZE, st.st_size);
+        }
+    }
+    return res;
+}
+
+int ghost_journal::replay(cache& c, std::vector<std::shared_ptr<ghost_file>>& unresolved) {
+    // Files whose url changed, by path, until their metadata is found.
+    std::unordered_map<std::string, std::shared_ptr<ghost_file>> pending;
+
+    int old_records = replay_file(_path + ".old", c, pending);
+    if (old_records < 0 && old_records != -ENOENT) {
+        return old_records;
+    }
+    int records = replay_file(_path, c, pending);
+    if (records < 0) {
+        return records;
+    }
+    for (auto& file : pending) {
+        unresolved.push_back(std::move(file.second));
+    }
+    return records + std::max(old_records, 0);
+}
+
+// Apply records stored at path, dropping the first torn or corrupt record
+// along with whatever follows it.
+int ghost_journal::replay_file(const std::string& path, cache& c,
+                               std::unordered_map<std::string, std::shared_ptr<ghost_file>>& pending) {
+    if (access(path.c_str(), F_OK) < 0) {
+        return -errno;
+    }
+    std::ifstream in(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (in.bad()) {
+        return -EIO;
+    }
+
+    size_t offset = 0;
+    int records = 0;
+
+    while (data.size() - offset >= RECORD_HEADER_SIZE) {
+        uint32_t size, crc;
+        memcpy(&size, data.data() + offset, sizeof(size));
+        memcpy(&crc, data.data() + offset + sizeof(size), sizeof(crc));
+        const char* content = data.data() + offset + RECORD_HEADER_SIZE;
+        if (data.size() - offset - RECORD_HEADER_SIZE < size || size == 0
+                || crc32c(content, size) != crc) {
+            break;
+        }
+
+        record_reader r{ content + 1, content + size };
+        std::string entry_path;
+        if (!r.get_string(entry_path)) {
+            break;
+        }
+
+        switch (content[0]) {
+        case JOURNAL_FILE:
+            _files->add_file(entry_path.c_str());
+            break;
+        case JOURNAL_DIR:
+            _files->add_dir(entry_path.c_str());
+            break;
+        case JOURNAL_REMOVE:
+            _files->remove_file(entry_path.c_str());
+            _files->remove_dir(entry_path.c_str());
+            pending.erase(entry_path);
+            break;
+        case JOURNAL_ATTRIBUTES: {
+            uint32_t count;
+            if (!r.get(&count, sizeof(count))) {
+                break;
+            }
+            std::unordered_map<std::string, std::string> attributes;
+            std::string key, value;
+            for (uint32_t i = 0; i < count && r.get_string(key) && r.get_string(value); i++) {
+                attributes[key] = value;
+            }
+            std::shared_ptr<ghost_file> file = _files->find_file(entry_path.c_str());
+            if (!file) {
+                break;
+            }
+            std::string old_url = file->get_url();
+            _files->set_attributes(file, std::move(attributes));
+            if (old_url != file->get_url()) {
+                pending[entry_path] = file;
+            }
+            break;
+        }
+        case JOURNAL_METADATA: {
+            uint64_t length;
+            std::string validator;
+            std::shared_ptr<ghost_file> file = _files->find_file(entry_path.c_str());
+            if (!file || !r.get(&length, sizeof(length)) || !r.get_string(validator)) {
+                break;
+            }
+            file->update_length(length, c);
+            file->set_validator(std::move(validator));
+            pending.erase(entry_path);
+            break;
+        }
+        }
+        offset += RECORD_HEADER_SIZE + size;
+        records++;
+    }
+
+    if (offset < data.size()) {
+        log("Dropping %lu bytes of journal %s from offset %lu\n", data.size() - offset,
+            path.c_str(), offset);
+        if (truncate(path.c_str(), offset) < 0) {
+            return -errno;
+        }
+        if (path == _path) {
+            _size = offset;
+        }
+    }
+    return records;
+}
+
+// A record that couldn't be fully written is cut off, so that records
+// appended later can still be replayed.
+void ghost_journal::append(int type, const std::string &content) {
+    if (_fd < 0) {
+        return;
+    }
+    std::string record;
+    put_u32(record, content.size() + 1);
+    put_u32(record, 0);
+    record += char(type);
+    record += content;
+    uint32_t crc = crc32c(record.data() + RECORD_HEADER_SIZE, record.size() - RECORD_HEADER_SIZE);
+    memcpy(&record[sizeof(uint32_t)], &crc, sizeof(crc));
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    ssize_t res = write(_fd, record.data(), record.size());
+    if (res != ssize_t(record.size())) {
+        log("Unable to append to journal %s: %s\n", _path.c_str(),
+            (res < 0) ? strerror(errno) : "short write");
+        if (res > 0 && ftruncate(_fd, _size) < 0) {
+            log("Unable to truncate journal %s: %s\n", _path.c_str(), strerror(errno));
+        }
+        return;
+    }
+    _size += record.size();
+    if (_size >= _compact_size) {
+        _cv.notify_one();
+    }
+}
+
+// Move records to <path>.old, leaving an empty journal. If an interrupted
+// compaction left <path>.old behind, records are appended to it instead, as
+// it may hold records not covered by any snapshot yet.
+int ghost_journal::rotate() {
+    std::string old_path = _path + ".old";
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    if (access(old_path.c_str(), F_OK) == 0) {
+        int fd = ::open(old_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0) {
+            return -errno;
+        }
+        std::vector<char> buf(64 * 1024);
+        off_t offset = 0;
+        ssize_t res;
+        while ((res = pread(_fd, buf.data(), buf.size(), offset)) > 0) {
+            if (write(fd, buf.data(), res) != res) {
+                res = -1;
+                break;
+            }
+            offset += res;
+        }
+        if (res < 0 || fsync(fd) < 0) {
+            int err = errno;
+            close(fd);
+            return -err;
+        }
+        close(fd);
+        if (ftruncate(_fd, 0) < 0) {
+            return -errno;
+        }
+    } else {
+        if (rename(_path.c_str(), old_path.c_str()) < 0) {
+            return -errno;
+        }
+        int fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return -errno;
+        }
+        close(_fd);
+        _fd = fd;
+        sync_dir(_path);
+    }
+    _size = 0;
+    return 0;
+}
+
+// Records are moved aside before taking the snapshot, so that whatever is
+// recorded afterwards isn't dropped along with them, even if the snapshot
+// doesn't cover it.
+int ghost_journal::compact() {
+    if (_fd < 0) {
+        return 0;
+    }
+    int res = rotate();
+    if (res < 0) {
+        return res;
+    }
+
+    std::vector<manifest_file> files;
+    _files->snapshot(files);
+    std::string snapshot_path = _path + ".snapshot";
+    std::string tmp_path = snapshot_path + ".tmp";
+    res = write_manifest(tmp_path.c_str(), std::move(files));
+    if (res < 0) {
+        return res;
+    }
+
+    int fd = ::open(tmp_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fsync(fd) < 0 || fstat(fd, &st) < 0) {
+        int err = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -err;
+    }
+    close(fd);
+    if (rename(tmp_path.c_str(), snapshot_path.c_str()) < 0) {
+        return -errno;
+    }
+    sync_dir(_path);
+    unlink((_path + ".old").c_str());
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    _compact_size = std::max<uint64_t>(JOURNAL_COMPACT_SIZE, st.st_size);
+    log("Compacted journal %s into a snapshot of %ld bytes\n", _path.c_str(), st.st_size);
+    return 0;
+}
+
+void ghost_journal::run() {
+    std::unique_lock<std::mutex> lock(_mtx);
+
+    while (true) {
+        _cv.wait(lock, [this] { return _stopped || _size >= _compact_size; });
+        if (_stopped) {
+            return;
+        }
+        lock.unlock();
+        int res = compact();
+        if (res < 0) {
+            log("Unable to compact journal %s: %s\n", _path.c_str(), strerror(-res));
+        }
+        if (_on_compact) {
+            _on_compact();
+        }
+        lock.lock();
+        // Failing again right away is pointless, so wait for twice as much.
+        if (res < 0) {
+            _compact_size = std::max(_compact_size, _size) * 2;
+        }
+    }
+}
+
+void ghost_journal::start(std::function<void ()> on_compact) {
+    if (_fd < 0) {
+        return;
+    }
+    _on_compact = std::move(on_compact);
+    _stopped = false;
+    _compactor = std::thread(&ghost_journal::run, this);
+}
+
+void ghost_journal::stop() {
+    if (!_compactor.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _stopped = true;
+    }
+    _cv.notify_one();
+    _compactor.join();
+
+    int res = compact();
+    if (res < 0) {
+        log("Unable to compact journal %s: %s\n", _path.c_str(), strerror(-res));
+    }
+    if (_on_compact) {
+        _on_compact();
+    }
+}
+
+// Append record of the given type for entry ino, which has no other field.
+void ghost_journal::append_entry(int type, uint64_t ino) {
+    if (_fd < 0) {
+        return;
+    }
+    epoch_guard guard;
+    std::string path = _files->path(ino);
+    if (path.empty()) {
+        return;
+    }
+    std::string content;
+    put_string(content, path);
+    append(type, content);
+}
+
+void ghost_journal::add_file(uint64_t ino) {
+    append_entry(JOURNAL_FILE, ino);
+}
+
+void ghost_journal::add_dir(uint64_t ino) {
+    append_entry(JOURNAL_DIR, ino);
+}
+
+void ghost_journal::remove(uint64_t parent, const char *name) {
+    if (_fd < 0) {
+        return;
+    }
+    epoch_guard guard;
+    std::string path = _files->path(parent);
+    if (path.empty()) {
+        return;
+    }
+    if (path.back() != '/') {
+        path += '/';
+    }
+    path += name;
+
+    std::string content;
+    put_string(content, path);
+    append(JOURNAL_REMOVE, content);
+}
+
+void ghost_journal::set_attributes(const ghost_file &file) {
+    if (_fd < 0) {
+        return;
+    }
+    epoch_guard guard;
+    std::string path = _files->path(file.ino());
+    if (path.empty()) {
+        return;
+    }
+    std::string content;
+    put_string(content, path);
+    auto attributes = file.attributes();
+    put_u32(content, attributes->size());
+    for (auto& attribute : *attributes) {
+        put_string(content, attribute.first);
+        put_string(content, attribute.second);
+    }
+    append(JOURNAL_ATTRIBUTES, content);
+}
+
+void ghost_journal::set_metadata(const ghost_file &file) {
+    if (_fd < 0) {
+        return;
+    }
+    epoch_guard guard;
+    std::string path = _files->path(file.ino());
+    if (path.empty()) {
+        return;
+    }
+    std::string content;
+    put_string(content, path);
+    put_u64(content, file.length());
+    put_string(content, file.validator());
+    append(JOURNAL_METADATA, content);
+}
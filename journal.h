@@ -0,0 +1,120 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ghost_namespace.h"
+#include "manifest.h"
+
+// Journal is compacted once it grows past this size, or past the size of the
+// last snapshot if it's larger, so that compaction cost stays amortized.
+#define JOURNAL_COMPACT_SIZE (4*1024*1024)
+
+// Types of records of a journal.
+enum {
+    JOURNAL_FILE = 1,
+    JOURNAL_DIR,
+    JOURNAL_REMOVE,
+    JOURNAL_ATTRIBUTES,
+    JOURNAL_METADATA,
+};
+
+// Changes to the namespace, persisted so that a restart gets the namespace
+// back without asking origins again. Files are:
+//  <path>           records appended since the last compaction.
+//  <path>.snapshot  namespace as of the last compaction, in the format of a
+//                   manifest, so that it's loaded lazily like one.
+//  <path>.old       records being compacted, only left over if compaction
+//                   got interrupted.
+// A record is made of its size, a CRC32C of its content and its content,
+// written with a single append. Records are idempotent and refer to entries
+// by path, so that replaying records already covered by the snapshot is
+// harmless. Replay stops at the first record that is torn or corrupt, which
+// is dropped along with whatever follows it.
+// Records aren't synced, so a crash of ghostfs loses nothing, while a crash
+// of the machine may lose the latest ones.
+struct ghost_journal {
+private:
+    std::string _path;
+    int _fd = -1;
+    ghost_namespace* _files = nullptr;
+    // Serializes appends with rotation of the journal.
+    std::mutex _mtx;
+    uint64_t _size = 0;
+    uint64_t _compact_size = JOURNAL_COMPACT_SIZE;
+    bool _stopped = false;
+    std::condition_variable _cv;
+    std::thread _compactor;
+    std::function<void ()> _on_compact;
+
+    void append(int type, const std::string& content);
+    void append_entry(int type, uint64_t ino);
+    int replay_file(const std::string& path, cache& c,
+                    std::unordered_map<std::string, std::shared_ptr<ghost_file>>& pending);
+    int rotate();
+    void run();
+public:
+    ~ghost_journal();
+
+    // Open journal at path, creating it if needed, for changes to files.
+    // Return 0 on success, or a negative error.
+    int open(const char* path, ghost_namespace& files);
+
+    bool is_open() const;
+
+    const std::string& path() const;
+
+    // Open snapshot written by the last compaction in m. Return 0 on success,
+    // or a negative error, -ENOENT meaning that there is none.
+    int open_snapshot(manifest& m);
+
+    // Apply records to the namespace, whose files are split in blocks of
+    // cache c, and store files whose url changed without their metadata
+    // getting recorded in unresolved. Return number of records applied, or a
+    // negative error.
+    int replay(cache& c, std::vector<std::shared_ptr<ghost_file>>& unresolved);
+
+    // Compact in background whenever journal grows too large, calling
+    // on_compact after each compaction.
+    void start(std::function<void ()> on_compact);
+
+    // Stop compacting in background, and compact one last time.
+    void stop();
+
+    // Write a snapshot of the namespace, and drop records it covers. Return
+    // 0 on success, or a negative error.
+    int compact();
+
+    // Record changes to the namespace. Nothing is recorded unless journal is
+    // open.
+    void add_file(uint64_t ino);
+
+    void add_dir(uint64_t ino);
+
+    // Record removal of name from directory parent, which must be done
+    // after name got removed.
+    void remove(uint64_t parent, const char* name);
+
+    void set_attributes(const ghost_file& file);
+
+    // Record length and validator of file.
+    void set_metadata(const ghost_file& file);
+};
+
+#endif // JOURNAL_H
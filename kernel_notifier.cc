@@ -0,0 +1,84 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <string.h>
+
+#include "kernel_notifier.h"
+#include "utils.h"
+
+void kernel_notifier::start(struct fuse_chan *ch) {
+    std::lock_guard<std::mutex> lock(_mtx);
+    _ch = ch;
+    _stopped = false;
+    _thread = std::thread(&kernel_notifier::run, this);
+}
+
+void kernel_notifier::stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (!_thread.joinable()) {
+            return;
+        }
+        _stopped = true;
+    }
+    _cv.notify_one();
+    _thread.join();
+    _requests.clear();
+    _ch = nullptr;
+}
+
+void kernel_notifier::push(request req) {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        // Kernel has nothing cached until file system is mounted.
+        if (!_ch || _stopped) {
+            return;
+        }
+        _requests.push_back(std::move(req));
+    }
+    _cv.notify_one();
+}
+
+void kernel_notifier::inval_inode(uint64_t ino) {
+    push(request{ 0, ino, std::string() });
+}
+
+void kernel_notifier::inval_entry(uint64_t parent, const char *name) {
+    push(request{ parent, 0, std::string(name) });
+}
+
+void kernel_notifier::run() {
+    std::unique_lock<std::mutex> lock(_mtx);
+
+    for (;;) {
+        _cv.wait(lock, [this] { return _stopped || !_requests.empty(); });
+        if (_stopped) {
+            break;
+        }
+        request req = std::move(_requests.front());
+        _requests.pop_front();
+        lock.unlock();
+
+        int res;
+        if (req.name.empty()) {
+            res = fuse_lowlevel_notify_inval_inode(_ch, req.ino, 0, 0);
+        } else {
+            res = fuse_lowlevel_notify_inval_entry(_ch, req.parent, req.name.c_str(),
+                                                   req.name.size());
+        }
+        // ENOENT only means that kernel has nothing cached.
+        if (res < 0 && res != -ENOENT) {
+            log("Unable to invalidate kernel cache: %s\n", strerror(-res));
+        }
+
+        lock.lock();
+    }
+}
@@ -0,0 +1,55 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef KERNEL_NOTIFIER_H
+#define KERNEL_NOTIFIER_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct fuse_chan;
+
+// Invalidates what kernel caches about files. Notifications are sent by a
+// background thread, as sending them from a request handler may deadlock,
+// e.g. if kernel holds a lock of the inode being invalidated while waiting
+// for the reply.
+struct kernel_notifier {
+private:
+    // Entry name in directory parent is invalidated if name isn't empty,
+    // and inode ino otherwise.
+    struct request {
+        uint64_t parent;
+        uint64_t ino;
+        std::string name;
+    };
+    struct fuse_chan* _ch = nullptr;
+    std::deque<request> _requests;
+    bool _stopped = false;
+    std::mutex _mtx;
+    std::condition_variable _cv;
+    std::thread _thread;
+
+    void run();
+    void push(request req);
+public:
+    void start(struct fuse_chan* ch);
+
+    void stop();
+
+    // Drop cached content and attributes of inode ino.
+    void inval_inode(uint64_t ino);
+
+    // Drop cached lookup of name in directory parent.
+    void inval_entry(uint64_t parent, const char* name);
+};
+
+#endif // KERNEL_NOTIFIER_H
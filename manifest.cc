@@ -0,0 +1,256 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <istream>
+
+#include "manifest.h"
+#include "utils.h"
+
+manifest::~manifest() {
+    if (_data) {
+        munmap(const_cast<char*>(_data), _size);
+    }
+}
+
+// Only the header is checked here, as checking every entry would take time
+// proportional to the size of the manifest. Entries are checked when read.
+int manifest::open(const char *path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(manifest_header)) {
+        close(fd);
+        return -EINVAL;
+    }
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -errno;
+    }
+
+    auto header = static_cast<const manifest_header*>(data);
+    bool valid = !memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic))
+        && header->version == MANIFEST_VERSION
+        && header->entry_size == sizeof(manifest_entry)
+        && header->entries_offset % alignof(manifest_entry) == 0
+        && header->entries_offset <= size
+        && header->count <= (size - header->entries_offset) / sizeof(manifest_entry)
+        && header->strings_offset <= size
+        && header->strings_size <= size - header->strings_offset;
+    if (!valid) {
+        munmap(data, size);
+        return -EINVAL;
+    }
+
+    _data = static_cast<const char*>(data);
+    _size = size;
+    _entries = reinterpret_cast<const manifest_entry*>(_data + header->entries_offset);
+    _count = header->count;
+    _strings = _data + header->strings_offset;
+    _strings_size = header->strings_size;
+    return 0;
+}
+
+uint64_t manifest::size() const {
+    return _count;
+}
+
+const char *manifest::path(uint64_t i, size_t &len) const {
+    const manifest_entry& e = _entries[i];
+    if (e.path > _strings_size || e.path_len > _strings_size - e.path) {
+        return nullptr;
+    }
+    len = e.path_len;
+    return _strings + e.path;
+}
+
+bool manifest::get_string(uint64_t offset, uint32_t len, std::string &s) const {
+    if (offset > _strings_size || len > _strings_size - offset) {
+        return false;
+    }
+    s.assign(_strings + offset, len);
+    return true;
+}
+
+bool manifest::get(uint64_t i, manifest_file &file) const {
+    const manifest_entry& e = _entries[i];
+    std::string attributes;
+
+    if (!get_string(e.path, e.path_len, file.path) || !get_string(e.url, e.url_len, file.url)
+        || !get_string(e.attributes, e.attributes_size, attributes)
+        || !get_string(e.validator, e.validator_len, file.validator)) {
+        return false;
+    }
+    file.is_dir = e.flags & MANIFEST_IS_DIR;
+    file.has_length = e.flags & MANIFEST_HAS_LENGTH;
+    file.length = file.has_length ? e.length : 0;
+    file.attributes.clear();
+
+    const char* p = attributes.c_str();
+    const char* end = p + attributes.size();
+    while (p < end) {
+        const char* value = p + strlen(p) + 1;
+        if (value >= end) {
+            return false;
+        }
+        file.attributes[p] = value;
+        p = value + strlen(value) + 1;
+    }
+    return true;
+}
+
+bool manifest::is_dir(uint64_t i) const {
+    return _entries[i].flags & MANIFEST_IS_DIR;
+}
+
+uint64_t manifest::lower_bound(const char *path, size_t len) const {
+    uint64_t first = 0, count = _count;
+
+    while (count > 0) {
+        uint64_t step = count / 2;
+        uint64_t i = first + step;
+        size_t entry_len;
+        const char* entry_path = manifest::path(i, entry_len);
+
+        // Corrupted entries sort first, so that a search never fails.
+        int cmp = -1;
+        if (entry_path) {
+            cmp = memcmp(entry_path, path, std::min(entry_len, len));
+            if (cmp == 0) {
+                cmp = (entry_len < len) ? -1 : (entry_len > len);
+            }
+        }
+        if (cmp < 0) {
+            first = i + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+    return first;
+}
+
+int write_manifest(const char *path, std::vector<manifest_file> files) {
+    std::sort(files.begin(), files.end(), [] (const manifest_file& a, const manifest_file& b) {
+        return a.path < b.path;
+    });
+    auto last = std::unique(files.begin(), files.end(), [] (const manifest_file& a, const manifest_file& b) {
+        return a.path == b.path;
+    });
+    files.erase(last, files.end());
+
+    std::vector<manifest_entry> entries;
+    std::string strings;
+    entries.reserve(files.size());
+
+    for (auto& file : files) {
+        manifest_entry e;
+        memset(&e, 0, sizeof(e));
+        e.length = file.length;
+        e.flags = (file.has_length ? MANIFEST_HAS_LENGTH : 0) | (file.is_dir ? MANIFEST_IS_DIR : 0);
+        e.path = strings.size();
+        e.path_len = file.path.size();
+        strings += file.path;
+        e.url = strings.size();
+        e.url_len = file.url.size();
+        strings += file.url;
+        e.attributes = strings.size();
+        for (auto& attribute : file.attributes) {
+            strings.append(attribute.first.c_str(), attribute.first.size() + 1);
+            strings.append(attribute.second.c_str(), attribute.second.size() + 1);
+        }
+        e.attributes_size = strings.size() - e.attributes;
+        e.validator = strings.size();
+        e.validator_len = file.validator.size();
+        strings += file.validator;
+        entries.push_back(e);
+    }
+
+    manifest_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    header.entry_size = sizeof(manifest_entry);
+    header.count = entries.size();
+    header.entries_offset = sizeof(header);
+    header.strings_offset = header.entries_offset + entries.size() * sizeof(manifest_entry);
+    header.strings_size = strings.size();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(manifest_entry));
+    out.write(strings.data(), strings.size());
+    out.close();
+    return out ? 0 : -EIO;
+}
+
+// Whether path is absolute and made of non empty components other than . and ..
+static bool is_valid_path(const std::string& path) {
+    if (path.size() < 2 || path[0] != '/' || path.back() == '/') {
+        return false;
+    }
+    for (auto& component : split(path.substr(1), '/')) {
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+    }
+    return true;
+}
+
+int parse_text_manifest(std::istream &in, std::vector<manifest_file> &files) {
+    std::string line;
+    int line_number = 0;
+
+    while (std::getline(in, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::vector<std::string> fields = split(line, '\t');
+        if (fields.size() < 2 || !is_valid_path(fields[0]) || fields[1].empty()) {
+            return line_number;
+        }
+
+        manifest_file file;
+        file.path = fields[0];
+        file.url = fields[1];
+        if (fields.size() > 2 && fields[2] != "-") {
+            char* end;
+            file.length = strtoull(fields[2].c_str(), &end, 10);
+            if (fields[2].empty() || *end) {
+                return line_number;
+            }
+            file.has_length = true;
+        }
+        for (size_t i = 3; i < fields.size(); i++) {
+            size_t eq = fields[i].find('=');
+            if (eq == std::string::npos || eq == 0) {
+                return line_number;
+            }
+            file.attributes[fields[i].substr(0, eq)] = fields[i].substr(eq + 1);
+        }
+        files.push_back(std::move(file));
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A manifest lists files to be created at mount time, with their url and
+// attributes, and optionally their length. It's written in a binary format
+// that is mapped into memory and parsed lazily, so mounting takes the same
+// time however many entries it has:
+//
+//   header | entries sorted by path | strings
+//
+// Paths are absolute, e.g. /dir/file, and sorting them bytewise keeps the
+// entries below a directory next to each other. Strings of an entry are
+// referenced by offset into strings, attributes being stored as a sequence
+// of NUL terminated key and value pairs. Directories are implied by paths of
+// their children, and only listed when they're empty.
+
+#define MANIFEST_MAGIC "GHOSTMF1"
+#define MANIFEST_VERSION 2
+
+struct manifest_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t count;
+    uint64_t entries_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+// Length of the remote object is known.
+#define MANIFEST_HAS_LENGTH 0x1
+// Entry is a directory.
+#define MANIFEST_IS_DIR 0x2
+
+struct manifest_entry {
+    uint64_t length;
+    uint64_t path;
+    uint64_t url;
+    uint64_t attributes;
+    uint64_t validator;
+    uint32_t path_len;
+    uint32_t url_len;
+    uint32_t attributes_size;
+    uint32_t validator_len;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+// Entry of a manifest, as given to write_manifest() or read from a manifest.
+struct manifest_file {
+    std::string path;
+    std::string url;
+    // Zero unless has_length is set.
+    uint64_t length = 0;
+    bool has_length = false;
+    // See remote_metadata.
+    std::string validator;
+    // Directories have neither url nor attributes.
+    bool is_dir = false;
+    std::unordered_map<std::string, std::string> attributes;
+};
+
+struct manifest {
+private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+    const manifest_entry* _entries = nullptr;
+    uint64_t _count = 0;
+    const char* _strings = nullptr;
+    uint64_t _strings_size = 0;
+
+    bool get_string(uint64_t offset, uint32_t len, std::string& s) const;
+public:
+    manifest() = default;
+    ~manifest();
+
+    manifest(const manifest&) = delete;
+    manifest& operator=(const manifest&) = delete;
+
+    // Map manifest stored at path. Return 0 on success, or a negative error.
+    int open(const char* path);
+
+    uint64_t size() const;
+
+    // Return path of entry i, which is not NUL terminated, and store its
+    // length in len. Return nullptr if the entry is corrupted.
+    const char* path(uint64_t i, size_t& len) const;
+
+    // Store entry i in file, and return whether it's valid.
+    bool get(uint64_t i, manifest_file& file) const;
+
+    bool is_dir(uint64_t i) const;
+
+    // Return index of the first entry whose path isn't less than the given
+    // one, or size() if there is none.
+    uint64_t lower_bound(const char* path, size_t len) const;
+};
+
+// Write files to a manifest at path. Return 0 on success, or a negative error.
+int write_manifest(const char* path, std::vector<manifest_file> files);
+
+// Parse a manifest in text format, with a file per line given as tab
+// separated fields:
+//
+//   <path> <url> [<length>|-] [<key>=<value>]...
+//
+// Empty lines and lines starting with # are ignored. Return 0 on success, or
+// the number of the first invalid line.
+int parse_text_manifest(std::istream& in, std::vector<manifest_file>& files);
+
+#endif // MANIFEST_H
@@ -0,0 +1,166 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <unordered_map>
+
+#include "metadata_resolver.h"
+#include "utils.h"
+
+metadata_resolver::~metadata_resolver() {
+    stop();
+}
+
+void metadata_resolver::start(unsigned threads, callback on_resolved) {
+    _on_resolved = std::move(on_resolved);
+    _stopped = false;
+    for (unsigned i = 0; i < threads; i++) {
+        _threads.emplace_back(&metadata_resolver::run, this);
+    }
+}
+
+// Files still queued are left unresolved, but nobody waits for them anymore.
+void metadata_resolver::stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _stopped = true;
+        for (auto& req : _requests) {
+            req.file->set_resolving(false);
+        }
+        _requests.clear();
+    }
+    _cv.notify_all();
+    _resolved_cv.notify_all();
+    for (auto& t : _threads) {
+        t.join();
+    }
+    _threads.clear();
+}
+
+void metadata_resolver::submit(std::shared_ptr<ghost_file> file, bool prefetch) {
+    std::shared_ptr<fetch_context> ctx = file->get_fetch_context();
+    std::vector<request> batch{ request{ file, ctx, prefetch } };
+
+    file->set_resolving(true);
+    if (!ctx) {
+        resolve(batch);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (!_threads.empty() && !_stopped) {
+            _requests.push_back(std::move(batch.front()));
+            _cv.notify_one();
+            return;
+        }
+    }
+    resolve(batch);
+}
+
+void metadata_resolver::cancel(const std::shared_ptr<ghost_file>& file) {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        file->set_resolving(false);
+    }
+    _resolved_cv.notify_all();
+}
+
+void metadata_resolver::wait(const ghost_file& file) {
+    if (!file.resolving()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(_mtx);
+    _resolved_cv.wait(lock, [&] { return !file.resolving(); });
+}
+
+// Take whatever was submitted, up to a batch, so that files submitted while
+// a batch is being resolved make up the next one.
+void metadata_resolver::run() {
+    std::vector<request> batch;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(_mtx);
+            _cv.wait(lock, [&] { return _stopped || !_requests.empty(); });
+            if (_stopped) {
+                return;
+            }
+            while (!_requests.empty() && batch.size() < METADATA_BATCH_SIZE) {
+                batch.push_back(std::move(_requests.front()));
+                _requests.pop_front();
+            }
+        }
+        resolve(batch);
+        batch.clear();
+    }
+}
+
+// Metadata is only stored if file still has the context it was resolved for.
+// Otherwise, its url or attributes changed in the meantime, and it was
+// submitted again, unless it no longer has an url.
+void metadata_resolver::resolve(std::vector<request>& batch) {
+    std::unordered_map<base_protocol*, std::vector<metadata_request>> requests;
+    std::unordered_map<base_protocol*, std::vector<request*>> files;
+
+    for (auto& req : batch) {
+        if (req.ctx) {
+            requests[req.ctx->handler].emplace_back(req.ctx.get());
+            files[req.ctx->handler].push_back(&req);
+        }
+    }
+    // Metadata of every file of a batch is known once the batch is done, so
+    // time of the batch is recorded for each of them.
+    for (auto& it : requests) {
+        uint64_t start = trace_clock();
+        it.first->get_metadata_batch(it.second);
+        uint64_t duration = trace_clock() - start;
+        for (auto& req : it.second) {
+            req.ctx->metrics->get_metadata.record(duration);
+        }
+    }
+
+    std::vector<std::pair<request*, metadata_request*>> resolved;
+    for (auto& it : requests) {
+        auto& handler_files = files[it.first];
+        for (size_t i = 0; i < it.second.size(); i++) {
+            resolved.emplace_back(handler_files[i], &it.second[i]);
+        }
+    }
+
+    for (auto& r : resolved) {
+        auto& req = *r.first;
+        auto& metadata = r.second->metadata;
+        if (req.file->get_fetch_context() != req.ctx) {
+            continue;
+        }
+        if (!r.second->found) {
+            log("Unable to resolve metadata of %s\n", req.ctx->url.c_str());
+        }
+        req.file->update_length(metadata.length, _cache);
+        req.file->set_validator(std::move(metadata.validator));
+        req.ctx->ranges = metadata.ranges;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        for (auto& req : batch) {
+            std::shared_ptr<fetch_context> ctx = req.file->get_fetch_context();
+            if (ctx == req.ctx || !ctx) {
+                req.file->set_resolving(false);
+            }
+        }
+    }
+    _resolved_cv.notify_all();
+
+    if (_on_resolved) {
+        for (auto& r : resolved) {
+            if (r.second->found && r.first->file->get_fetch_context() == r.first->ctx) {
+                _on_resolved(r.first->file, r.first->ctx, r.first->prefetch);
+            }
+        }
+    }
+}
@@ -0,0 +1,77 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef METADATA_RESOLVER_H
+#define METADATA_RESOLVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ghost_file.h"
+
+// Maximum number of files resolved with a single request to a handler.
+#define METADATA_BATCH_SIZE 256
+
+// Resolves length and validator of remote objects of files in background, so
+// that creating a file doesn't wait for its origin. Files submitted at about
+// the same time are resolved together through get_metadata_batch(), letting
+// handlers keep many requests in flight. Whoever needs the length of a file
+// being resolved waits for it.
+struct metadata_resolver {
+    // Called once file got resolved for context ctx, with whether it was
+    // submitted for prefetch.
+    typedef std::function<void (const std::shared_ptr<ghost_file>&,
+                                const std::shared_ptr<fetch_context>&, bool)> callback;
+private:
+    struct request {
+        std::shared_ptr<ghost_file> file;
+        std::shared_ptr<fetch_context> ctx;
+        bool prefetch;
+    };
+    std::deque<request> _requests;
+    cache& _cache;
+    callback _on_resolved;
+    bool _stopped = false;
+    std::mutex _mtx;
+    std::condition_variable _cv;
+    std::condition_variable _resolved_cv;
+    std::vector<std::thread> _threads;
+
+    void run();
+    void resolve(std::vector<request>& batch);
+public:
+    // Resolve files whose content is split in blocks of cache c.
+    explicit metadata_resolver(cache& c)
+        : _cache(c) {}
+
+    ~metadata_resolver();
+
+    // Start threads resolving files, calling on_resolved for each of them.
+    void start(unsigned threads, callback on_resolved);
+
+    void stop();
+
+    // Resolve file for its current fetch context. If resolver isn't running,
+    // file is resolved before returning. prefetch is passed on to the
+    // callback, for files likely to be read once resolved.
+    void submit(std::shared_ptr<ghost_file> file, bool prefetch = false);
+
+    // Stop resolving file, whose content has nothing to resolve, and wake up
+    // whoever waits for it.
+    void cancel(const std::shared_ptr<ghost_file>& file);
+
+    // Wait until file is resolved.
+    void wait(const ghost_file& file);
+};
+
+#endif // METADATA_RESOLVER_H
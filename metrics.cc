@@ -0,0 +1,351 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <map>
+#include <new>
+#include <thread>
+
+#include "metrics.h"
+#include "protocol/base_protocol.h"
+#include "utils.h"
+
+size_t metrics_shard() {
+    static std::atomic<size_t> next_shard { 0 };
+    static thread_local size_t shard = next_shard++ % METRICS_SHARDS;
+    return shard;
+}
+
+uint64_t metric_counter::value() const {
+    uint64_t value = 0;
+    for (auto& shard : _shards) {
+        value += shard.value.load(std::memory_order_relaxed);
+    }
+    return value;
+}
+
+latency_histogram::shard::shard() {
+    for (auto& bucket : buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+// Values below HISTOGRAM_SUB_BUCKETS get a bucket each. Larger ones get the
+// bucket of their power of 2 and of the bits following the most significant
+// one.
+static size_t bucket_of(uint64_t ns) {
+    if (ns < HISTOGRAM_SUB_BUCKETS) {
+        return ns;
+    }
+    int exp = 63 - __builtin_clzll(ns);
+    size_t bucket = (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+        + (ns >> (exp - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_BUCKETS;
+    return std::min<size_t>(bucket, HISTOGRAM_BUCKETS - 1);
+}
+
+// Smallest value counted in bucket.
+static uint64_t bucket_start(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    size_t group = bucket / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub) << (group - 1);
+}
+
+void latency_histogram::record(uint64_t ns) {
+    shard& s = _shards[metrics_shard()];
+    s.buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    s.sum.fetch_add(ns, std::memory_order_relaxed);
+    s.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void latency_histogram::read(snapshot &s) const {
+    s.count = 0;
+    s.sum = 0;
+    s.buckets.assign(HISTOGRAM_BUCKETS, 0);
+
+    for (auto& shard : _shards) {
+        s.count += shard.count.load(std::memory_order_relaxed);
+        s.sum += shard.sum.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            s.buckets[i] += shard.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// Highest value of the bucket holding the quantile, so that it's never
+// underestimated.
+uint64_t latency_histogram::snapshot::quantile(double q) const {
+    uint64_t total = 0;
+    for (auto count : buckets) {
+        total += count;
+    }
+    if (!total) {
+        return 0;
+    }
+
+    uint64_t rank = std::max<uint64_t>(1, q * total + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return (i + 1 < buckets.size()) ? bucket_start(i + 1) - 1 : bucket_start(i);
+        }
+    }
+    return bucket_start(buckets.size() - 1);
+}
+
+static latency_histogram fuse_histograms[FUSE_OPERATIONS];
+
+static const char* fuse_operation_names[FUSE_OPERATIONS] = {
+    "lookup",
+    "getattr",
+    "readdir",
+    "mkdir",
+    "rmdir",
+    "open",
+    "create",
+    "read",
+    "release",
+    "setxattr",
+    "getxattr",
+    "removexattr",
+};
+
+latency_histogram &fuse_latency(fuse_operation op) {
+    return fuse_histograms[op];
+}
+
+static latency_histogram lock_histograms[METERED_LOCKS];
+
+static const char* lock_names[METERED_LOCKS] = {
+    "cache",
+    "block",
+};
+
+latency_histogram &lock_wait(metered_lock lock) {
+    return lock_histograms[lock];
+}
+
+// Metrics of fetches are never freed, as fetch contexts point to them. They
+// are allocated aligned to cache lines, which plain new doesn't guarantee.
+static std::mutex fetch_metrics_mtx;
+static std::map<std::pair<std::string, std::string>, fetch_metrics*> all_fetch_metrics;
+
+fetch_metrics &get_fetch_metrics(const char *driver, const std::string &host) {
+    std::lock_guard<std::mutex> lock(fetch_metrics_mtx);
+    auto& metrics = all_fetch_metrics[std::make_pair(std::string(driver), host)];
+    if (!metrics) {
+        void* mem;
+        if (posix_memalign(&mem, alignof(fetch_metrics), sizeof(fetch_metrics))) {
+            log("Unable to allocate metrics of %s\n", host.c_str());
+            abort();
+        }
+        metrics = new (mem) fetch_metrics;
+        metrics->driver = driver;
+        metrics->host = host;
+    }
+    return *metrics;
+}
+
+read_metrics &get_read_metrics() {
+    static read_metrics metrics;
+    return metrics;
+}
+
+peer_metrics &get_peer_metrics() {
+    static peer_metrics metrics;
+    return metrics;
+}
+
+// Value of a label, with backslash, double quote and line feed escaped.
+static std::string label_value(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static void write_header(std::ostream& out, const char* name, const char* type, const char* help) {
+    out << "# HELP " << name << ' ' << help << '\n';
+    out << "# TYPE " << name << ' ' << type << '\n';
+}
+
+static void write_counter(std::ostream& out, const char* name, const std::string& labels,
+                          uint64_t value) {
+    out << name;
+    if (!labels.empty()) {
+        out << '{' << labels << '}';
+    }
+    out << ' ' << value << '\n';
+}
+
+// Histograms are exported as summaries, whose quantiles are exact within the
+// precision of the histogram.
+static void write_summary(std::ostream& out, const char* name, const std::string& labels,
+                          const latency_histogram& histogram) {
+    static const char* quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+    latency_histogram::snapshot s;
+    histogram.read(s);
+
+    std::string separator = labels.empty() ? "" : ",";
+    for (auto q : quantiles) {
+        out << name << '{' << labels << separator << "quantile=\"" << q << "\"} "
+            << s.quantile(atof(q)) / 1e9 << '\n';
+    }
+    std::string braces = labels.empty() ? "" : '{' + labels + '}';
+    out << name << "_sum" << braces << ' ' << s.sum / 1e9 << '\n';
+    out << name << "_count" << braces << ' ' << s.count << '\n';
+}
+
+int write_metrics(const char *path) {
+    std::string tmp_path = std::string(path) + ".tmp";
+    std::ofstream out(tmp_path, std::ios::trunc);
+    out.precision(9);
+
+    write_header(out, "ghostfs_fuse_operation_seconds", "summary", "Time taken by FUSE operations.");
+    for (int op = 0; op < FUSE_OPERATIONS; op++) {
+        write_summary(out, "ghostfs_fuse_operation_seconds",
+                      std::string("operation=\"") + fuse_operation_names[op] + '"', fuse_histograms[op]);
+    }
+
+    read_metrics& reads = get_read_metrics();
+    write_header(out, "ghostfs_read_seconds", "summary", "Time taken by reads, by whether they were served from cache.");
+    write_summary(out, "ghostfs_read_seconds", "cache=\"hit\"", reads.hit);
+    write_summary(out, "ghostfs_read_seconds", "cache=\"miss\"", reads.miss);
+    write_header(out, "ghostfs_cache_hits_total", "counter", "Blocks read from cache.");
+    write_counter(out, "ghostfs_cache_hits_total", "", reads.cache_hits.value());
+    write_header(out, "ghostfs_cache_misses_total", "counter", "Blocks read from origin.");
+    write_counter(out, "ghostfs_cache_misses_total", "", reads.cache_misses.value());
+    write_header(out, "ghostfs_prefetched_blocks_total", "counter", "Blocks prefetched.");
+    write_counter(out, "ghostfs_prefetched_blocks_total", "", reads.prefetched.value());
+    write_header(out, "ghostfs_prefetch_hits_total", "counter", "Prefetched blocks which got read.");
+    write_counter(out, "ghostfs_prefetch_hits_total", "", reads.prefetch_hits.value());
+    write_header(out, "ghostfs_prefetch_wasted_total", "counter", "Prefetched blocks evicted before being read.");
+    write_counter(out, "ghostfs_prefetch_wasted_total", "", reads.prefetch_wasted.value());
+
+    peer_metrics& peers = get_peer_metrics();
+    write_header(out, "ghostfs_peer_blocks_total", "counter", "Blocks asked to peers, by whether they served them.");
+    write_counter(out, "ghostfs_peer_blocks_total", "result=\"hit\"", peers.hits.value());
+    write_counter(out, "ghostfs_peer_blocks_total", "result=\"miss\"", peers.misses.value());
+    write_counter(out, "ghostfs_peer_blocks_total", "result=\"corrupt\"", peers.corrupt.value());
+    write_header(out, "ghostfs_peer_bytes_total", "counter", "Bytes got from peers instead of origin, and bytes served to peers.");
+    write_counter(out, "ghostfs_peer_bytes_total", "direction=\"received\"", peers.bytes.value());
+    write_counter(out, "ghostfs_peer_bytes_total", "direction=\"sent\"", peers.served_bytes.value());
+    write_header(out, "ghostfs_peer_served_blocks_total", "counter", "Blocks served to peers.");
+    write_counter(out, "ghostfs_peer_served_blocks_total", "", peers.served.value());
+    write_header(out, "ghostfs_peer_errors_total", "counter", "Peers which couldn't be reached or failed.");
+    write_counter(out, "ghostfs_peer_errors_total", "", peers.errors.value());
+
+    write_header(out, "ghostfs_lock_wait_seconds", "summary", "Time spent waiting for locks.");
+    for (int lock = 0; lock < METERED_LOCKS; lock++) {
+        write_summary(out, "ghostfs_lock_wait_seconds",
+                      std::string("lock=\"") + lock_names[lock] + '"', lock_histograms[lock]);
+    }
+
+    std::vector<fetch_metrics*> fetches;
+    {
+        std::lock_guard<std::mutex> lock(fetch_metrics_mtx);
+        for (auto& metrics : all_fetch_metrics) {
+            fetches.push_back(metrics.second);
+        }
+    }
+    write_header(out, "ghostfs_origin_call_seconds", "summary", "Time taken by calls to drivers, by driver and host.");
+    for (auto metrics : fetches) {
+        std::string labels = "driver=\"" + label_value(metrics->driver) + "\",host=\""
+            + label_value(metrics->host) + "\",call=";
+        write_summary(out, "ghostfs_origin_call_seconds", labels + "\"get_block\"", metrics->get_block);
+        write_summary(out, "ghostfs_origin_call_seconds", labels + "\"get_blocks\"", metrics->get_blocks);
+        write_summary(out, "ghostfs_origin_call_seconds", labels + "\"get_metadata\"", metrics->get_metadata);
+    }
+    write_header(out, "ghostfs_origin_bytes_total", "counter", "Bytes fetched, by driver and host.");
+    for (auto metrics : fetches) {
+        write_counter(out, "ghostfs_origin_bytes_total", "driver=\"" + label_value(metrics->driver)
+                      + "\",host=\"" + label_value(metrics->host) + '"', metrics->bytes.value());
+    }
+    write_header(out, "ghostfs_origin_failures_total", "counter", "Blocks which couldn't be fetched, by driver and host.");
+    for (auto metrics : fetches) {
+        write_counter(out, "ghostfs_origin_failures_total", "driver=\"" + label_value(metrics->driver)
+                      + "\",host=\"" + label_value(metrics->host) + '"', metrics->failures.value());
+    }
+    write_header(out, "ghostfs_origin_checksum_mismatches_total", "counter", "Blocks fetched whose checksum didn't match, by driver and host.");
+    for (auto metrics : fetches) {
+        write_counter(out, "ghostfs_origin_checksum_mismatches_total", "driver=\"" + label_value(metrics->driver)
+                      + "\",host=\"" + label_value(metrics->host) + '"', metrics->checksum_mismatches.value());
+    }
+
+    fetch_stats& stats = get_fetch_stats();
+    write_header(out, "ghostfs_fetch_timeouts_total", "counter", "Fetches which timed out.");
+    write_counter(out, "ghostfs_fetch_timeouts_total", "", stats.timeouts);
+    write_header(out, "ghostfs_fetch_retries_total", "counter", "Fetches which were retried.");
+    write_counter(out, "ghostfs_fetch_retries_total", "", stats.retries);
+    write_header(out, "ghostfs_fetch_failures_total", "counter", "Fetches which failed.");
+    write_counter(out, "ghostfs_fetch_failures_total", "", stats.failures);
+
+    out.close();
+    if (!out) {
+        return -EIO;
+    }
+    if (rename(tmp_path.c_str(), path) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static std::thread exporter;
+static bool exporter_stopped;
+static std::mutex exporter_mtx;
+static std::condition_variable exporter_cv;
+
+static void run_exporter(std::string path, unsigned interval) {
+    std::unique_lock<std::mutex> lock(exporter_mtx);
+
+    do {
+        lock.unlock();
+        int res = write_metrics(path.c_str());
+        if (res < 0) {
+            log("Unable to write metrics to %s: %s\n", path.c_str(), strerror(-res));
+        }
+        lock.lock();
+    } while (!exporter_cv.wait_for(lock, std::chrono::seconds(interval),
+                                   [] { return exporter_stopped; }));
+    lock.unlock();
+    write_metrics(path.c_str());
+}
+
+void metrics_start(const char *path, unsigned interval) {
+    exporter_stopped = false;
+    exporter = std::thread(run_exporter, std::string(path), std::max(interval, 1u));
+}
+
+void metrics_stop() {
+    if (!exporter.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(exporter_mtx);
+        exporter_stopped = true;
+    }
+    exporter_cv.notify_one();
+    exporter.join();
+}
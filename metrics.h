@@ -0,0 +1,205 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+// Counters and latency histograms, exported periodically to a file in
+// Prometheus text format. Updates are spread over METRICS_SHARDS shards, a
+// thread always updating the same one, so that threads rarely write to the
+// same cache line, and shards are only summed when exported.
+
+#define METRICS_SHARDS 8
+
+// A histogram has HISTOGRAM_SUB_BUCKETS buckets per power of 2 of nanoseconds,
+// so that any latency is known within 1/HISTOGRAM_SUB_BUCKETS of its value,
+// up to 2^HISTOGRAM_MAX_EXP ns (about 18 minutes), larger ones being counted
+// as that.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_EXP 40
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_MAX_EXP - HISTOGRAM_SUB_BITS + 1))
+
+// Index of the shard updated by the calling thread.
+size_t metrics_shard();
+
+struct metric_counter {
+private:
+    struct alignas(64) shard {
+        std::atomic<uint64_t> value { 0 };
+    };
+    shard _shards[METRICS_SHARDS];
+public:
+    void add(uint64_t n = 1) {
+        _shards[metrics_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+};
+
+struct latency_histogram {
+private:
+    struct alignas(64) shard {
+        std::atomic<uint64_t> count { 0 };
+        std::atomic<uint64_t> sum { 0 };
+        std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+
+        shard();
+    };
+    shard _shards[METRICS_SHARDS];
+public:
+    // Sum of shards at some point.
+    struct snapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        std::vector<uint64_t> buckets;
+
+        // Return value in ns below which there is the given fraction of
+        // recorded values.
+        uint64_t quantile(double q) const;
+    };
+
+    void record(uint64_t ns);
+
+    void read(snapshot& s) const;
+};
+
+// Record time from its creation to its destruction in a histogram.
+struct latency_timer {
+    latency_histogram& histogram;
+    uint64_t start;
+
+    explicit latency_timer(latency_histogram& histogram)
+        : histogram(histogram)
+        , start(trace_clock()) {}
+
+    ~latency_timer() {
+        histogram.record(trace_clock() - start);
+    }
+};
+
+enum fuse_operation {
+    OP_LOOKUP,
+    OP_GETATTR,
+    OP_READDIR,
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_OPEN,
+    OP_CREATE,
+    OP_READ,
+    OP_RELEASE,
+    OP_SETXATTR,
+    OP_GETXATTR,
+    OP_REMOVEXATTR,
+    FUSE_OPERATIONS
+};
+
+latency_histogram& fuse_latency(fuse_operation op);
+
+enum metered_lock {
+    LOCK_CACHE,
+    LOCK_BLOCK,
+    METERED_LOCKS
+};
+
+// Time spent waiting for a lock of the given type.
+latency_histogram& lock_wait(metered_lock lock);
+
+// Mutex recording in lock_wait(Lock) the time it takes to acquire it. Only
+// acquisitions that had to wait read the clock, the other ones count as 0.
+template <metered_lock Lock>
+struct metered_mutex {
+private:
+    std::mutex _mtx;
+public:
+    void lock() {
+        if (_mtx.try_lock()) {
+            lock_wait(Lock).record(0);
+            return;
+        }
+        latency_timer timer(lock_wait(Lock));
+        _mtx.lock();
+    }
+
+    bool try_lock() {
+        return _mtx.try_lock();
+    }
+
+    void unlock() {
+        _mtx.unlock();
+    }
+};
+
+// Metrics of fetches from a host through a driver, which are looked up once
+// per fetch context.
+struct fetch_metrics {
+    std::string driver;
+    std::string host;
+    latency_histogram get_block;
+    latency_histogram get_blocks;
+    latency_histogram get_metadata;
+    metric_counter bytes;
+    // Blocks which got fewer bytes than expected.
+    metric_counter failures;
+    // Blocks whose content didn't match their checksum.
+    metric_counter checksum_mismatches;
+};
+
+fetch_metrics& get_fetch_metrics(const char* driver, const std::string& host);
+
+struct read_metrics {
+    // Reads served from cache, and reads that fetched some block.
+    latency_histogram hit;
+    latency_histogram miss;
+    metric_counter cache_hits;
+    metric_counter cache_misses;
+    // Blocks prefetched, and how many of them got read or evicted unread.
+    metric_counter prefetched;
+    metric_counter prefetch_hits;
+    metric_counter prefetch_wasted;
+};
+
+read_metrics& get_read_metrics();
+
+// Counters of the peer tier, see peer_tier.
+struct peer_metrics {
+    // Blocks peers served, and their bytes, which weren't fetched from
+    // origin, and blocks peers were asked for and didn't serve.
+    metric_counter hits;
+    metric_counter bytes;
+    metric_counter misses;
+    // Blocks peers served whose checksum didn't match their content.
+    metric_counter corrupt;
+    // Peers that couldn't be reached or failed.
+    metric_counter errors;
+    // Blocks served to peers, and their bytes.
+    metric_counter served;
+    metric_counter served_bytes;
+};
+
+peer_metrics& get_peer_metrics();
+
+// Write metrics to path, through a temporary file renamed over it. Return 0
+// on success, or a negative error.
+int write_metrics(const char* path);
+
+// Write metrics to path every interval seconds, until metrics_stop().
+void metrics_start(const char* path, unsigned interval);
+
+// Stop writing metrics, and write them one last time.
+void metrics_stop();
+
+#endif // METRICS_H
@@ -0,0 +1,522 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+
+#include "checksum.h"
+#include "metrics.h"
+#include "peer_tier.h"
+#include "utils.h"
+
+// Requests are a peer_request_header followed by the handler, url and
+// validator of the object, and responses a peer_response_header followed by
+// the block if found, along with its CRC32C, which the asking instance checks
+// before using it. Integers are in network byte order.
+#define PEER_MAGIC 0x47485032 // "GHP2"
+
+// Limits on requests, so that a bogus one can't exhaust memory.
+#define PEER_MAX_STRING 65536
+#define PEER_MAX_BLOCK (64 * 1024 * 1024)
+
+enum peer_status : uint32_t {
+    PEER_FOUND,
+    PEER_MISSING,
+};
+
+struct peer_request_header {
+    uint32_t magic;
+    uint32_t handler_size;
+    uint32_t url_size;
+    uint32_t validator_size;
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t block_id;
+};
+
+struct peer_response_header {
+    uint32_t status;
+    uint32_t size;
+    uint32_t crc;
+};
+
+struct peer_tier::peer {
+    std::string address;
+    std::string host;
+    std::string port;
+    uint64_t hash = 0;
+    bool self = false;
+    // Connections to peer that aren't in use.
+    std::mutex mtx;
+    std::vector<int> idle;
+    // Time, in ms of steady clock, until which peer isn't asked.
+    std::atomic<int64_t> down_until { 0 };
+};
+
+struct peer_tier::connection {
+    int fd;
+    std::thread thread;
+    bool done = false;
+};
+
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// FNV-1a, continuing from h.
+static uint64_t hash_string(const std::string& s, uint64_t h = 0xcbf29ce484222325ULL) {
+    for (unsigned char c : s) {
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Finalizer of splitmix64, so that close inputs get unrelated outputs.
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static bool read_all(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size) {
+        ssize_t res = read(fd, p, size);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            return false;
+        }
+        p += res;
+        size -= res;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size) {
+        ssize_t res = send(fd, p, size, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            return false;
+        }
+        p += res;
+        size -= res;
+    }
+    return true;
+}
+
+static void set_timeout(int fd, int option, unsigned ms) {
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+// Whether host is an address of this machine, i.e. one that can be bound to.
+static bool is_local_host(const std::string& host) {
+    struct addrinfo hints;
+    struct addrinfo* res;
+    bool local = false;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0) {
+        return false;
+    }
+    for (struct addrinfo* ai = res; ai && !local; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            continue;
+        }
+        local = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        close(fd);
+    }
+    freeaddrinfo(res);
+    return local;
+}
+
+peer_tier::peer_tier() = default;
+
+// Connections to peers are only closed once started again or destroyed, as
+// fetches may still be using them once stopped.
+peer_tier::~peer_tier() {
+    stop();
+    for (auto& p : _peers) {
+        for (int fd : p->idle) {
+            close(fd);
+        }
+    }
+}
+
+int peer_tier::start(const std::vector<std::string>& peers, unsigned port,
+                     const peer_block_server& serve) {
+    _serve = serve;
+    _stopped = false;
+    _remote = false;
+    for (auto& p : _peers) {
+        for (int fd : p->idle) {
+            close(fd);
+        }
+    }
+    _peers.clear();
+
+    for (auto& address : peers) {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == address.size()) {
+            log("Invalid peer %s, expected <host>:<port>\n", address.c_str());
+            return -EINVAL;
+        }
+        std::unique_ptr<peer> p(new peer);
+        p->address = address;
+        p->host = address.substr(0, colon);
+        p->port = address.substr(colon + 1);
+        // Brackets of IPv6 addresses.
+        if (p->host.size() > 2 && p->host.front() == '[' && p->host.back() == ']') {
+            p->host = p->host.substr(1, p->host.size() - 2);
+        }
+        p->hash = mix(hash_string(address));
+        p->self = port && strtoul(p->port.c_str(), nullptr, 10) == port && is_local_host(p->host);
+        _remote |= !p->self;
+        _peers.push_back(std::move(p));
+    }
+
+    if (!port) {
+        return 0;
+    }
+    _listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool ipv6 = _listen_fd >= 0;
+    if (!ipv6) {
+        _listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (_listen_fd < 0) {
+        return -errno;
+    }
+    int on = 1, off = 0;
+    setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    int res;
+    if (ipv6) {
+        // Peers may reach this instance through IPv4 as well.
+        setsockopt(_listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        struct sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        res = bind(_listen_fd, (struct sockaddr*) &addr, sizeof(addr));
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        res = bind(_listen_fd, (struct sockaddr*) &addr, sizeof(addr));
+    }
+    if (res < 0 || listen(_listen_fd, SOMAXCONN) < 0) {
+        res = -errno;
+        close(_listen_fd);
+        _listen_fd = -1;
+        return res;
+    }
+    _acceptor = std::thread(&peer_tier::run_acceptor, this);
+    return 0;
+}
+
+void peer_tier::stop() {
+    if (_listen_fd >= 0) {
+        // Wakes up accept().
+        shutdown(_listen_fd, SHUT_RDWR);
+        _acceptor.join();
+        close(_listen_fd);
+        _listen_fd = -1;
+    }
+
+    std::list<connection> connections;
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _stopped = true;
+        for (auto& conn : _connections) {
+            if (!conn.done) {
+                shutdown(conn.fd, SHUT_RDWR);
+            }
+        }
+        connections.swap(_connections);
+    }
+    for (auto& conn : connections) {
+        conn.thread.join();
+    }
+}
+
+bool peer_tier::enabled() const {
+    return _remote;
+}
+
+size_t peer_tier::owner(const peer_object& object, size_t block_id) const {
+    uint64_t key = mix(hash_string(object.validator, hash_string(object.url,
+                       hash_string(object.handler))) + block_id);
+    size_t best = 0;
+    uint64_t best_score = 0;
+
+    for (size_t i = 0; i < _peers.size(); i++) {
+        uint64_t score = mix(_peers[i]->hash ^ key);
+        if (i == 0 || score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// Return a connection to p, either an idle one or a new one, in which case
+// fresh is set, or -1 if p can't be reached.
+int peer_tier::connect_to(peer& p, const fetch_policy& policy, bool& fresh) {
+    {
+        std::lock_guard<std::mutex> lock(p.mtx);
+        if (!p.idle.empty()) {
+            int fd = p.idle.back();
+            p.idle.pop_back();
+            fresh = false;
+            return fd;
+        }
+    }
+    fresh = true;
+
+    struct addrinfo hints;
+    struct addrinfo* res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(p.host.c_str(), p.port.c_str(), &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            continue;
+        }
+        // Timeout of sends applies to connect() as well.
+        set_timeout(fd, SO_SNDTIMEO, policy.connect_timeout_ms);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    // Owner may have to fetch the block from origin first.
+    set_timeout(fd, SO_SNDTIMEO, policy.budget_ms);
+    set_timeout(fd, SO_RCVTIMEO, policy.budget_ms);
+    return fd;
+}
+
+static bool send_request(int fd, const peer_object& object, size_t block_size, size_t block_id) {
+    peer_request_header h;
+    h.magic = htonl(PEER_MAGIC);
+    h.handler_size = htonl(object.handler.size());
+    h.url_size = htonl(object.url.size());
+    h.validator_size = htonl(object.validator.size());
+    h.block_size = htonl(block_size);
+    h.reserved = 0;
+    h.block_id = htobe64(block_id);
+
+    std::string request(reinterpret_cast<const char*>(&h), sizeof(h));
+    request += object.handler;
+    request += object.url;
+    request += object.validator;
+    return write_all(fd, request.data(), request.size());
+}
+
+// Requests to a peer are all sent before its responses are read, and peers
+// are asked at the same time, so that blocks of a fetch take about a round
+// trip whatever their number.
+void peer_tier::get_blocks(const peer_object& object, const fetch_policy& policy,
+                           size_t block_size, std::vector<block_request>& requests) {
+    peer_metrics& metrics = get_peer_metrics();
+    std::vector<std::vector<block_request*>> by_peer(_peers.size());
+    int64_t now = now_ms();
+
+    for (auto& req : requests) {
+        size_t i = owner(object, req.block_id);
+        if (!_peers[i]->self && _peers[i]->down_until.load(std::memory_order_relaxed) <= now) {
+            by_peer[i].push_back(&req);
+        }
+    }
+
+    std::vector<int> fds(_peers.size(), -1);
+    std::vector<bool> fresh(_peers.size(), false);
+    for (size_t i = 0; i < _peers.size(); i++) {
+        if (by_peer[i].empty()) {
+            continue;
+        }
+        bool is_fresh;
+        int fd = connect_to(*_peers[i], policy, is_fresh);
+        for (auto req : by_peer[i]) {
+            if (fd >= 0 && !send_request(fd, object, block_size, req->block_id)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        fds[i] = fd;
+        fresh[i] = is_fresh;
+        if (fd < 0 && is_fresh) {
+            log("Unable to reach peer %s, not asking it for %u ms\n", _peers[i]->address.c_str(),
+                PEER_RETRY_MS);
+            _peers[i]->down_until = now_ms() + PEER_RETRY_MS;
+            metrics.errors.add();
+        }
+    }
+
+    for (size_t i = 0; i < _peers.size(); i++) {
+        int fd = fds[i];
+        if (fd < 0) {
+            continue;
+        }
+        bool ok = true;
+        for (auto req : by_peer[i]) {
+            peer_response_header h;
+            if (!read_all(fd, &h, sizeof(h))) {
+                ok = false;
+                break;
+            }
+            uint32_t status = ntohl(h.status);
+            uint32_t size = ntohl(h.size);
+            if (status == PEER_FOUND && size <= block_size && read_all(fd, req->data, size)) {
+                // A block corrupted on its way is fetched from origin.
+                if (crc32c(req->data, size) != ntohl(h.crc)) {
+                    metrics.corrupt.add();
+                    continue;
+                }
+                req->bytes_read = size;
+                metrics.hits.add();
+                metrics.bytes.add(size);
+            } else if (status == PEER_MISSING && size == 0) {
+                metrics.misses.add();
+            } else {
+                ok = false;
+                break;
+            }
+        }
+        if (ok) {
+            std::lock_guard<std::mutex> lock(_peers[i]->mtx);
+            _peers[i]->idle.push_back(fd);
+            continue;
+        }
+        close(fd);
+        metrics.errors.add();
+        if (fresh[i]) {
+            log("Peer %s failed, not asking it for %u ms\n", _peers[i]->address.c_str(),
+                PEER_RETRY_MS);
+            _peers[i]->down_until = now_ms() + PEER_RETRY_MS;
+        }
+    }
+}
+
+void peer_tier::run_acceptor() {
+    for (;;) {
+        int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_stopped) {
+            close(fd);
+            break;
+        }
+        // Threads of connections that were closed are joined here.
+        for (auto it = _connections.begin(); it != _connections.end();) {
+            if (it->done) {
+                it->thread.join();
+                it = _connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        _connections.emplace_back();
+        connection* conn = &_connections.back();
+        conn->fd = fd;
+        conn->thread = std::thread(&peer_tier::serve_connection, this, conn);
+    }
+}
+
+void peer_tier::serve_connection(connection* conn) {
+    peer_metrics& metrics = get_peer_metrics();
+    peer_request_header h;
+    peer_object object;
+    std::vector<char> data;
+    int fd = conn->fd;
+
+    auto read_string = [&] (uint32_t size, std::string& s) {
+        s.resize(size);
+        return read_all(fd, &s[0], size);
+    };
+
+    while (read_all(fd, &h, sizeof(h))) {
+        uint32_t handler_size = ntohl(h.handler_size);
+        uint32_t url_size = ntohl(h.url_size);
+        uint32_t validator_size = ntohl(h.validator_size);
+        uint32_t block_size = ntohl(h.block_size);
+
+        if (ntohl(h.magic) != PEER_MAGIC || handler_size > PEER_MAX_STRING ||
+            url_size > PEER_MAX_STRING || validator_size > PEER_MAX_STRING ||
+            block_size > PEER_MAX_BLOCK) {
+            log("Invalid request from peer, closing connection\n");
+            break;
+        }
+        if (!read_string(handler_size, object.handler) || !read_string(url_size, object.url) ||
+            !read_string(validator_size, object.validator)) {
+            break;
+        }
+
+        int res = _serve(object, block_size, be64toh(h.block_id), data);
+        peer_response_header response;
+        response.status = htonl(res == 0 ? PEER_FOUND : PEER_MISSING);
+        response.size = htonl(res == 0 ? data.size() : 0);
+        response.crc = htonl(res == 0 ? crc32c(data.data(), data.size()) : 0);
+        if (!write_all(fd, &response, sizeof(response)) ||
+            (res == 0 && !write_all(fd, data.data(), data.size()))) {
+            break;
+        }
+        if (res == 0) {
+            metrics.served.add();
+            metrics.served_bytes.add(data.size());
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    close(fd);
+    conn->done = true;
+}
@@ -0,0 +1,90 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef PEER_TIER_H
+#define PEER_TIER_H
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "protocol/base_protocol.h"
+
+// Time a peer isn't asked for blocks once it couldn't be reached.
+#define PEER_RETRY_MS 5000
+
+// Object blocks are asked for, which is the same across peers only if they
+// serve it through the same handler, e.g. decompressed, at the same url, and
+// its validator is the same.
+struct peer_object {
+    std::string handler;
+    std::string url;
+    std::string validator;
+};
+
+// Store block block_id of object, split in blocks of block_size bytes, in
+// data, which is resized to the length of the block. Return 0 on success, or
+// a negative error if it can't be served.
+typedef std::function<int (const peer_object& object, size_t block_size, size_t block_id,
+                           std::vector<char>& data)> peer_block_server;
+
+// Other instances of ghostfs, which are asked for blocks missing from cache
+// before their origin. Each block has a single owner among all instances,
+// found by rendezvous hashing of the block and the address of instances, so
+// that every instance asks the same one for it. The owner serves it from its
+// cache, or fetches it from origin first, so that the origin is asked for it
+// once however many instances read it. Blocks owned by this instance, and
+// blocks peers don't serve, are fetched from origin as usual.
+//
+// Peers are listed as <host>:<port>, the same way on every instance, this
+// one included: it's the one whose port is the one it listens on, at a local
+// address. Blocks are asked for over TCP, through a connection per peer kept
+// open between fetches, and a peer that can't be reached is left alone for
+// PEER_RETRY_MS.
+class peer_tier {
+    struct peer;
+    struct connection;
+
+    std::vector<std::unique_ptr<peer>> _peers;
+    bool _remote = false;
+    peer_block_server _serve;
+    int _listen_fd = -1;
+    std::thread _acceptor;
+    // Connections of peers being served.
+    std::mutex _mtx;
+    std::list<connection> _connections;
+    bool _stopped = false;
+
+    size_t owner(const peer_object& object, size_t block_id) const;
+    int connect_to(peer& p, const fetch_policy& policy, bool& fresh);
+    void run_acceptor();
+    void serve_connection(connection* conn);
+public:
+    peer_tier();
+    ~peer_tier();
+
+    // Start listening on port, unless it's 0, and serving blocks to peers
+    // with serve. Return 0 on success, or a negative error.
+    int start(const std::vector<std::string>& peers, unsigned port, const peer_block_server& serve);
+
+    void stop();
+
+    // Whether there are peers to ask for blocks.
+    bool enabled() const;
+
+    // Ask owners of requested blocks of object for them, if they're peers,
+    // setting bytes_read of the ones they served.
+    void get_blocks(const peer_object& object, const fetch_policy& policy, size_t block_size,
+                    std::vector<block_request>& requests);
+};
+
+#endif // PEER_TIER_H
@@ -7,23 +7,177 @@
 */
 
 #include <string>
+#include <string.h>
+#include <algorithm>
+#include <random>
 
 #include "utils.h"
+#include "trace.h"
 #include "base_protocol.h"
+#include "compressed_protocol.h"
 #include "ghost_fs.h"
 
+void base_protocol::get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests) {
+    for (auto& req : requests) {
+        req.bytes_read = get_block(ctx, req.block_id, block_size, req.data);
+    }
+}
+
+// Drivers report failures as short blocks, so a short chunk is only the end
+// of the object if its length is reached, or if it isn't empty when the
+// length isn't known.
+bool base_protocol::get_stream(const fetch_context& ctx, const stream_consumer& consumer) {
+    std::unique_ptr<char[]> data(new char[STREAM_CHUNK_SIZE]);
+    remote_metadata metadata;
+    bool known = get_metadata(ctx, metadata);
+    uint64_t offset = 0;
+
+    for (size_t blk_id = 0;; blk_id++) {
+        size_t size = get_block(ctx, blk_id, STREAM_CHUNK_SIZE, data.get());
+        if (size && !consumer(data.get(), size)) {
+            return false;
+        }
+        offset += size;
+        if (size < STREAM_CHUNK_SIZE) {
+            return known ? offset >= metadata.length : size != 0;
+        }
+    }
+}
+
+bool base_protocol::get_metadata(const fetch_context& ctx, remote_metadata& metadata) {
+    metadata.length = get_content_length_for_url(ctx.url.c_str());
+    metadata.validator.clear();
+    metadata.ranges = supports_range();
+    // Drivers report failures as length 0.
+    return metadata.length != 0;
+}
+
+void base_protocol::get_metadata_batch(std::vector<metadata_request>& requests) {
+    for (auto& req : requests) {
+        req.found = get_metadata(*req.ctx, req.metadata);
+    }
+}
+
+fetch_policy& default_fetch_policy() {
+    static fetch_policy policy;
+    return policy;
+}
+
+fetch_stats& get_fetch_stats() {
+    static fetch_stats stats;
+    return stats;
+}
+
+// Full jitter exponential backoff: a random delay up to 100ms * 2^attempt.
+std::chrono::milliseconds fetch_backoff(unsigned attempt) {
+    static thread_local std::minstd_rand rng(std::random_device{}());
+    unsigned cap = 100u << std::min(attempt, 6u);
+    return std::chrono::milliseconds(std::uniform_int_distribution<unsigned>(0, cap)(rng));
+}
+
+fetch_context::~fetch_context() {
+    if (handler) {
+        handler->release(*this);
+    }
+}
+
+// Split url into scheme, host and path, e.g. "http://example.com/file" into
+// "http", "example.com" and "/file". URLs without "//" after the scheme only
+// have a path.
+static void parse_url(fetch_context& ctx) {
+    const std::string& url = ctx.url;
+    size_t scheme_end = url.find(':');
+
+    if (scheme_end == std::string::npos) {
+        ctx.path = url;
+        return;
+    }
+    ctx.scheme = url.substr(0, scheme_end);
+
+    size_t rest = scheme_end + 1;
+    if (url.compare(rest, 2, "//") != 0) {
+        ctx.path = url.substr(rest);
+        return;
+    }
+    rest += 2;
+
+    size_t path_start = url.find('/', rest);
+    if (path_start == std::string::npos) {
+        ctx.host = url.substr(rest);
+        return;
+    }
+    ctx.host = url.substr(rest, path_start - rest);
+    ctx.path = url.substr(path_start);
+}
+
+std::shared_ptr<fetch_context> make_fetch_context(const char* url,
+        const std::unordered_map<std::string, std::string>& attributes) {
+    base_protocol* handler = get_handler(url);
+
+    if (!handler) {
+        return nullptr;
+    }
+
+    std::shared_ptr<fetch_context> ctx = std::make_shared<fetch_context>();
+    ctx->handler = handler;
+    ctx->url = url;
+    ctx->attributes = attributes;
+    ctx->policy = default_fetch_policy();
+    parse_url(*ctx);
+    ctx->metrics = &get_fetch_metrics(handler->name(), ctx->host);
+    ctx->ranges = handler->supports_range();
+
+    auto it = attributes.find(FETCH_BUDGET_ATTRIBUTE);
+    if (it != attributes.end()) {
+        ctx->policy.budget_ms = strtoul(it->second.c_str(), nullptr, 10);
+    }
+
+    it = attributes.find(CHECKSUMS_ATTRIBUTE);
+    if (it != attributes.end()) {
+        auto checksums = std::make_shared<block_checksums>();
+        int res = load_block_checksums(it->second.c_str(), *checksums);
+        if (res < 0) {
+            log("Unable to load checksums of %s from %s: %s\n", url, it->second.c_str(),
+                strerror(-res));
+        } else {
+            ctx->checksums = std::move(checksums);
+        }
+    }
+
+    // Compressed objects are fetched through handler of url on behalf of the
+    // one decompressing them.
+    it = attributes.find(COMPRESSION_ATTRIBUTE);
+    if (it != attributes.end()) {
+        base_protocol* decompressor = get_compression_handler(parse_compression(it->second));
+        if (decompressor) {
+            ctx->handler = decompressor;
+            ctx->metrics = &get_fetch_metrics(decompressor->name(), ctx->host);
+        } else {
+            log("Unknown compression %s of %s\n", it->second.c_str(), url);
+        }
+    }
+
+    ctx->handler->prepare(*ctx);
+
+    return ctx;
+}
+
 size_t write_callback(void *content_read, size_t size, size_t nmemb, void *p) {
     size_t actual_size = size * nmemb;
     struct data_info* info = (struct data_info*) p;
-    log("\twrite_callback: actual_size: %ld\n", actual_size);
+    TRACE_DEBUG(TRACE_RECEIVED, 0, 0, actual_size, 0);
 
     // Handle possible overflow.
     if (info->offset + actual_size > info->size) {
-        log("\twrite_callback: write would go beyond the end of the buffer\n");
+        TRACE_ERROR(TRACE_OVERFLOW, 0, 0, actual_size, 0);
         return 0;
     }
     memcpy((char *) info->data + info->offset, content_read, actual_size);
     info->offset += actual_size;
+    if (info->progress) {
+        (*info->progress)(info->offset);
+    }
     return actual_size;
 }
 
@@ -33,16 +187,9 @@ void register_handler(struct base_protocol *handler) {
     handlers_[handler->name()] = handler;
 }
 
-std::string get_protocol(const std::string& path) {
-    auto tokens = split(path, ':');
-
-    if (tokens.size() == 0) return "";
-
-    return tokens[0];
-}
-
 struct base_protocol *get_handler(const char *path) {
-    auto it = handlers_.find(get_protocol(path));
+    // Protocol is everything before the first ':'.
+    auto it = handlers_.find(std::string(path, strcspn(path, ":")));
 
     if (it == handlers_.end()) return 0;
 
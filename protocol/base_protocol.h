@@ -9,8 +9,137 @@
 #ifndef BASE_PROTOCOL_H
 #define BASE_PROTOCOL_H
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <stdint.h>
+#include <memory>
+#include <string>
 #include <unordered_map>
+#include <vector>
+
+#include "checksum.h"
+#include "metrics.h"
+
+struct base_protocol;
+
+// Attribute of a file overriding the latency budget of its fetches, in ms.
+#define FETCH_BUDGET_ATTRIBUTE "fetch_budget_ms"
+
+// Limits on how long a fetch may take. Transports enforce them, so a stuck
+// origin fails the fetch instead of blocking readers indefinitely.
+struct fetch_policy {
+    // Time available to a fetch, including retries.
+    unsigned budget_ms = 30000;
+    // Time available to establish a connection.
+    unsigned connect_timeout_ms = 5000;
+    // Time available to receive the first byte of content.
+    unsigned first_byte_timeout_ms = 10000;
+    // Time a transfer may go without receiving anything.
+    unsigned stall_timeout_ms = 5000;
+    // Maximum number of retries of a failed fetch, within its budget.
+    unsigned max_retries = 3;
+};
+
+// Policy of fetches unless overridden by attributes of a file.
+fetch_policy& default_fetch_policy();
+
+struct fetch_stats {
+    std::atomic<uint64_t> timeouts { 0 };
+    std::atomic<uint64_t> retries { 0 };
+    std::atomic<uint64_t> failures { 0 };
+};
+
+fetch_stats& get_fetch_stats();
+
+// Delay before retry attempt + 1 of a failed fetch.
+std::chrono::milliseconds fetch_backoff(unsigned attempt);
+
+// Everything needed to fetch content of a file, which is resolved once, when
+// url or attributes of the file change, instead of on every read.
+struct fetch_context {
+    base_protocol* handler = nullptr;
+    std::string url;
+    // Components of url, e.g. "http", "example.com:8080" and "/dir/file?x=y".
+    std::string scheme;
+    std::string host;
+    std::string path;
+    // Snapshot of attributes of the file at the time context was created.
+    std::unordered_map<std::string, std::string> attributes;
+    fetch_policy policy;
+    // Request template prepared by handler, e.g. with headers to be sent.
+    // It's released by handler when context is destroyed.
+    void* request = nullptr;
+    // Metrics of fetches from host through handler.
+    fetch_metrics* metrics = nullptr;
+    // Checksums of blocks given by the sidecar named by the checksums
+    // attribute, if any.
+    std::shared_ptr<const block_checksums> checksums;
+    // Whether origin serves ranges of the object, as found when metadata got
+    // resolved, or when a fetch got the whole object instead of a range.
+    mutable std::atomic<bool> ranges { true };
+
+    fetch_context() = default;
+    fetch_context(const fetch_context&) = delete;
+
+    ~fetch_context();
+};
+
+// Create context for url, or return nullptr if there is no handler for it.
+std::shared_ptr<fetch_context> make_fetch_context(const char* url,
+    const std::unordered_map<std::string, std::string>& attributes);
+
+// Called with the number of bytes stored from the start of a block, i.e. its
+// watermark, as content of the block lands.
+typedef std::function<void (size_t valid)> block_progress;
+
+// A single block asked by get_blocks(). Driver stores block content in data and
+// sets bytes_read, which cannot be greater than block_size, accordingly.
+// Drivers that report progress call progress, if set, whenever the watermark
+// of data advances, so that reads of the start of the block don't wait for
+// the rest of it. A retry may call it again from a lower watermark, storing
+// the same bytes again.
+struct block_request {
+    size_t block_id;
+    char* data;
+    size_t bytes_read;
+    const block_progress* progress = nullptr;
+
+    block_request(size_t block_id, char* data)
+        : block_id(block_id)
+        , data(data)
+        , bytes_read(0) {}
+};
+
+// Metadata of a remote object.
+struct remote_metadata {
+    uint64_t length = 0;
+    // Opaque value that changes whenever content changes, e.g. an ETag, or
+    // empty if origin provides none.
+    std::string validator;
+    // Whether origin serves ranges of the object. If not, it's streamed from
+    // its start, see get_stream().
+    bool ranges = true;
+};
+
+// Bytes of an object fetched at once by the default get_stream().
+#define STREAM_CHUNK_SIZE (1024 * 1024)
+
+// Called by get_stream() with content of an object as it arrives, in order.
+// Returning false aborts the transfer.
+typedef std::function<bool (const char* data, size_t size)> stream_consumer;
+
+// A single object asked by get_metadata_batch(). Driver stores its metadata
+// in metadata and sets found if it could be retrieved.
+struct metadata_request {
+    const fetch_context* ctx;
+    remote_metadata metadata;
+    bool found;
+
+    explicit metadata_request(const fetch_context* ctx)
+        : ctx(ctx)
+        , found(false) {}
+};
 
 struct base_protocol {
     virtual ~base_protocol(){}
@@ -19,18 +148,51 @@ struct base_protocol {
 
     virtual bool is_url_valid(const char* url) = 0;
     virtual uint64_t get_content_length_for_url(const char *url) = 0;
+    // Store metadata of object at url of ctx in metadata, and return whether
+    // it could be retrieved. Default implementation only knows the length.
+    virtual bool get_metadata(const fetch_context& ctx, remote_metadata& metadata);
+    // Vectored version of get_metadata(), for objects whose contexts all have
+    // this driver as handler. Default implementation falls back to
+    // get_metadata() for each request, so a driver only has to override it if
+    // it's able to issue requests concurrently.
+    virtual void get_metadata_batch(std::vector<metadata_request>& requests);
     // Return number of bytes stored in data, which cannot be greater than block_size.
     // Otherwise there would be an overflow on data.
-    virtual size_t get_block(const char *url, size_t block_id, size_t block_size,
-        const std::unordered_map<std::string, std::string>& attributes, char* data) = 0;
+    virtual size_t get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+        char* data) = 0;
+    // Vectored version of get_block(). Default implementation falls back to
+    // get_block() for each request, so a driver only has to override it if
+    // it's able to batch, coalesce or pipeline requests.
+    virtual void get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests);
+    // Pass content of object from its start to consumer with a single
+    // transfer, for origins that don't serve ranges. Return whether it got
+    // to the end of the object. Default implementation gets it a chunk at a
+    // time through get_block().
+    virtual bool get_stream(const fetch_context& ctx, const stream_consumer& consumer);
+
+    // Prepare a request template for ctx, which will be available to every
+    // fetch through ctx.request, and release it when ctx is destroyed.
+    virtual void prepare(fetch_context& ctx) {}
+    virtual void release(fetch_context& ctx) {}
+
+    // Amount of bytes the driver prefers to get per fetch, 0 if no preference.
+    virtual size_t preferred_fetch_size() { return 0; }
+    // Whether content can be read starting at any offset. If not, objects
+    // are streamed unless their metadata says otherwise.
+    virtual bool supports_range() { return true; }
+    // Whether get_blocks() calls block_request::progress as content lands.
+    virtual bool reports_progress() { return false; }
 };
 
 // write_callback() may be called multiple times to fullfil a request,
-// so data_info is needed to keep track of the offset in data.
+// so data_info is needed to keep track of the offset in data, which is
+// reported to progress, if set.
 struct data_info {
     void *data;
     size_t offset;
     size_t size;
+    const block_progress *progress = nullptr;
 };
 
 size_t write_callback(void *content_read, size_t size, size_t nmemb, void *p);
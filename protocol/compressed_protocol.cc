@@ -0,0 +1,322 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+
+#include "utils.h"
+#include "compressed_protocol.h"
+
+// Compressed object of a file, stored in ctx.request.
+struct compressed_object {
+    // Context of the object through the handler of its url.
+    std::shared_ptr<fetch_context> origin;
+    std::string index_path;
+    // Index is replaced atomically, never modified, so that reads can keep
+    // using the one they got while it's built again. It's built without any
+    // lock held, so reads racing to index an object may each build it.
+    std::shared_ptr<const seek_index> index;
+};
+
+const char* compressed_protocol::name() {
+    return _format == COMPRESSION_GZIP ? "gzip" : "zstd";
+}
+
+bool compressed_protocol::is_url_valid(const char* url) {
+    base_protocol* handler = get_handler(url);
+    return handler && handler->is_url_valid(url);
+}
+
+// Length is only known once the object is indexed, see get_metadata().
+uint64_t compressed_protocol::get_content_length_for_url(const char* url) {
+    return 0;
+}
+
+void compressed_protocol::prepare(fetch_context& ctx) {
+    compressed_object* object = new compressed_object;
+    auto attributes = ctx.attributes;
+
+    // Checksums are the ones of decompressed blocks.
+    attributes.erase(COMPRESSION_ATTRIBUTE);
+    attributes.erase(CHECKSUMS_ATTRIBUTE);
+    object->origin = make_fetch_context(ctx.url.c_str(), attributes);
+
+    auto it = ctx.attributes.find(SEEK_INDEX_ATTRIBUTE);
+    if (it != ctx.attributes.end()) {
+        object->index_path = it->second;
+    }
+    ctx.request = object;
+}
+
+void compressed_protocol::release(fetch_context& ctx) {
+    delete static_cast<compressed_object*>(ctx.request);
+    ctx.request = nullptr;
+}
+
+// Fetch bytes from start to end of an object of length bytes, as blocks of
+// block_size through handler of origin, into data, which is resized to the
+// bytes fetched from the block start is in. Return offset of start in data,
+// or -EIO if some block couldn't be fetched whole.
+static ssize_t fetch_range(const fetch_context& origin, uint64_t length, uint64_t start,
+                           uint64_t end, size_t block_size, std::vector<char>& data) {
+    end = std::min(end, length);
+    if (start >= end) {
+        return -EIO;
+    }
+    size_t first_blk_id = start / block_size;
+    size_t last_blk_id = (end - 1) / block_size;
+    uint64_t first_offset = uint64_t(first_blk_id) * block_size;
+    std::vector<block_request> requests;
+
+    data.resize((last_blk_id - first_blk_id + 1) * block_size);
+    for (size_t blk_id = first_blk_id; blk_id <= last_blk_id; blk_id++) {
+        requests.emplace_back(blk_id, data.data() + (blk_id - first_blk_id) * block_size);
+    }
+    {
+        latency_timer timer(requests.size() == 1 ? origin.metrics->get_block
+                                                 : origin.metrics->get_blocks);
+        origin.handler->get_blocks(origin, block_size, requests);
+    }
+
+    for (auto& req : requests) {
+        origin.metrics->bytes.add(req.bytes_read);
+        if (req.bytes_read < std::min<uint64_t>(block_size, length - uint64_t(req.block_id) * block_size)) {
+            origin.metrics->failures.add();
+            return -EIO;
+        }
+    }
+    data.resize(std::min<uint64_t>(data.size(), length - first_offset));
+    return start - first_offset;
+}
+
+// Load the seek table ending a zstd object, if it has one, in index.
+static int load_zstd_seek_table(const fetch_context& origin, uint64_t length, seek_index& index) {
+    std::vector<char> data;
+
+    if (length < ZSTD_SEEK_FOOTER) {
+        return -EINVAL;
+    }
+    ssize_t footer = fetch_range(origin, length, length - ZSTD_SEEK_FOOTER, length, SEEK_FETCH_SIZE,
+                                 data);
+    if (footer < 0) {
+        return footer;
+    }
+    size_t size = zstd_seek_table_size(data.data() + footer);
+    if (!size || size > length) {
+        return -EINVAL;
+    }
+    // Table is usually within the block its footer is in.
+    ssize_t table = footer + ZSTD_SEEK_FOOTER - ssize_t(size);
+    if (table < 0) {
+        table = fetch_range(origin, length, length - size, length, SEEK_FETCH_SIZE, data);
+        if (table < 0) {
+            return table;
+        }
+    }
+    return parse_zstd_seek_table(data.data() + table, size, index);
+}
+
+// Build index of an object of length bytes by decompressing all of it.
+static int build_index(const fetch_context& origin, compression_format format, uint64_t length,
+                       seek_index& index) {
+    const size_t fetch_size = SEEK_FETCH_SIZE * 4;
+    seek_index_builder builder(format);
+    std::vector<char> data;
+
+    for (uint64_t offset = 0; offset < length; offset += fetch_size) {
+        ssize_t res = fetch_range(origin, length, offset, offset + fetch_size, SEEK_FETCH_SIZE, data);
+        if (res < 0) {
+            return res;
+        }
+        res = builder.add(data.data(), data.size());
+        if (res < 0) {
+            return res;
+        }
+    }
+    return builder.finish(index);
+}
+
+static bool index_matches(const seek_index& index, compression_format format,
+                          const remote_metadata& metadata) {
+    return index.format == format && index.compressed_length == metadata.length &&
+        index.validator == metadata.validator;
+}
+
+// Return index of object, which is loaded or built if it isn't known yet or
+// doesn't match metadata of the object, if given, or nullptr if it can't be.
+static std::shared_ptr<const seek_index> get_index(compressed_object& object,
+                                                   compression_format format,
+                                                   const remote_metadata* metadata) {
+    const fetch_context& origin = *object.origin;
+    std::shared_ptr<const seek_index> known = std::atomic_load(&object.index);
+    remote_metadata current;
+
+    if (!metadata) {
+        if (known) {
+            return known;
+        }
+        latency_timer timer(origin.metrics->get_metadata);
+        if (!origin.handler->get_metadata(origin, current)) {
+            return nullptr;
+        }
+        metadata = &current;
+    }
+    if (known && index_matches(*known, format, *metadata)) {
+        return known;
+    }
+
+    auto index = std::make_shared<seek_index>();
+    const char* path = object.index_path.c_str();
+    if (*path && load_seek_index(path, *index) == 0 && index_matches(*index, format, *metadata)) {
+        std::atomic_store(&object.index, std::shared_ptr<const seek_index>(index));
+        return index;
+    }
+
+    int res = -EINVAL;
+    if (format == COMPRESSION_ZSTD) {
+        res = load_zstd_seek_table(origin, metadata->length, *index);
+    }
+    if (res < 0) {
+        res = build_index(origin, format, metadata->length, *index);
+    }
+    if (res < 0) {
+        log("Unable to index %s: %s\n", origin.url.c_str(), strerror(-res));
+        return nullptr;
+    }
+    index->compressed_length = metadata->length;
+    index->validator = metadata->validator;
+    log("Indexed %s: %lu bytes, %lu points\n", origin.url.c_str(), index->length,
+        index->points.size());
+
+    if (*path && (res = save_seek_index(path, *index)) < 0) {
+        log("Unable to save seek index of %s to %s: %s\n", origin.url.c_str(), path,
+            strerror(-res));
+    }
+    std::atomic_store(&object.index, std::shared_ptr<const seek_index>(index));
+    return index;
+}
+
+bool compressed_protocol::get_metadata(const fetch_context& ctx, remote_metadata& metadata) {
+    auto object = static_cast<compressed_object*>(ctx.request);
+    if (!object || !object->origin) {
+        return false;
+    }
+    const fetch_context& origin = *object->origin;
+    remote_metadata origin_metadata;
+    {
+        latency_timer timer(origin.metrics->get_metadata);
+        if (!origin.handler->get_metadata(origin, origin_metadata)) {
+            return false;
+        }
+    }
+    if (!origin_metadata.ranges) {
+        // Seeking in the object takes ranges of it.
+        log("Unable to decompress %s: its origin doesn't serve ranges\n", origin.url.c_str());
+        return false;
+    }
+
+    std::shared_ptr<const seek_index> index = get_index(*object, _format, &origin_metadata);
+    if (!index) {
+        return false;
+    }
+    metadata.length = index->length;
+    metadata.validator = origin_metadata.validator;
+    return metadata.length != 0;
+}
+
+size_t compressed_protocol::get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+        char* data) {
+    std::vector<block_request> requests{ block_request(block_id, data) };
+    get_blocks(ctx, block_size, requests);
+    return requests[0].bytes_read;
+}
+
+// Decompress consecutive blocks of a run with a single pass, from the point
+// preceding the first one, fetching compressed blocks up to the point
+// following the last one.
+static void decompress_run(const fetch_context& origin, const seek_index& index, size_t block_size,
+                           block_request** run, size_t count) {
+    uint64_t start = uint64_t(run[0]->block_id) * block_size;
+    uint64_t end = std::min<uint64_t>(index.length, (uint64_t(run[count - 1]->block_id) + 1) * block_size);
+    const seek_point& point = index.find(start);
+    uint64_t in_start = point.in - (point.bits ? 1 : 0);
+    std::vector<char> data;
+
+    ssize_t offset = fetch_range(origin, index.compressed_length, in_start,
+                                 std::max(index.end_of(end), in_start + 1), block_size, data);
+    if (offset < 0) {
+        return;
+    }
+    seek_reader reader(index, point, data.data() + offset, data.size() - offset);
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t blk_start = uint64_t(run[i]->block_id) * block_size;
+        if (blk_start >= end) {
+            break;
+        }
+        size_t size = std::min<uint64_t>(block_size, end - blk_start);
+        ssize_t res = reader.read(blk_start, run[i]->data, size);
+        if (res < 0) {
+            log("Unable to decompress %s from %lu: %s\n", origin.url.c_str(), blk_start,
+                strerror(-res));
+            break;
+        }
+        run[i]->bytes_read = res;
+        if (size_t(res) < size) {
+            break;
+        }
+    }
+}
+
+void compressed_protocol::get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests) {
+    auto object = static_cast<compressed_object*>(ctx.request);
+    std::vector<block_request*> sorted;
+
+    for (auto& req : requests) {
+        req.bytes_read = 0;
+        sorted.push_back(&req);
+    }
+    if (!object || !object->origin) {
+        return;
+    }
+    std::shared_ptr<const seek_index> index = get_index(*object, _format, nullptr);
+    if (!index) {
+        return;
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [] (const block_request* a, const block_request* b) {
+        return a->block_id < b->block_id;
+    });
+    for (size_t i = 0; i < sorted.size();) {
+        size_t j = i + 1;
+        while (j < sorted.size() && sorted[j]->block_id == sorted[j - 1]->block_id + 1) {
+            j++;
+        }
+        if (uint64_t(sorted[i]->block_id) * block_size < index->length) {
+            decompress_run(*object->origin, *index, block_size, &sorted[i], j - i);
+        }
+        i = j;
+    }
+}
+
+base_protocol* get_compression_handler(compression_format format) {
+    static compressed_protocol gzip(COMPRESSION_GZIP);
+    static compressed_protocol zstd(COMPRESSION_ZSTD);
+
+    switch (format) {
+    case COMPRESSION_GZIP:
+        return &gzip;
+    case COMPRESSION_ZSTD:
+        return &zstd;
+    default:
+        return nullptr;
+    }
+}
@@ -0,0 +1,52 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef COMPRESSED_PROTOCOL_H
+#define COMPRESSED_PROTOCOL_H
+
+#include "base_protocol.h"
+#include "seek_index.h"
+
+// Bytes of compressed object fetched at once while its index is built.
+#define SEEK_FETCH_SIZE (1024 * 1024)
+
+// Serves the content of compressed objects decompressed, on behalf of the
+// handler of their url, for files with the compression attribute. Length of
+// a file is the one of its decompressed content, and blocks are ranges of
+// it, which get cached like any other block.
+//
+// Reads decompress from the closest point of the seek index of the object,
+// only fetching the compressed bytes up to the next point. The index is
+// loaded from the file named by the seek_index attribute, or from the seek
+// table of zstd seekable format, and otherwise built by fetching the whole
+// object once, and saved to that file if any. It's built again whenever the
+// object changes.
+struct compressed_protocol : public base_protocol {
+    explicit compressed_protocol(compression_format format)
+        : _format(format) {}
+
+    virtual const char* name();
+
+    virtual bool is_url_valid(const char* url);
+    virtual uint64_t get_content_length_for_url(const char *url);
+    virtual bool get_metadata(const fetch_context& ctx, remote_metadata& metadata);
+    virtual size_t get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+        char* data);
+    virtual void get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests);
+
+    virtual void prepare(fetch_context& ctx);
+    virtual void release(fetch_context& ctx);
+private:
+    compression_format _format;
+};
+
+// Return handler decompressing objects in format, or nullptr if there's none.
+base_protocol* get_compression_handler(compression_format format);
+
+#endif // COMPRESSED_PROTOCOL_H
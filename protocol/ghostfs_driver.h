@@ -0,0 +1,109 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// Stable C ABI for native (.so) drivers.
+//
+// A driver library exports GHOSTFS_DRIVER_ENTRY_FUNC, which is called with the
+// ABI version GhostFS was built against and returns a NULL-terminated array of
+// drivers, or NULL if it cannot work with that version. Only the types in this
+// header cross the library boundary, so a driver doesn't need to be built with
+// the same compiler or C++ runtime as GhostFS.
+//
+// Block requests are submitted without blocking, and the driver reports their
+// completion by calling the given callback, from any thread, exactly once. So
+// drivers are free to perform I/O asynchronously with an event loop of their
+// own, instead of having GhostFS dedicate a thread to each request. A request
+// not completed within its timeout is failed by GhostFS, which stops waiting
+// for it.
+
+#ifndef GHOSTFS_DRIVER_H
+#define GHOSTFS_DRIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GHOSTFS_DRIVER_ABI_VERSION 2
+#define GHOSTFS_DRIVER_ENTRY_FUNC "ghostfs_driver_entry"
+
+struct ghostfs_attribute {
+    const char *key;
+    const char *value;
+};
+
+// Memory pointed by a request is owned by GhostFS and remains valid until its
+// completion callback is called, except data, which may be reused once the
+// timeout of the request passed.
+struct ghostfs_block_request {
+    const char *url;
+    const struct ghostfs_attribute *attributes;
+    size_t attributes_count;
+    uint64_t offset;
+    // Driver stores up to length bytes of content, starting at offset, in data.
+    size_t length;
+    char *data;
+    // Time, in ms from submission, left to the request, retries included.
+    // Once it passed, the request is failed, and data must not be written
+    // anymore, though the completion callback must still be called.
+    uint32_t timeout_ms;
+    // Reserved for GhostFS, must not be touched by the driver.
+    void *private_data;
+};
+
+// result is the number of bytes stored in data, or a negative errno on failure.
+typedef void (*ghostfs_completion_func)(struct ghostfs_block_request *req, int64_t result);
+
+#define GHOSTFS_DRIVER_CAP_RANGE (1 << 0) // Content can be read at any offset.
+
+struct ghostfs_driver_capabilities {
+    // Maximum number of requests in flight, 0 if unlimited.
+    uint32_t max_concurrency;
+    // Amount of bytes the driver prefers to get per fetch, 0 if no preference.
+    uint64_t preferred_fetch_size;
+    uint32_t flags;
+};
+
+struct ghostfs_driver_ops {
+    // Must be set to GHOSTFS_DRIVER_ABI_VERSION and sizeof(struct ghostfs_driver_ops)
+    // respectively, allowing new operations to be appended in future versions.
+    uint32_t abi_version;
+    uint32_t struct_size;
+
+    // Protocol handled by the driver, e.g. "s3" for s3://bucket/key.
+    const char *name;
+
+    // Lifecycle: init() is called once when driver is loaded and returns the
+    // context passed to every other operation, or NULL on failure, in which
+    // case the driver is discarded. shutdown() is called once on unmount,
+    // after all submitted requests were completed, or not at all if some
+    // still weren't once the default fetch budget passed.
+    void *(*init)(void);
+    void (*shutdown)(void *ctx);
+
+    void (*get_capabilities)(void *ctx, struct ghostfs_driver_capabilities *caps);
+
+    // Return non-zero if url can be handled.
+    int (*is_url_valid)(void *ctx, const char *url);
+    // Return length of content pointed by url, or a negative errno on failure.
+    int64_t (*get_content_length)(void *ctx, const char *url);
+
+    // Submit a request without blocking. Return 0 if request was accepted, in
+    // which case done() will be called later, or a negative errno otherwise.
+    int (*submit)(void *ctx, struct ghostfs_block_request *req, ghostfs_completion_func done);
+};
+
+typedef const struct ghostfs_driver_ops *const *(*ghostfs_driver_entry_func)(uint32_t abi_version);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // GHOSTFS_DRIVER_H
@@ -7,48 +7,559 @@
 */
 
 #include <curl/curl.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #include "utils.h"
+#include "trace.h"
 #include "http_protocol.h"
 #include "ghost_fs.h"
 
-size_t http_protocol::get_block(const char *url, size_t block_id, size_t block_size,
-        const std::unordered_map<std::string, std::string>& attributes, char* data) {
+// Request template of a file, from which a handle is duplicated for each fetch.
+struct http_request_template {
+    CURL *curl;
+    struct curl_slist *headers;
+};
+
+void http_protocol::prepare(fetch_context& ctx) {
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        log("Curl initialization failed when about to prepare requests to %s\n", ctx.url.c_str());
+        return;
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, ctx.url.c_str());
+
+    struct curl_slist *headers = nullptr;
+    size_t prefix_size = strlen(HTTP_HEADER_ATTRIBUTE_PREFIX);
+    for (auto& it : ctx.attributes) {
+        if (it.first.compare(0, prefix_size, HTTP_HEADER_ATTRIBUTE_PREFIX) == 0) {
+            std::string header = it.first.substr(prefix_size) + ": " + it.second;
+            headers = curl_slist_append(headers, header.c_str());
+        }
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    ctx.request = new http_request_template{ curl, headers };
+}
+
+void http_protocol::release(fetch_context& ctx) {
+    auto tmpl = static_cast<http_request_template*>(ctx.request);
+    if (!tmpl) {
+        return;
+    }
+    curl_easy_cleanup(tmpl->curl);
+    curl_slist_free_all(tmpl->headers);
+    delete tmpl;
+    ctx.request = nullptr;
+}
+
+// Return a curl handle ready to perform a request to url of ctx.
+static CURL *new_request(const fetch_context& ctx) {
+    auto tmpl = static_cast<http_request_template*>(ctx.request);
+    if (tmpl) {
+        return curl_easy_duphandle(tmpl->curl);
+    }
+
+    CURL *curl = curl_easy_init();
+    if (curl) {
+        curl_easy_setopt(curl, CURLOPT_URL, ctx.url.c_str());
+    }
+    return curl;
+}
+
+// Set up curl handle to perform a range request for size bytes starting at
+// offset, whose content will be stored in the buffer described by info.
+static void setup_range_request(CURL *curl, const char *url, uint64_t offset,
+        size_t size, char *range, size_t range_size, struct data_info *info) {
+    snprintf(range, range_size, "%ld-%ld", offset, offset+size-1);
+    TRACE_DEBUG(TRACE_RANGE_REQUEST, 0, offset, size, 0);
+
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)info);
+}
+
+size_t http_get_range(const char *url, uint64_t offset, size_t size, char *data) {
     char buffer[128];
     struct data_info info;
     CURL *curl;
 
     curl = curl_easy_init();
     if(!curl) {
-        log("Curl initialization failed when about to get block %ld from %s\n", block_id, url);
+        log("Curl initialization failed when about to get offset %ld from %s\n", offset, url);
         return 0;
     }
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-
-    size_t offset = block_id * block_size;
-    snprintf(buffer, 128, "%ld-%ld", offset, offset+block_size-1);
-    log("\trange request to %s: %s\n", url, buffer);
-
     info.data = data;
     info.offset = 0;
-    info.size = block_size;
+    info.size = size;
 
-    curl_easy_setopt(curl, CURLOPT_RANGE, buffer);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&info);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    setup_range_request(curl, url, offset, size, buffer, sizeof(buffer), &info);
+
+    // Python drivers may block in here with no way to be interrupted, so the
+    // request is aborted if it runs out of budget, or gets no byte for as
+    // long as a stall may last.
+    const fetch_policy& policy = default_fetch_policy();
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long) policy.connect_timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long) policy.budget_ms);
+    if (policy.stall_timeout_ms) {
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,
+            std::max(1L, long(policy.stall_timeout_ms / 1000)));
+    }
 
     /* Perform the request */
     CURLcode res = curl_easy_perform(curl);
     if (res != CURLE_OK) {
+        if (res == CURLE_OPERATION_TIMEDOUT) {
+            get_fetch_stats().timeouts++;
+        }
         log("Request to %s failed, reason: %s\n", url, curl_easy_strerror(res));
+        curl_easy_cleanup(curl);
         return 0;
     }
-    log("\tget_block finished for block %ld of %s!\n", block_id, url);
     curl_easy_cleanup(curl);
     return info.offset;
 }
 
+size_t http_protocol::get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+        char* data) {
+    std::vector<block_request> requests{ block_request(block_id, data) };
+    get_blocks(ctx, block_size, requests);
+    return requests[0].bytes_read;
+}
+
+// State of one range request, shared with curl callbacks.
+struct transfer {
+    CURL *curl = nullptr;
+    struct data_info info;
+    char range[128];
+    const fetch_policy *policy;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point last_progress;
+    curl_off_t received = 0;
+    // Set when progress_callback() aborted the transfer.
+    bool timed_out = false;
+};
+
+// Abort transfers that don't get their first byte, or any further byte, in time.
+static int progress_callback(void *p, curl_off_t dltotal, curl_off_t dlnow,
+        curl_off_t ultotal, curl_off_t ulnow) {
+    auto t = static_cast<transfer*>(p);
+    auto now = std::chrono::steady_clock::now();
+
+    if (dlnow != t->received) {
+        t->received = dlnow;
+        t->last_progress = now;
+        return 0;
+    }
+    unsigned timeout_ms = t->received ? t->policy->stall_timeout_ms : t->policy->first_byte_timeout_ms;
+    if (timeout_ms && now - t->last_progress > std::chrono::milliseconds(timeout_ms)) {
+        t->timed_out = true;
+        return 1;
+    }
+    return 0;
+}
+
+// Failures that a later attempt may not run into.
+static bool is_retryable(CURLcode res, long response_code) {
+    switch (res) {
+    case CURLE_HTTP_RETURNED_ERROR:
+        return response_code >= 500 || response_code == 429;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_ABORTED_BY_CALLBACK:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_RECV_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// All range requests are performed concurrently through a curl multi handle,
+// which will also multiplex them over a single connection if the server
+// supports HTTP/2. Failed requests are retried while the budget of ctx allows.
+void http_protocol::get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests) {
+    using clock = std::chrono::steady_clock;
+    const char *url = ctx.url.c_str();
+    const fetch_policy& policy = ctx.policy;
+    auto& stats = get_fetch_stats();
+    auto deadline = clock::now() + std::chrono::milliseconds(policy.budget_ms);
+    std::vector<transfer> transfers(requests.size());
+
+    CURLM *multi = curl_multi_init();
+    if (!multi) {
+        log("Curl multi initialization failed when about to get %ld blocks from %s\n",
+            requests.size(), url);
+        return;
+    }
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < requests.size(); i++) {
+        requests[i].bytes_read = 0;
+        pending.push_back(i);
+    }
+
+    for (unsigned attempt = 0; !pending.empty(); attempt++) {
+        auto now = clock::now();
+        if (now >= deadline) {
+            log("Budget of %u ms to fetch from %s ran out\n", policy.budget_ms, url);
+            stats.timeouts += pending.size();
+            break;
+        }
+        long remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+
+        for (auto i : pending) {
+            auto& req = requests[i];
+            auto& t = transfers[i];
+
+            t.curl = new_request(ctx);
+            if (!t.curl) {
+                log("Curl initialization failed when about to get block %ld from %s\n", req.block_id, url);
+                continue;
+            }
+            t.info.data = req.data;
+            t.info.offset = 0;
+            t.info.size = block_size;
+            t.info.progress = req.progress;
+            t.policy = &policy;
+            t.started = t.last_progress = now;
+            t.received = 0;
+            t.timed_out = false;
+
+            setup_range_request(t.curl, url, req.block_id * block_size, block_size, t.range, sizeof(t.range), &t.info);
+            curl_easy_setopt(t.curl, CURLOPT_PIPEWAIT, 1L);
+            curl_easy_setopt(t.curl, CURLOPT_FAILONERROR, 1L);
+            curl_easy_setopt(t.curl, CURLOPT_TIMEOUT_MS, remaining_ms);
+            curl_easy_setopt(t.curl, CURLOPT_CONNECTTIMEOUT_MS,
+                std::min<long>(policy.connect_timeout_ms, remaining_ms));
+            curl_easy_setopt(t.curl, CURLOPT_NOPROGRESS, 0L);
+            curl_easy_setopt(t.curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+            curl_easy_setopt(t.curl, CURLOPT_XFERINFODATA, (void *)&t);
+            curl_multi_add_handle(multi, t.curl);
+        }
+
+        int running = 0;
+        do {
+            CURLMcode mc = curl_multi_perform(multi, &running);
+            if (mc == CURLM_OK && running) {
+                mc = curl_multi_wait(multi, NULL, 0, 100, NULL);
+            }
+            if (mc != CURLM_OK) {
+                log("Requests to %s failed, reason: %s\n", url, curl_multi_strerror(mc));
+                break;
+            }
+        } while (running);
+
+        // Only transfers that completed successfully are accounted as read.
+        std::vector<size_t> retry;
+        CURLMsg *msg;
+        int msgs_left;
+        while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            for (auto i : pending) {
+                auto& t = transfers[i];
+                if (t.curl != msg->easy_handle) {
+                    continue;
+                }
+                CURLcode res = msg->data.result;
+                if (res == CURLE_OK) {
+                    requests[i].bytes_read = t.info.offset;
+                    break;
+                }
+                long response_code = 0;
+                curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &response_code);
+                if (res == CURLE_WRITE_ERROR && response_code == 200) {
+                    // Whole object got sent instead of the range, and
+                    // overflowed the block.
+                    log("Origin of %s doesn't serve ranges, it will be streamed\n", url);
+                    ctx.ranges = false;
+                    break;
+                }
+                log("Request to %s failed, reason: %s%s\n", url, curl_easy_strerror(res),
+                    t.timed_out ? " (no progress)" : "");
+                if (t.timed_out || res == CURLE_OPERATION_TIMEDOUT) {
+                    stats.timeouts++;
+                }
+                if (is_retryable(res, response_code)) {
+                    retry.push_back(i);
+                }
+                break;
+            }
+        }
+
+        for (auto i : pending) {
+            auto& t = transfers[i];
+            if (t.curl) {
+                curl_multi_remove_handle(multi, t.curl);
+                curl_easy_cleanup(t.curl);
+                t.curl = nullptr;
+            }
+        }
+
+        if (retry.empty() || attempt >= policy.max_retries) {
+            break;
+        }
+        auto delay = fetch_backoff(attempt);
+        if (clock::now() + delay >= deadline) {
+            break;
+        }
+        std::this_thread::sleep_for(delay);
+        stats.retries += retry.size();
+        pending.swap(retry);
+    }
+
+    for (auto& req : requests) {
+        if (!req.bytes_read) {
+            stats.failures++;
+        }
+    }
+    curl_multi_cleanup(multi);
+}
+
+// State of one metadata request, shared with curl callbacks.
+struct metadata_transfer {
+    CURL *curl = nullptr;
+    size_t index;
+    std::string etag;
+    // Total length given by Content-Range, or -1 if there is none.
+    curl_off_t range_total = -1;
+    // Whether Accept-Ranges says ranges are served, or -1 if there is none.
+    int accept_ranges = -1;
+    // Set once the first byte is asked instead of HEAD, either because HEAD
+    // got rejected or because it didn't tell whether ranges are served.
+    bool ranged = false;
+    // Set when the first byte was asked, and the whole object came instead.
+    bool whole = false;
+};
+
+// Return value of header in buffer, or nullptr if buffer holds another header.
+static const char *header_value(const char *buffer, size_t len, const char *header) {
+    size_t header_len = strlen(header);
+    if (len <= header_len || strncasecmp(buffer, header, header_len) != 0) {
+        return nullptr;
+    }
+    return buffer + header_len;
+}
+
+// Store value of ETag and total length given by Content-Range, e.g.
+// "bytes 0-0/1234", in the transfer pointed by p.
+static size_t metadata_header_callback(char *buffer, size_t size, size_t nitems, void *p) {
+    auto t = static_cast<metadata_transfer*>(p);
+    size_t len = size * nitems;
+    const char *end = buffer + len;
+    const char *value;
+
+    if ((value = header_value(buffer, len, "ETag:"))) {
+        t->etag.assign(value, end);
+        t->etag.erase(0, t->etag.find_first_not_of(" \t"));
+        t->etag.erase(t->etag.find_last_not_of(" \t\r\n") + 1);
+    } else if ((value = header_value(buffer, len, "Accept-Ranges:"))) {
+        std::string units(value, end);
+        t->accept_ranges = units.find("bytes") != std::string::npos;
+    } else if ((value = header_value(buffer, len, "Content-Range:"))) {
+        std::string range(value, end);
+        size_t slash = range.find('/');
+        if (slash != std::string::npos && isdigit(range[slash + 1])) {
+            t->range_total = strtoll(range.c_str() + slash + 1, nullptr, 10);
+        }
+    }
+    return len;
+}
+
+// Discard the first byte, and abort the transfer if the whole object is being
+// sent instead.
+static size_t first_byte_callback(void *content_read, size_t size, size_t nmemb, void *p) {
+    auto t = static_cast<metadata_transfer*>(p);
+    long response_code = 0;
+
+    curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &response_code);
+    if (response_code == 200) {
+        t->whole = true;
+        return 0;
+    }
+    return size * nmemb;
+}
+
+// Set up a HEAD request for metadata of ctx, or a request for its first byte,
+// which tells whether ranges are served, if HEAD didn't do.
+static bool setup_metadata_request(metadata_transfer& t, const fetch_context& ctx) {
+    t.curl = new_request(ctx);
+    if (!t.curl) {
+        log("Curl initialization failed when about to get metadata of %s\n", ctx.url.c_str());
+        return false;
+    }
+    t.etag.clear();
+    t.range_total = -1;
+    t.accept_ranges = -1;
+    t.whole = false;
+
+    if (t.ranged) {
+        curl_easy_setopt(t.curl, CURLOPT_RANGE, "0-0");
+        curl_easy_setopt(t.curl, CURLOPT_WRITEFUNCTION, first_byte_callback);
+        curl_easy_setopt(t.curl, CURLOPT_WRITEDATA, (void *)&t);
+    } else {
+        curl_easy_setopt(t.curl, CURLOPT_NOBODY, 1L);
+    }
+    curl_easy_setopt(t.curl, CURLOPT_PRIVATE, (char *)&t);
+    curl_easy_setopt(t.curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(t.curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(t.curl, CURLOPT_FILETIME, 1L);
+    curl_easy_setopt(t.curl, CURLOPT_HEADERFUNCTION, metadata_header_callback);
+    curl_easy_setopt(t.curl, CURLOPT_HEADERDATA, (void *)&t);
+    curl_easy_setopt(t.curl, CURLOPT_CONNECTTIMEOUT_MS, (long) ctx.policy.connect_timeout_ms);
+    curl_easy_setopt(t.curl, CURLOPT_TIMEOUT_MS, (long) ctx.policy.budget_ms);
+    return true;
+}
+
+// ETag is used as validator, falling back to modification time if origin
+// doesn't provide one.
+static void store_metadata(metadata_transfer& t, remote_metadata& metadata) {
+    curl_off_t length = -1;
+    long filetime = -1;
+
+    if (t.ranged && !t.whole) {
+        length = t.range_total;
+    } else {
+        curl_easy_getinfo(t.curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    }
+    metadata.ranges = t.ranged ? !t.whole : t.accept_ranges == 1;
+    curl_easy_getinfo(t.curl, CURLINFO_FILETIME, &filetime);
+
+    metadata.length = (length > 0) ? length : 0;
+    if (!t.etag.empty()) {
+        metadata.validator = t.etag;
+    } else if (filetime >= 0) {
+        metadata.validator = std::to_string(filetime);
+    } else {
+        metadata.validator.clear();
+    }
+}
+
+bool http_protocol::get_metadata(const fetch_context& ctx, remote_metadata& metadata) {
+    std::vector<metadata_request> requests{ metadata_request(&ctx) };
+    get_metadata_batch(requests);
+    metadata = std::move(requests[0].metadata);
+    return requests[0].found;
+}
+
+// Up to HTTP_METADATA_CONCURRENCY requests are kept in flight through a curl
+// multi handle, which reuses connections across requests to the same origin
+// and multiplexes them if it supports HTTP/2. Origins rejecting HEAD, or not
+// telling whether they serve ranges with Accept-Ranges, are asked for the
+// first byte instead, whose response has the total length in Content-Range if
+// they do.
+void http_protocol::get_metadata_batch(std::vector<metadata_request>& requests) {
+    std::vector<metadata_transfer> transfers(requests.size());
+    size_t next = 0, in_flight = 0;
+
+    CURLM *multi = curl_multi_init();
+    if (!multi) {
+        log("Curl multi initialization failed when about to get metadata of %ld objects\n",
+            requests.size());
+        return;
+    }
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    auto add_next = [&] {
+        while (next < requests.size() && in_flight < HTTP_METADATA_CONCURRENCY) {
+            auto& t = transfers[next];
+            t.index = next++;
+            if (setup_metadata_request(t, *requests[t.index].ctx)) {
+                curl_multi_add_handle(multi, t.curl);
+                in_flight++;
+            }
+        }
+    };
+    auto finish = [&] (metadata_transfer& t) {
+        curl_multi_remove_handle(multi, t.curl);
+        curl_easy_cleanup(t.curl);
+        t.curl = nullptr;
+        in_flight--;
+    };
+
+    add_next();
+    while (in_flight) {
+        int running = 0;
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (mc == CURLM_OK && running) {
+            mc = curl_multi_wait(multi, NULL, 0, 100, NULL);
+        }
+        if (mc != CURLM_OK) {
+            log("Metadata requests failed, reason: %s\n", curl_multi_strerror(mc));
+            break;
+        }
+
+        CURLMsg *msg;
+        int msgs_left;
+        while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            char *priv;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+            auto& t = *reinterpret_cast<metadata_transfer*>(priv);
+            auto& req = requests[t.index];
+            const char *url = req.ctx->url.c_str();
+            CURLcode res = msg->data.result;
+
+            if (res == CURLE_OK && !t.ranged && t.accept_ranges < 0) {
+                finish(t);
+                t.ranged = true;
+                if (setup_metadata_request(t, *req.ctx)) {
+                    curl_multi_add_handle(multi, t.curl);
+                    in_flight++;
+                }
+                continue;
+            }
+            if (res == CURLE_OK || (res == CURLE_WRITE_ERROR && t.whole)) {
+                store_metadata(t, req.metadata);
+                req.found = true;
+                finish(t);
+                continue;
+            }
+            long response_code = 0;
+            curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &response_code);
+            finish(t);
+
+            if (!t.ranged && (response_code == 405 || response_code == 501)) {
+                t.ranged = true;
+                if (setup_metadata_request(t, *req.ctx)) {
+                    curl_multi_add_handle(multi, t.curl);
+                    in_flight++;
+                }
+                continue;
+            }
+            log("Request to %s failed, reason: %s\n", url, curl_easy_strerror(res));
+        }
+        add_next();
+    }
+
+    for (auto& t : transfers) {
+        if (t.curl) {
+            curl_multi_remove_handle(multi, t.curl);
+            curl_easy_cleanup(t.curl);
+        }
+    }
+    curl_multi_cleanup(multi);
+}
+
 uint64_t http_protocol::get_content_length_for_url(const char *url) {
     CURL *curl = curl_easy_init();
     if(!curl) {
@@ -71,7 +582,59 @@ uint64_t http_protocol::get_content_length_for_url(const char *url) {
     return (uint64_t) content_length;
 }
 
-// TODO: check if web server exists and accepts range request
+// Whether origin serves ranges is found along with metadata, see
+// get_metadata_batch().
 bool http_protocol::is_url_valid(const char* url) {
     return true;
 }
+
+// State of a stream, shared with curl callbacks.
+struct stream_transfer {
+    transfer t;
+    const stream_consumer *consumer;
+};
+
+static size_t stream_callback(void *content_read, size_t size, size_t nmemb, void *p) {
+    auto s = static_cast<stream_transfer*>(p);
+    size_t actual_size = size * nmemb;
+    TRACE_DEBUG(TRACE_RECEIVED, 0, 0, actual_size, 0);
+
+    return (*s->consumer)(static_cast<const char *>(content_read), actual_size) ? actual_size : 0;
+}
+
+// A stream has no budget, as it lasts as long as the object takes to be
+// transferred, but is aborted like a range request if it goes without
+// progress for too long. It isn't retried, as its consumer would have to
+// start over.
+bool http_protocol::get_stream(const fetch_context& ctx, const stream_consumer& consumer) {
+    const char *url = ctx.url.c_str();
+    stream_transfer s;
+
+    s.t.curl = new_request(ctx);
+    if (!s.t.curl) {
+        log("Curl initialization failed when about to stream %s\n", url);
+        return false;
+    }
+    s.consumer = &consumer;
+    s.t.policy = &ctx.policy;
+    s.t.started = s.t.last_progress = std::chrono::steady_clock::now();
+
+    curl_easy_setopt(s.t.curl, CURLOPT_WRITEFUNCTION, stream_callback);
+    curl_easy_setopt(s.t.curl, CURLOPT_WRITEDATA, (void *)&s);
+    curl_easy_setopt(s.t.curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(s.t.curl, CURLOPT_CONNECTTIMEOUT_MS, (long) ctx.policy.connect_timeout_ms);
+    curl_easy_setopt(s.t.curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(s.t.curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+    curl_easy_setopt(s.t.curl, CURLOPT_XFERINFODATA, (void *)&s.t);
+
+    CURLcode res = curl_easy_perform(s.t.curl);
+    if (res != CURLE_OK && res != CURLE_WRITE_ERROR) {
+        log("Stream of %s failed, reason: %s%s\n", url, curl_easy_strerror(res),
+            s.t.timed_out ? " (no progress)" : "");
+        if (s.t.timed_out) {
+            get_fetch_stats().timeouts++;
+        }
+    }
+    curl_easy_cleanup(s.t.curl);
+    return res == CURLE_OK;
+}
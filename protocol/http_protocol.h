@@ -11,15 +11,37 @@
 
 #include "base_protocol.h"
 
+// Attributes of a file starting with this prefix are sent as request headers,
+// e.g. attribute header.Authorization is sent as header Authorization.
+#define HTTP_HEADER_ATTRIBUTE_PREFIX "header."
+
+// Maximum number of metadata requests in flight in a batch.
+#define HTTP_METADATA_CONCURRENCY 32
+
 struct http_protocol : public base_protocol {
     virtual const char* name() { return "http"; }
 
     virtual bool is_url_valid(const char* url);
     virtual uint64_t get_content_length_for_url(const char *url);
-    virtual size_t get_block(const char *url, size_t block_id, size_t block_size,
-        const std::unordered_map<std::string, std::string>& attributes, char* data);
+    virtual bool get_metadata(const fetch_context& ctx, remote_metadata& metadata);
+    virtual void get_metadata_batch(std::vector<metadata_request>& requests);
+    virtual size_t get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+        char* data);
+    virtual void get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests);
+    virtual bool get_stream(const fetch_context& ctx, const stream_consumer& consumer);
+
+    virtual void prepare(fetch_context& ctx);
+    virtual void release(fetch_context& ctx);
+
+    virtual bool reports_progress() { return true; }
 };
 
+// Store up to size bytes of url, starting at offset, in data with a single
+// range request, bounded by the default fetch policy. Return number of bytes
+// stored.
+size_t http_get_range(const char *url, uint64_t offset, size_t size, char *data);
+
 struct https_protocol : public http_protocol {
     virtual const char* name() { return "https"; }
 };
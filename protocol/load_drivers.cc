@@ -12,15 +12,44 @@
 #include "utils.h"
 #include "protocol/load_drivers.h"
 #include "protocol/base_protocol.h"
+#include "protocol/native_driver.h"
 
+static std::vector<native_protocol*> native_drivers;
 
-ghostfs_driver_init_func get_driver_init_function(const char* lib) {
-    void* handler = dlopen(lib, RTLD_NOW);
-    return reinterpret_cast<ghostfs_driver_init_func>(dlsym(handler, GHOSTFS_DRIVER_INIT_FUNC));
+static void register_native_drivers(ghostfs_driver_entry_func entry) {
+    const ghostfs_driver_ops* const* drivers = entry(GHOSTFS_DRIVER_ABI_VERSION);
+
+    if (!drivers) {
+        log("Native driver library doesn't support ABI version %d\n", GHOSTFS_DRIVER_ABI_VERSION);
+        return;
+    }
+
+    for (; *drivers; ++drivers) {
+        native_protocol* handler = make_native_protocol(*drivers);
+
+        if (handler) {
+            native_drivers.push_back(handler);
+            register_handler(handler);
+        }
+    }
 }
 
 void register_drivers(const boost::filesystem::path& lib) {
-    auto fini = get_driver_init_function(lib.string().c_str());
+    void* handler = dlopen(lib.string().c_str(), RTLD_NOW);
+
+    if (!handler) {
+        log("Unable to load driver %s, reason: %s\n", lib.string().c_str(), dlerror());
+        return;
+    }
+
+    auto entry = reinterpret_cast<ghostfs_driver_entry_func>(dlsym(handler, GHOSTFS_DRIVER_ENTRY_FUNC));
+
+    if (entry) {
+        register_native_drivers(entry);
+        return;
+    }
+
+    auto fini = reinterpret_cast<ghostfs_driver_init_func>(dlsym(handler, GHOSTFS_DRIVER_INIT_FUNC));
 
     if (fini) {
         fini();
@@ -66,3 +95,9 @@ void load_drivers(const boost::filesystem::path& current_path) {
         }
     }
 }
+
+void unload_drivers() {
+    for (auto driver : native_drivers) {
+        driver->shutdown();
+    }
+}
@@ -17,11 +17,17 @@
 
 void load_drivers(const boost::filesystem::path& current_path);
 
+// Call shutdown hook of native drivers.
+void unload_drivers();
+
 #define GHOSTFS_EXT_LIB_DECL extern "C"
 #define GHOSTFS_DRIVER_DIR "ghostfs_driver"
 #define GHOSTFS_DRIVER_INIT_FUNC "drivers_init"
 #define GHOSTFS_DRIVER_EXT ".so"
 
+// Legacy entry point, which registers drivers through register_handler() and
+// so requires the driver to be built with the same C++ ABI as GhostFS. Drivers
+// should export GHOSTFS_DRIVER_ENTRY_FUNC instead, see ghostfs_driver.h.
 typedef void (*ghostfs_driver_init_func)();
 
 #endif // LIB_PROTOCOL_H
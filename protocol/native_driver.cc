@@ -0,0 +1,246 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <string.h>
+
+#include "utils.h"
+#include "protocol/native_driver.h"
+
+// Url and attributes of a fetch context in the C representation, which are
+// shared with batches, as those may outlive the context.
+struct native_request_template {
+    std::string url;
+    std::unordered_map<std::string, std::string> attributes;
+    std::vector<ghostfs_attribute> c_attributes;
+};
+
+// Keeps track of a batch of requests submitted to the driver, which is
+// complete once pending drops to zero. If the caller stops waiting for it
+// before, it's abandoned, and deleted by the last completion.
+struct native_batch {
+    native_protocol* driver;
+    std::shared_ptr<const native_request_template> request;
+    std::vector<ghostfs_block_request> requests;
+    std::vector<int64_t> results;
+    size_t pending = 0;
+    bool abandoned = false;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+native_protocol::native_protocol(const ghostfs_driver_ops* ops, void* ctx)
+    : _ops(ops)
+    , _ctx(ctx) {
+    memset(&_caps, 0, sizeof(_caps));
+    _caps.flags = GHOSTFS_DRIVER_CAP_RANGE;
+    if (_ops->get_capabilities) {
+        _ops->get_capabilities(_ctx, &_caps);
+    }
+}
+
+native_protocol::~native_protocol() {
+    shutdown();
+}
+
+const char *native_protocol::name() {
+    return _ops->name;
+}
+
+bool native_protocol::is_url_valid(const char *url) {
+    return _ops->is_url_valid(_ctx, url) != 0;
+}
+
+uint64_t native_protocol::get_content_length_for_url(const char *url) {
+    int64_t length = _ops->get_content_length(_ctx, url);
+    if (length < 0) {
+        log("%s: unable to get length of %s, reason: %s\n", name(), url, strerror(-length));
+        return 0;
+    }
+    return length;
+}
+
+// Attributes are converted to the C representation once per context.
+void native_protocol::prepare(fetch_context& ctx) {
+    auto request = std::make_shared<native_request_template>();
+    request->url = ctx.url;
+    request->attributes = ctx.attributes;
+    request->c_attributes.reserve(request->attributes.size());
+    for (auto& it : request->attributes) {
+        request->c_attributes.push_back({ it.first.c_str(), it.second.c_str() });
+    }
+    ctx.request = new std::shared_ptr<const native_request_template>(std::move(request));
+}
+
+void native_protocol::release(fetch_context& ctx) {
+    delete static_cast<std::shared_ptr<const native_request_template>*>(ctx.request);
+    ctx.request = nullptr;
+}
+
+size_t native_protocol::get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+        char* data) {
+    std::vector<block_request> requests;
+    requests.emplace_back(block_id, data);
+    get_blocks(ctx, block_size, requests);
+    return requests.front().bytes_read;
+}
+
+// Requests are given the time left of the budget of ctx when submitted, and
+// the ones not completed once it ran out are failed.
+void native_protocol::get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests) {
+    using clock = std::chrono::steady_clock;
+    auto deadline = clock::now() + std::chrono::milliseconds(ctx.policy.budget_ms);
+    auto request = *static_cast<std::shared_ptr<const native_request_template>*>(ctx.request);
+
+    native_batch* batch = new native_batch;
+    batch->driver = this;
+    batch->request = request;
+    batch->requests.resize(requests.size());
+    batch->results.assign(requests.size(), -ETIMEDOUT);
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        ghostfs_block_request& req = batch->requests[i];
+        req.url = request->url.c_str();
+        req.attributes = request->c_attributes.data();
+        req.attributes_count = request->c_attributes.size();
+        req.offset = requests[i].block_id * block_size;
+        req.length = block_size;
+        req.data = requests[i].data;
+        req.private_data = batch;
+
+        if (!acquire_slot(deadline)) {
+            break;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - clock::now()).count();
+        req.timeout_ms = std::max<int64_t>(remaining, 1);
+        {
+            std::lock_guard<std::mutex> lock(batch->mtx);
+            batch->pending++;
+        }
+        int ret = _ops->submit(_ctx, &req, complete);
+        // Failure is logged by complete().
+        if (ret < 0) {
+            complete(&req, ret);
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(batch->mtx);
+    batch->cv.wait_until(lock, deadline, [batch] { return batch->pending == 0; });
+
+    size_t timed_out = 0;
+    for (size_t i = 0; i < requests.size(); i++) {
+        int64_t result = batch->results[i];
+        timed_out += result == -ETIMEDOUT;
+        // Driver cannot store more than block size bytes.
+        requests[i].bytes_read = (result < 0) ? 0 : std::min(size_t(result), block_size);
+    }
+    if (timed_out) {
+        log("%s: budget of %u ms to fetch from %s ran out\n", name(), ctx.policy.budget_ms,
+            ctx.url.c_str());
+        get_fetch_stats().timeouts += timed_out;
+    }
+
+    if (batch->pending) {
+        batch->abandoned = true;
+        return;
+    }
+    lock.unlock();
+    delete batch;
+}
+
+size_t native_protocol::preferred_fetch_size() {
+    return _caps.preferred_fetch_size;
+}
+
+bool native_protocol::supports_range() {
+    return _caps.flags & GHOSTFS_DRIVER_CAP_RANGE;
+}
+
+void native_protocol::shutdown() {
+    if (_shut_down) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(_mtx);
+        auto timeout = std::chrono::milliseconds(default_fetch_policy().budget_ms);
+        if (!_cv.wait_for(lock, timeout, [this] { return _in_flight == 0; })) {
+            log("%s: %lu requests still in flight, driver isn't shut down\n", name(), _in_flight);
+            _shut_down = true;
+            return;
+        }
+    }
+    if (_ops->shutdown) {
+        _ops->shutdown(_ctx);
+    }
+    _shut_down = true;
+}
+
+bool native_protocol::acquire_slot(std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(_mtx);
+    if (_caps.max_concurrency &&
+            !_cv.wait_until(lock, deadline, [this] { return _in_flight < _caps.max_concurrency; })) {
+        return false;
+    }
+    _in_flight++;
+    return true;
+}
+
+void native_protocol::release_slot() {
+    std::lock_guard<std::mutex> lock(_mtx);
+    _in_flight--;
+    _cv.notify_all();
+}
+
+// Completion callback given to the driver, which may call it from any thread.
+void native_protocol::complete(ghostfs_block_request *req, int64_t result) {
+    native_batch* batch = static_cast<native_batch*>(req->private_data);
+    size_t i = req - batch->requests.data();
+
+    if (result < 0) {
+        log("%s: request for offset %ld of %s failed, reason: %s\n",
+            batch->driver->name(), req->offset, req->url, strerror(-result));
+    }
+    batch->driver->release_slot();
+
+    std::unique_lock<std::mutex> lock(batch->mtx);
+    if (batch->abandoned) {
+        if (--batch->pending == 0) {
+            lock.unlock();
+            delete batch;
+        }
+        return;
+    }
+    batch->results[i] = result;
+    if (--batch->pending == 0) {
+        batch->cv.notify_all();
+    }
+}
+
+native_protocol* make_native_protocol(const ghostfs_driver_ops* ops) {
+    if (!ops || ops->abi_version != GHOSTFS_DRIVER_ABI_VERSION ||
+            ops->struct_size < sizeof(ghostfs_driver_ops)) {
+        log("Native driver %s was built against an incompatible ABI version\n",
+            (ops && ops->name) ? ops->name : "<unknown>");
+        return nullptr;
+    }
+
+    if (!ops->name || !ops->is_url_valid || !ops->get_content_length || !ops->submit) {
+        log("Native driver %s doesn't define all mandatory operations\n",
+            ops->name ? ops->name : "<unknown>");
+        return nullptr;
+    }
+
+    void* ctx = ops->init ? ops->init() : nullptr;
+    if (ops->init && !ctx) {
+        log("Native driver %s failed to initialize\n", ops->name);
+        return nullptr;
+    }
+
+    return new native_protocol(ops, ctx);
+}
@@ -0,0 +1,68 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef NATIVE_DRIVER_H
+#define NATIVE_DRIVER_H
+
+#include <condition_variable>
+#include <mutex>
+
+#include "base_protocol.h"
+#include "ghostfs_driver.h"
+
+struct native_batch;
+
+// Adapter of a driver written against the C ABI in ghostfs_driver.h.
+// Requests are submitted asynchronously, and the calling thread only waits
+// for their completion, so a batch of blocks doesn't need a thread per block.
+// It waits for no longer than the budget of the fetch, failing requests the
+// driver didn't complete by then.
+struct native_protocol : public base_protocol {
+    native_protocol(const ghostfs_driver_ops* ops, void* ctx);
+
+    virtual ~native_protocol();
+
+    virtual const char* name();
+
+    virtual bool is_url_valid(const char* url);
+    virtual uint64_t get_content_length_for_url(const char *url);
+    virtual size_t get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+        char* data);
+    virtual void get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests);
+    virtual void prepare(fetch_context& ctx);
+    virtual void release(fetch_context& ctx);
+    virtual size_t preferred_fetch_size();
+    virtual bool supports_range();
+
+    // Wait for requests in flight and call driver's shutdown hook, unless
+    // some are still in flight after the default fetch budget.
+    void shutdown();
+private:
+    const ghostfs_driver_ops* _ops;
+    void* _ctx;
+    ghostfs_driver_capabilities _caps;
+    bool _shut_down = false;
+
+    // Number of requests in flight, bounded by max_concurrency of the driver.
+    size_t _in_flight = 0;
+    std::mutex _mtx;
+    std::condition_variable _cv;
+
+    // Return false if no slot got free by deadline.
+    bool acquire_slot(std::chrono::steady_clock::time_point deadline);
+    void release_slot();
+
+    static void complete(ghostfs_block_request* req, int64_t result);
+};
+
+// Create an adapter for ops, or return nullptr if driver is incompatible
+// or failed to initialize.
+native_protocol* make_native_protocol(const ghostfs_driver_ops* ops);
+
+#endif // NATIVE_DRIVER_H
@@ -6,21 +6,36 @@
   See the file COPYING.
 */
 
+#include <algorithm>
 #include <vector>
 
 #include <boost/filesystem.hpp>
 
 #include "protocol/base_protocol.h"
+#include "protocol/http_protocol.h"
 #include "protocol/python_driver.h"
 #include "utils.h"
 
 namespace  fs = boost::filesystem;
 
+// Maximum number of attribute dictionaries cached per driver.
+#define PYTHON_ATTRIBUTES_CACHE_SIZE 4096
+
+// Read-only dictionary of attributes of a file, which is only rebuilt when
+// attributes of the file change, i.e. when its fetch context is recreated.
+struct python_attributes {
+    std::unordered_map<std::string, std::string> snapshot;
+    PyObject* dict = nullptr;
+};
+
 struct python_protocol_placeholder_impl {
     python_protocol_placeholder_impl(PyObject* _instance)
-        : _instance(_instance) {}
+        : _instance(_instance)
+        , _has_get_block_into(PyObject_HasAttrString(_instance, "get_block_into") == 1) {}
 
     ~python_protocol_placeholder_impl() {
+        python::ensure_gil_state ensure_gil;
+        clear_attributes_cache();
         Py_XDECREF(_instance);
     }
 
@@ -30,8 +45,20 @@ struct python_protocol_placeholder_impl {
     uint64_t get_content_length_for_url(const char *url);
     size_t get_block(const char *url, size_t block_id, size_t block_size,
                    const std::unordered_map<std::string, std::string>& attributes, char* data);
+    void get_blocks(const char *url, size_t block_size,
+                    const std::unordered_map<std::string, std::string>& attributes,
+                    std::vector<block_request>& requests);
 private:
     PyObject* _instance = 0;
+    bool _has_get_block_into;
+    // Keyed by address of attributes in the fetch context of a file. Only
+    // accessed with GIL held.
+    std::unordered_map<const void*, python_attributes> _attributes_cache;
+
+    PyObject* get_attributes(const std::unordered_map<std::string, std::string>& attributes);
+    void clear_attributes_cache();
+    size_t fetch_block(const char *url, PyObject* attributes, size_t offset,
+                       size_t block_size, char* data);
 };
 ////////////////////////////////////////////////////////////////////////////
 using plugin_names_list = std::vector<std::string>;
@@ -156,17 +183,134 @@ uint64_t python_protocol_placeholder_impl::get_content_length_for_url(const char
 PyObject* convert_to_pyhashmap(const std::unordered_map<std::string, std::string> &attributes) {
     PyObject* dict = PyDict_New();
 
-    for (auto it: attributes) {
+    for (auto& it: attributes) {
         PyObject* py_key = PyString_FromString(it.first.c_str());
         PyObject* py_value = PyString_FromString(it.second.c_str());
 
+        // PyDict_SetItem() doesn't steal references.
         PyDict_SetItem(dict, py_key, py_value);
-
+        Py_XDECREF(py_key);
+        Py_XDECREF(py_value);
     }
 
     return dict;
 }
 
+// Return a borrowed reference to a read-only dictionary with attributes, which
+// is only rebuilt if attributes changed since the last call for the same file.
+PyObject* python_protocol_placeholder_impl::get_attributes(const std::unordered_map<std::string, std::string> &attributes) {
+    auto it = _attributes_cache.find(&attributes);
+
+    if (it != _attributes_cache.end() && it->second.snapshot == attributes) {
+        return it->second.dict;
+    }
+
+    if (it == _attributes_cache.end() && _attributes_cache.size() >= PYTHON_ATTRIBUTES_CACHE_SIZE) {
+        clear_attributes_cache();
+    }
+
+    python_attributes& cached = _attributes_cache[&attributes];
+    PyObject* dict = convert_to_pyhashmap(attributes);
+
+    Py_XDECREF(cached.dict);
+    // Drivers share the cached dictionary, so they are given a read-only view of it.
+    cached.dict = PyDictProxy_New(dict);
+    cached.snapshot = attributes;
+    Py_XDECREF(dict);
+
+    return cached.dict;
+}
+
+void python_protocol_placeholder_impl::clear_attributes_cache() {
+    for (auto& it : _attributes_cache) {
+        Py_XDECREF(it.second.dict);
+    }
+    _attributes_cache.clear();
+}
+
+// Copy content of a string returned by the driver into data. Content beyond
+// block_size is discarded, otherwise there would be an overflow on data.
+static size_t copy_block_result(PyObject* result, size_t block_size, char* data) {
+    if (PyString_Check(result) == 0) {
+        log("'get_block()' must to return a string.\n");
+        return 0;
+    }
+
+    size_t size = PyString_Size(result);
+    char* c_result = PyString_AsString(result);
+
+    if (!c_result) {
+        return 0;
+    }
+    size = std::min(size, block_size);
+    memcpy(data, c_result, size);
+
+    return size;
+}
+
+// If the driver defines 'get_block_into(url, attributes, offset, buffer)', it's
+// given a writable memoryview over data, so it can store block content there
+// directly, e.g. with readinto(), and return the number of bytes stored.
+// Otherwise, string returned by 'get_block()' is copied into data.
+// Must be called with GIL held.
+size_t python_protocol_placeholder_impl::fetch_block(const char *url, PyObject* attributes,
+                                                     size_t offset, size_t block_size, char* data) {
+    if (!_has_get_block_into) {
+        PyObject* result = PyObject_CallMethod(_instance,
+                                               "get_block", "(sOLL)",
+                                               url, attributes,
+                                               offset, block_size);
+        if (result == NULL) {
+            PyErr_Print();
+            PyErr_Clear();
+            return 0;
+        }
+
+        size_t size = copy_block_result(result, block_size, data);
+        Py_XDECREF(result);
+        return size;
+    }
+
+    Py_buffer view;
+    PyBuffer_FillInfo(&view, NULL, data, block_size, 0, PyBUF_CONTIG);
+    PyObject* buffer = PyMemoryView_FromBuffer(&view);
+
+    if (buffer == NULL) {
+        PyErr_Print();
+        PyErr_Clear();
+        return 0;
+    }
+
+    PyObject* result = PyObject_CallMethod(_instance,
+                                           "get_block_into", "(sOLO)",
+                                           url, attributes,
+                                           offset, buffer);
+    if (result == NULL) {
+        PyErr_Print();
+        PyErr_Clear();
+    }
+
+    // data belongs to a cache block that will be reused later on.
+    if (Py_REFCNT(buffer) > 1) {
+        log("'get_block_into()' must not keep a reference to buffer.\n");
+    }
+    Py_XDECREF(buffer);
+
+    if (result == NULL) {
+        return 0;
+    }
+
+    Py_ssize_t size = 0;
+    if (PyInt_Check(result) || PyLong_Check(result)) {
+        size = PyNumber_AsSsize_t(result, NULL);
+    } else {
+        log("'get_block_into()' must to return number of bytes stored in buffer.\n");
+    }
+    Py_XDECREF(result);
+
+    return (size < 0) ? 0 : std::min(size_t(size), block_size);
+}
+
 size_t python_protocol_placeholder_impl::get_block(const char *url,
                                                  size_t block_id,
                                                  size_t block_size,
@@ -175,29 +319,61 @@ size_t python_protocol_placeholder_impl::get_block(const char *url,
     python::ensure_gil_state ensure_gil;
     size_t offset = block_id * block_size;
 
+    return fetch_block(url, get_attributes(attributes), offset, block_size, data);
+}
+
+// If the driver defines 'get_blocks(url, attributes, offsets, block_size)', all
+// blocks are asked in a single call, which must return a list of strings in
+// the same order of offsets. Otherwise, each block is fetched individually,
+// but GIL is acquired only once.
+void python_protocol_placeholder_impl::get_blocks(const char *url,
+                                                  size_t block_size,
+                                                  const std::unordered_map<std::string, std::string> &attributes,
+                                                  std::vector<block_request>& requests) {
+    python::ensure_gil_state ensure_gil;
+
+    PyObject* m = get_attributes(attributes);
+
+    if (PyObject_HasAttrString(_instance, "get_blocks") == 0) {
+        for (auto& req : requests) {
+            req.bytes_read = fetch_block(url, m, req.block_id * block_size, block_size, req.data);
+        }
+        return;
+    }
+
+    PyObject* offsets = PyList_New(requests.size());
+    for (size_t i = 0; i < requests.size(); i++) {
+        requests[i].bytes_read = 0;
+        // PyList_SetItem() steals the reference.
+        PyList_SetItem(offsets, i, PyLong_FromSize_t(requests[i].block_id * block_size));
+    }
 
-    PyObject* m = convert_to_pyhashmap(attributes);
     PyObject* result = PyObject_CallMethod(_instance,
-                                           "get_block", "(sOLL)",
+                                           "get_blocks", "(sOOL)",
                                            url, m,
-                                           offset, block_size);
+                                           offsets, block_size);
+    Py_XDECREF(offsets);
 
     if (result == NULL) {
         PyErr_Print();
         PyErr_Clear();
-        return 0;
+        return;
     }
 
-    size_t size = PyString_Size(result);
-    char* c_result = PyString_AsString(result);
+    if (PyList_Check(result) == 0) {
+        log("'get_blocks()' must to return a list.\n");
+        Py_XDECREF(result);
+        return;
+    }
 
-    if (c_result) {
-        memcpy(data, c_result, size);
+    size_t count = std::min(size_t(PyList_Size(result)), requests.size());
+    for (size_t i = 0; i < count; i++) {
+        // PyList_GetItem() returns a borrowed reference.
+        PyObject* block = PyList_GetItem(result, i);
+        requests[i].bytes_read = copy_block_result(block, block_size, requests[i].data);
     }
 
-    Py_XDECREF(m);
     Py_XDECREF(result);
-    return size;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////
@@ -222,18 +398,23 @@ uint64_t python_protocol_placeholder::get_content_length_for_url(const char *url
     return _impl->get_content_length_for_url(url);
 }
 
-size_t python_protocol_placeholder::get_block(const char *url,
+size_t python_protocol_placeholder::get_block(const fetch_context& ctx,
                                             size_t block_id,
                                             size_t block_size,
-                                            const std::unordered_map<std::string, std::string> &attributes,
                                             char *data) {
-    return _impl->get_block(url,
+    return _impl->get_block(ctx.url.c_str(),
                      block_id,
                      block_size,
-                     attributes,
+                     ctx.attributes,
                      data);
 }
 
+void python_protocol_placeholder::get_blocks(const fetch_context& ctx,
+                                             size_t block_size,
+                                             std::vector<block_request>& requests) {
+    _impl->get_blocks(ctx.url.c_str(), block_size, ctx.attributes, requests);
+}
+
 python_protocol_placeholder* get_python_plugin(const char* module,
                                                const char* plugin_name) {
     PyObject* pModule = PyImport_ImportModule(module);
@@ -292,6 +473,12 @@ python_protocol_placeholder* get_python_plugin(const char* module,
     return new python_protocol_placeholder(pInstance);
 }
 
+static std::vector<std::string> python_drivers;
+
+const std::vector<std::string>& python_driver_names() {
+    return python_drivers;
+}
+
 void register_python_drivers(const boost::filesystem::path& script) {
     python::ensure_gil_state ensure_gil;
 
@@ -304,6 +491,7 @@ void register_python_drivers(const boost::filesystem::path& script) {
 
         if (handler) {
             register_handler(handler);
+            python_drivers.push_back(handler->name());
         } else {
             PyErr_Print();
             PyErr_Clear();
@@ -358,10 +546,41 @@ void load_python_drivers(const boost::filesystem::path &current_path)
 }
 
 ///////////////////////////////////////////////////////////
+// Built-in 'ghostfs' module, whose functions perform I/O with GIL released,
+// so other threads running python drivers aren't blocked meanwhile.
+
+// ghostfs.fetch_range(url, offset, buffer): store content of url starting at
+// offset in writable buffer with a range request, and return number of bytes
+// stored.
+static PyObject* ghostfs_fetch_range(PyObject* self, PyObject* args) {
+    const char* url;
+    unsigned long long offset;
+    Py_buffer buffer;
+
+    if (!PyArg_ParseTuple(args, "sKw*", &url, &offset, &buffer)) {
+        return NULL;
+    }
+
+    size_t size;
+    Py_BEGIN_ALLOW_THREADS
+    size = http_get_range(url, offset, buffer.len, static_cast<char*>(buffer.buf));
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&buffer);
+    return PyLong_FromSize_t(size);
+}
+
+static PyMethodDef ghostfs_methods[] = {
+    {"fetch_range", ghostfs_fetch_range, METH_VARARGS,
+     "Store content of url starting at offset in buffer, releasing the GIL meanwhile."},
+    {NULL, NULL, 0, NULL}
+};
+
 python::initialize::initialize()
 {
     PyEval_InitThreads();
     Py_Initialize();
+    Py_InitModule("ghostfs", ghostfs_methods);
     _mainstate = PyThreadState_Swap(NULL);
     PyEval_ReleaseLock();
 }
@@ -17,9 +17,20 @@
 
 void load_python_drivers(const boost::filesystem::path& current_path);
 
+// Names of python drivers registered by load_python_drivers().
+const std::vector<std::string>& python_driver_names();
+
 #define GHOSTFS_PYTHON_DRIVER_DIR "ghostfs_driver/python"
 #define GHOSTFS_PYTHON_GET_DRIVERS_FUNC "get_drivers"
 
+// Adapter of a driver written in python, which must define name(),
+// is_url_valid(url), get_content_length_for_url(url) and either:
+//  - get_block_into(url, attributes, offset, buffer), storing block content
+//    directly in writable memoryview buffer and returning number of bytes stored;
+//  - get_block(url, attributes, offset, size), returning block content as string.
+// attributes is a read-only dictionary, and buffer must not be referenced after
+// get_block_into() returns. Drivers may use ghostfs.fetch_range(url, offset,
+// buffer) to perform a range request with GIL released.
 struct python_protocol_placeholder_impl;
 struct python_protocol_placeholder : public base_protocol {
     python_protocol_placeholder(PyObject* instance);
@@ -30,8 +41,10 @@ struct python_protocol_placeholder : public base_protocol {
 
     virtual bool is_url_valid(const char* url);
     virtual uint64_t get_content_length_for_url(const char *url);
-    virtual size_t get_block(const char *url, size_t block_id, size_t block_size,
-                           const std::unordered_map<std::string, std::string>& attributes, char* data);
+    virtual size_t get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+                             char* data);
+    virtual void get_blocks(const fetch_context& ctx, size_t block_size,
+                            std::vector<block_request>& requests);
 private:
     python_protocol_placeholder_impl* _impl = 0;
 };
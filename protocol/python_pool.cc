@@ -0,0 +1,796 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "protocol/base_protocol.h"
+#include "protocol/python_driver.h"
+#include "protocol/python_pool.h"
+
+#define PYTHON_POOL_MAX_WORKERS 64
+#define PYTHON_POOL_SLOTS 256
+#define PYTHON_POOL_MAX_DRIVERS 64
+#define PYTHON_POOL_NAME_SIZE 64
+#define PYTHON_POOL_URL_SIZE 4096
+#define PYTHON_POOL_ATTRIBUTES_SIZE 4096
+#define PYTHON_POOL_STARTUP_TIMEOUT 30 // seconds
+#define PYTHON_POOL_BOUNCE_BUFFERS 32
+#define PYTHON_POOL_BOUNCE_SIZE (1024 * 1024)
+
+enum pool_op : uint32_t {
+    POOL_OP_IS_URL_VALID,
+    POOL_OP_GET_CONTENT_LENGTH,
+    POOL_OP_GET_BLOCK,
+};
+
+enum slot_state : uint32_t {
+    SLOT_FREE,
+    SLOT_QUEUED,
+    SLOT_TAKEN,
+    SLOT_DONE,
+    // Caller ran out of budget before any worker took it, so the worker that
+    // dequeues it frees it instead.
+    SLOT_CANCELLED,
+};
+
+// A request, which is owned by the caller until it's queued, then by the
+// worker that took it until it's done.
+struct pool_slot {
+    std::atomic<uint32_t> state;
+    uint32_t op;
+    int32_t worker;
+    uint64_t offset;
+    uint64_t size;
+    // Offset of the buffer content is written to, in cache or in bounce
+    // buffers if bounce is set.
+    uint64_t arena_offset;
+    uint32_t bounce;
+    int64_t result;
+    sem_t done;
+    char url[PYTHON_POOL_URL_SIZE];
+    // Attributes stored as a sequence of null-terminated key and value.
+    uint32_t attributes_size;
+    char attributes[PYTHON_POOL_ATTRIBUTES_SIZE];
+};
+
+// Ring of slot indexes queued to a worker. It cannot overflow because there
+// are only PYTHON_POOL_SLOTS slots in total.
+struct pool_queue {
+    pthread_mutex_t mtx;
+    sem_t items;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring[PYTHON_POOL_SLOTS];
+};
+
+// Layout of the memory shared between ghostfs and its workers.
+struct pool_shared {
+    pthread_mutex_t mtx; // protects free_list.
+    sem_t free_slots;
+    uint32_t free_count;
+    uint32_t free_list[PYTHON_POOL_SLOTS];
+
+    std::atomic<uint32_t> shutdown;
+
+    // Drivers published by the first worker that finished loading them.
+    sem_t drivers_ready;
+    std::atomic<uint32_t> drivers_published;
+    uint32_t driver_count;
+    char drivers[PYTHON_POOL_MAX_DRIVERS][PYTHON_POOL_NAME_SIZE];
+
+    pool_queue queues[PYTHON_POOL_MAX_WORKERS];
+    pool_slot slots[PYTHON_POOL_SLOTS];
+};
+
+// Lock a mutex shared with workers, recovering it if its owner died.
+static void lock_shared(pthread_mutex_t* mtx) {
+    if (pthread_mutex_lock(mtx) == EOWNERDEAD) {
+        pthread_mutex_consistent(mtx);
+    }
+}
+
+static void init_shared_mutex(pthread_mutex_t* mtx) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void wait_sem(sem_t* sem) {
+    while (sem_wait(sem) < 0 && errno == EINTR);
+}
+
+using pool_clock = std::chrono::steady_clock;
+
+static pool_clock::time_point deadline_after(unsigned budget_ms) {
+    return pool_clock::now() + std::chrono::milliseconds(budget_ms);
+}
+
+// Wait for sem until deadline, and return false if it passed.
+static bool wait_sem_until(sem_t* sem, pool_clock::time_point deadline) {
+    auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::max(deadline - pool_clock::now(), pool_clock::duration::zero())).count();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000000000 + (ts.tv_nsec + timeout % 1000000000) / 1000000000;
+    ts.tv_nsec = (ts.tv_nsec + timeout % 1000000000) % 1000000000;
+
+    int res;
+    while ((res = sem_timedwait(sem, &ts)) < 0 && errno == EINTR);
+    return res == 0;
+}
+
+// Give slot back to the free list, from ghostfs or from a worker.
+static void release_slot(pool_shared* shared, uint32_t index) {
+    shared->slots[index].state = SLOT_FREE;
+    lock_shared(&shared->mtx);
+    shared->free_list[shared->free_count++] = index;
+    pthread_mutex_unlock(&shared->mtx);
+    sem_post(&shared->free_slots);
+}
+
+static pool_shared* map_shared(int fd) {
+    void* p = mmap(nullptr, sizeof(pool_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return (p == MAP_FAILED) ? nullptr : static_cast<pool_shared*>(p);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ghostfs side
+
+struct python_pool {
+    pool_shared* shared = nullptr;
+    int shared_fd = -1;
+    cache* c = nullptr;
+    unsigned workers = 0;
+    std::mutex pids_mtx; // protects pids.
+    std::vector<pid_t> pids;
+    std::string exe;
+    std::thread monitor;
+    // Content of requests whose buffer isn't in cache, e.g. compressed
+    // content fetched by the gzip and zstd handlers, is written by workers
+    // to one of the bounce buffers, and copied to the buffer once done.
+    int bounce_fd = -1;
+    char* bounce = nullptr;
+    std::mutex bounce_mtx;
+    std::condition_variable bounce_cv;
+    std::vector<uint32_t> free_bounce;
+    // Buffer and bounce buffer of each slot, if it uses one.
+    char* bounce_data[PYTHON_POOL_SLOTS] = {};
+    int32_t bounce_of[PYTHON_POOL_SLOTS] = {};
+
+    bool spawn(unsigned worker);
+    void fail_taken(unsigned worker);
+    void kill_taker(pool_slot& slot);
+    void watch();
+    // Return a free bounce buffer, waiting for one until deadline if wait is
+    // set, or -EBUSY or -ETIMEDOUT.
+    int32_t take_bounce(bool wait, pool_clock::time_point deadline);
+    void free_bounce_buffer(int32_t buffer);
+    // Queue a request and return its slot, or a negative errno on failure.
+    // Unless wait is set, -EBUSY is returned if no slot is free, or if data
+    // needs a bounce buffer and none is free, as the caller may hold the
+    // ones to be freed. Otherwise they're waited for until deadline.
+    int64_t submit(uint64_t workers_mask, pool_op op, const char* url,
+                   const std::unordered_map<std::string, std::string>* attributes,
+                   uint64_t offset, uint64_t size, char* data,
+                   pool_clock::time_point deadline, bool wait = true);
+    // Wait for completion of a request until deadline and return its result,
+    // or -ETIMEDOUT, once the request is cancelled or its worker killed.
+    int64_t wait(int64_t index, pool_clock::time_point deadline);
+    int64_t call(uint64_t workers_mask, pool_op op, const char* url,
+                 const std::unordered_map<std::string, std::string>* attributes,
+                 uint64_t offset, uint64_t size, char* data, unsigned budget_ms) {
+        auto deadline = deadline_after(budget_ms);
+        return wait(submit(workers_mask, op, url, attributes, offset, size, data, deadline),
+                    deadline);
+    }
+};
+
+static python_pool pool;
+
+bool python_pool::spawn(unsigned worker) {
+    std::string index = std::to_string(worker);
+    std::string shared_arg = std::to_string(shared_fd);
+    std::string arena_arg = std::to_string(c->arena_fd());
+    std::string bounce_arg = std::to_string(bounce_fd);
+    char* argv[] = { const_cast<char*>(exe.c_str()),
+                     const_cast<char*>(GHOSTFS_PYTHON_WORKER_ARG),
+                     const_cast<char*>(index.c_str()),
+                     const_cast<char*>(shared_arg.c_str()),
+                     const_cast<char*>(arena_arg.c_str()),
+                     const_cast<char*>(bounce_arg.c_str()),
+                     nullptr };
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unable to start python worker %d, reason: %s\n", worker, strerror(errno));
+        return false;
+    }
+    if (pid == 0) {
+        execv(exe.c_str(), argv);
+        _exit(127);
+    }
+    std::lock_guard<std::mutex> lock(pids_mtx);
+    pids[worker] = pid;
+    return true;
+}
+
+// Fail requests taken by a worker that died, so their callers aren't stuck.
+// Requests still queued to it will be served by its replacement.
+void python_pool::fail_taken(unsigned worker) {
+    for (auto& slot : shared->slots) {
+        uint32_t expected = SLOT_TAKEN;
+        if (slot.worker == int32_t(worker) &&
+                slot.state.compare_exchange_strong(expected, SLOT_DONE)) {
+            slot.result = -EIO;
+            sem_post(&slot.done);
+        }
+    }
+}
+
+// Kill the worker that took slot, whose request ran out of budget, as python
+// code cannot be interrupted otherwise. Its request is then failed by
+// fail_taken() once it's reaped.
+void python_pool::kill_taker(pool_slot& slot) {
+    std::lock_guard<std::mutex> lock(pids_mtx);
+    // Worker may have finished, or died and been replaced, since.
+    if (slot.state != SLOT_TAKEN || pids[slot.worker] <= 0) {
+        return;
+    }
+    log("Python worker %d ran out of budget to fetch from %s, killing it\n", slot.worker, slot.url);
+    kill(pids[slot.worker], SIGKILL);
+}
+
+// Reap workers that exited, and replace them unless pool is stopping.
+void python_pool::watch() {
+    for (;;) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (shared->shutdown) {
+                return;
+            }
+            usleep(100 * 1000);
+            continue;
+        }
+
+        int worker = -1;
+        {
+            std::lock_guard<std::mutex> lock(pids_mtx);
+            for (unsigned i = 0; i < workers; i++) {
+                if (pids[i] == pid) {
+                    pids[i] = -1;
+                    worker = i;
+                }
+            }
+        }
+        if (worker >= 0) {
+            fail_taken(worker);
+            if (!shared->shutdown) {
+                log("Python worker %d exited with status %d, restarting it\n", worker, status);
+                spawn(worker);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(pids_mtx);
+        if (shared->shutdown && std::none_of(pids.begin(), pids.end(), [] (pid_t p) { return p > 0; })) {
+            return;
+        }
+    }
+}
+
+int32_t python_pool::take_bounce(bool wait, pool_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(bounce_mtx);
+    if (free_bounce.empty() && !wait) {
+        return -EBUSY;
+    }
+    if (!bounce_cv.wait_until(lock, deadline, [this] { return !free_bounce.empty(); })) {
+        return -ETIMEDOUT;
+    }
+    int32_t buffer = free_bounce.back();
+    free_bounce.pop_back();
+    return buffer;
+}
+
+void python_pool::free_bounce_buffer(int32_t buffer) {
+    std::lock_guard<std::mutex> lock(bounce_mtx);
+    free_bounce.push_back(buffer);
+    bounce_cv.notify_one();
+}
+
+// Serialize a request into a free slot and queue it to the least loaded
+// worker allowed by workers_mask.
+int64_t python_pool::submit(uint64_t workers_mask, pool_op op, const char* url,
+                            const std::unordered_map<std::string, std::string>* attributes,
+                            uint64_t offset, uint64_t size, char* data,
+                            pool_clock::time_point deadline, bool wait) {
+    if (strlen(url) >= PYTHON_POOL_URL_SIZE) {
+        log("URL %s is too long to be handled by python workers\n", url);
+        return -ENAMETOOLONG;
+    }
+    int32_t buffer = -1;
+    if (data && !c->arena_contains(data, size)) {
+        if (size > PYTHON_POOL_BOUNCE_SIZE) {
+            log("Buffer for %s isn't shared with python workers\n", url);
+            return -EINVAL;
+        }
+        buffer = take_bounce(wait, deadline);
+        if (buffer < 0) {
+            return buffer;
+        }
+    }
+
+    size_t attributes_size = 0;
+    if (attributes) {
+        for (auto& it : *attributes) {
+            attributes_size += it.first.size() + it.second.size() + 2;
+        }
+    }
+    if (attributes_size > PYTHON_POOL_ATTRIBUTES_SIZE) {
+        log("Attributes of %s are too long to be handled by python workers\n", url);
+        if (buffer >= 0) {
+            free_bounce_buffer(buffer);
+        }
+        return -E2BIG;
+    }
+
+    int res = 0;
+    if (wait) {
+        res = wait_sem_until(&shared->free_slots, deadline) ? 0 : -ETIMEDOUT;
+    } else {
+        while ((res = sem_trywait(&shared->free_slots)) < 0 && errno == EINTR);
+        res = (res < 0) ? -EBUSY : 0;
+    }
+    if (res < 0) {
+        if (buffer >= 0) {
+            free_bounce_buffer(buffer);
+        }
+        return res;
+    }
+    lock_shared(&shared->mtx);
+    uint32_t index = shared->free_list[--shared->free_count];
+    pthread_mutex_unlock(&shared->mtx);
+
+    pool_slot& slot = shared->slots[index];
+    slot.op = op;
+    slot.worker = -1;
+    slot.offset = offset;
+    slot.size = size;
+    slot.bounce = buffer >= 0;
+    if (slot.bounce) {
+        slot.arena_offset = uint64_t(buffer) * PYTHON_POOL_BOUNCE_SIZE;
+    } else {
+        slot.arena_offset = data ? c->arena_offset(data) : 0;
+    }
+    bounce_of[index] = buffer;
+    bounce_data[index] = data;
+    slot.result = -EIO;
+    strcpy(slot.url, url);
+
+    slot.attributes_size = 0;
+    if (attributes) {
+        for (auto& it : *attributes) {
+            memcpy(slot.attributes + slot.attributes_size, it.first.c_str(), it.first.size() + 1);
+            slot.attributes_size += it.first.size() + 1;
+            memcpy(slot.attributes + slot.attributes_size, it.second.c_str(), it.second.size() + 1);
+            slot.attributes_size += it.second.size() + 1;
+        }
+    }
+
+    unsigned target = 0;
+    uint32_t target_load = UINT32_MAX;
+    for (unsigned i = 0; i < workers; i++) {
+        uint32_t load = shared->queues[i].tail - shared->queues[i].head;
+        if ((workers_mask & (uint64_t(1) << i)) && load < target_load) {
+            target = i;
+            target_load = load;
+        }
+    }
+
+    pool_queue& q = shared->queues[target];
+    slot.state = SLOT_QUEUED;
+    lock_shared(&q.mtx);
+    q.ring[q.tail++ % PYTHON_POOL_SLOTS] = index;
+    pthread_mutex_unlock(&q.mtx);
+    sem_post(&q.items);
+
+    return index;
+}
+
+// A request that runs out of budget while queued is cancelled, and one that
+// does while taken has its worker killed, and is only given up once that
+// worker is reaped, so nothing is written to its buffer afterwards.
+int64_t python_pool::wait(int64_t index, pool_clock::time_point deadline) {
+    if (index < 0) {
+        if (index == -ETIMEDOUT) {
+            get_fetch_stats().timeouts++;
+        }
+        return index;
+    }
+
+    pool_slot& slot = shared->slots[index];
+    int32_t buffer = bounce_of[index];
+    bool timed_out = false;
+    if (!wait_sem_until(&slot.done, deadline)) {
+        uint32_t expected = SLOT_QUEUED;
+        if (slot.state.compare_exchange_strong(expected, SLOT_CANCELLED)) {
+            if (buffer >= 0) {
+                free_bounce_buffer(buffer);
+            }
+            get_fetch_stats().timeouts++;
+            return -ETIMEDOUT;
+        }
+        if (expected == SLOT_TAKEN) {
+            kill_taker(slot);
+            timed_out = true;
+        }
+        wait_sem(&slot.done);
+    }
+    int64_t result = timed_out ? -ETIMEDOUT : slot.result;
+    if (timed_out) {
+        get_fetch_stats().timeouts++;
+    }
+
+    if (buffer >= 0) {
+        if (result > 0) {
+            memcpy(bounce_data[index], bounce + uint64_t(buffer) * PYTHON_POOL_BOUNCE_SIZE,
+                   std::min(uint64_t(result), slot.size));
+        }
+        free_bounce_buffer(buffer);
+    }
+
+    release_slot(shared, index);
+
+    return result;
+}
+
+// Handler registered in ghostfs for each python driver run by workers.
+struct python_pool_protocol : public base_protocol {
+    python_pool_protocol(const char* name, uint64_t workers_mask)
+        : _name(name)
+        , _workers_mask(workers_mask) {}
+
+    virtual const char* name() {
+        return _name.c_str();
+    }
+
+    // Requests without a fetch context are bounded by the default budget.
+    virtual bool is_url_valid(const char* url) {
+        return pool.call(_workers_mask, POOL_OP_IS_URL_VALID, url, nullptr, 0, 0, nullptr,
+                         default_fetch_policy().budget_ms) > 0;
+    }
+
+    virtual uint64_t get_content_length_for_url(const char *url) {
+        int64_t length = pool.call(_workers_mask, POOL_OP_GET_CONTENT_LENGTH, url, nullptr, 0, 0, nullptr,
+                                   default_fetch_policy().budget_ms);
+        return (length < 0) ? 0 : length;
+    }
+
+    virtual size_t get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+            char* data) {
+        int64_t bytes_read = pool.call(_workers_mask, POOL_OP_GET_BLOCK, ctx.url.c_str(), &ctx.attributes,
+                                       block_id * block_size, block_size, data, ctx.policy.budget_ms);
+        return (bytes_read < 0) ? 0 : std::min(size_t(bytes_read), block_size);
+    }
+
+    // All blocks are queued before waiting for any of them, so they're spread
+    // across workers and fetched in parallel. If slots or bounce buffers run
+    // out, the blocks queued so far are waited for, freeing the ones they
+    // use, so that no caller waits for them while holding any. The budget
+    // bounds the whole batch.
+    virtual void get_blocks(const fetch_context& ctx, size_t block_size,
+            std::vector<block_request>& requests) {
+        auto deadline = deadline_after(ctx.policy.budget_ms);
+        std::vector<int64_t> slots;
+        size_t waited = 0;
+        auto wait_until = [&] (size_t end) {
+            for (; waited < end; waited++) {
+                int64_t bytes_read = pool.wait(slots[waited], deadline);
+                requests[waited].bytes_read = (bytes_read < 0) ? 0 : std::min(size_t(bytes_read), block_size);
+            }
+        };
+        for (auto& req : requests) {
+            int64_t slot = pool.submit(_workers_mask, POOL_OP_GET_BLOCK, ctx.url.c_str(), &ctx.attributes,
+                                       req.block_id * block_size, block_size, req.data, deadline, false);
+            if (slot == -EBUSY) {
+                wait_until(slots.size());
+                slot = pool.submit(_workers_mask, POOL_OP_GET_BLOCK, ctx.url.c_str(), &ctx.attributes,
+                                   req.block_id * block_size, block_size, req.data, deadline);
+            }
+            slots.push_back(slot);
+        }
+        wait_until(slots.size());
+    }
+private:
+    std::string _name;
+    uint64_t _workers_mask;
+};
+
+// Parse affinity entries and return mask of workers allowed to run driver.
+static uint64_t workers_mask_for(const char* driver, const std::vector<std::string>& affinity,
+                                 unsigned workers) {
+    uint64_t all = (workers == 64) ? ~uint64_t(0) : ((uint64_t(1) << workers) - 1);
+    uint64_t mask = 0;
+
+    for (auto& entry : affinity) {
+        auto tokens = split(entry, ':');
+        if (tokens.size() != 2 || tokens[0] != driver) {
+            continue;
+        }
+        auto range = split(tokens[1], '-');
+        unsigned first = std::stoul(range[0]);
+        unsigned last = (range.size() > 1) ? std::stoul(range[1]) : first;
+        for (unsigned i = first; i <= last && i < workers; i++) {
+            mask |= uint64_t(1) << i;
+        }
+    }
+
+    return mask ? mask : all;
+}
+
+bool start_python_pool(unsigned workers, const std::vector<std::string>& affinity,
+                       cache& c, const boost::filesystem::path& current_path) {
+    if (workers > PYTHON_POOL_MAX_WORKERS) {
+        log("At most %d python workers are supported\n", PYTHON_POOL_MAX_WORKERS);
+        return false;
+    }
+    if (c.arena_fd() < 0) {
+        log("Cache cannot be shared with python workers\n");
+        return false;
+    }
+
+    pool.shared_fd = memfd_create("ghostfs_python_pool", 0);
+    if (pool.shared_fd < 0 || ftruncate(pool.shared_fd, sizeof(pool_shared)) < 0) {
+        log("Unable to create memory shared with python workers, reason: %s\n", strerror(errno));
+        return false;
+    }
+    pool.shared = map_shared(pool.shared_fd);
+    if (!pool.shared) {
+        log("Unable to map memory shared with python workers, reason: %s\n", strerror(errno));
+        return false;
+    }
+
+    size_t bounce_size = size_t(PYTHON_POOL_BOUNCE_BUFFERS) * PYTHON_POOL_BOUNCE_SIZE;
+    pool.bounce_fd = memfd_create("ghostfs_python_bounce", 0);
+    if (pool.bounce_fd < 0 || ftruncate(pool.bounce_fd, bounce_size) < 0) {
+        log("Unable to create bounce buffers of python workers, reason: %s\n", strerror(errno));
+        return false;
+    }
+    void* bounce = mmap(nullptr, bounce_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool.bounce_fd, 0);
+    if (bounce == MAP_FAILED) {
+        log("Unable to map bounce buffers of python workers, reason: %s\n", strerror(errno));
+        return false;
+    }
+    pool.bounce = static_cast<char*>(bounce);
+    for (uint32_t i = 0; i < PYTHON_POOL_BOUNCE_BUFFERS; i++) {
+        pool.free_bounce.push_back(i);
+    }
+
+    pool_shared* shared = pool.shared;
+    init_shared_mutex(&shared->mtx);
+    sem_init(&shared->free_slots, 1, PYTHON_POOL_SLOTS);
+    sem_init(&shared->drivers_ready, 1, 0);
+    shared->free_count = PYTHON_POOL_SLOTS;
+    for (uint32_t i = 0; i < PYTHON_POOL_SLOTS; i++) {
+        shared->free_list[i] = i;
+        shared->slots[i].state = SLOT_FREE;
+        sem_init(&shared->slots[i].done, 1, 0);
+    }
+    for (unsigned i = 0; i < workers; i++) {
+        init_shared_mutex(&shared->queues[i].mtx);
+        sem_init(&shared->queues[i].items, 1, 0);
+    }
+
+    pool.c = &c;
+    pool.workers = workers;
+    pool.pids.assign(workers, -1);
+    pool.exe = (current_path / "ghostfs").string();
+    char exe[PATH_MAX];
+    ssize_t exe_size = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (exe_size > 0) {
+        pool.exe.assign(exe, exe_size);
+    }
+
+    for (unsigned i = 0; i < workers; i++) {
+        if (!pool.spawn(i)) {
+            stop_python_pool();
+            return false;
+        }
+    }
+    pool.monitor = std::thread([] { pool.watch(); });
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PYTHON_POOL_STARTUP_TIMEOUT;
+    while (sem_timedwait(&shared->drivers_ready, &deadline) < 0) {
+        if (errno != EINTR) {
+            log("Python workers didn't load drivers in time\n");
+            stop_python_pool();
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < shared->driver_count; i++) {
+        const char* name = shared->drivers[i];
+        register_handler(new python_pool_protocol(name, workers_mask_for(name, affinity, workers)));
+        log("Python driver %s will run in worker processes\n", name);
+    }
+
+    return true;
+}
+
+void stop_python_pool() {
+    if (!pool.shared) {
+        return;
+    }
+    pool.shared->shutdown = 1;
+    for (unsigned i = 0; i < pool.workers; i++) {
+        sem_post(&pool.shared->queues[i].items);
+    }
+    // Workers busy with a request wouldn't notice the shutdown.
+    {
+        std::lock_guard<std::mutex> lock(pool.pids_mtx);
+        for (auto pid : pool.pids) {
+            if (pid > 0) {
+                kill(pid, SIGTERM);
+            }
+        }
+    }
+    if (pool.monitor.joinable()) {
+        pool.monitor.join();
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// worker side
+
+static void handle_request(pool_slot& slot, char* arena, char* bounce,
+                           std::unordered_map<std::string, std::shared_ptr<fetch_context>>& contexts) {
+    base_protocol* handler = get_handler(slot.url);
+    if (!handler) {
+        slot.result = -ENOENT;
+        return;
+    }
+
+    switch (slot.op) {
+    case POOL_OP_IS_URL_VALID:
+        slot.result = handler->is_url_valid(slot.url);
+        break;
+    case POOL_OP_GET_CONTENT_LENGTH:
+        slot.result = handler->get_content_length_for_url(slot.url);
+        break;
+    case POOL_OP_GET_BLOCK: {
+        // Contexts are kept per url and only recreated if attributes changed,
+        // so the python bridge doesn't rebuild its dictionary on every request.
+        std::unordered_map<std::string, std::string> attributes;
+        for (uint32_t i = 0; i < slot.attributes_size; ) {
+            const char* key = slot.attributes + i;
+            i += strlen(key) + 1;
+            const char* value = slot.attributes + i;
+            i += strlen(value) + 1;
+            attributes.emplace(key, value);
+        }
+        auto& ctx = contexts[slot.url];
+        if (!ctx || ctx->attributes != attributes) {
+            ctx = make_fetch_context(slot.url, attributes);
+        }
+
+        size_t block_id = slot.offset / slot.size;
+        char* data = (slot.bounce ? bounce : arena) + slot.arena_offset;
+        slot.result = handler->get_block(*ctx, block_id, slot.size, data);
+        break;
+    }
+    default:
+        slot.result = -EINVAL;
+    }
+}
+
+int python_worker_main(int argc, char *argv[]) {
+    if (argc < 6) {
+        log("Usage: %s %s <index> <shared fd> <arena fd> <bounce fd>\n", argv[0],
+            GHOSTFS_PYTHON_WORKER_ARG);
+        return 1;
+    }
+    unsigned index = std::stoul(argv[2]);
+    int shared_fd = std::stoi(argv[3]);
+    int arena_fd = std::stoi(argv[4]);
+    int bounce_fd = std::stoi(argv[5]);
+
+    pool_shared* shared = map_shared(shared_fd);
+    struct stat st;
+    if (!shared || fstat(arena_fd, &st) < 0) {
+        log("Python worker %d is unable to map shared memory\n", index);
+        return 1;
+    }
+    void* arena = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, arena_fd, 0);
+    if (arena == MAP_FAILED) {
+        log("Python worker %d is unable to map cache\n", index);
+        return 1;
+    }
+    void* bounce = mmap(nullptr, size_t(PYTHON_POOL_BOUNCE_BUFFERS) * PYTHON_POOL_BOUNCE_SIZE,
+                        PROT_READ | PROT_WRITE, MAP_SHARED, bounce_fd, 0);
+    if (bounce == MAP_FAILED) {
+        log("Python worker %d is unable to map bounce buffers\n", index);
+        return 1;
+    }
+
+    // Worker shouldn't be killed by terminal signals meant to ghostfs, which
+    // stops it through shared memory instead.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+
+    boost::filesystem::path current_path = boost::filesystem::path(argv[0]).parent_path();
+    python::initialize initialize;
+    load_python_drivers(current_path);
+
+    uint32_t expected = 0;
+    if (shared->drivers_published.compare_exchange_strong(expected, 1)) {
+        auto& names = python_driver_names();
+        shared->driver_count = std::min(names.size(), size_t(PYTHON_POOL_MAX_DRIVERS));
+        for (uint32_t i = 0; i < shared->driver_count; i++) {
+            snprintf(shared->drivers[i], PYTHON_POOL_NAME_SIZE, "%s", names[i].c_str());
+        }
+        sem_post(&shared->drivers_ready);
+    }
+
+    std::unordered_map<std::string, std::shared_ptr<fetch_context>> contexts;
+    pool_queue& q = shared->queues[index];
+
+    while (!shared->shutdown) {
+        wait_sem(&q.items);
+        if (shared->shutdown) {
+            break;
+        }
+
+        lock_shared(&q.mtx);
+        uint32_t slot_index = q.ring[q.head % PYTHON_POOL_SLOTS];
+        pool_slot& slot = shared->slots[slot_index];
+        slot.worker = index;
+        expected = SLOT_QUEUED;
+        bool taken = slot.state.compare_exchange_strong(expected, SLOT_TAKEN);
+        q.head++;
+        pthread_mutex_unlock(&q.mtx);
+
+        if (!taken) {
+            release_slot(shared, slot_index);
+            continue;
+        }
+
+        handle_request(slot, static_cast<char*>(arena), static_cast<char*>(bounce), contexts);
+
+        expected = SLOT_TAKEN;
+        if (slot.state.compare_exchange_strong(expected, SLOT_DONE)) {
+            sem_post(&slot.done);
+        }
+    }
+
+    return 0;
+}
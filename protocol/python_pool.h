@@ -0,0 +1,40 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+// Out-of-process python drivers.
+//
+// Python drivers run in a pool of worker processes, each one with its own
+// interpreter, so they aren't limited by a single GIL and a crash of a driver
+// doesn't take down the mount. Requests are exchanged through a shared-memory
+// ring per worker, and block content is written by the worker directly into
+// the cache, whose blocks are backed by shared memory too.
+
+#ifndef PYTHON_POOL_H
+#define PYTHON_POOL_H
+
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include "cache.h"
+
+#define GHOSTFS_PYTHON_WORKER_ARG "--python-worker"
+
+// Start workers and register a handler for each python driver they loaded.
+// affinity restricts a driver to a range of workers, given as
+// <driver>:<first worker>[-<last worker>]. Return false on failure.
+bool start_python_pool(unsigned workers, const std::vector<std::string>& affinity,
+                       cache& c, const boost::filesystem::path& current_path);
+
+void stop_python_pool();
+
+// Entry point of a worker process, which is started by executing ghostfs
+// with GHOSTFS_PYTHON_WORKER_ARG as the first argument.
+int python_worker_main(int argc, char *argv[]);
+
+#endif // PYTHON_POOL_H
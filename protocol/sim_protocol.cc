@@ -0,0 +1,450 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <tuple>
+
+#include "utils.h"
+#include "sim_protocol.h"
+
+enum sim_latency {
+    SIM_FIXED,
+    SIM_UNIFORM,
+    SIM_EXP,
+    SIM_PARETO,
+};
+
+// Parameters of a file, parsed from its url and attributes when its fetch
+// context is prepared, see sim_protocol.
+struct sim_config {
+    uint64_t size = 0;
+    sim_latency latency = SIM_FIXED;
+    double latency_ms = 0;
+    double jitter_ms = 0;
+    double bandwidth = 0;
+    double error_rate = 0;
+    double short_rate = 0;
+    double stall_rate = 0;
+    double stall_ms = 0;
+    uint64_t seed = 0;
+    std::string version = "1";
+    bool ranges = true;
+    // Number of streams of the object so far, see get_stream().
+    mutable std::atomic<unsigned> streams { 0 };
+    // Hash of path of the object, which content is derived from.
+    uint64_t object = 0;
+};
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Hash of path of an object, query excluded.
+static uint64_t object_hash(const std::string& path) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < path.size() && path[i] != '?'; i++) {
+        h = (h ^ (unsigned char) path[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void object_content(uint64_t object, uint64_t offset, size_t size, char* data) {
+    uint64_t word = offset / 8;
+    uint64_t value = mix(object + word);
+
+    for (size_t i = 0; i < size; i++) {
+        if ((offset + i) / 8 != word) {
+            word = (offset + i) / 8;
+            value = mix(object + word);
+        }
+        data[i] = char(value >> (((offset + i) % 8) * 8));
+    }
+}
+
+void sim_content(const std::string& path, uint64_t offset, size_t size, char* data) {
+    object_content(object_hash(path), offset, size, data);
+}
+
+// Parse a number of bytes with an optional k, m or g suffix.
+static uint64_t parse_size(const char* value) {
+    char* end;
+    uint64_t size = strtoull(value, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K': return size << 10;
+    case 'm': case 'M': return size << 20;
+    case 'g': case 'G': return size << 30;
+    default: return size;
+    }
+}
+
+static void set_parameter(sim_config& config, const std::string& key, const std::string& value) {
+    const char* v = value.c_str();
+
+    if (key == "size") {
+        config.size = parse_size(v);
+    } else if (key == "latency") {
+        if (value == "fixed") {
+            config.latency = SIM_FIXED;
+        } else if (value == "uniform") {
+            config.latency = SIM_UNIFORM;
+        } else if (value == "exp") {
+            config.latency = SIM_EXP;
+        } else if (value == "pareto") {
+            config.latency = SIM_PARETO;
+        } else {
+            log("Unknown latency distribution %s of sim origin\n", v);
+        }
+    } else if (key == "latency_ms") {
+        config.latency_ms = atof(v);
+    } else if (key == "jitter_ms") {
+        config.jitter_ms = atof(v);
+    } else if (key == "bandwidth") {
+        config.bandwidth = atof(v);
+    } else if (key == "error_rate") {
+        config.error_rate = atof(v);
+    } else if (key == "short_rate") {
+        config.short_rate = atof(v);
+    } else if (key == "stall_rate") {
+        config.stall_rate = atof(v);
+    } else if (key == "stall_ms") {
+        config.stall_ms = atof(v);
+    } else if (key == "seed") {
+        config.seed = strtoull(v, nullptr, 10);
+    } else if (key == "version") {
+        config.version = value;
+    } else if (key == "ranges") {
+        config.ranges = atoi(v) != 0;
+    } else {
+        log("Unknown parameter %s of sim origin\n", key.c_str());
+    }
+}
+
+// Parse parameters given by query of url, e.g. "?size=1m&latency_ms=20".
+static void parse_url_parameters(const char* url, sim_config& config) {
+    const char* query = strchr(url, '?');
+    if (!query) {
+        return;
+    }
+    std::string params(query + 1);
+    size_t start = 0;
+
+    while (start < params.size()) {
+        size_t end = params.find('&', start);
+        if (end == std::string::npos) {
+            end = params.size();
+        }
+        size_t eq = params.find('=', start);
+        if (eq != std::string::npos && eq < end) {
+            set_parameter(config, params.substr(start, eq - start),
+                          params.substr(eq + 1, end - eq - 1));
+        }
+        start = end + 1;
+    }
+}
+
+void sim_protocol::prepare(fetch_context& ctx) {
+    sim_config* config = new sim_config;
+    size_t prefix_size = strlen(SIM_ATTRIBUTE_PREFIX);
+
+    parse_url_parameters(ctx.url.c_str(), *config);
+    for (auto& it : ctx.attributes) {
+        if (it.first.compare(0, prefix_size, SIM_ATTRIBUTE_PREFIX) == 0) {
+            set_parameter(*config, it.first.substr(prefix_size), it.second);
+        }
+    }
+    config->object = object_hash(ctx.path);
+    ctx.request = config;
+}
+
+void sim_protocol::release(fetch_context& ctx) {
+    delete static_cast<sim_config*>(ctx.request);
+    ctx.request = nullptr;
+}
+
+bool sim_protocol::is_url_valid(const char* url) {
+    return strncmp(url, "sim://", 6) == 0 && get_content_length_for_url(url) > 0;
+}
+
+uint64_t sim_protocol::get_content_length_for_url(const char* url) {
+    sim_config config;
+    parse_url_parameters(url, config);
+    return config.size;
+}
+
+// Fate of one attempt at fetching a block.
+struct sim_attempt {
+    // Time it takes, in ms, whether it succeeds or not.
+    double duration_ms = 0;
+    // Time to first byte, and time the bytes take to land once they start
+    // to, apart from a stall halfway of stall_ms.
+    double first_byte_ms = 0;
+    double transfer_ms = 0;
+    double stall_ms = 0;
+    size_t bytes = 0;
+    bool failed = false;
+    bool timed_out = false;
+};
+
+static double sample_latency(const sim_config& config, std::mt19937_64& rng) {
+    std::uniform_real_distribution<double> uniform(0, 1);
+    double u = uniform(rng);
+
+    switch (config.latency) {
+    case SIM_UNIFORM:
+        return std::max(0.0, config.latency_ms + (2 * u - 1) * config.jitter_ms);
+    case SIM_EXP:
+        return -config.latency_ms * log(1 - u);
+    case SIM_PARETO:
+        // Shape 1.5, whose scale is a third of the mean, capped to keep a
+        // single fetch from taking forever.
+        return std::min(config.latency_ms * 100, config.latency_ms / 3 / pow(1 - u, 1 / 1.5));
+    default:
+        return config.latency_ms;
+    }
+}
+
+// Decide the fate of attempt at fetching expected bytes of block blk_id,
+// which has remaining_ms left.
+static sim_attempt simulate(const sim_config& config, const fetch_policy& policy,
+                            uint64_t blk_id, unsigned attempt, size_t expected,
+                            double remaining_ms) {
+    std::mt19937_64 rng(mix(config.seed ^ config.object ^ mix(blk_id) ^ mix(attempt + 1)));
+    std::uniform_real_distribution<double> uniform(0, 1);
+    sim_attempt a;
+
+    double latency = sample_latency(config, rng);
+    double transfer = config.bandwidth > 0 ? expected / (config.bandwidth * 1048576) * 1000 : 0;
+    bool error = uniform(rng) < config.error_rate;
+    bool stall = uniform(rng) < config.stall_rate;
+    bool short_read = uniform(rng) < config.short_rate;
+
+    a.bytes = expected;
+    if (short_read && expected) {
+        a.bytes = rng() % expected;
+        transfer = transfer * a.bytes / expected;
+    }
+    a.duration_ms = latency + transfer;
+    a.first_byte_ms = latency;
+    a.transfer_ms = transfer;
+
+    if (policy.first_byte_timeout_ms && latency > policy.first_byte_timeout_ms) {
+        a.duration_ms = policy.first_byte_timeout_ms;
+        a.timed_out = true;
+    } else if (error) {
+        a.duration_ms = latency;
+        a.failed = true;
+    } else if (stall && config.stall_ms > 0) {
+        if (policy.stall_timeout_ms && config.stall_ms > policy.stall_timeout_ms) {
+            a.duration_ms = latency + transfer / 2 + policy.stall_timeout_ms;
+            a.timed_out = true;
+        } else {
+            a.duration_ms += config.stall_ms;
+            a.stall_ms = config.stall_ms;
+        }
+    }
+    if (a.duration_ms > remaining_ms) {
+        a.duration_ms = remaining_ms;
+        a.timed_out = true;
+    }
+    if (a.timed_out) {
+        a.failed = true;
+    }
+    if (a.failed) {
+        a.bytes = 0;
+    }
+    return a;
+}
+
+static void sleep_ms(double ms) {
+    if (ms > 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(ms));
+    }
+}
+
+// Sleep until ms after start.
+static void sleep_until(std::chrono::steady_clock::time_point start, double ms) {
+    std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(ms)));
+}
+
+// Content lands in pieces of SIM_STREAM_PIECE bytes.
+#define SIM_STREAM_PIECE (64 * 1024)
+
+bool sim_protocol::get_metadata(const fetch_context& ctx, remote_metadata& metadata) {
+    auto config = static_cast<const sim_config*>(ctx.request);
+    if (!config) {
+        return false;
+    }
+    std::mt19937_64 rng(mix(config->seed ^ config->object));
+    sleep_ms(sample_latency(*config, rng));
+
+    metadata.length = config->size;
+    metadata.validator = config->version;
+    metadata.ranges = config->ranges;
+    return metadata.length != 0;
+}
+
+size_t sim_protocol::get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+        char* data) {
+    std::vector<block_request> requests{ block_request(block_id, data) };
+    get_blocks(ctx, block_size, requests);
+    return requests[0].bytes_read;
+}
+
+// Requests are fetched concurrently, as HTTP origins are, so an attempt takes
+// as long as the slowest of its requests. Failed requests are retried while
+// the budget of ctx allows.
+void sim_protocol::get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests) {
+    using clock = std::chrono::steady_clock;
+    auto config = static_cast<const sim_config*>(ctx.request);
+    const fetch_policy& policy = ctx.policy;
+    auto& stats = get_fetch_stats();
+    auto deadline = clock::now() + std::chrono::milliseconds(policy.budget_ms);
+
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < requests.size(); i++) {
+        requests[i].bytes_read = 0;
+        pending.push_back(i);
+    }
+    if (!config) {
+        pending.clear();
+    } else if (!config->ranges) {
+        // Origin would send the whole object instead of the range asked.
+        log("Origin of %s doesn't serve ranges\n", ctx.url.c_str());
+        ctx.ranges = false;
+        pending.clear();
+    }
+
+    for (unsigned attempt = 0; !pending.empty(); attempt++) {
+        auto now = clock::now();
+        if (now >= deadline) {
+            log("Budget of %u ms to fetch from %s ran out\n", policy.budget_ms, ctx.url.c_str());
+            stats.timeouts += pending.size();
+            break;
+        }
+        std::chrono::duration<double, std::milli> remaining = deadline - now;
+        std::vector<size_t> retry;
+        double longest = 0;
+        // Pieces of requests reporting progress, by time they land at, with
+        // the watermark they bring their request to.
+        std::vector<std::tuple<double, size_t, size_t>> pieces;
+
+        for (auto i : pending) {
+            auto& req = requests[i];
+            uint64_t offset = uint64_t(req.block_id) * block_size;
+            size_t expected = offset < config->size ? std::min<uint64_t>(block_size, config->size - offset) : 0;
+            sim_attempt a = simulate(*config, policy, req.block_id, attempt, expected, remaining.count());
+
+            longest = std::max(longest, a.duration_ms);
+            if (a.failed) {
+                if (a.timed_out) {
+                    stats.timeouts++;
+                }
+                retry.push_back(i);
+                continue;
+            }
+            if (!req.progress) {
+                object_content(config->object, offset, a.bytes, req.data);
+                req.bytes_read = a.bytes;
+                continue;
+            }
+            for (size_t valid = 0; valid < a.bytes;) {
+                valid = std::min<size_t>(a.bytes, valid + SIM_STREAM_PIECE);
+                double at = a.first_byte_ms + a.transfer_ms * valid / a.bytes +
+                    (valid > a.bytes / 2 ? a.stall_ms : 0);
+                pieces.emplace_back(at, i, valid);
+            }
+        }
+        std::sort(pieces.begin(), pieces.end());
+        for (auto& piece : pieces) {
+            auto& req = requests[std::get<1>(piece)];
+            size_t valid = std::get<2>(piece);
+            sleep_until(now, std::get<0>(piece));
+            object_content(config->object, uint64_t(req.block_id) * block_size + req.bytes_read,
+                           valid - req.bytes_read, req.data + req.bytes_read);
+            req.bytes_read = valid;
+            (*req.progress)(valid);
+        }
+        sleep_until(now, longest);
+
+        if (retry.empty() || attempt >= policy.max_retries) {
+            break;
+        }
+        auto delay = fetch_backoff(attempt);
+        if (clock::now() + delay >= deadline) {
+            break;
+        }
+        std::this_thread::sleep_for(delay);
+        stats.retries += retry.size();
+        pending.swap(retry);
+    }
+
+    // Blocks past the end of objects, e.g. the empty one following their
+    // last block, have nothing to be fetched.
+    for (auto& req : requests) {
+        if (!req.bytes_read && config && uint64_t(req.block_id) * block_size < config->size) {
+            stats.failures++;
+        }
+    }
+}
+
+// Content is sent in pieces at the bandwidth of the object, after a single
+// time to first byte. Faults of the n-th stream of an object are drawn the
+// same way as the ones of the n-th attempt at a block, and happen halfway
+// through: the stream fails, gets cut short or stalls.
+
+bool sim_protocol::get_stream(const fetch_context& ctx, const stream_consumer& consumer) {
+    auto config = static_cast<const sim_config*>(ctx.request);
+    if (!config) {
+        return false;
+    }
+    const fetch_policy& policy = ctx.policy;
+    auto& stats = get_fetch_stats();
+    unsigned stream = config->streams++;
+    std::mt19937_64 rng(mix(config->seed ^ config->object ^ mix(stream + 1)));
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    bool error = uniform(rng) < config->error_rate;
+    bool stall = uniform(rng) < config->stall_rate && config->stall_ms > 0;
+    bool short_read = uniform(rng) < config->short_rate;
+    bool timed_out = stall && policy.stall_timeout_ms && config->stall_ms > policy.stall_timeout_ms;
+    uint64_t halfway = config->size / 2;
+    uint64_t end = (error || short_read || timed_out) ? halfway : config->size;
+    double piece_ms = config->bandwidth > 0 ? SIM_STREAM_PIECE / (config->bandwidth * 1048576) * 1000 : 0;
+    std::vector<char> data(SIM_STREAM_PIECE);
+
+    sleep_ms(sample_latency(*config, rng));
+    for (uint64_t offset = 0; offset < end; offset += data.size()) {
+        size_t size = std::min<uint64_t>(data.size(), end - offset);
+        if (stall && !timed_out && offset <= halfway && halfway < offset + size) {
+            sleep_ms(config->stall_ms);
+        }
+        sleep_ms(piece_ms * size / data.size());
+        object_content(config->object, offset, size, data.data());
+        if (!consumer(data.data(), size)) {
+            return false;
+        }
+    }
+    if (timed_out) {
+        sleep_ms(policy.stall_timeout_ms);
+        stats.timeouts++;
+    }
+    return end == config->size;
+}
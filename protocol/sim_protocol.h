@@ -0,0 +1,61 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef SIM_PROTOCOL_H
+#define SIM_PROTOCOL_H
+
+#include "base_protocol.h"
+
+// Attributes of a file starting with this prefix override parameters of its
+// url, e.g. attribute sim.error_rate overrides error_rate.
+#define SIM_ATTRIBUTE_PREFIX "sim."
+
+// Origin simulated in memory, whose objects are named
+// sim://<host>/<path>?size=<bytes>[&<parameter>=<value>...], size taking an
+// optional k, m or g suffix. Content of an object only depends on its path,
+// see sim_content(), and every fetch is subject to the following parameters:
+//   latency: distribution of time to first byte, which is fixed (default),
+//     uniform, exp or pareto, the last two having a mean of latency_ms.
+//   latency_ms, jitter_ms: time to first byte, and for uniform, how far it
+//     may be from latency_ms.
+//   bandwidth: MB/s of each fetch, unlimited if 0 (default).
+//   error_rate: fraction of fetches failing after time to first byte, like
+//     an HTTP 503 would.
+//   short_rate: fraction of fetches getting fewer bytes than asked.
+//   stall_rate, stall_ms: fraction of fetches that get no byte for stall_ms
+//     halfway through, and for how long.
+//   seed: seed of faults and latencies, so that the n-th attempt at a given
+//     block of a given object always has the same fate.
+//   version: validator of objects, so that revalidation sees them change.
+//   ranges: 0 if origin doesn't serve ranges, so that objects get streamed.
+// Failed fetches are retried and given up on the way fetch_policy says, a
+// fetch being aborted once it goes without progress for longer than allowed.
+// Content of a block lands, and progress is reported, in pieces of 64KB.
+struct sim_protocol : public base_protocol {
+    virtual const char* name() { return "sim"; }
+
+    virtual bool is_url_valid(const char* url);
+    virtual uint64_t get_content_length_for_url(const char *url);
+    virtual bool get_metadata(const fetch_context& ctx, remote_metadata& metadata);
+    virtual size_t get_block(const fetch_context& ctx, size_t block_id, size_t block_size,
+        char* data);
+    virtual void get_blocks(const fetch_context& ctx, size_t block_size,
+        std::vector<block_request>& requests);
+    virtual bool get_stream(const fetch_context& ctx, const stream_consumer& consumer);
+
+    virtual void prepare(fetch_context& ctx);
+    virtual void release(fetch_context& ctx);
+
+    virtual bool reports_progress() { return true; }
+};
+
+// Store size bytes of object at path from offset in data, as served by
+// sim_protocol.
+void sim_content(const std::string& path, uint64_t offset, size_t size, char* data);
+
+#endif // SIM_PROTOCOL_H
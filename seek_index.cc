@@ -0,0 +1,513 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
+#include <fstream>
+
+#ifdef GHOSTFS_ZSTD
+#include <zstd.h>
+#endif
+
+#include "seek_index.h"
+
+// Window bits of inflate detecting gzip and zlib headers, and of inflate of
+// raw deflate streams.
+#define INFLATE_HEADER (15 + 32)
+#define INFLATE_RAW (-15)
+#define GZIP_TRAILER 8
+
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+
+#define SEEK_INDEX_MAGIC "GHOSTIDX"
+#define SEEK_INDEX_VERSION 1
+
+compression_format parse_compression(const std::string& name) {
+    if (name == "gzip" || name == "gz") {
+        return COMPRESSION_GZIP;
+    }
+#ifdef GHOSTFS_ZSTD
+    if (name == "zstd" || name == "zst") {
+        return COMPRESSION_ZSTD;
+    }
+#endif
+    return COMPRESSION_NONE;
+}
+
+const seek_point& seek_index::find(uint64_t out) const {
+    auto it = std::upper_bound(points.begin(), points.end(), out,
+                               [] (uint64_t out, const seek_point& p) { return out < p.out; });
+    return *(it == points.begin() ? it : it - 1);
+}
+
+uint64_t seek_index::end_of(uint64_t out) const {
+    auto it = std::lower_bound(points.begin(), points.end(), out,
+                               [] (const seek_point& p, uint64_t out) { return p.out < out; });
+    return it == points.end() ? compressed_length : it->in;
+}
+
+struct seek_index_builder::state {
+    compression_format format;
+    std::vector<seek_point> points;
+    // Compressed bytes consumed and decompressed bytes produced so far, and
+    // offset of the last point.
+    uint64_t in = 0;
+    uint64_t out = 0;
+    uint64_t last = 0;
+    // Whether a gzip member or a zstd frame just ended, and whether the
+    // current gzip member didn't produce anything yet.
+    bool ended = false;
+    bool member_start = true;
+    // Whether what follows the last gzip member is to be ignored, like gzip
+    // does with trailing garbage.
+    bool trailing = false;
+
+    z_stream strm;
+    // Last SEEK_WINDOW bytes produced, in circular order.
+    std::vector<char> window;
+#ifdef GHOSTFS_ZSTD
+    ZSTD_DCtx* dctx = nullptr;
+#endif
+    std::vector<char> discard;
+
+    void add_point(bool start, uint8_t bits) {
+        seek_point p;
+        p.in = in;
+        p.out = out;
+        p.start = start;
+        p.bits = bits;
+        if (!start) {
+            // Bytes of window are ordered from where the next output goes.
+            size_t left = strm.avail_out;
+            p.window.resize(SEEK_WINDOW);
+            memcpy(p.window.data(), window.data() + SEEK_WINDOW - left, left);
+            memcpy(p.window.data() + left, window.data(), SEEK_WINDOW - left);
+        }
+        points.push_back(std::move(p));
+        last = out;
+    }
+
+    int add_gzip(const char* data, size_t size);
+    int add_zstd(const char* data, size_t size);
+};
+
+seek_index_builder::seek_index_builder(compression_format format)
+    : _state(new state) {
+    state& s = *_state;
+
+    s.format = format;
+    s.points.emplace_back();
+    memset(&s.strm, 0, sizeof(s.strm));
+    if (format == COMPRESSION_GZIP) {
+        inflateInit2(&s.strm, INFLATE_HEADER);
+        s.window.resize(SEEK_WINDOW);
+    }
+#ifdef GHOSTFS_ZSTD
+    if (format == COMPRESSION_ZSTD) {
+        s.dctx = ZSTD_createDCtx();
+        s.discard.resize(ZSTD_DStreamOutSize());
+    }
+#endif
+}
+
+seek_index_builder::~seek_index_builder() {
+    if (_state->format == COMPRESSION_GZIP) {
+        inflateEnd(&_state->strm);
+    }
+#ifdef GHOSTFS_ZSTD
+    ZSTD_freeDCtx(_state->dctx);
+#endif
+}
+
+// Points are added every SEEK_SPAN bytes, at boundaries of deflate blocks,
+// as well as at the start of each member, following zran.c of zlib.
+int seek_index_builder::state::add_gzip(const char* data, size_t size) {
+    strm.next_in = (Bytef*) data;
+    strm.avail_in = size;
+
+    while (strm.avail_in && !trailing) {
+        if (ended) {
+            ended = false;
+            member_start = true;
+            inflateReset(&strm);
+            add_point(true, 0);
+        }
+        if (!strm.avail_out) {
+            strm.next_out = (Bytef*) window.data();
+            strm.avail_out = SEEK_WINDOW;
+        }
+        size_t avail_in = strm.avail_in;
+        size_t avail_out = strm.avail_out;
+        int ret = inflate(&strm, Z_BLOCK);
+        in += avail_in - strm.avail_in;
+        out += avail_out - strm.avail_out;
+        member_start = member_start && out == last;
+
+        if (ret == Z_STREAM_END) {
+            ended = true;
+        } else if (ret == Z_DATA_ERROR && member_start && points.size() > 1) {
+            points.pop_back();
+            trailing = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return -EINVAL;
+        } else if ((strm.data_type & 128) && !(strm.data_type & 64) && out - last >= SEEK_SPAN) {
+            add_point(false, strm.data_type & 7);
+        }
+    }
+    return 0;
+}
+
+// Every frame is a point, unless it follows the previous point by less than
+// a window, so that tiny frames don't make an index huge.
+int seek_index_builder::state::add_zstd(const char* data, size_t size) {
+#ifdef GHOSTFS_ZSTD
+    ZSTD_inBuffer input = { data, size, 0 };
+
+    for (;;) {
+        if (ended && input.pos < input.size) {
+            ended = false;
+            if (out - last >= SEEK_WINDOW) {
+                add_point(true, 0);
+            }
+        }
+        ZSTD_outBuffer output = { discard.data(), discard.size(), 0 };
+        size_t pos = input.pos;
+        size_t ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(ret)) {
+            return -EINVAL;
+        }
+        in += input.pos - pos;
+        out += output.pos;
+        if (ret == 0) {
+            ended = true;
+        }
+        if (input.pos == input.size && output.pos < output.size) {
+            return 0;
+        }
+    }
+#else
+    return -ENOTSUP;
+#endif
+}
+
+int seek_index_builder::add(const char* data, size_t size) {
+    if (_state->format == COMPRESSION_GZIP) {
+        return _state->add_gzip(data, size);
+    }
+    return _state->add_zstd(data, size);
+}
+
+int seek_index_builder::finish(seek_index& index) {
+    if (!_state->ended && !_state->trailing) {
+        return -EINVAL;
+    }
+    index.format = _state->format;
+    index.length = _state->out;
+    index.points = std::move(_state->points);
+    return 0;
+}
+
+struct seek_reader::state {
+    compression_format format;
+    uint64_t pos;
+    // Whether content given was all decompressed, and why not if error is set.
+    bool eof = false;
+    int error = 0;
+
+    z_stream strm;
+    // Whether gzip stream is a raw deflate one, started from the middle of a
+    // member, and whether current member didn't produce anything yet.
+    bool raw = false;
+    bool member_start = true;
+#ifdef GHOSTFS_ZSTD
+    ZSTD_DCtx* dctx = nullptr;
+    ZSTD_inBuffer input;
+#endif
+    std::vector<char> discard;
+
+    ssize_t produce(char* data, size_t size);
+    ssize_t inflate_some(char* data, size_t size);
+    ssize_t decompress_some(char* data, size_t size);
+};
+
+seek_reader::seek_reader(const seek_index& index, const seek_point& point, const char* data,
+                         size_t size)
+    : _state(new state) {
+    state& s = *_state;
+
+    s.format = index.format;
+    s.pos = point.out;
+    s.discard.resize(SEEK_WINDOW);
+    memset(&s.strm, 0, sizeof(s.strm));
+
+    if (s.format == COMPRESSION_GZIP) {
+        s.raw = !point.start;
+        if (inflateInit2(&s.strm, s.raw ? INFLATE_RAW : INFLATE_HEADER) != Z_OK) {
+            s.error = -ENOMEM;
+            return;
+        }
+        if (point.bits) {
+            if (!size) {
+                s.error = -EINVAL;
+                return;
+            }
+            inflatePrime(&s.strm, point.bits, (unsigned char) data[0] >> (8 - point.bits));
+            data++;
+            size--;
+        }
+        if (s.raw) {
+            inflateSetDictionary(&s.strm, (const Bytef*) point.window.data(), point.window.size());
+        }
+        s.strm.next_in = (Bytef*) data;
+        s.strm.avail_in = size;
+    }
+#ifdef GHOSTFS_ZSTD
+    if (s.format == COMPRESSION_ZSTD) {
+        s.dctx = ZSTD_createDCtx();
+        s.input = { data, size, 0 };
+    }
+#endif
+}
+
+seek_reader::~seek_reader() {
+    if (_state->format == COMPRESSION_GZIP) {
+        inflateEnd(&_state->strm);
+    }
+#ifdef GHOSTFS_ZSTD
+    ZSTD_freeDCtx(_state->dctx);
+#endif
+}
+
+ssize_t seek_reader::state::inflate_some(char* data, size_t size) {
+    strm.next_out = (Bytef*) data;
+    strm.avail_out = size;
+
+    while (strm.avail_out == size && !eof) {
+        if (!strm.avail_in) {
+            eof = true;
+            break;
+        }
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if (strm.avail_out != size) {
+            member_start = false;
+        }
+        if (ret == Z_STREAM_END) {
+            // Next member follows the trailer, which raw streams leave.
+            size_t trailer = raw ? GZIP_TRAILER : 0;
+            if (strm.avail_in <= trailer) {
+                eof = true;
+                break;
+            }
+            strm.next_in += trailer;
+            strm.avail_in -= trailer;
+            raw = false;
+            member_start = true;
+            inflateReset2(&strm, INFLATE_HEADER);
+        } else if (ret == Z_BUF_ERROR || (ret == Z_DATA_ERROR && member_start)) {
+            // Either more content is needed or the rest is garbage.
+            eof = true;
+        } else if (ret != Z_OK) {
+            return -EINVAL;
+        }
+    }
+    return size - strm.avail_out;
+}
+
+ssize_t seek_reader::state::decompress_some(char* data, size_t size) {
+#ifdef GHOSTFS_ZSTD
+    ZSTD_outBuffer output = { data, size, 0 };
+
+    while (!output.pos && !eof) {
+        size_t pos = input.pos;
+        size_t ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(ret)) {
+            return -EINVAL;
+        }
+        if (!output.pos && input.pos == pos) {
+            eof = true;
+        }
+    }
+    return output.pos;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+// Decompress at least one byte, unless there's nothing left, in data.
+ssize_t seek_reader::state::produce(char* data, size_t size) {
+    if (error) {
+        return error;
+    }
+    ssize_t res = format == COMPRESSION_GZIP ? inflate_some(data, size) : decompress_some(data, size);
+    if (res < 0) {
+        error = res;
+    } else {
+        pos += res;
+    }
+    return res;
+}
+
+ssize_t seek_reader::read(uint64_t offset, char* data, size_t size) {
+    state& s = *_state;
+
+    if (offset < s.pos) {
+        return -EINVAL;
+    }
+    while (s.pos < offset) {
+        ssize_t res = s.produce(s.discard.data(), std::min<uint64_t>(s.discard.size(), offset - s.pos));
+        if (res <= 0) {
+            return res;
+        }
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = s.produce(data + done, size - done);
+        if (res < 0) {
+            return res;
+        } else if (res == 0) {
+            break;
+        }
+        done += res;
+    }
+    return done;
+}
+
+static uint32_t load_le32(const char* p) {
+    const unsigned char* b = (const unsigned char*) p;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | (uint32_t(b[3]) << 24);
+}
+
+// Seek table is a skippable frame listing compressed and decompressed sizes
+// of every frame, optionally followed by a checksum, and ending with a
+// footer giving the number of frames, a descriptor and a magic number.
+size_t zstd_seek_table_size(const char* footer) {
+    uint32_t frames = load_le32(footer);
+    unsigned char descriptor = footer[4];
+
+    if (load_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC || (descriptor & 0x7c)) {
+        return 0;
+    }
+    size_t entry_size = (descriptor & 0x80) ? 12 : 8;
+    return 8 + size_t(frames) * entry_size + ZSTD_SEEK_FOOTER;
+}
+
+int parse_zstd_seek_table(const char* table, size_t size, seek_index& index) {
+    if (size < 8 + ZSTD_SEEK_FOOTER || zstd_seek_table_size(table + size - ZSTD_SEEK_FOOTER) != size ||
+        load_le32(table) != ZSTD_SKIPPABLE_MAGIC || load_le32(table + 4) != size - 8) {
+        return -EINVAL;
+    }
+    uint32_t frames = load_le32(table + size - ZSTD_SEEK_FOOTER);
+    size_t entry_size = (table[size - ZSTD_SEEK_FOOTER + 4] & 0x80) ? 12 : 8;
+    uint64_t in = 0;
+    uint64_t out = 0;
+
+    index.format = COMPRESSION_ZSTD;
+    index.points.clear();
+    for (uint32_t i = 0; i < frames; i++) {
+        const char* entry = table + 8 + i * entry_size;
+        seek_point p;
+        p.in = in;
+        p.out = out;
+        index.points.push_back(std::move(p));
+        in += load_le32(entry);
+        out += load_le32(entry + 4);
+    }
+    if (index.points.empty()) {
+        index.points.emplace_back();
+    }
+    index.length = out;
+    return 0;
+}
+
+template <typename T>
+static void write_value(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool read_value(std::ifstream& in, T& value) {
+    return bool(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+// Index is stored as a header, giving format, lengths and validator, followed
+// by points, in host byte order, as it's only meant to be read back by the
+// same host.
+int save_seek_index(const char* path, const seek_index& index) {
+    std::string tmp_path = std::string(path) + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+
+    if (!out) {
+        return errno ? -errno : -EIO;
+    }
+    out.write(SEEK_INDEX_MAGIC, strlen(SEEK_INDEX_MAGIC));
+    write_value(out, uint32_t(SEEK_INDEX_VERSION));
+    write_value(out, uint32_t(index.format));
+    write_value(out, index.compressed_length);
+    write_value(out, index.length);
+    write_value(out, uint32_t(index.validator.size()));
+    out.write(index.validator.data(), index.validator.size());
+    write_value(out, uint64_t(index.points.size()));
+    for (auto& p : index.points) {
+        write_value(out, p.in);
+        write_value(out, p.out);
+        write_value(out, uint8_t(p.start));
+        write_value(out, p.bits);
+        write_value(out, uint32_t(p.window.size()));
+        out.write(p.window.data(), p.window.size());
+    }
+    out.close();
+    if (!out || rename(tmp_path.c_str(), path) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+int load_seek_index(const char* path, seek_index& index) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(SEEK_INDEX_MAGIC) - 1];
+    uint32_t version, format, validator_size;
+    uint64_t count;
+
+    if (!in) {
+        return errno ? -errno : -ENOENT;
+    }
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, SEEK_INDEX_MAGIC, sizeof(magic)) != 0 ||
+        !read_value(in, version) || version != SEEK_INDEX_VERSION || !read_value(in, format) ||
+        !read_value(in, index.compressed_length) || !read_value(in, index.length) ||
+        !read_value(in, validator_size) || validator_size > 4096) {
+        return -EINVAL;
+    }
+    index.format = compression_format(format);
+    index.validator.resize(validator_size);
+    if (!in.read(&index.validator[0], validator_size) || !read_value(in, count) || !count) {
+        return -EINVAL;
+    }
+
+    index.points.clear();
+    for (uint64_t i = 0; i < count; i++) {
+        seek_point p;
+        uint8_t start;
+        uint32_t window_size;
+        if (!read_value(in, p.in) || !read_value(in, p.out) || !read_value(in, start) ||
+            !read_value(in, p.bits) || !read_value(in, window_size) || window_size > SEEK_WINDOW) {
+            return -EINVAL;
+        }
+        p.start = start;
+        p.window.resize(window_size);
+        if (!in.read(p.window.data(), window_size)) {
+            return -EINVAL;
+        }
+        index.points.push_back(std::move(p));
+    }
+    return 0;
+}
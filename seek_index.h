@@ -0,0 +1,119 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Attribute of a file whose remote object is compressed, either "gzip" or
+// "zstd", so that it's served decompressed, see compressed_protocol.
+#define COMPRESSION_ATTRIBUTE "compression"
+
+// Attribute of a compressed file naming where its seek index is stored, so
+// that it's only built once.
+#define SEEK_INDEX_ATTRIBUTE "seek_index"
+
+// Decompressed bytes between consecutive points of a gzip index, each of
+// which keeps the SEEK_WINDOW bytes preceding it.
+#define SEEK_SPAN (1024 * 1024)
+#define SEEK_WINDOW 32768
+
+enum compression_format {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD,
+};
+
+// Return format named name, or COMPRESSION_NONE if unknown or, for zstd, if
+// ghostfs was built without it.
+compression_format parse_compression(const std::string& name);
+
+// Point decompression can start from.
+struct seek_point {
+    // Offset in compressed object, and in decompressed content.
+    uint64_t in = 0;
+    uint64_t out = 0;
+    // Whether point starts a gzip member or a zstd frame. Otherwise, it's in
+    // the middle of a deflate stream, whose first bits bits are in the byte
+    // preceding in, and which refers to the window preceding out.
+    bool start = true;
+    uint8_t bits = 0;
+    std::vector<char> window;
+};
+
+// Index of points of a compressed object, ordered by offset, the first one
+// being at offset 0.
+struct seek_index {
+    compression_format format = COMPRESSION_NONE;
+    // Length of compressed object and its validator, which index is only
+    // valid for, and length of decompressed content.
+    uint64_t compressed_length = 0;
+    std::string validator;
+    uint64_t length = 0;
+    std::vector<seek_point> points;
+
+    // Return last point at or before offset out.
+    const seek_point& find(uint64_t out) const;
+    // Return compressed offset decompression of content up to offset out is
+    // done at, i.e. of the first point at or after it.
+    uint64_t end_of(uint64_t out) const;
+};
+
+// Builds the index of an object from its compressed content, which is given
+// in order, a piece at a time.
+class seek_index_builder {
+    struct state;
+    std::unique_ptr<state> _state;
+public:
+    explicit seek_index_builder(compression_format format);
+    ~seek_index_builder();
+
+    // Decompress size bytes following the ones given so far. Return 0 on
+    // success, or a negative error if content is corrupt.
+    int add(const char* data, size_t size);
+    // Store points found and length of content in index. Return 0 on
+    // success, or a negative error if content is truncated.
+    int finish(seek_index& index);
+};
+
+// Decompresses content of an object sequentially from a point, given the
+// compressed content starting at point.in, or the byte before it if it has
+// bits.
+class seek_reader {
+    struct state;
+    std::unique_ptr<state> _state;
+public:
+    seek_reader(const seek_index& index, const seek_point& point, const char* data, size_t size);
+    ~seek_reader();
+
+    // Store up to size bytes of content from offset, which cannot be before
+    // the end of the previous read, in data. Return number of bytes stored,
+    // fewer than size only at the end of data, or a negative error.
+    ssize_t read(uint64_t offset, char* data, size_t size);
+};
+
+// Return size of the seek table of zstd seekable format ending an object,
+// given its last ZSTD_SEEK_FOOTER bytes, or 0 if it has none.
+#define ZSTD_SEEK_FOOTER 9
+size_t zstd_seek_table_size(const char* footer);
+
+// Store points of frames listed by seek table of zstd seekable format, and
+// length of content, in index. Return 0 on success, or a negative error.
+int parse_zstd_seek_table(const char* table, size_t size, seek_index& index);
+
+// Store index at path, or load it. Return 0 on success, or a negative error.
+int save_seek_index(const char* path, const seek_index& index);
+int load_seek_index(const char* path, seek_index& index);
+
+#endif // SEEK_INDEX_H
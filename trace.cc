@@ -0,0 +1,246 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+#include "utils.h"
+
+// Interval, in ms, at which rings are drained.
+#define TRACE_DRAIN_INTERVAL 100
+
+std::atomic<int> trace_level { TRACE_LEVEL_OFF };
+
+// Ring written by a single thread and drained by the drainer. Owner only
+// advances head and drainer only advances tail, so neither takes a lock.
+struct trace_ring {
+    trace_record records[TRACE_RING_SIZE];
+    std::atomic<uint64_t> head { 0 };
+    std::atomic<uint64_t> tail { 0 };
+    std::atomic<uint64_t> dropped { 0 };
+    // Dropped records already reported, only used by drainer.
+    uint64_t reported = 0;
+    // Set once owner exited, so that ring gets freed once drained.
+    std::atomic<bool> exited { false };
+    uint32_t thread;
+};
+
+static std::mutex rings_mtx;
+static std::vector<trace_ring*> rings;
+
+static int trace_fd = -1;
+static std::thread drainer;
+static bool drainer_stopped;
+static std::mutex drainer_mtx;
+static std::condition_variable drainer_cv;
+
+// Ring of the calling thread, created on its first event.
+struct trace_ring_owner {
+    trace_ring* ring = nullptr;
+
+    ~trace_ring_owner() {
+        if (ring) {
+            ring->exited.store(true, std::memory_order_release);
+        }
+    }
+};
+
+static thread_local trace_ring_owner ring_owner;
+
+static trace_ring* get_ring() {
+    if (!ring_owner.ring) {
+        trace_ring* ring = new trace_ring;
+        ring->thread = syscall(SYS_gettid);
+        std::lock_guard<std::mutex> lock(rings_mtx);
+        rings.push_back(ring);
+        ring_owner.ring = ring;
+    }
+    return ring_owner.ring;
+}
+
+static const char* event_names[TRACE_EVENTS] = {
+    "dropped",
+    "open",
+    "read",
+    "cache_hit",
+    "cache_miss",
+    "fetch",
+    "fetch_failed",
+    "prefetch",
+    "prefetch_done",
+    "setxattr",
+    "getxattr",
+    "range_request",
+    "received",
+    "overflow",
+    "access",
+    "checksum_mismatch",
+    "stream",
+};
+
+const char *trace_event_name(int event) {
+    return (event >= 0 && event < TRACE_EVENTS) ? event_names[event] : "unknown";
+}
+
+void trace_emit(int level, int event, uint64_t ino, uint64_t block, uint64_t value,
+                uint64_t duration) {
+    trace_ring* ring = get_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+    if (head - ring->tail.load(std::memory_order_acquire) == TRACE_RING_SIZE) {
+        ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+        return;
+    }
+    trace_record& record = ring->records[head & (TRACE_RING_SIZE - 1)];
+    record.timestamp = trace_clock();
+    record.ino = ino;
+    record.block = block;
+    record.value = value;
+    record.duration = duration;
+    record.thread = ring->thread;
+    record.event = event;
+    record.level = level;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// Write records of every ring to the trace file, and free rings whose owner
+// exited once they're empty.
+static void drain_rings(std::vector<trace_record>& buf) {
+    std::vector<trace_ring*> drained;
+    {
+        std::lock_guard<std::mutex> lock(rings_mtx);
+        drained = rings;
+    }
+
+    for (trace_ring* ring : drained) {
+        // Owner is done writing if it exited before head is read.
+        bool exited = ring->exited.load(std::memory_order_acquire);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+
+        buf.clear();
+        uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+        if (dropped != ring->reported) {
+            trace_record record;
+            memset(&record, 0, sizeof(record));
+            record.timestamp = trace_clock();
+            record.value = dropped - ring->reported;
+            record.thread = ring->thread;
+            record.event = TRACE_DROPPED;
+            record.level = TRACE_LEVEL_ERROR;
+            buf.push_back(record);
+            ring->reported = dropped;
+        }
+        for (; tail != head; tail++) {
+            buf.push_back(ring->records[tail & (TRACE_RING_SIZE - 1)]);
+        }
+        ring->tail.store(tail, std::memory_order_release);
+
+        size_t size = buf.size() * sizeof(trace_record);
+        if (size && write(trace_fd, buf.data(), size) != ssize_t(size)) {
+            log("Unable to write trace: %s\n", strerror(errno));
+        }
+
+        if (exited) {
+            std::lock_guard<std::mutex> lock(rings_mtx);
+            rings.erase(std::find(rings.begin(), rings.end(), ring));
+            delete ring;
+        }
+    }
+}
+
+static void run_drainer() {
+    std::vector<trace_record> buf;
+    std::unique_lock<std::mutex> lock(drainer_mtx);
+
+    while (!drainer_cv.wait_for(lock, std::chrono::milliseconds(TRACE_DRAIN_INTERVAL),
+                                [] { return drainer_stopped; })) {
+        lock.unlock();
+        drain_rings(buf);
+        lock.lock();
+    }
+    lock.unlock();
+    drain_rings(buf);
+}
+
+int trace_start(const char *path, int level) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record);
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+
+    trace_fd = fd;
+    drainer_stopped = false;
+    drainer = std::thread(run_drainer);
+    trace_level = std::min(level, GHOSTFS_TRACE_LEVEL);
+    return 0;
+}
+
+void trace_stop() {
+    if (!drainer.joinable()) {
+        return;
+    }
+    trace_level = TRACE_LEVEL_OFF;
+    {
+        std::lock_guard<std::mutex> lock(drainer_mtx);
+        drainer_stopped = true;
+    }
+    drainer_cv.notify_one();
+    drainer.join();
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+int read_trace(const char *path, std::vector<trace_record> &records) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    trace_header header;
+    bool valid = read(fd, &header, sizeof(header)) == sizeof(header)
+        && !memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+        && header.version == TRACE_VERSION
+        && header.record_size == sizeof(trace_record);
+    if (!valid) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    trace_record buf[256];
+    ssize_t res;
+    while ((res = read(fd, buf, sizeof(buf))) > 0) {
+        records.insert(records.end(), buf, buf + res / sizeof(trace_record));
+    }
+    int err = (res < 0) ? -errno : 0;
+    close(fd);
+
+    std::stable_sort(records.begin(), records.end(), [] (const trace_record& a, const trace_record& b) {
+        return a.timestamp < b.timestamp;
+    });
+    return err;
+}
@@ -0,0 +1,162 @@
+/*
+  Ghost File System, or simply GhostFS
+  Copyright (C) 2016 Raphael S. Carvalho
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+// Tracing of events on the hot path, e.g. reads and fetches, as binary
+// records. A thread appends records to a ring of its own without taking any
+// lock, and rings are drained to a file in background, so that tracing
+// doesn't slow down what's being traced. Records that don't fit in a full ring
+// are dropped and counted. Messages which are rare or meant for the user still
+// go through log().
+
+// Levels of events, from the least to the most verbose.
+#define TRACE_LEVEL_OFF 0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_DEBUG 3
+
+// Events above this level compile to nothing, arguments included. It's set by
+// CMake, see GHOSTFS_TRACE_LEVEL there. Events up to it are recorded only if
+// tracing is started, otherwise each of them costs a single load.
+#ifndef GHOSTFS_TRACE_LEVEL
+#define GHOSTFS_TRACE_LEVEL TRACE_LEVEL_DEBUG
+#endif
+
+// Number of records a ring holds, which is a power of 2.
+#define TRACE_RING_SIZE 4096
+
+#define TRACE_MAGIC "GHOSTTR1"
+#define TRACE_VERSION 1
+
+enum trace_event {
+    // Records dropped by a thread, in value.
+    TRACE_DROPPED,
+    // Open of a file of value bytes, or 0 if its length isn't known yet.
+    TRACE_OPEN,
+    // Read of value bytes, starting at block.
+    TRACE_READ,
+    TRACE_CACHE_HIT,
+    TRACE_CACHE_MISS,
+    // Fetch of value blocks from block on, by a read.
+    TRACE_FETCH,
+    // Block got value bytes, fewer than expected.
+    TRACE_FETCH_FAILED,
+    TRACE_PREFETCH,
+    // Prefetch of block finished, value is 1 if it failed.
+    TRACE_PREFETCH_DONE,
+    TRACE_SETXATTR,
+    TRACE_GETXATTR,
+    // Range request for value bytes at offset block of an url.
+    TRACE_RANGE_REQUEST,
+    // Driver received value bytes.
+    TRACE_RECEIVED,
+    // Driver received more than asked, value bytes were discarded.
+    TRACE_OVERFLOW,
+    // Read of value bytes at offset block, as recorded for ghostfs_replay.
+    // Duration is the time blocks missing from cache took to be fetched, so
+    // it's 0 if the read was served from cache.
+    TRACE_ACCESS,
+    // Block fetched with checksum value, which isn't the expected one.
+    TRACE_CHECKSUM_MISMATCH,
+    // Stream of an object filled block, value is 1 if it was already cached.
+    TRACE_STREAM,
+    TRACE_EVENTS
+};
+
+// Trace file is made of a header followed by records, which are ordered by
+// timestamp within a thread only.
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct trace_record {
+    // Nanoseconds, from a monotonic clock.
+    uint64_t timestamp;
+    // Inode number of the file, or 0 if unknown.
+    uint64_t ino;
+    uint64_t block;
+    uint64_t value;
+    // Nanoseconds the event took, or 0 if it's instantaneous.
+    uint64_t duration;
+    uint32_t thread;
+    uint16_t event;
+    uint16_t level;
+};
+
+// Most verbose level being recorded, TRACE_LEVEL_OFF if tracing isn't started.
+extern std::atomic<int> trace_level;
+
+inline bool trace_enabled(int level) {
+    return level <= trace_level.load(std::memory_order_relaxed);
+}
+
+inline uint64_t trace_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Nanoseconds since start, given by TRACE_CLOCK(), or 0 if it isn't set.
+inline uint64_t trace_since(uint64_t start) {
+    return start ? trace_clock() - start : 0;
+}
+
+const char* trace_event_name(int event);
+
+void trace_emit(int level, int event, uint64_t ino, uint64_t block, uint64_t value,
+                uint64_t duration);
+
+// Record events up to level to path, until trace_stop(). Return 0 on success,
+// or a negative error.
+int trace_start(const char* path, int level);
+
+// Stop recording, and write whatever is left in rings.
+void trace_stop();
+
+// Append records of trace at path to records, ordered by timestamp. Return 0
+// on success, or a negative error.
+int read_trace(const char* path, std::vector<trace_record>& records);
+
+#define GHOST_TRACE(level, event, ino, block, value, duration) do { \
+        if (trace_enabled(level)) { \
+            trace_emit(level, event, ino, block, value, duration); \
+        } \
+    } while (0)
+
+#if GHOSTFS_TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(...) GHOST_TRACE(TRACE_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define TRACE_ERROR(...) do {} while (0)
+#endif
+
+#if GHOSTFS_TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(...) GHOST_TRACE(TRACE_LEVEL_INFO, __VA_ARGS__)
+#else
+#define TRACE_INFO(...) do {} while (0)
+#endif
+
+#if GHOSTFS_TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(...) GHOST_TRACE(TRACE_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define TRACE_DEBUG(...) do {} while (0)
+#endif
+
+// Timestamp to measure the duration of an event at level from, or 0 if the
+// event isn't recorded, so that the clock is only read when tracing.
+#define TRACE_CLOCK(level) \
+    (((level) <= GHOSTFS_TRACE_LEVEL && trace_enabled(level)) ? trace_clock() : 0)
+
+#endif // TRACE_H